@@ -27,6 +27,10 @@
  * stayed the same, though the way utiles get laid out has changed.
  */
 
+#if defined(PIPE_ARCH_SSE)
+#include <emmintrin.h>
+#endif
+
 static inline void
 v3d_load_utile(void *cpu, uint32_t cpu_stride,
                void *gpu, uint32_t gpu_stride)
@@ -129,6 +133,35 @@ v3d_load_utile(void *cpu, uint32_t cpu_stride,
                         : "v0", "v1", "v2", "v3");
                 return;
         }
+#elif defined(PIPE_ARCH_SSE)
+        /* Move the utile in 128-bit pieces: each is two 8-byte lines, one
+         * 16-byte line, or half of a 32-byte line.
+         */
+        if (gpu_stride == 8) {
+                for (int i = 0; i < 4; i++) {
+                        __m128i v = _mm_loadu_si128((__m128i *)gpu + i);
+                        _mm_storel_epi64(cpu, v);
+                        _mm_storel_epi64(cpu + cpu_stride,
+                                         _mm_unpackhi_epi64(v, v));
+                        cpu += 2 * cpu_stride;
+                }
+                return;
+        } else if (gpu_stride == 16) {
+                for (int i = 0; i < 4; i++) {
+                        _mm_storeu_si128(cpu, _mm_loadu_si128((__m128i *)gpu + i));
+                        cpu += cpu_stride;
+                }
+                return;
+        } else if (gpu_stride == 32) {
+                for (int i = 0; i < 2; i++) {
+                        _mm_storeu_si128(cpu,
+                                         _mm_loadu_si128((__m128i *)gpu + 2 * i));
+                        _mm_storeu_si128(cpu + 16,
+                                         _mm_loadu_si128((__m128i *)gpu + 2 * i + 1));
+                        cpu += cpu_stride;
+                }
+                return;
+        }
 #endif
 
         for (uint32_t gpu_offset = 0; gpu_offset < 64; gpu_offset += gpu_stride) {
@@ -233,6 +266,32 @@ v3d_store_utile(void *gpu, uint32_t gpu_stride,
                         : "v0", "v1", "v2", "v3");
                 return;
         }
+#elif defined(PIPE_ARCH_SSE)
+        if (gpu_stride == 8) {
+                for (int i = 0; i < 4; i++) {
+                        __m128i lo = _mm_loadl_epi64(cpu);
+                        __m128i hi = _mm_loadl_epi64(cpu + cpu_stride);
+                        _mm_storeu_si128((__m128i *)gpu + i,
+                                         _mm_unpacklo_epi64(lo, hi));
+                        cpu += 2 * cpu_stride;
+                }
+                return;
+        } else if (gpu_stride == 16) {
+                for (int i = 0; i < 4; i++) {
+                        _mm_storeu_si128((__m128i *)gpu + i, _mm_loadu_si128(cpu));
+                        cpu += cpu_stride;
+                }
+                return;
+        } else if (gpu_stride == 32) {
+                for (int i = 0; i < 2; i++) {
+                        _mm_storeu_si128((__m128i *)gpu + 2 * i,
+                                         _mm_loadu_si128(cpu));
+                        _mm_storeu_si128((__m128i *)gpu + 2 * i + 1,
+                                         _mm_loadu_si128(cpu + 16));
+                        cpu += cpu_stride;
+                }
+                return;
+        }
 #endif
 
         for (uint32_t gpu_offset = 0; gpu_offset < 64; gpu_offset += gpu_stride) {
@@ -56,6 +56,8 @@ static const struct debug_control debug_control[] = {
         { "cs",          V3D_DEBUG_CS},
         { "always_flush", V3D_DEBUG_ALWAYS_FLUSH},
         { "precompile",  V3D_DEBUG_PRECOMPILE},
+        { "novirsched",  V3D_DEBUG_NO_VIR_SCHED},
+        { "cache",       V3D_DEBUG_CACHE},
         { NULL,    0 }
 };
 
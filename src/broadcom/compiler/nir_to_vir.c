@@ -23,6 +23,7 @@
 
 #include <inttypes.h>
 #include "util/format/u_format.h"
+#include "util/u_atomic.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
 #include "util/ralloc.h"
@@ -2599,6 +2600,11 @@ ntq_emit_block(struct v3d_compile *c, nir_block *block)
 
 static void ntq_emit_cf_list(struct v3d_compile *c, struct exec_list *list);
 
+/* Trip count assumed by the cost estimate for loops that loop analysis
+ * couldn't bound.
+ */
+#define ESTIMATE_LOOP_TRIPS 8
+
 static void
 ntq_emit_loop(struct v3d_compile *c, nir_loop *loop)
 {
@@ -2617,6 +2623,21 @@ ntq_emit_loop(struct v3d_compile *c, nir_loop *loop)
         c->loop_cont_block = vir_new_block(c);
         c->loop_break_block = vir_new_block(c);
 
+        /* Weight the blocks of the body by the trip count for
+         * v3d_qpu_estimate().  The break block runs at the outer count.
+         */
+        uint32_t save_exec_count = c->exec_count;
+        uint32_t trips = ESTIMATE_LOOP_TRIPS;
+        if (loop->info && loop->info->max_trip_count) {
+                trips = loop->info->max_trip_count;
+        } else {
+                if (loop->info && loop->info->guessed_trip_count)
+                        trips = loop->info->guessed_trip_count;
+                c->estimate.unknown_loops++;
+        }
+        c->exec_count = MIN2((uint64_t)save_exec_count * trips, UINT32_MAX);
+        c->loop_cont_block->exec_count = c->exec_count;
+
         vir_link_blocks(c->cur_block, c->loop_cont_block);
         vir_set_emit_block(c, c->loop_cont_block);
         ntq_activate_execute_for_block(c);
@@ -2653,6 +2674,7 @@ ntq_emit_loop(struct v3d_compile *c, nir_loop *loop)
 
         c->loop_break_block = save_loop_break_block;
         c->loop_cont_block = save_loop_cont_block;
+        c->exec_count = save_exec_count;
 
         c->loops++;
 
@@ -2958,14 +2980,11 @@ v3d_nir_to_vir(struct v3d_compile *c)
 
         vir_check_payload_w(c);
 
-        /* XXX perf: On VC4, we do a VIR-level instruction scheduling here.
-         * We used that on that platform to pipeline TMU writes and reduce the
-         * number of thread switches, as well as try (mostly successfully) to
-         * reduce maximum register pressure to allow more threads.  We should
-         * do something of that sort for V3D -- either instruction scheduling
-         * here, or delay the the THRSW and LDTMUs from our texture
-         * instructions until the results are needed.
+        /* Pipeline the TMU accesses and share their thread switches, while
+         * keeping an eye on register pressure so we can keep our threads.
          */
+        if (!(V3D_DEBUG & V3D_DEBUG_NO_VIR_SCHED))
+                vir_schedule_instructions(c);
 
         if (V3D_DEBUG & (V3D_DEBUG_VIR |
                          v3d_debug_flag_for_shader_stage(c->s->info.stage))) {
@@ -2979,9 +2998,16 @@ v3d_nir_to_vir(struct v3d_compile *c)
         /* Attempt to allocate registers for the temporaries.  If we fail,
          * reduce thread count and try again.
          */
-        int min_threads = (c->devinfo->ver >= 41) ? 2 : 1;
         struct qpu_reg *temp_registers;
         while (true) {
+                /* A compile of this shader at more threads made it, so
+                 * there's no point in finishing this one.
+                 */
+                if (c->cancelled && p_atomic_read(c->cancelled)) {
+                        c->failed = true;
+                        return;
+                }
+
                 bool spilled;
                 temp_registers = v3d_register_allocate(c, &spilled);
                 if (spilled)
@@ -2990,10 +3016,15 @@ v3d_nir_to_vir(struct v3d_compile *c)
                 if (temp_registers)
                         break;
 
-                if (c->threads == min_threads) {
-                        fprintf(stderr, "Failed to register allocate at %d threads:\n",
-                                c->threads);
-                        vir_dump(c);
+                if (c->threads <= c->min_threads) {
+                        /* Speculative compiles at more threads than the
+                         * minimum are expected to fail.
+                         */
+                        if (c->min_threads == V3D_MIN_THREADS(c->devinfo)) {
+                                fprintf(stderr, "Failed to register allocate at %d threads:\n",
+                                        c->threads);
+                                vir_dump(c);
+                        }
                         c->failed = true;
                         return;
                 }
@@ -3014,5 +3045,11 @@ v3d_nir_to_vir(struct v3d_compile *c)
                 fprintf(stderr, "\n");
         }
 
+        if (c->cancelled && p_atomic_read(c->cancelled)) {
+                free(temp_registers);
+                c->failed = true;
+                return;
+        }
+
         v3d_vir_to_qpu(c, temp_registers);
 }
@@ -0,0 +1,246 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ *
+ * Estimates the cost of the scheduled QPU code, for ranking shaders without
+ * running them.
+ *
+ * Each block is walked in order, issuing one instruction per cycle and
+ * stalling until its sources are ready according to the latency model of
+ * qpu_schedule.c.  TMU results are considered ready once the lookup's last
+ * TMU write has had its latency; if a thread switch happened in between,
+ * only our share of the wait is counted, since the other threads run in the
+ * meantime.  Values coming from other blocks are assumed to be ready, and
+ * each block's cost is multiplied by how many times nir_to_vir estimated it
+ * to run from the trip counts of its loops.
+ */
+
+#include "v3d_compiler.h"
+
+/* Physical registers, followed by the accumulators r0-r5. */
+#define ESTIMATE_ACC0 64
+#define ESTIMATE_REG_COUNT (ESTIMATE_ACC0 + 6)
+
+struct estimate_value {
+        /* Instruction that produced the value, NULL if it's from another
+         * block.
+         */
+        const struct v3d_qpu_instr *writer;
+        /* Cycle the writer issued at. */
+        uint32_t time;
+        /* Length of the dependency chain up to the writer. */
+        uint32_t depth;
+};
+
+struct estimate_state {
+        struct v3d_compile *c;
+        struct estimate_value regs[ESTIMATE_REG_COUNT];
+
+        /* Last TMU write of the lookups in flight. */
+        struct estimate_value tmu;
+        /* Whether a THRSW issued since the last TMU write. */
+        bool tmu_thrsw;
+
+        uint32_t time;
+        uint32_t depth;
+        uint32_t tmu_stall_cycles;
+        uint32_t latency_stall_cycles;
+        uint32_t tmu_reads;
+        uint32_t sfu_ops;
+};
+
+static void
+estimate_read_value(const struct estimate_value *value,
+                    const struct v3d_qpu_instr *inst,
+                    uint32_t *ready, uint32_t *depth)
+{
+        if (!value->writer)
+                return;
+
+        uint32_t latency = v3d_qpu_instr_latency(value->writer, inst);
+        *ready = MAX2(*ready, value->time + latency);
+        *depth = MAX2(*depth, value->depth + latency);
+}
+
+static void
+estimate_read_mux(struct estimate_state *state,
+                  const struct v3d_qpu_instr *inst, enum v3d_qpu_mux mux,
+                  uint32_t *ready, uint32_t *depth)
+{
+        int reg;
+
+        switch (mux) {
+        case V3D_QPU_MUX_A:
+                reg = inst->raddr_a;
+                break;
+        case V3D_QPU_MUX_B:
+                if (inst->sig.small_imm)
+                        return;
+                reg = inst->raddr_b;
+                break;
+        default:
+                reg = ESTIMATE_ACC0 + mux - V3D_QPU_MUX_R0;
+                break;
+        }
+
+        estimate_read_value(&state->regs[reg], inst, ready, depth);
+}
+
+static void
+estimate_write_waddr(struct estimate_state *state, uint8_t waddr,
+                     bool magic, const struct estimate_value *value)
+{
+        if (!magic)
+                state->regs[waddr] = *value;
+        else if (waddr <= V3D_QPU_WADDR_R5)
+                state->regs[ESTIMATE_ACC0 + waddr - V3D_QPU_WADDR_R0] = *value;
+}
+
+static void
+estimate_instruction(struct estimate_state *state,
+                     const struct v3d_qpu_instr *inst)
+{
+        const struct v3d_device_info *devinfo = state->c->devinfo;
+        uint32_t ready = state->time;
+        uint32_t depth = 0;
+
+        if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+                if (inst->alu.add.op != V3D_QPU_A_NOP) {
+                        int nsrc = v3d_qpu_add_op_num_src(inst->alu.add.op);
+                        if (nsrc > 0) {
+                                estimate_read_mux(state, inst, inst->alu.add.a,
+                                                  &ready, &depth);
+                        }
+                        if (nsrc > 1) {
+                                estimate_read_mux(state, inst, inst->alu.add.b,
+                                                  &ready, &depth);
+                        }
+                }
+
+                if (inst->alu.mul.op != V3D_QPU_M_NOP) {
+                        int nsrc = v3d_qpu_mul_op_num_src(inst->alu.mul.op);
+                        if (nsrc > 0) {
+                                estimate_read_mux(state, inst, inst->alu.mul.a,
+                                                  &ready, &depth);
+                        }
+                        if (nsrc > 1) {
+                                estimate_read_mux(state, inst, inst->alu.mul.b,
+                                                  &ready, &depth);
+                        }
+                }
+        }
+
+        uint32_t latency_stall = ready - state->time;
+        uint32_t tmu_stall = 0;
+        if (v3d_qpu_waits_on_tmu(inst)) {
+                uint32_t tmu_ready = state->time;
+                estimate_read_value(&state->tmu, inst, &tmu_ready, &depth);
+
+                tmu_stall = tmu_ready - state->time;
+                if (state->tmu_thrsw)
+                        tmu_stall = DIV_ROUND_UP(tmu_stall, state->c->threads);
+
+                state->tmu_reads++;
+        }
+
+        if (tmu_stall >= latency_stall)
+                state->tmu_stall_cycles += tmu_stall;
+        else
+                state->latency_stall_cycles += latency_stall;
+
+        struct estimate_value value = {
+                .writer = inst,
+                .time = state->time + MAX2(tmu_stall, latency_stall),
+                .depth = depth,
+        };
+        state->time = value.time + 1;
+        state->depth = MAX2(state->depth, depth + 1);
+
+        if (inst->type == V3D_QPU_INSTR_TYPE_ALU) {
+                if (inst->alu.add.op != V3D_QPU_A_NOP) {
+                        estimate_write_waddr(state, inst->alu.add.waddr,
+                                             inst->alu.add.magic_write,
+                                             &value);
+                }
+                if (inst->alu.mul.op != V3D_QPU_M_NOP) {
+                        estimate_write_waddr(state, inst->alu.mul.waddr,
+                                             inst->alu.mul.magic_write,
+                                             &value);
+                }
+        }
+
+        if (v3d_qpu_sig_writes_address(devinfo, &inst->sig)) {
+                estimate_write_waddr(state, inst->sig_addr, inst->sig_magic,
+                                     &value);
+        }
+        if (v3d_qpu_writes_r3(devinfo, inst))
+                state->regs[ESTIMATE_ACC0 + 3] = value;
+        if (v3d_qpu_writes_r4(devinfo, inst))
+                state->regs[ESTIMATE_ACC0 + 4] = value;
+        if (v3d_qpu_writes_r5(devinfo, inst))
+                state->regs[ESTIMATE_ACC0 + 5] = value;
+
+        if (v3d_qpu_writes_tmu(inst)) {
+                state->tmu = value;
+                state->tmu_thrsw = false;
+        }
+
+        if (inst->sig.thrsw)
+                state->tmu_thrsw = true;
+
+        if (v3d_qpu_instr_is_sfu(inst))
+                state->sfu_ops++;
+}
+
+void
+v3d_qpu_estimate(struct v3d_compile *c)
+{
+        uint64_t cycles = 0, critical_path = 0;
+        uint64_t tmu_stall_cycles = 0, latency_stall_cycles = 0;
+        uint64_t tmu_reads = 0, sfu_ops = 0;
+
+        vir_for_each_block(block, c) {
+                struct estimate_state state = { .c = c };
+
+                vir_for_each_inst(inst, block)
+                        estimate_instruction(&state, &inst->qpu);
+
+                uint64_t weight = block->exec_count;
+                cycles += weight * state.time;
+                critical_path += weight * state.depth;
+                tmu_stall_cycles += weight * state.tmu_stall_cycles;
+                latency_stall_cycles += weight * state.latency_stall_cycles;
+                tmu_reads += weight * state.tmu_reads;
+                sfu_ops += weight * state.sfu_ops;
+        }
+
+        c->estimate.cycles = MIN2(cycles, UINT32_MAX);
+        c->estimate.critical_path = MIN2(critical_path, UINT32_MAX);
+        c->estimate.tmu_stall_cycles = MIN2(tmu_stall_cycles, UINT32_MAX);
+        c->estimate.latency_stall_cycles =
+                MIN2(latency_stall_cycles, UINT32_MAX);
+        c->estimate.tmu_reads = MIN2(tmu_reads, UINT32_MAX);
+        c->estimate.sfu_ops = MIN2(sfu_ops, UINT32_MAX);
+}
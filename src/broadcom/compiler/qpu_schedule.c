@@ -998,11 +998,14 @@ static uint32_t magic_waddr_latency(enum v3d_qpu_waddr waddr,
         return 1;
 }
 
-static uint32_t
-instruction_latency(struct schedule_node *before, struct schedule_node *after)
+/**
+ * Returns the number of cycles after \p before issues that \p after can
+ * consume its results without stalling.  Also used by qpu_estimate.c.
+ */
+uint32_t
+v3d_qpu_instr_latency(const struct v3d_qpu_instr *before_inst,
+                      const struct v3d_qpu_instr *after_inst)
 {
-        const struct v3d_qpu_instr *before_inst = &before->inst->qpu;
-        const struct v3d_qpu_instr *after_inst = &after->inst->qpu;
         uint32_t latency = 1;
 
         if (before_inst->type != V3D_QPU_INSTR_TYPE_ALU ||
@@ -1027,6 +1030,12 @@ instruction_latency(struct schedule_node *before, struct schedule_node *after)
         return latency;
 }
 
+static uint32_t
+instruction_latency(struct schedule_node *before, struct schedule_node *after)
+{
+        return v3d_qpu_instr_latency(&before->inst->qpu, &after->inst->qpu);
+}
+
 /** Recursive computation of the delay member of a node. */
 static void
 compute_delay(struct dag_node *node, void *state)
@@ -1288,6 +1297,132 @@ emit_thrsw(struct v3d_compile *c,
         return time;
 }
 
+static bool
+qpu_instruction_valid_in_branch_delay_slot(struct v3d_compile *c,
+                                           const struct qinst *qinst,
+                                           const struct qinst *branch)
+{
+        const struct v3d_qpu_instr *inst = &qinst->qpu;
+
+        if (inst->type != V3D_QPU_INSTR_TYPE_ALU)
+                return false;
+
+        /* Nothing touching the uniform stream, which the branch resets, and
+         * no signals, which could need their result to land before the
+         * successor we jump to starts.
+         */
+        if (qinst->uniform != ~0)
+                return false;
+
+        if (v3d_qpu_sig_has_signals(&inst->sig))
+                return false;
+
+        /* The target's first instructions were scheduled without knowing
+         * about these, so only allow writes with no latency to track.
+         */
+        if (inst->alu.add.op != V3D_QPU_A_NOP &&
+            inst->alu.add.magic_write &&
+            inst->alu.add.waddr > V3D_QPU_WADDR_R5 &&
+            inst->alu.add.waddr != V3D_QPU_WADDR_NOP) {
+                return false;
+        }
+        if (inst->alu.mul.op != V3D_QPU_M_NOP &&
+            inst->alu.mul.magic_write &&
+            inst->alu.mul.waddr > V3D_QPU_WADDR_R5 &&
+            inst->alu.mul.waddr != V3D_QPU_WADDR_NOP) {
+                return false;
+        }
+
+        if (v3d_qpu_instr_is_sfu(inst) ||
+            v3d_qpu_writes_r3(c->devinfo, inst) ||
+            v3d_qpu_writes_r4(c->devinfo, inst) ||
+            v3d_qpu_writes_r5(c->devinfo, inst)) {
+                return false;
+        }
+
+        switch (inst->alu.add.op) {
+        case V3D_QPU_A_SETMSF:
+        case V3D_QPU_A_SETREVF:
+                return false;
+        default:
+                break;
+        }
+
+        /* The branch condition would read the flags from before the
+         * update.
+         */
+        if (branch->qpu.branch.cond != V3D_QPU_BRANCH_COND_ALWAYS &&
+            (inst->flags.apf != V3D_QPU_PF_NONE ||
+             inst->flags.mpf != V3D_QPU_PF_NONE ||
+             inst->flags.auf != V3D_QPU_UF_NONE ||
+             inst->flags.muf != V3D_QPU_UF_NONE)) {
+                return false;
+        }
+
+        return true;
+}
+
+/**
+ * Emits a branch, moving it up past the last instructions of the block so
+ * that they execute in its delay slots instead of NOPs.
+ *
+ * The instructions keep their place in the stream, so they still run before
+ * either successor and the fall-through successor, which was scheduled
+ * right after them, sees the same latencies.  The successor we jump to
+ * doesn't know about them, though, which is why
+ * qpu_instruction_valid_in_branch_delay_slot() only lets through the ones
+ * without latencies to track.
+ */
+static int
+emit_branch(struct v3d_compile *c,
+            struct qblock *block,
+            struct choose_scoreboard *scoreboard,
+            struct qinst *branch)
+{
+        int slots_filled = 0;
+        struct qinst *first_slot = NULL;
+
+        if (branch->qpu.branch.bdi == V3D_QPU_BRANCH_DEST_REL &&
+            (!branch->qpu.branch.ub ||
+             branch->qpu.branch.bdu == V3D_QPU_BRANCH_DEST_REL)) {
+                vir_for_each_inst_rev(prev_inst, block) {
+                        /* No branching in a THRSW's delay slots. */
+                        if (scoreboard->last_thrsw_tick + 3 >
+                            scoreboard->tick - (slots_filled + 1)) {
+                                break;
+                        }
+
+                        if (!qpu_instruction_valid_in_branch_delay_slot(c,
+                                                                        prev_inst,
+                                                                        branch)) {
+                                break;
+                        }
+
+                        first_slot = prev_inst;
+                        if (++slots_filled == 3)
+                                break;
+                }
+        }
+
+        if (first_slot) {
+                list_addtail(&branch->link, &first_slot->link);
+                c->qpu_inst_count++;
+                scoreboard->tick++;
+        } else {
+                insert_scheduled_instruction(c, block, scoreboard, branch);
+        }
+        int time = 1;
+        block->branch_qpu_ip = c->qpu_inst_count - 1 - slots_filled;
+
+        /* Insert any extra delay slot NOPs we need. */
+        for (int i = 0; i < 3 - slots_filled; i++) {
+                emit_nop(c, block, scoreboard);
+                time++;
+        }
+
+        return time;
+}
+
 static uint32_t
 schedule_instructions(struct v3d_compile *c,
                       struct choose_scoreboard *scoreboard,
@@ -1401,23 +1536,11 @@ schedule_instructions(struct v3d_compile *c,
 
                 if (inst->sig.thrsw) {
                         time += emit_thrsw(c, block, scoreboard, qinst, false);
+                } else if (inst->type == V3D_QPU_INSTR_TYPE_BRANCH) {
+                        time += emit_branch(c, block, scoreboard, qinst);
                 } else {
                         insert_scheduled_instruction(c, block,
                                                      scoreboard, qinst);
-
-                        if (inst->type == V3D_QPU_INSTR_TYPE_BRANCH) {
-                                block->branch_qpu_ip = c->qpu_inst_count - 1;
-                                /* Fill the delay slots.
-                                 *
-                                 * We should fill these with actual instructions,
-                                 * instead, but that will probably need to be done
-                                 * after this, once we know what the leading
-                                 * instructions of the successors are (so we can
-                                 * handle A/B register file write latency)
-                                 */
-                                for (int i = 0; i < 3; i++)
-                                        emit_nop(c, block, scoreboard);
-                        }
                 }
         }
 
@@ -1520,10 +1643,74 @@ qpu_set_branch_targets(struct v3d_compile *c)
         }
 }
 
+/**
+ * Appends each block that can only be entered by falling through from the
+ * previous one to it, so that the two get scheduled as a single DAG.
+ *
+ * Otherwise the scheduler starts every block with nothing to pair up or
+ * hide latencies with, even though there is no control flow between the
+ * end of one and the start of the other.
+ */
+static void
+qpu_merge_fallthrough_blocks(struct v3d_compile *c)
+{
+        struct qblock *block = vir_entry_block(c);
+
+        while (block->link.next != &c->blocks) {
+                struct qblock *next = list_first_entry(&block->link,
+                                                       struct qblock, link);
+
+                bool ends_in_branch = false;
+                if (!list_is_empty(&block->instructions)) {
+                        struct qinst *last =
+                                list_last_entry(&block->instructions,
+                                                struct qinst, link);
+                        ends_in_branch =
+                                last->qpu.type == V3D_QPU_INSTR_TYPE_BRANCH;
+                }
+
+                if (ends_in_branch ||
+                    block->successors[0] != next ||
+                    block->successors[1] ||
+                    next->predecessors->entries != 1) {
+                        block = next;
+                        continue;
+                }
+
+                list_splicetail(&next->instructions, &block->instructions);
+                list_inithead(&next->instructions);
+
+                for (int i = 0; i < ARRAY_SIZE(next->successors); i++) {
+                        struct qblock *succ = next->successors[i];
+
+                        block->successors[i] = succ;
+                        if (succ) {
+                                _mesa_set_remove_key(succ->predecessors, next);
+                                _mesa_set_add(succ->predecessors, block);
+                        }
+                }
+
+                list_del(&next->link);
+        }
+}
+
+static bool
+qpu_inst_is_nop(const struct v3d_qpu_instr *inst)
+{
+        return (inst->type == V3D_QPU_INSTR_TYPE_ALU &&
+                inst->alu.add.op == V3D_QPU_A_NOP &&
+                inst->alu.mul.op == V3D_QPU_M_NOP &&
+                !inst->sig.small_imm &&
+                !v3d_qpu_sig_has_signals(&inst->sig));
+}
+
 uint32_t
 v3d_qpu_schedule_instructions(struct v3d_compile *c)
 {
         const struct v3d_device_info *devinfo = c->devinfo;
+
+        qpu_merge_fallthrough_blocks(c);
+
         struct qblock *end_block = list_last_entry(&c->blocks,
                                                    struct qblock, link);
 
@@ -1582,6 +1769,13 @@ v3d_qpu_schedule_instructions(struct v3d_compile *c)
 
         qpu_set_branch_targets(c);
 
+        vir_for_each_block(block, c) {
+                vir_for_each_inst(inst, block) {
+                        if (qpu_inst_is_nop(&inst->qpu))
+                                c->qpu_inst_nop_count++;
+                }
+        }
+
         assert(next_uniform == c->num_uniforms);
 
         return cycles;
@@ -0,0 +1,258 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Measures the time it takes to compile a corpus of generated compute
+ * shaders, from short ones that fit at 4 threads to large ones that drop
+ * threads and spill, which is where register allocation dominates, and
+ * ones with tens of thousands of short-lived temps, which stress the
+ * passes that scale with the number of temps like liveness.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/os_time.h"
+#include "util/ralloc.h"
+#include "compiler/glsl_types.h"
+#include "compiler/nir/nir_builder.h"
+#include "broadcom/common/v3d_device_info.h"
+#include "broadcom/compiler/v3d_compiler.h"
+
+struct bench_shader {
+        const char *name;
+        /* Values loaded up front and kept live until the end. */
+        unsigned live_values;
+        /* Sums of pairwise products of those values to store. */
+        unsigned outputs;
+};
+
+static const struct bench_shader corpus[] = {
+        { "small",      8,   2 },
+        { "medium",     32,  4 },
+        { "threads",    64,  4 },
+        { "spills",     128, 4 },
+        { "many_spills", 256, 8 },
+};
+
+struct bench_temps_shader {
+        const char *name;
+        /* Independent chains of math, each loaded, updated and stored. */
+        unsigned chains;
+        unsigned chain_length;
+        /* If non-zero, each group of this many chains is put under an if,
+         * to give the liveness dataflow some blocks to iterate over.
+         */
+        unsigned chains_per_if;
+};
+
+static const struct bench_temps_shader temps_corpus[] = {
+        { "temps_16k",    512,  32, 0 },
+        { "temps_16k_cf", 512,  32, 4 },
+        { "temps_32k_cf", 1024, 32, 4 },
+};
+
+static nir_ssa_def *
+bench_load_ssbo(nir_builder *b, unsigned buffer, unsigned offset)
+{
+        nir_intrinsic_instr *load =
+                nir_intrinsic_instr_create(b->shader, nir_intrinsic_load_ssbo);
+        load->num_components = 1;
+        load->src[0] = nir_src_for_ssa(nir_imm_int(b, buffer));
+        load->src[1] = nir_src_for_ssa(nir_imm_int(b, offset));
+        nir_intrinsic_set_align(load, 4, 0);
+        nir_ssa_dest_init(&load->instr, &load->dest, 1, 32, NULL);
+        nir_builder_instr_insert(b, &load->instr);
+
+        return &load->dest.ssa;
+}
+
+static void
+bench_store_ssbo(nir_builder *b, unsigned buffer, unsigned offset,
+                 nir_ssa_def *value)
+{
+        nir_intrinsic_instr *store =
+                nir_intrinsic_instr_create(b->shader, nir_intrinsic_store_ssbo);
+        store->num_components = 1;
+        store->src[0] = nir_src_for_ssa(value);
+        store->src[1] = nir_src_for_ssa(nir_imm_int(b, buffer));
+        store->src[2] = nir_src_for_ssa(nir_imm_int(b, offset));
+        nir_intrinsic_set_write_mask(store, 0x1);
+        nir_intrinsic_set_align(store, 4, 0);
+        nir_builder_instr_insert(b, &store->instr);
+}
+
+static void
+bench_init_builder(nir_builder *b, const char *name)
+{
+        nir_builder_init_simple_shader(b, NULL, MESA_SHADER_COMPUTE,
+                                       &v3d_nir_options);
+        b->shader->info.name = ralloc_strdup(b->shader, name);
+        b->shader->info.cs.local_size[0] = 16;
+        b->shader->info.cs.local_size[1] = 1;
+        b->shader->info.cs.local_size[2] = 1;
+        b->shader->info.num_ssbos = 2;
+}
+
+static nir_shader *
+bench_build_shader(const struct bench_shader *shader)
+{
+        nir_builder b;
+        bench_init_builder(&b, shader->name);
+
+        nir_ssa_def **values = ralloc_array(b.shader, nir_ssa_def *,
+                                            shader->live_values);
+        for (unsigned i = 0; i < shader->live_values; i++)
+                values[i] = bench_load_ssbo(&b, 0, i * 4);
+
+        for (unsigned o = 0; o < shader->outputs; o++) {
+                nir_ssa_def *sum = nir_imm_float(&b, 0.0);
+
+                for (unsigned i = 0; i < shader->live_values; i++) {
+                        unsigned j = (i + o + 1) % shader->live_values;
+                        sum = nir_fadd(&b, sum,
+                                       nir_fmul(&b, values[i], values[j]));
+                }
+
+                bench_store_ssbo(&b, 1, o * 4, sum);
+        }
+
+        return b.shader;
+}
+
+static nir_shader *
+bench_build_temps_shader(const struct bench_temps_shader *shader)
+{
+        nir_builder b;
+        bench_init_builder(&b, shader->name);
+
+        nir_ssa_def *cond_value = bench_load_ssbo(&b, 0, 0);
+        nir_if *nif = NULL;
+
+        for (unsigned c = 0; c < shader->chains; c++) {
+                if (shader->chains_per_if && c % shader->chains_per_if == 0) {
+                        if (nif)
+                                nir_pop_if(&b, nif);
+                        nif = nir_push_if(&b, nir_flt(&b, cond_value,
+                                                      nir_imm_float(&b, c)));
+                }
+
+                /* Distinct constants keep CSE from merging the chains. */
+                nir_ssa_def *value = bench_load_ssbo(&b, 0, (c + 1) * 4);
+                for (unsigned i = 0; i < shader->chain_length; i++) {
+                        float k = c * shader->chain_length + i;
+                        value = nir_fadd(&b,
+                                         nir_fmul(&b, value,
+                                                  nir_imm_float(&b, k)),
+                                         nir_imm_float(&b, -k));
+                }
+
+                bench_store_ssbo(&b, 1, c * 4, value);
+        }
+
+        if (nif)
+                nir_pop_if(&b, nif);
+
+        return b.shader;
+}
+
+static void
+bench_debug_output(const char *msg, void *data)
+{
+}
+
+static int
+bench_compile(const struct v3d_compiler *compiler, nir_shader *s,
+              int iterations)
+{
+        struct v3d_key key = { 0 };
+        struct v3d_prog_data *prog_data = NULL;
+        uint32_t size = 0;
+        int64_t elapsed = 0;
+
+        for (int it = 0; it < iterations; it++) {
+                ralloc_free(prog_data);
+
+                int64_t start = os_time_get_nano();
+                uint64_t *qpu_insts =
+                        v3d_compile(compiler, &key, &prog_data, s,
+                                    bench_debug_output, NULL,
+                                    0, 0, &size);
+                elapsed += os_time_get_nano() - start;
+
+                if (!qpu_insts) {
+                        fprintf(stderr, "failed to compile %s\n",
+                                s->info.name);
+                        return 1;
+                }
+                free(qpu_insts);
+        }
+
+        printf("{\"bench\": \"v3d_compile\", \"workload\": \"%s\", "
+               "\"compiles\": %d, \"ms_per_compile\": %.3f, "
+               "\"inst\": %u, \"threads\": %u, \"spill_size\": %u}\n",
+               s->info.name, iterations,
+               (double)elapsed / iterations / 1000000.0,
+               size / 8, prog_data->threads, prog_data->spill_size);
+        fflush(stdout);
+
+        ralloc_free(prog_data);
+
+        return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+        int iterations = argc > 1 ? atoi(argv[1]) : 20;
+        struct v3d_device_info devinfo = {
+                .ver = 42,
+                .vpm_size = 16 * 1024,
+                .qpu_count = 8,
+        };
+
+        glsl_type_singleton_init_or_ref();
+
+        const struct v3d_compiler *compiler = v3d_compiler_init(&devinfo);
+
+        for (int i = 0; i < ARRAY_SIZE(corpus); i++) {
+                nir_shader *s = bench_build_shader(&corpus[i]);
+                int ret = bench_compile(compiler, s, iterations);
+                ralloc_free(s);
+                if (ret)
+                        return ret;
+        }
+
+        for (int i = 0; i < ARRAY_SIZE(temps_corpus); i++) {
+                nir_shader *s = bench_build_temps_shader(&temps_corpus[i]);
+                int ret = bench_compile(compiler, s, iterations);
+                ralloc_free(s);
+                if (ret)
+                        return ret;
+        }
+
+        v3d_compiler_free(compiler);
+        glsl_type_singleton_decref();
+
+        return 0;
+}
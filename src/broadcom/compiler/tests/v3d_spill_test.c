@@ -0,0 +1,188 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Compiles a compute shader keeping many integer products of uniforms live,
+ * so that register allocation has to spill them, and checks that every
+ * UMUL24 in the generated code still has its MULTOP right before it, rather
+ * than being computed again on its own at a use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/ralloc.h"
+#include "compiler/glsl_types.h"
+#include "compiler/nir/nir_builder.h"
+#include "broadcom/common/v3d_device_info.h"
+#include "broadcom/compiler/v3d_compiler.h"
+#include "broadcom/qpu/qpu_instr.h"
+
+#define LIVE_VALUES 128
+#define OUTPUTS 4
+
+static nir_ssa_def *
+test_load_uniform(nir_builder *b, unsigned offset)
+{
+        nir_intrinsic_instr *load =
+                nir_intrinsic_instr_create(b->shader,
+                                           nir_intrinsic_load_uniform);
+        load->num_components = 1;
+        load->src[0] = nir_src_for_ssa(nir_imm_int(b, 0));
+        nir_intrinsic_set_base(load, offset);
+        nir_intrinsic_set_range(load, 4);
+        nir_ssa_dest_init(&load->instr, &load->dest, 1, 32, NULL);
+        nir_builder_instr_insert(b, &load->instr);
+
+        return &load->dest.ssa;
+}
+
+static void
+test_store_ssbo(nir_builder *b, unsigned offset, nir_ssa_def *value)
+{
+        nir_intrinsic_instr *store =
+                nir_intrinsic_instr_create(b->shader, nir_intrinsic_store_ssbo);
+        store->num_components = 1;
+        store->src[0] = nir_src_for_ssa(value);
+        store->src[1] = nir_src_for_ssa(nir_imm_int(b, 0));
+        store->src[2] = nir_src_for_ssa(nir_imm_int(b, offset));
+        nir_intrinsic_set_write_mask(store, 0x1);
+        nir_intrinsic_set_align(store, 4, 0);
+        nir_builder_instr_insert(b, &store->instr);
+}
+
+static nir_shader *
+test_build_shader(void)
+{
+        nir_builder b;
+        nir_builder_init_simple_shader(&b, NULL, MESA_SHADER_COMPUTE,
+                                       &v3d_nir_options);
+        b.shader->info.name = ralloc_strdup(b.shader, "imul_uniform_spills");
+        b.shader->info.cs.local_size[0] = 16;
+        b.shader->info.cs.local_size[1] = 1;
+        b.shader->info.cs.local_size[2] = 1;
+        b.shader->info.num_ssbos = 1;
+        b.shader->num_uniforms = 2 * LIVE_VALUES * 4;
+
+        nir_ssa_def *values[LIVE_VALUES];
+        for (unsigned i = 0; i < LIVE_VALUES; i++) {
+                values[i] = nir_imul(&b,
+                                     test_load_uniform(&b, i * 4),
+                                     test_load_uniform(&b,
+                                                       (LIVE_VALUES + i) * 4));
+        }
+
+        for (unsigned o = 0; o < OUTPUTS; o++) {
+                nir_ssa_def *sum = nir_imm_int(&b, 0);
+
+                for (unsigned i = 0; i < LIVE_VALUES; i++) {
+                        unsigned j = (i + o + 1) % LIVE_VALUES;
+                        sum = nir_iadd(&b, sum,
+                                       nir_ixor(&b, values[i], values[j]));
+                }
+
+                test_store_ssbo(&b, o * 4, sum);
+        }
+
+        return b.shader;
+}
+
+static void
+test_debug_output(const char *msg, void *data)
+{
+}
+
+int
+main(int argc, char **argv)
+{
+        struct v3d_device_info devinfo = {
+                .ver = 42,
+                .vpm_size = 16 * 1024,
+                .qpu_count = 8,
+        };
+        int ret = 0;
+
+        glsl_type_singleton_init_or_ref();
+
+        const struct v3d_compiler *compiler = v3d_compiler_init(&devinfo);
+        nir_shader *s = test_build_shader();
+
+        struct v3d_key key = { 0 };
+        struct v3d_prog_data *prog_data = NULL;
+        uint32_t size = 0;
+        uint64_t *qpu_insts = v3d_compile(compiler, &key, &prog_data, s,
+                                          test_debug_output, NULL,
+                                          0, 0, &size);
+        if (!qpu_insts) {
+                fprintf(stderr, "failed to compile %s\n", s->info.name);
+                ret = 1;
+                goto done;
+        }
+
+        if (prog_data->spill_size == 0) {
+                fprintf(stderr, "%s didn't spill\n", s->info.name);
+                ret = 1;
+        }
+
+        /* rtop is set by each MULTOP and read by the UMUL24 of the same
+         * vir_UMUL(), so the two have to alternate in the program.
+         */
+        bool rtop_set = false;
+        for (uint32_t i = 0; i < size / sizeof(uint64_t); i++) {
+                struct v3d_qpu_instr inst;
+                if (!v3d_qpu_instr_unpack(&devinfo, qpu_insts[i], &inst)) {
+                        fprintf(stderr, "failed to unpack 0x%016llx\n",
+                                (long long)qpu_insts[i]);
+                        ret = 1;
+                        break;
+                }
+
+                if (inst.type != V3D_QPU_INSTR_TYPE_ALU)
+                        continue;
+
+                if (inst.alu.mul.op == V3D_QPU_M_MULTOP) {
+                        if (rtop_set) {
+                                fprintf(stderr, "inst %u: MULTOP overwrites "
+                                        "an unread rtop\n", i);
+                                ret = 1;
+                        }
+                        rtop_set = true;
+                } else if (inst.alu.mul.op == V3D_QPU_M_UMUL24) {
+                        if (!rtop_set) {
+                                fprintf(stderr, "inst %u: UMUL24 without a "
+                                        "MULTOP before it\n", i);
+                                ret = 1;
+                        }
+                        rtop_set = false;
+                }
+        }
+
+        free(qpu_insts);
+
+done:
+        ralloc_free(prog_data);
+        ralloc_free(s);
+        v3d_compiler_free(compiler);
+        glsl_type_singleton_decref();
+
+        return ret;
+}
@@ -0,0 +1,700 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file
+ *
+ * Standalone V3D shader compiler, for tracking the compiler's output without
+ * hardware or a GL/Vulkan application.
+ *
+ * Each GLSL (.vert, .geom, .frag, .comp) or SPIR-V (.spv) file given, or
+ * found under a directory given, is compiled on its own with the same keys
+ * V3D_DEBUG=precompile uses in the gallium driver.  The SHADER-DB stats of
+ * every variant, and optionally the QPU disassembly, are printed in the
+ * order the files were given, while the compiles themselves run in
+ * parallel.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <ftw.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "c11/threads.h"
+#include "util/ralloc.h"
+#include "util/u_dynarray.h"
+#include "util/u_queue.h"
+#include "util/u_cpu_detect.h"
+
+#include "main/mtypes.h"
+#include "compiler/glsl/standalone.h"
+#include "compiler/glsl/glsl_to_nir.h"
+#include "compiler/glsl/gl_nir.h"
+#include "compiler/glsl_types.h"
+#include "compiler/nir/nir_builder.h"
+#include "compiler/spirv/nir_spirv.h"
+
+#include "broadcom/common/v3d_debug.h"
+#include "broadcom/common/v3d_device_info.h"
+#include "broadcom/compiler/v3d_compiler.h"
+#include "broadcom/qpu/qpu_disasm.h"
+#include "pipe/p_state.h"
+
+struct v3d_cmdline_shader {
+        char *filename;
+        gl_shader_stage stage;
+        bool spirv;
+
+        /* Everything to print for the shader, ralloced. */
+        char *output;
+        bool failed;
+
+        struct util_queue_fence fence;
+};
+
+static struct v3d_device_info devinfo = {
+        .ver = 42,
+        .vpm_size = 16 * 1024,
+        .qpu_count = 8,
+};
+static const struct v3d_compiler *compiler;
+static const char *spirv_entry = "main";
+static gl_shader_stage spirv_stage = MESA_SHADER_NONE;
+static bool print_disasm;
+
+/* The standalone GLSL compiler keeps its state in globals. */
+static mtx_t glsl_mutex = _MTX_INITIALIZER_NP;
+
+/* Files found while walking the directories given. */
+static struct util_dynarray found_files;
+
+static gl_shader_stage
+stage_from_extension(const char *ext)
+{
+        if (!strcmp(ext, ".vert"))
+                return MESA_SHADER_VERTEX;
+        if (!strcmp(ext, ".geom"))
+                return MESA_SHADER_GEOMETRY;
+        if (!strcmp(ext, ".frag"))
+                return MESA_SHADER_FRAGMENT;
+        if (!strcmp(ext, ".comp"))
+                return MESA_SHADER_COMPUTE;
+
+        return MESA_SHADER_NONE;
+}
+
+/**
+ * Returns the stage of a shader file from its name: foo.frag for GLSL, and
+ * foo.frag.spv or, with --stage, any foo.spv for SPIR-V.
+ */
+static gl_shader_stage
+stage_from_filename(const char *filename, bool *spirv)
+{
+        const char *ext = strrchr(filename, '.');
+        if (!ext)
+                return MESA_SHADER_NONE;
+
+        *spirv = !strcmp(ext, ".spv");
+        if (!*spirv)
+                return stage_from_extension(ext);
+
+        if (spirv_stage != MESA_SHADER_NONE)
+                return spirv_stage;
+
+        const char *stage_ext = ext;
+        while (stage_ext > filename && *--stage_ext != '.')
+                ;
+
+        char buf[8];
+        if (ext - stage_ext >= sizeof(buf))
+                return MESA_SHADER_NONE;
+        memcpy(buf, stage_ext, ext - stage_ext);
+        buf[ext - stage_ext] = '\0';
+
+        return stage_from_extension(buf);
+}
+
+static int
+type_size(const struct glsl_type *type, bool bindless)
+{
+        return glsl_count_attribute_slots(type, false);
+}
+
+/* Uniforms are loaded by byte offset, with each slot vec4-aligned. */
+static int
+uniform_type_size(const struct glsl_type *type, bool bindless)
+{
+        return glsl_count_attribute_slots(type, false) * 16;
+}
+
+static nir_shader *
+load_glsl(struct v3d_cmdline_shader *shader)
+{
+        static const struct standalone_options options = {
+                .glsl_version = 460,
+                .do_link = true,
+                .just_log = true,
+        };
+        static struct gl_context local_ctx;
+        char *files[] = { shader->filename };
+        nir_shader *nir = NULL;
+
+        mtx_lock(&glsl_mutex);
+
+        struct gl_shader_program *prog =
+                standalone_compile_shader(&options, 1, files, &local_ctx);
+        if (!prog)
+                goto out;
+
+        if (!prog->_LinkedShaders[shader->stage]) {
+                standalone_compiler_cleanup(prog);
+                goto out;
+        }
+
+        nir = glsl_to_nir(&local_ctx, prog, shader->stage, &v3d_nir_options);
+
+        NIR_PASS_V(nir, nir_lower_io_to_temporaries,
+                   nir_shader_get_entrypoint(nir), true,
+                   shader->stage != MESA_SHADER_FRAGMENT);
+        NIR_PASS_V(nir, nir_lower_global_vars_to_local);
+        NIR_PASS_V(nir, nir_split_var_copies);
+        NIR_PASS_V(nir, nir_lower_var_copies);
+
+        NIR_PASS_V(nir, gl_nir_lower_atomics, prog, true);
+        NIR_PASS_V(nir, nir_lower_atomics_to_ssbo, 0);
+        NIR_PASS_V(nir, gl_nir_lower_samplers, prog);
+
+        standalone_compiler_cleanup(prog);
+
+out:
+        mtx_unlock(&glsl_mutex);
+
+        return nir;
+}
+
+/**
+ * Flattens the Vulkan resource model the way a simple driver would: UBO and
+ * SSBO indices are the bindings (ignoring the descriptor set), and push
+ * constants are loaded like uniforms.
+ */
+static void
+lower_vulkan_resources(nir_shader *nir)
+{
+        nir_foreach_function(function, nir) {
+                if (!function->impl)
+                        continue;
+
+                nir_builder b;
+                nir_builder_init(&b, function->impl);
+
+                nir_foreach_block(block, function->impl) {
+                        nir_foreach_instr_safe(instr, block) {
+                                if (instr->type != nir_instr_type_intrinsic)
+                                        continue;
+
+                                nir_intrinsic_instr *intr =
+                                        nir_instr_as_intrinsic(instr);
+                                nir_ssa_def *index;
+
+                                b.cursor = nir_before_instr(instr);
+
+                                switch (intr->intrinsic) {
+                                case nir_intrinsic_vulkan_resource_index:
+                                        index = nir_iadd(&b,
+                                                         nir_imm_int(&b, nir_intrinsic_binding(intr)),
+                                                         intr->src[0].ssa);
+                                        break;
+                                case nir_intrinsic_vulkan_resource_reindex:
+                                        index = nir_iadd(&b,
+                                                         intr->src[0].ssa,
+                                                         intr->src[1].ssa);
+                                        break;
+                                case nir_intrinsic_load_push_constant:
+                                        intr->intrinsic =
+                                                nir_intrinsic_load_uniform;
+                                        continue;
+                                default:
+                                        continue;
+                                }
+
+                                nir_ssa_def_rewrite_uses(&intr->dest.ssa,
+                                                         nir_src_for_ssa(index));
+                                nir_instr_remove(instr);
+                        }
+                }
+
+                nir_metadata_preserve(function->impl,
+                                      nir_metadata_block_index |
+                                      nir_metadata_dominance);
+        }
+}
+
+static nir_shader *
+load_spirv(struct v3d_cmdline_shader *shader)
+{
+        const struct spirv_to_nir_options spirv_options = {
+                .frag_coord_is_sysval = true,
+                .lower_ubo_ssbo_access_to_offsets = true,
+                .caps = {
+                        .draw_parameters = true,
+                        .image_read_without_format = true,
+                        .image_write_without_format = true,
+                },
+        };
+
+        FILE *f = fopen(shader->filename, "rb");
+        if (!f)
+                return NULL;
+
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+
+        uint32_t *words = malloc(size);
+        bool ok = words && size % 4 == 0 && fread(words, size, 1, f) == 1;
+        fclose(f);
+        if (!ok) {
+                free(words);
+                return NULL;
+        }
+
+        nir_shader *nir = spirv_to_nir(words, size / 4, NULL, 0,
+                                       shader->stage, spirv_entry,
+                                       &spirv_options, &v3d_nir_options);
+        free(words);
+        if (!nir)
+                return NULL;
+
+        NIR_PASS_V(nir, nir_lower_constant_initializers,
+                   nir_var_function_temp);
+        NIR_PASS_V(nir, nir_lower_returns);
+        NIR_PASS_V(nir, nir_inline_functions);
+        NIR_PASS_V(nir, nir_opt_deref);
+        foreach_list_typed_safe(nir_function, func, node, &nir->functions) {
+                if (!func->is_entrypoint)
+                        exec_node_remove(&func->node);
+        }
+        NIR_PASS_V(nir, nir_lower_constant_initializers,
+                   ~nir_var_function_temp);
+
+        NIR_PASS_V(nir, nir_split_var_copies);
+        NIR_PASS_V(nir, nir_split_per_member_structs);
+        NIR_PASS_V(nir, nir_lower_io_to_temporaries,
+                   nir_shader_get_entrypoint(nir), true, true);
+        NIR_PASS_V(nir, nir_lower_global_vars_to_local);
+        NIR_PASS_V(nir, nir_split_var_copies);
+        NIR_PASS_V(nir, nir_lower_var_copies);
+
+        NIR_PASS_V(nir, nir_lower_samplers);
+        lower_vulkan_resources(nir);
+
+        return nir;
+}
+
+/* Lowers the shader to what the gallium driver hands v3d_compile(). */
+static void
+lower_nir(nir_shader *nir)
+{
+        nir_assign_var_locations(&nir->uniforms, &nir->num_uniforms,
+                                 uniform_type_size);
+        NIR_PASS_V(nir, nir_lower_io, nir_var_uniform, uniform_type_size,
+                   (nir_lower_io_options)0);
+
+        nir_assign_var_locations(&nir->inputs, &nir->num_inputs, type_size);
+        nir_assign_var_locations(&nir->outputs, &nir->num_outputs, type_size);
+
+        nir_variable_mode lower_mode = nir_var_all & ~nir_var_uniform;
+        if (nir->info.stage == MESA_SHADER_VERTEX ||
+            nir->info.stage == MESA_SHADER_GEOMETRY) {
+                lower_mode &= ~(nir_var_shader_in | nir_var_shader_out);
+        }
+        NIR_PASS_V(nir, nir_lower_io, lower_mode, type_size,
+                   (nir_lower_io_options)0);
+
+        NIR_PASS_V(nir, nir_lower_system_values);
+        NIR_PASS_V(nir, nir_lower_regs_to_ssa);
+        NIR_PASS_V(nir, nir_normalize_cubemap_coords);
+        NIR_PASS_V(nir, nir_lower_load_const_to_scalar);
+
+        v3d_optimize_nir(nir);
+
+        NIR_PASS_V(nir, nir_remove_dead_variables, nir_var_function_temp);
+        nir_sweep(nir);
+}
+
+static void
+v3d_cmdline_debug_output(const char *message, void *data)
+{
+        struct v3d_cmdline_shader *shader = data;
+
+        ralloc_asprintf_append(&shader->output, "%s - %s\n",
+                               shader->filename, message);
+}
+
+static void
+compile_variant(struct v3d_cmdline_shader *shader, nir_shader *nir,
+                struct v3d_key *key, const char *variant_name)
+{
+        struct v3d_prog_data *prog_data;
+        uint32_t size;
+
+        uint64_t *qpu_insts = v3d_compile(compiler, key, &prog_data, nir,
+                                          v3d_cmdline_debug_output, shader,
+                                          0, 0, &size);
+        if (!qpu_insts) {
+                ralloc_asprintf_append(&shader->output,
+                                       "%s - %s compile failed\n",
+                                       shader->filename, variant_name);
+                shader->failed = true;
+                return;
+        }
+
+        if (print_disasm) {
+                ralloc_asprintf_append(&shader->output, "; %s %s:\n",
+                                       shader->filename, variant_name);
+                for (uint32_t i = 0; i < size / sizeof(uint64_t); i++) {
+                        const char *inst = v3d_qpu_disasm(&devinfo,
+                                                          qpu_insts[i]);
+                        ralloc_asprintf_append(&shader->output, "%s\n", inst);
+                        ralloc_free((char *)inst);
+                }
+        }
+
+        free(qpu_insts);
+        ralloc_free(prog_data);
+}
+
+static void
+setup_tex_key(nir_shader *nir, struct v3d_key *key)
+{
+        for (int i = 0; i < nir->info.num_textures; i++) {
+                key->tex[i].return_size = 16;
+                key->tex[i].return_channels = 2;
+
+                key->tex[i].swizzle[0] = PIPE_SWIZZLE_X;
+                key->tex[i].swizzle[1] = PIPE_SWIZZLE_Y;
+                key->tex[i].swizzle[2] = PIPE_SWIZZLE_Z;
+                key->tex[i].swizzle[3] = PIPE_SWIZZLE_W;
+        }
+}
+
+static void
+setup_all_outputs(nir_shader *nir, struct v3d_varying_slot *outputs,
+                  uint8_t *num_outputs)
+{
+        nir_foreach_variable(var, &nir->outputs) {
+                const int array_len = MAX2(glsl_get_length(var->type), 1);
+                for (int j = 0; j < array_len; j++) {
+                        const int slot = var->data.location + j;
+                        const int num_components =
+                                glsl_get_components(var->type);
+                        for (int i = 0; i < num_components; i++) {
+                                const int swiz = var->data.location_frac + i;
+                                outputs[(*num_outputs)++] =
+                                        v3d_slot_from_slot_and_component(slot,
+                                                                         swiz);
+                        }
+                }
+        }
+}
+
+static void
+compile_shader(void *data, int thread_index)
+{
+        struct v3d_cmdline_shader *shader = data;
+
+        shader->output = ralloc_strdup(NULL, "");
+
+        nir_shader *nir = shader->spirv ? load_spirv(shader) :
+                                          load_glsl(shader);
+        if (!nir) {
+                ralloc_asprintf_append(&shader->output,
+                                       "%s - failed to translate to NIR\n",
+                                       shader->filename);
+                shader->failed = true;
+                return;
+        }
+
+        lower_nir(nir);
+
+        switch (nir->info.stage) {
+        case MESA_SHADER_FRAGMENT: {
+                struct v3d_fs_key key = { 0 };
+
+                setup_tex_key(nir, &key.base);
+                nir_foreach_variable(var, &nir->outputs) {
+                        if (var->data.location == FRAG_RESULT_COLOR) {
+                                key.cbufs |= 1 << 0;
+                        } else if (var->data.location >= FRAG_RESULT_DATA0) {
+                                key.cbufs |= 1 << (var->data.location -
+                                                   FRAG_RESULT_DATA0);
+                        }
+                }
+                key.logicop_func = PIPE_LOGICOP_COPY;
+
+                compile_variant(shader, nir, &key.base, "FS");
+                break;
+        }
+
+        case MESA_SHADER_GEOMETRY: {
+                struct v3d_gs_key key = {
+                        .base.is_last_geometry_stage = true,
+                };
+
+                setup_tex_key(nir, &key.base);
+                setup_all_outputs(nir, key.used_outputs,
+                                  &key.num_used_outputs);
+                compile_variant(shader, nir, &key.base, "GS");
+
+                key.is_coord = true;
+                key.num_used_outputs = 0;
+                for (int i = 0; i < 4; i++) {
+                        key.used_outputs[key.num_used_outputs++] =
+                                v3d_slot_from_slot_and_component(VARYING_SLOT_POS,
+                                                                 i);
+                }
+                compile_variant(shader, nir, &key.base, "GS bin");
+                break;
+        }
+
+        case MESA_SHADER_VERTEX: {
+                struct v3d_vs_key key = {
+                        .base.is_last_geometry_stage = true,
+                };
+
+                setup_tex_key(nir, &key.base);
+                setup_all_outputs(nir, key.used_outputs,
+                                  &key.num_used_outputs);
+                compile_variant(shader, nir, &key.base, "VS");
+
+                key.is_coord = true;
+                key.num_used_outputs = 0;
+                for (int i = 0; i < 4; i++) {
+                        key.used_outputs[key.num_used_outputs++] =
+                                v3d_slot_from_slot_and_component(VARYING_SLOT_POS,
+                                                                 i);
+                }
+                compile_variant(shader, nir, &key.base, "VS bin");
+                break;
+        }
+
+        case MESA_SHADER_COMPUTE: {
+                struct v3d_key key = { 0 };
+
+                setup_tex_key(nir, &key);
+                compile_variant(shader, nir, &key, "CS");
+                break;
+        }
+
+        default:
+                unreachable("unsupported shader stage");
+        }
+
+        ralloc_free(nir);
+}
+
+static int
+add_found_file(const char *path, const struct stat *sb, int type,
+               struct FTW *ftwbuf)
+{
+        bool spirv;
+
+        if (type == FTW_F &&
+            stage_from_filename(path, &spirv) != MESA_SHADER_NONE) {
+                util_dynarray_append(&found_files, char *, strdup(path));
+        }
+
+        return 0;
+}
+
+static int
+compare_filenames(const void *a, const void *b)
+{
+        return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void
+print_usage(void)
+{
+        printf("Usage: v3d_compiler [OPTIONS]... <file.vert | file.geom | file.frag | file.comp | file.spv | directory>...\n");
+        printf("    --ver VERSION     - V3D version to compile for: 33, 41 or 42 (default 42)\n");
+        printf("    --disasm          - print the QPU disassembly of each variant\n");
+        printf("    --jobs N          - number of shaders to compile in parallel (default: number of CPUs)\n");
+        printf("    --entry NAME      - SPIR-V entry point (default main)\n");
+        printf("    --stage STAGE     - SPIR-V stage: vert, geom, frag or comp (default from foo.STAGE.spv)\n");
+        printf("    --help            - show this message\n");
+}
+
+int
+main(int argc, char **argv)
+{
+        static const struct option long_options[] = {
+                { "ver",    required_argument, NULL, 'v' },
+                { "disasm", no_argument,       NULL, 'd' },
+                { "jobs",   required_argument, NULL, 'j' },
+                { "entry",  required_argument, NULL, 'e' },
+                { "stage",  required_argument, NULL, 's' },
+                { "help",   no_argument,       NULL, 'h' },
+                { NULL, 0, NULL, 0 },
+        };
+        int jobs = 0;
+        int opt;
+
+        while ((opt = getopt_long(argc, argv, "v:dj:e:s:h",
+                                  long_options, NULL)) != -1) {
+                switch (opt) {
+                case 'v':
+                        devinfo.ver = atoi(optarg);
+                        if (devinfo.ver != 33 && devinfo.ver != 41 &&
+                            devinfo.ver != 42) {
+                                fprintf(stderr, "unsupported V3D version %s\n",
+                                        optarg);
+                                return 1;
+                        }
+                        break;
+                case 'd':
+                        print_disasm = true;
+                        break;
+                case 'j':
+                        jobs = atoi(optarg);
+                        break;
+                case 'e':
+                        spirv_entry = optarg;
+                        break;
+                case 's': {
+                        char ext[8];
+                        snprintf(ext, sizeof(ext), ".%s", optarg);
+                        spirv_stage = stage_from_extension(ext);
+                        if (spirv_stage == MESA_SHADER_NONE) {
+                                fprintf(stderr, "unknown stage %s\n", optarg);
+                                return 1;
+                        }
+                        break;
+                }
+                case 'h':
+                        print_usage();
+                        return 0;
+                default:
+                        print_usage();
+                        return 1;
+                }
+        }
+
+        if (optind == argc) {
+                print_usage();
+                return 1;
+        }
+
+        util_dynarray_init(&found_files, NULL);
+        for (int i = optind; i < argc; i++) {
+                struct stat st;
+
+                if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+                        unsigned first = util_dynarray_num_elements(&found_files,
+                                                                    char *);
+                        nftw(argv[i], add_found_file, 16, 0);
+                        qsort(util_dynarray_element(&found_files, char *,
+                                                    first),
+                              util_dynarray_num_elements(&found_files,
+                                                         char *) - first,
+                              sizeof(char *), compare_filenames);
+                } else {
+                        util_dynarray_append(&found_files, char *,
+                                             strdup(argv[i]));
+                }
+        }
+
+        unsigned num_shaders = util_dynarray_num_elements(&found_files,
+                                                          char *);
+        struct v3d_cmdline_shader *shaders =
+                calloc(num_shaders, sizeof(*shaders));
+
+        for (unsigned i = 0; i < num_shaders; i++) {
+                struct v3d_cmdline_shader *shader = &shaders[i];
+
+                shader->filename = *util_dynarray_element(&found_files,
+                                                          char *, i);
+                shader->stage = stage_from_filename(shader->filename,
+                                                    &shader->spirv);
+                if (shader->stage == MESA_SHADER_NONE) {
+                        fprintf(stderr, "unknown shader type for %s\n",
+                                shader->filename);
+                        print_usage();
+                        return 1;
+                }
+        }
+
+        /* The stats always come through the debug output callback, so
+         * V3D_DEBUG=shaderdb would only print them a second time.
+         */
+        v3d_process_debug_variable();
+        V3D_DEBUG &= ~V3D_DEBUG_SHADERDB;
+
+        glsl_type_singleton_init_or_ref();
+        compiler = v3d_compiler_init(&devinfo);
+
+        if (jobs <= 0) {
+                util_cpu_detect();
+                jobs = util_cpu_caps.nr_cpus;
+        }
+
+        struct util_queue queue;
+        if (!util_queue_init(&queue, "v3d_compile", num_shaders, jobs,
+                             UTIL_QUEUE_INIT_RESIZE_IF_FULL)) {
+                fprintf(stderr, "failed to create the compile threads\n");
+                return 1;
+        }
+
+        for (unsigned i = 0; i < num_shaders; i++) {
+                util_queue_fence_init(&shaders[i].fence);
+                util_queue_add_job(&queue, &shaders[i], &shaders[i].fence,
+                                   compile_shader, NULL, 0);
+        }
+
+        int ret = 0;
+        for (unsigned i = 0; i < num_shaders; i++) {
+                struct v3d_cmdline_shader *shader = &shaders[i];
+
+                util_queue_fence_wait(&shader->fence);
+                util_queue_fence_destroy(&shader->fence);
+
+                fputs(shader->output, stdout);
+                if (shader->failed)
+                        ret = 1;
+
+                ralloc_free(shader->output);
+                free(shader->filename);
+        }
+
+        util_queue_destroy(&queue);
+        free(shaders);
+        util_dynarray_fini(&found_files);
+
+        v3d_compiler_free(compiler);
+        glsl_type_singleton_decref();
+
+        return ret;
+}
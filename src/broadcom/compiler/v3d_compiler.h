@@ -428,6 +428,12 @@ struct qblock {
         /** Offset within the uniform stream of the branch instruction */
         uint32_t branch_uniform;
 
+        /**
+         * Estimated number of times the block runs per invocation, from the
+         * trip counts of the loops it is in.  Used by qpu_estimate.c.
+         */
+        uint32_t exec_count;
+
         /** @{ used by v3d_vir_live_variables.c */
         BITSET_WORD *def;
         BITSET_WORD *defin;
@@ -492,6 +498,38 @@ struct v3d_compiler {
         unsigned int reg_class_r5[3];
         unsigned int reg_class_phys[3];
         unsigned int reg_class_phys_or_acc[3];
+
+        /* Workers for the compiles at lower thread counts that
+         * v3d_compile() runs speculatively, if enabled.
+         */
+        struct util_queue *speculative_queue;
+};
+
+/* The lowest thread count we can register allocate at: V3D 4.x always runs
+ * at least 2 threads.
+ */
+#define V3D_MIN_THREADS(devinfo) ((devinfo)->ver >= 41 ? 2 : 1)
+
+/**
+ * Static estimate of the cost of the final QPU code, from qpu_estimate.c.
+ *
+ * Cycles are instruction issue cycles of one thread, with the blocks in
+ * loops weighted by the loops' trip counts.  It is only meant to rank
+ * shaders against each other, not to predict hardware timings.
+ */
+struct v3d_qpu_estimate {
+        /* Issue cycles, including the stalls not hidden by other threads. */
+        uint32_t cycles;
+        /* Longest chain of dependent instructions, ignoring issue order. */
+        uint32_t critical_path;
+        /* Cycles spent waiting on TMU results and on other latencies. */
+        uint32_t tmu_stall_cycles;
+        uint32_t latency_stall_cycles;
+        /* TMU results read (LDTMU and TMUWT) and SFU operations issued. */
+        uint32_t tmu_reads;
+        uint32_t sfu_ops;
+        /* Loops whose trip count was guessed. */
+        uint32_t unknown_loops;
 };
 
 struct v3d_compile {
@@ -579,7 +617,7 @@ struct v3d_compile {
          */
         uint32_t spill_size;
         /* Shader-db stats */
-        uint32_t spills, fills, loops;
+        uint32_t spills, fills, remats, loops;
         /**
          * Register spilling's per-thread base address, shared between each
          * spill/fill's addressing calculations.
@@ -587,6 +625,10 @@ struct v3d_compile {
         struct qreg spill_base;
         /* Bit vector of which temps may be spilled */
         BITSET_WORD *spillable;
+        /* Temp interference found by earlier register allocation attempts,
+         * see v3d_register_allocate().
+         */
+        struct v3d_ra_interference *ra_interference;
 
         /**
          * Array of the VARYING_SLOT_* of all FS QFILE_VARY reads.
@@ -630,11 +672,16 @@ struct v3d_compile {
         struct qblock *cur_block;
         struct qblock *loop_cont_block;
         struct qblock *loop_break_block;
+        /* exec_count for the blocks created at the current loop depth. */
+        uint32_t exec_count;
 
         uint64_t *qpu_insts;
         uint32_t qpu_inst_count;
         uint32_t qpu_inst_size;
         uint32_t qpu_inst_stalled_count;
+        uint32_t qpu_inst_thrsw_count;
+        uint32_t qpu_inst_nop_count;
+        struct v3d_qpu_estimate estimate;
 
         /* For the FS, the number of varying inputs not counting the
          * point/line varyings payload
@@ -653,6 +700,12 @@ struct v3d_compile {
          * physical reg space in half.
          */
         uint8_t threads;
+        /* Thread count below which we give up instead of trying again. */
+        uint8_t min_threads;
+        /* Set by v3d_compile() once a compile of the same shader at more
+         * threads succeeded, so that this one can stop early.
+         */
+        const int *cancelled;
         struct qinst *last_thrsw;
         bool last_thrsw_at_top_level;
 
@@ -683,6 +736,8 @@ struct v3d_prog_data {
         bool single_seg;
 
         bool tmu_dirty_rcl;
+
+        struct v3d_qpu_estimate estimate;
 };
 
 struct v3d_vs_prog_data {
@@ -777,7 +832,11 @@ vir_has_uniform(struct qinst *inst)
 extern const nir_shader_compiler_options v3d_nir_options;
 
 const struct v3d_compiler *v3d_compiler_init(const struct v3d_device_info *devinfo);
+const struct v3d_compiler *
+v3d_compiler_init_speculative(const struct v3d_device_info *devinfo,
+                              unsigned num_threads);
 void v3d_compiler_free(const struct v3d_compiler *compiler);
+uint32_t v3d_prog_data_size(gl_shader_stage stage);
 void v3d_optimize_nir(struct nir_shader *s);
 
 uint64_t *v3d_compile(const struct v3d_compiler *compiler,
@@ -876,6 +935,9 @@ void v3d40_vir_emit_image_load_store(struct v3d_compile *c,
 
 void v3d_vir_to_qpu(struct v3d_compile *c, struct qpu_reg *temp_registers);
 uint32_t v3d_qpu_schedule_instructions(struct v3d_compile *c);
+uint32_t v3d_qpu_instr_latency(const struct v3d_qpu_instr *before,
+                               const struct v3d_qpu_instr *after);
+void v3d_qpu_estimate(struct v3d_compile *c);
 void qpu_validate(struct v3d_compile *c);
 struct qpu_reg *v3d_register_allocate(struct v3d_compile *c, bool *spilled);
 bool vir_init_reg_sets(struct v3d_compiler *compiler);
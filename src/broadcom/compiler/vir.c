@@ -23,7 +23,9 @@
 
 #include "broadcom/common/v3d_device_info.h"
 #include "v3d_compiler.h"
+#include "util/u_atomic.h"
 #include "util/u_prim.h"
+#include "util/u_queue.h"
 
 int
 vir_get_nsrc(struct qinst *inst)
@@ -433,6 +435,7 @@ vir_new_block(struct v3d_compile *c)
                                                _mesa_key_pointer_equal);
 
         block->index = c->next_block_index++;
+        block->exec_count = c->exec_count;
 
         return block;
 }
@@ -471,6 +474,20 @@ vir_link_blocks(struct qblock *predecessor, struct qblock *successor)
 
 const struct v3d_compiler *
 v3d_compiler_init(const struct v3d_device_info *devinfo)
+{
+        return v3d_compiler_init_speculative(devinfo, 0);
+}
+
+/**
+ * Like v3d_compiler_init(), but with v3d_compile() also compiling each
+ * shader at the lower thread counts on @num_threads workers, rather than
+ * only falling back to them once register allocation failed at 4 threads.
+ * This spends CPU time on compiles that may get thrown away to get a lower
+ * latency for the shaders that end up at fewer threads.
+ */
+const struct v3d_compiler *
+v3d_compiler_init_speculative(const struct v3d_device_info *devinfo,
+                              unsigned num_threads)
 {
         struct v3d_compiler *compiler = rzalloc(NULL, struct v3d_compiler);
         if (!compiler)
@@ -483,15 +500,69 @@ v3d_compiler_init(const struct v3d_device_info *devinfo)
                 return NULL;
         }
 
+        if (num_threads) {
+                compiler->speculative_queue =
+                        rzalloc(compiler, struct util_queue);
+                if (!util_queue_init(compiler->speculative_queue,
+                                     "v3d_compile", 16, num_threads,
+                                     UTIL_QUEUE_INIT_RESIZE_IF_FULL)) {
+                        ralloc_free(compiler->speculative_queue);
+                        compiler->speculative_queue = NULL;
+                }
+        }
+
         return compiler;
 }
 
 void
 v3d_compiler_free(const struct v3d_compiler *compiler)
 {
+        if (compiler->speculative_queue) {
+                /* Destroying the queue drops the jobs still queued without
+                 * running their cleanup, which would leak them.
+                 */
+                util_queue_finish(compiler->speculative_queue);
+                util_queue_destroy(compiler->speculative_queue);
+        }
+
         ralloc_free((void *)compiler);
 }
 
+static size_t
+v3d_key_size(gl_shader_stage stage)
+{
+        switch (stage) {
+        case MESA_SHADER_VERTEX:
+                return sizeof(struct v3d_vs_key);
+        case MESA_SHADER_GEOMETRY:
+                return sizeof(struct v3d_gs_key);
+        case MESA_SHADER_FRAGMENT:
+                return sizeof(struct v3d_fs_key);
+        default:
+                return sizeof(struct v3d_key);
+        }
+}
+
+static void
+vir_compile_set_key(struct v3d_compile *c, struct v3d_key *key)
+{
+        c->key = key;
+
+        switch (c->s->info.stage) {
+        case MESA_SHADER_VERTEX:
+                c->vs_key = (struct v3d_vs_key *)key;
+                break;
+        case MESA_SHADER_GEOMETRY:
+                c->gs_key = (struct v3d_gs_key *)key;
+                break;
+        case MESA_SHADER_FRAGMENT:
+                c->fs_key = (struct v3d_fs_key *)key;
+                break;
+        default:
+                break;
+        }
+}
+
 static struct v3d_compile *
 vir_compile_init(const struct v3d_compiler *compiler,
                  struct v3d_key *key,
@@ -505,17 +576,20 @@ vir_compile_init(const struct v3d_compiler *compiler,
 
         c->compiler = compiler;
         c->devinfo = compiler->devinfo;
-        c->key = key;
         c->program_id = program_id;
         c->variant_id = variant_id;
         c->threads = 4;
+        c->min_threads = V3D_MIN_THREADS(c->devinfo);
         c->debug_output = debug_output;
         c->debug_output_data = debug_output_data;
 
         s = nir_shader_clone(c, s);
         c->s = s;
 
+        vir_compile_set_key(c, key);
+
         list_inithead(&c->blocks);
+        c->exec_count = 1;
         vir_set_emit_block(c, vir_new_block(c));
 
         c->output_position_index = -1;
@@ -753,6 +827,7 @@ v3d_set_prog_data(struct v3d_compile *c,
         prog_data->single_seg = !c->last_thrsw;
         prog_data->spill_size = c->spill_size;
         prog_data->tmu_dirty_rcl = c->tmu_dirty_rcl;
+        prog_data->estimate = c->estimate;
 
         v3d_set_prog_data_uniforms(c, prog_data);
 
@@ -980,43 +1055,12 @@ vir_get_max_temps(struct v3d_compile *c)
         return max_temps;
 }
 
-uint64_t *v3d_compile(const struct v3d_compiler *compiler,
-                      struct v3d_key *key,
-                      struct v3d_prog_data **out_prog_data,
-                      nir_shader *s,
-                      void (*debug_output)(const char *msg,
-                                           void *debug_output_data),
-                      void *debug_output_data,
-                      int program_id, int variant_id,
-                      uint32_t *final_assembly_size)
+/* Lowers the NIR and generates the QPU code of a compile set up by
+ * vir_compile_init().
+ */
+static void
+vir_compile_run(struct v3d_compile *c)
 {
-        struct v3d_prog_data *prog_data;
-        struct v3d_compile *c = vir_compile_init(compiler, key, s,
-                                                 debug_output, debug_output_data,
-                                                 program_id, variant_id);
-
-        switch (c->s->info.stage) {
-        case MESA_SHADER_VERTEX:
-                c->vs_key = (struct v3d_vs_key *)key;
-                prog_data = rzalloc_size(NULL, sizeof(struct v3d_vs_prog_data));
-                break;
-        case MESA_SHADER_GEOMETRY:
-                c->gs_key = (struct v3d_gs_key *)key;
-                prog_data = rzalloc_size(NULL, sizeof(struct v3d_gs_prog_data));
-                break;
-        case MESA_SHADER_FRAGMENT:
-                c->fs_key = (struct v3d_fs_key *)key;
-                prog_data = rzalloc_size(NULL, sizeof(struct v3d_fs_prog_data));
-                break;
-        case MESA_SHADER_COMPUTE:
-                prog_data = rzalloc_size(NULL,
-                                         sizeof(struct v3d_compute_prog_data));
-                break;
-        default:
-                unreachable("unsupported shader stage");
-        }
-
-
         switch (c->s->info.stage) {
         case MESA_SHADER_VERTEX:
                 v3d_nir_lower_vs_early(c);
@@ -1070,6 +1114,18 @@ uint64_t *v3d_compile(const struct v3d_compiler *compiler,
         }
 
         NIR_PASS_V(c->s, nir_lower_bool_to_int32);
+
+        /* Loop analysis needs SSA.  The trip counts it leaves in loop->info
+         * are only used for the cost estimate, see ntq_emit_loop().
+         */
+        nir_foreach_function(function, c->s) {
+                if (function->impl) {
+                        nir_metadata_require(function->impl,
+                                             nir_metadata_loop_analysis,
+                                             nir_var_all);
+                }
+        }
+
         NIR_PASS_V(c->s, nir_convert_from_ssa, true);
 
         /* Schedule for about half our register space, to enable more shaders
@@ -1078,6 +1134,164 @@ uint64_t *v3d_compile(const struct v3d_compiler *compiler,
         NIR_PASS_V(c->s, nir_schedule, 24);
 
         v3d_nir_to_vir(c);
+}
+
+struct v3d_speculative_compile {
+        struct util_queue_fence fence;
+        struct v3d_compile *c;
+        int cancelled;
+        /* Held by v3d_compile() and by the queue. */
+        int refcount;
+};
+
+static void
+v3d_speculative_compile_unref(struct v3d_speculative_compile *job)
+{
+        if (!p_atomic_dec_zero(&job->refcount))
+                return;
+
+        if (job->c)
+                vir_compile_destroy(job->c);
+        util_queue_fence_destroy(&job->fence);
+        free(job);
+}
+
+static void
+v3d_speculative_compile_execute(void *data, int thread_index)
+{
+        struct v3d_speculative_compile *job = data;
+
+        if (!p_atomic_read(&job->cancelled))
+                vir_compile_run(job->c);
+}
+
+static void
+v3d_speculative_compile_cleanup(void *data, int thread_index)
+{
+        v3d_speculative_compile_unref(data);
+}
+
+/**
+ * Compiles the shader at 4 threads on this thread while the workers compile
+ * it at each of the lower thread counts, and returns the compile with the
+ * most threads that made it.  Only the compile at the lowest thread count
+ * spills to the TMU, so that is also the one with the fewest spills.
+ *
+ * The compiles that lose are cancelled rather than waited for, so they get
+ * their own copies of the shader and the key.
+ */
+static struct v3d_compile *
+v3d_compile_speculative(const struct v3d_compiler *compiler,
+                        struct v3d_key *key, nir_shader *s,
+                        void (*debug_output)(const char *msg,
+                                             void *debug_output_data),
+                        void *debug_output_data,
+                        int program_id, int variant_id)
+{
+        struct v3d_speculative_compile *jobs[2];
+        int num_jobs = 0;
+
+        for (int threads = 2;
+             threads >= V3D_MIN_THREADS(compiler->devinfo);
+             threads /= 2) {
+                struct v3d_speculative_compile *job = calloc(1, sizeof(*job));
+                if (!job)
+                        break;
+
+                job->c = vir_compile_init(compiler, key, s,
+                                          debug_output, debug_output_data,
+                                          program_id, variant_id);
+
+                size_t key_size = v3d_key_size(s->info.stage);
+                struct v3d_key *key_copy = ralloc_size(job->c, key_size);
+                memcpy(key_copy, key, key_size);
+                vir_compile_set_key(job->c, key_copy);
+
+                job->c->threads = threads;
+                job->c->min_threads = threads;
+                job->c->cancelled = &job->cancelled;
+                job->refcount = 2;
+                util_queue_fence_init(&job->fence);
+
+                util_queue_add_job(compiler->speculative_queue, job,
+                                   &job->fence,
+                                   v3d_speculative_compile_execute,
+                                   v3d_speculative_compile_cleanup, 0);
+                jobs[num_jobs++] = job;
+        }
+
+        struct v3d_compile *c = vir_compile_init(compiler, key, s,
+                                                 debug_output,
+                                                 debug_output_data,
+                                                 program_id, variant_id);
+        if (num_jobs)
+                c->min_threads = c->threads;
+        vir_compile_run(c);
+
+        for (int i = 0; i < num_jobs; i++) {
+                struct v3d_speculative_compile *job = jobs[i];
+
+                if (c->failed) {
+                        util_queue_fence_wait(&job->fence);
+                        vir_compile_destroy(c);
+                        c = job->c;
+                        c->cancelled = NULL;
+                        job->c = NULL;
+                } else {
+                        p_atomic_set(&job->cancelled, 1);
+                }
+
+                v3d_speculative_compile_unref(job);
+        }
+
+        return c;
+}
+
+uint32_t
+v3d_prog_data_size(gl_shader_stage stage)
+{
+        static const int prog_data_size[] = {
+                [MESA_SHADER_VERTEX] = sizeof(struct v3d_vs_prog_data),
+                [MESA_SHADER_GEOMETRY] = sizeof(struct v3d_gs_prog_data),
+                [MESA_SHADER_FRAGMENT] = sizeof(struct v3d_fs_prog_data),
+                [MESA_SHADER_COMPUTE] = sizeof(struct v3d_compute_prog_data),
+        };
+
+        assert(stage >= 0 &&
+               stage < ARRAY_SIZE(prog_data_size) &&
+               prog_data_size[stage]);
+
+        return prog_data_size[stage];
+}
+
+uint64_t *v3d_compile(const struct v3d_compiler *compiler,
+                      struct v3d_key *key,
+                      struct v3d_prog_data **out_prog_data,
+                      nir_shader *s,
+                      void (*debug_output)(const char *msg,
+                                           void *debug_output_data),
+                      void *debug_output_data,
+                      int program_id, int variant_id,
+                      uint32_t *final_assembly_size)
+{
+        struct v3d_prog_data *prog_data;
+        struct v3d_compile *c;
+
+        /* Don't interleave the debug dumps of concurrent compiles. */
+        if (compiler->speculative_queue &&
+            !(V3D_DEBUG & (V3D_DEBUG_NIR | V3D_DEBUG_VIR | V3D_DEBUG_QPU |
+                           v3d_debug_flag_for_shader_stage(s->info.stage)))) {
+                c = v3d_compile_speculative(compiler, key, s,
+                                            debug_output, debug_output_data,
+                                            program_id, variant_id);
+        } else {
+                c = vir_compile_init(compiler, key, s,
+                                     debug_output, debug_output_data,
+                                     program_id, variant_id);
+                vir_compile_run(c);
+        }
+
+        prog_data = rzalloc_size(NULL, v3d_prog_data_size(c->s->info.stage));
 
         v3d_set_prog_data(c, prog_data);
 
@@ -1087,7 +1301,11 @@ uint64_t *v3d_compile(const struct v3d_compiler *compiler,
         int ret = asprintf(&shaderdb,
                            "%s shader: %d inst, %d threads, %d loops, "
                            "%d uniforms, %d max-temps, %d:%d spills:fills, "
-                           "%d sfu-stalls, %d inst-and-stalls",
+                           "%d remats, %d sfu-stalls, %d inst-and-stalls, %d thrsw, "
+                           "%d nops, %d est-cycles, %d est-critical-path, "
+                           "%d est-tmu-stalls, %d est-latency-stalls, "
+                           "%d est-tmu-reads, %d est-sfu-ops, "
+                           "%d est-unknown-loops",
                            vir_get_stage_name(c),
                            c->qpu_inst_count,
                            c->threads,
@@ -1096,8 +1314,18 @@ uint64_t *v3d_compile(const struct v3d_compiler *compiler,
                            vir_get_max_temps(c),
                            c->spills,
                            c->fills,
+                           c->remats,
                            c->qpu_inst_stalled_count,
-                           c->qpu_inst_count + c->qpu_inst_stalled_count);
+                           c->qpu_inst_count + c->qpu_inst_stalled_count,
+                           c->qpu_inst_thrsw_count,
+                           c->qpu_inst_nop_count,
+                           c->estimate.cycles,
+                           c->estimate.critical_path,
+                           c->estimate.tmu_stall_cycles,
+                           c->estimate.latency_stall_cycles,
+                           c->estimate.tmu_reads,
+                           c->estimate.sfu_ops,
+                           c->estimate.unknown_loops);
         if (ret >= 0) {
                 if (V3D_DEBUG & V3D_DEBUG_SHADERDB)
                         fprintf(stderr, "SHADER-DB: %s\n", shaderdb);
@@ -31,19 +31,29 @@
 struct partial_update_state {
         struct qinst *insts[4];
         uint8_t channels;
+        bool touched;
 };
 
-static uint32_t
-int_hash(const void *key)
-{
-        return _mesa_hash_data(key, sizeof(int));
-}
+/* Partial updates of the temps within the current block, indexed by temp.
+ * The temps touched in the block are listed so that the state can be reset
+ * for the next block without clearing the whole array.
+ */
+struct partial_update_tracker {
+        struct partial_update_state *states;
+        int *touched;
+        int num_touched;
+};
 
-static bool
-int_compare(const void *key1, const void *key2)
-{
-        return *(const int *)key1 == *(const int *)key2;
-}
+/* The blocks in reverse postorder, and the set of RPO positions of the
+ * blocks the dataflow passes still have to visit.
+ */
+struct vir_live_worklist {
+        struct qblock **blocks;
+        int num_blocks;
+        /* RPO position of each block, by block->index. */
+        int *rpo_index;
+        BITSET_WORD *pending;
+};
 
 static int
 vir_reg_to_var(struct qreg reg)
@@ -74,26 +84,23 @@ vir_setup_use(struct v3d_compile *c, struct qblock *block, int ip,
 }
 
 static struct partial_update_state *
-get_partial_update_state(struct hash_table *partial_update_ht,
+get_partial_update_state(struct partial_update_tracker *tracker,
                          struct qinst *inst)
 {
-        struct hash_entry *entry =
-                _mesa_hash_table_search(partial_update_ht,
-                                        &inst->dst.index);
-        if (entry)
-                return entry->data;
-
         struct partial_update_state *state =
-                rzalloc(partial_update_ht, struct partial_update_state);
+                &tracker->states[inst->dst.index];
 
-        _mesa_hash_table_insert(partial_update_ht, &inst->dst.index, state);
+        if (!state->touched) {
+                state->touched = true;
+                tracker->touched[tracker->num_touched++] = inst->dst.index;
+        }
 
         return state;
 }
 
 static void
 vir_setup_def(struct v3d_compile *c, struct qblock *block, int ip,
-              struct hash_table *partial_update_ht, struct qinst *inst)
+              struct partial_update_tracker *tracker, struct qinst *inst)
 {
         if (inst->qpu.type != V3D_QPU_INSTR_TYPE_ALU)
                 return;
@@ -146,7 +153,7 @@ vir_setup_def(struct v3d_compile *c, struct qblock *block, int ip,
          * program.
          */
         struct partial_update_state *state =
-                get_partial_update_state(partial_update_ht, inst);
+                get_partial_update_state(tracker, inst);
         uint8_t mask = 0xf; /* XXX vir_channels_written(inst); */
 
         if (inst->qpu.flags.ac == V3D_QPU_COND_NONE &&
@@ -172,10 +179,11 @@ vir_setup_def(struct v3d_compile *c, struct qblock *block, int ip,
 }
 
 static void
-sf_state_clear(struct hash_table *partial_update_ht)
+sf_state_clear(struct partial_update_tracker *tracker)
 {
-        hash_table_foreach(partial_update_ht, entry) {
-                struct partial_update_state *state = entry->data;
+        for (int t = 0; t < tracker->num_touched; t++) {
+                struct partial_update_state *state =
+                        &tracker->states[tracker->touched[t]];
 
                 for (int i = 0; i < 4; i++) {
                         if (state->insts[i] &&
@@ -194,25 +202,32 @@ sf_state_clear(struct hash_table *partial_update_ht)
  * vir_compute_start_end().
  */
 static void
-vir_setup_def_use(struct v3d_compile *c)
+vir_setup_def_use(struct v3d_compile *c, void *mem_ctx)
 {
-        struct hash_table *partial_update_ht =
-                _mesa_hash_table_create(c, int_hash, int_compare);
+        struct partial_update_tracker tracker = {
+                .states = rzalloc_array(mem_ctx, struct partial_update_state,
+                                        c->num_temps),
+                .touched = ralloc_array(mem_ctx, int, c->num_temps),
+        };
         int ip = 0;
 
         vir_for_each_block(block, c) {
                 block->start_ip = ip;
 
-                _mesa_hash_table_clear(partial_update_ht, NULL);
+                for (int t = 0; t < tracker.num_touched; t++) {
+                        memset(&tracker.states[tracker.touched[t]], 0,
+                               sizeof(*tracker.states));
+                }
+                tracker.num_touched = 0;
 
                 vir_for_each_inst(inst, block) {
                         for (int i = 0; i < vir_get_nsrc(inst); i++)
                                 vir_setup_use(c, block, ip, inst->src[i]);
 
-                        vir_setup_def(c, block, ip, partial_update_ht, inst);
+                        vir_setup_def(c, block, ip, &tracker, inst);
 
                         if (false /* XXX inst->uf */)
-                                sf_state_clear(partial_update_ht);
+                                sf_state_clear(&tracker);
 
                         /* Payload registers: r0/1/2 contain W, centroid W,
                          * and Z at program start.  Register allocation will
@@ -232,71 +247,194 @@ vir_setup_def_use(struct v3d_compile *c)
                 }
                 block->end_ip = ip;
         }
+}
+
+/**
+ * Sorts the blocks in reverse postorder, so that each block comes after its
+ * predecessors other than through back edges.
+ */
+static void
+vir_live_worklist_init(struct v3d_compile *c, struct vir_live_worklist *wl,
+                       void *mem_ctx)
+{
+        int num_blocks = 0;
+        vir_for_each_block(block, c)
+                num_blocks++;
+
+        wl->num_blocks = num_blocks;
+        wl->blocks = ralloc_array(mem_ctx, struct qblock *, num_blocks);
+        wl->rpo_index = ralloc_array(mem_ctx, int, c->next_block_index);
+        wl->pending = rzalloc_array(mem_ctx, BITSET_WORD,
+                                    BITSET_WORDS(num_blocks));
+        for (int i = 0; i < c->next_block_index; i++)
+                wl->rpo_index[i] = -1;
+
+        /* Depth-first search, filling the array from the end as blocks
+         * finish.  Blocks not reachable from the start get searched from
+         * as well, so every block ends up with a position.
+         */
+        struct qblock **stack = ralloc_array(mem_ctx, struct qblock *,
+                                             num_blocks);
+        int *stack_succ = ralloc_array(mem_ctx, int, num_blocks);
+        int pos = num_blocks;
+
+        vir_for_each_block(root, c) {
+                if (wl->rpo_index[root->index] != -1)
+                        continue;
+
+                int depth = 0;
+                wl->rpo_index[root->index] = -2;
+                stack[depth] = root;
+                stack_succ[depth++] = 0;
+
+                while (depth) {
+                        struct qblock *block = stack[depth - 1];
+                        int s = stack_succ[depth - 1]++;
+
+                        if (s < 2 && block->successors[s]) {
+                                struct qblock *succ = block->successors[s];
+                                if (wl->rpo_index[succ->index] == -1) {
+                                        wl->rpo_index[succ->index] = -2;
+                                        stack[depth] = succ;
+                                        stack_succ[depth++] = 0;
+                                }
+                                continue;
+                        }
+
+                        wl->blocks[--pos] = block;
+                        wl->rpo_index[block->index] = pos;
+                        depth--;
+                }
+        }
+        assert(pos == 0);
 
-        _mesa_hash_table_destroy(partial_update_ht, NULL);
+        ralloc_free(stack);
+        ralloc_free(stack_succ);
 }
 
-static bool
-vir_live_variables_dataflow(struct v3d_compile *c, int bitset_words)
+static void
+vir_live_worklist_add(struct vir_live_worklist *wl, struct qblock *block)
 {
-        bool cont = false;
+        BITSET_SET(wl->pending, wl->rpo_index[block->index]);
+}
+
+static void
+vir_live_worklist_add_all(struct vir_live_worklist *wl)
+{
+        for (int i = 0; i < wl->num_blocks; i++)
+                BITSET_SET(wl->pending, i);
+}
+
+/* Returns the pending block latest in RPO, or NULL if there's none. */
+static struct qblock *
+vir_live_worklist_pop_last(struct vir_live_worklist *wl)
+{
+        for (int w = BITSET_WORDS(wl->num_blocks) - 1; w >= 0; w--) {
+                if (wl->pending[w]) {
+                        int i = (w * BITSET_WORDBITS +
+                                 util_last_bit(wl->pending[w]) - 1);
+                        BITSET_CLEAR(wl->pending, i);
+                        return wl->blocks[i];
+                }
+        }
 
-        vir_for_each_block_rev(block, c) {
+        return NULL;
+}
+
+/* Returns the pending block earliest in RPO, or NULL if there's none. */
+static struct qblock *
+vir_live_worklist_pop_first(struct vir_live_worklist *wl)
+{
+        for (int w = 0; w < BITSET_WORDS(wl->num_blocks); w++) {
+                if (wl->pending[w]) {
+                        int i = w * BITSET_WORDBITS + ffs(wl->pending[w]) - 1;
+                        BITSET_CLEAR(wl->pending, i);
+                        return wl->blocks[i];
+                }
+        }
+
+        return NULL;
+}
+
+/**
+ * Computes live_in/live_out.  Liveness flows backwards, so blocks are
+ * visited last to first in RPO, and a block's predecessors are revisited
+ * only when its live_in grows.
+ */
+static void
+vir_live_variables_dataflow(struct v3d_compile *c,
+                            struct vir_live_worklist *wl, int bitset_words)
+{
+        struct qblock *block;
+
+        vir_live_worklist_add_all(wl);
+
+        while ((block = vir_live_worklist_pop_last(wl))) {
                 /* Update live_out: Any successor using the variable
                  * on entrance needs us to have the variable live on
                  * exit.
                  */
                 vir_for_each_successor(succ, block) {
-                        for (int i = 0; i < bitset_words; i++) {
-                                BITSET_WORD new_live_out = (succ->live_in[i] &
-                                                            ~block->live_out[i]);
-                                if (new_live_out) {
-                                        block->live_out[i] |= new_live_out;
-                                        cont = true;
-                                }
-                        }
+                        for (int i = 0; i < bitset_words; i++)
+                                block->live_out[i] |= succ->live_in[i];
                 }
 
                 /* Update live_in */
+                bool progress = false;
                 for (int i = 0; i < bitset_words; i++) {
                         BITSET_WORD new_live_in = (block->use[i] |
                                                    (block->live_out[i] &
                                                     ~block->def[i]));
                         if (new_live_in & ~block->live_in[i]) {
                                 block->live_in[i] |= new_live_in;
-                                cont = true;
+                                progress = true;
                         }
                 }
-        }
 
-        return cont;
+                if (progress) {
+                        set_foreach(block->predecessors, entry) {
+                                struct qblock *pred =
+                                        (struct qblock *)entry->key;
+                                vir_live_worklist_add(wl, pred);
+                        }
+                }
+        }
 }
 
-static bool
-vir_live_variables_defin_defout_dataflow(struct v3d_compile *c, int bitset_words)
+/**
+ * Propagates defin/defout down the successors to produce the union of
+ * blocks with a reachable (partial) definition of the var.
+ *
+ * This keeps a conditional first write to a reg from extending its lifetime
+ * back to the start of the program.
+ */
+static void
+vir_live_variables_defin_defout_dataflow(struct v3d_compile *c,
+                                         struct vir_live_worklist *wl,
+                                         int bitset_words)
 {
-        bool cont = false;
-
-        vir_for_each_block_rev(block, c) {
-                /* Propagate defin/defout down the successors to produce the
-                 * union of blocks with a reachable (partial) definition of
-                 * the var.
-                 *
-                 * This keeps a conditional first write to a reg from
-                 * extending its lifetime back to the start of the program.
-                 */
+        struct qblock *block;
+
+        vir_live_worklist_add_all(wl);
+
+        while ((block = vir_live_worklist_pop_first(wl))) {
                 vir_for_each_successor(succ, block) {
+                        bool progress = false;
+
                         for (int i = 0; i < bitset_words; i++) {
                                 BITSET_WORD new_def = (block->defout[i] &
                                                        ~succ->defin[i]);
-                                succ->defin[i] |= new_def;
-                                succ->defout[i] |= new_def;
-                                cont |= new_def;
+                                if (new_def) {
+                                        succ->defin[i] |= new_def;
+                                        succ->defout[i] |= new_def;
+                                        progress = true;
+                                }
                         }
+
+                        if (progress)
+                                vir_live_worklist_add(wl, succ);
                 }
         }
-
-        return cont;
 }
 
 /**
@@ -304,20 +442,24 @@ vir_live_variables_defin_defout_dataflow(struct v3d_compile *c, int bitset_words
  * new information calculated from control flow.
  */
 static void
-vir_compute_start_end(struct v3d_compile *c, int num_vars)
+vir_compute_start_end(struct v3d_compile *c, int bitset_words)
 {
         vir_for_each_block(block, c) {
-                for (int i = 0; i < num_vars; i++) {
-                        if (BITSET_TEST(block->live_in, i) &&
-                            BITSET_TEST(block->defin, i)) {
+                for (int w = 0; w < bitset_words; w++) {
+                        BITSET_WORD live = block->live_in[w] & block->defin[w];
+                        while (live) {
+                                int i = (w * BITSET_WORDBITS +
+                                         u_bit_scan(&live));
                                 c->temp_start[i] = MIN2(c->temp_start[i],
                                                         block->start_ip);
                                 c->temp_end[i] = MAX2(c->temp_end[i],
                                                       block->start_ip);
                         }
 
-                        if (BITSET_TEST(block->live_out, i) &&
-                            BITSET_TEST(block->defout, i)) {
+                        live = block->live_out[w] & block->defout[w];
+                        while (live) {
+                                int i = (w * BITSET_WORDBITS +
+                                         u_bit_scan(&live));
                                 c->temp_start[i] = MIN2(c->temp_start[i],
                                                         block->end_ip);
                                 c->temp_end[i] = MAX2(c->temp_end[i],
@@ -341,6 +483,8 @@ vir_calculate_live_intervals(struct v3d_compile *c)
 
                 vir_for_each_block(block, c) {
                         ralloc_free(block->def);
+                        ralloc_free(block->defin);
+                        ralloc_free(block->defout);
                         ralloc_free(block->use);
                         ralloc_free(block->live_in);
                         ralloc_free(block->live_out);
@@ -364,15 +508,18 @@ vir_calculate_live_intervals(struct v3d_compile *c)
                 block->live_out = rzalloc_array(c, BITSET_WORD, bitset_words);
         }
 
-        vir_setup_def_use(c);
+        void *mem_ctx = ralloc_context(c);
+        struct vir_live_worklist wl;
+
+        vir_setup_def_use(c, mem_ctx);
 
-        while (vir_live_variables_dataflow(c, bitset_words))
-                ;
+        vir_live_worklist_init(c, &wl, mem_ctx);
+        vir_live_variables_dataflow(c, &wl, bitset_words);
+        vir_live_variables_defin_defout_dataflow(c, &wl, bitset_words);
 
-        while (vir_live_variables_defin_defout_dataflow(c, bitset_words))
-                ;
+        vir_compute_start_end(c, bitset_words);
 
-        vir_compute_start_end(c, c->num_temps);
+        ralloc_free(mem_ctx);
 
         c->live_intervals_valid = true;
 }
@@ -23,6 +23,7 @@
 
 #include "util/ralloc.h"
 #include "util/register_allocate.h"
+#include "util/u_dynarray.h"
 #include "common/v3d_device_info.h"
 #include "v3d_compiler.h"
 
@@ -36,16 +37,21 @@
 static inline bool
 qinst_writes_tmu(struct qinst *inst)
 {
-        return (inst->dst.file == QFILE_MAGIC &&
-                v3d_qpu_magic_waddr_is_tmu(inst->dst.index));
+        return ((inst->dst.file == QFILE_MAGIC &&
+                 v3d_qpu_magic_waddr_is_tmu(inst->dst.index)) ||
+                inst->qpu.sig.wrtmuc);
 }
 
+/* Returns whether this LDTMU or TMUWT is the last one before the next TMU
+ * setup.  The VIR scheduler may have several TMU operations in flight, so
+ * a TMUWT or an LDTMU doesn't necessarily end the sequence.
+ */
 static bool
-is_last_ldtmu(struct qinst *inst, struct qblock *block)
+is_end_of_tmu_sequence(struct qinst *inst, struct qblock *block)
 {
         list_for_each_entry_from(struct qinst, scan_inst, inst->link.next,
                                  &block->instructions, link) {
-                if (scan_inst->qpu.sig.ldtmu)
+                if (v3d_qpu_waits_on_tmu(&scan_inst->qpu))
                         return false;
                 if (qinst_writes_tmu(scan_inst))
                         return true;
@@ -62,21 +68,147 @@ vir_is_mov_uniform(struct v3d_compile *c, int temp)
         return def && def->qpu.sig.ldunif;
 }
 
+/* Returns whether the ALU op computes its result only from its sources, or
+ * from per-invocation state that the QPU can read again at any point
+ * (unlike the rf0-rf2 payload, which gets overwritten).
+ */
+static bool
+vir_op_is_rematerializable(struct qinst *inst)
+{
+        if (inst->qpu.alu.add.op != V3D_QPU_A_NOP) {
+                switch (inst->qpu.alu.add.op) {
+                case V3D_QPU_A_FADD:
+                case V3D_QPU_A_FADDNF:
+                case V3D_QPU_A_VFPACK:
+                case V3D_QPU_A_ADD:
+                case V3D_QPU_A_SUB:
+                case V3D_QPU_A_FSUB:
+                case V3D_QPU_A_MIN:
+                case V3D_QPU_A_MAX:
+                case V3D_QPU_A_UMIN:
+                case V3D_QPU_A_UMAX:
+                case V3D_QPU_A_SHL:
+                case V3D_QPU_A_SHR:
+                case V3D_QPU_A_ASR:
+                case V3D_QPU_A_ROR:
+                case V3D_QPU_A_FMIN:
+                case V3D_QPU_A_FMAX:
+                case V3D_QPU_A_AND:
+                case V3D_QPU_A_OR:
+                case V3D_QPU_A_XOR:
+                case V3D_QPU_A_NOT:
+                case V3D_QPU_A_NEG:
+                case V3D_QPU_A_FTOIZ:
+                case V3D_QPU_A_FTOUZ:
+                case V3D_QPU_A_ITOF:
+                case V3D_QPU_A_UTOF:
+                case V3D_QPU_A_TIDX:
+                case V3D_QPU_A_EIDX:
+                case V3D_QPU_A_IID:
+                case V3D_QPU_A_SAMPID:
+                        return true;
+                default:
+                        return false;
+                }
+        }
+
+        /* UMUL24 isn't here, since it reads the high bits of its operands
+         * from rtop, which only the MULTOP emitted right before it sets up.
+         */
+        switch (inst->qpu.alu.mul.op) {
+        case V3D_QPU_M_ADD:
+        case V3D_QPU_M_SUB:
+        case V3D_QPU_M_SMUL24:
+        case V3D_QPU_M_FMUL:
+        case V3D_QPU_M_MOV:
+        case V3D_QPU_M_FMOV:
+                return true;
+        default:
+                return false;
+        }
+}
+
+/**
+ * Returns the number of instructions it takes to compute the temp again at
+ * one of its uses, or 0 if it has to go through a TMU spill instead.
+ *
+ * Uniforms are loaded again, and ALU results are computed again from small
+ * immediates and uniforms loaded again, which is much cheaper than the
+ * TMU write, thread switch and LDTMU of a fill.
+ */
+static int
+vir_remat_cost(struct v3d_compile *c, int temp)
+{
+        struct qinst *def = c->defs[temp];
+
+        if (!def)
+                return 0;
+
+        if (def->qpu.sig.ldunif)
+                return 1;
+
+        if (def->qpu.type != V3D_QPU_INSTR_TYPE_ALU ||
+            !vir_op_is_rematerializable(def)) {
+                return 0;
+        }
+
+        if (v3d_qpu_sig_has_signals(&def->qpu.sig))
+                return 0;
+
+        if (def->qpu.flags.ac != V3D_QPU_COND_NONE ||
+            def->qpu.flags.mc != V3D_QPU_COND_NONE ||
+            def->qpu.flags.apf != V3D_QPU_PF_NONE ||
+            def->qpu.flags.mpf != V3D_QPU_PF_NONE ||
+            def->qpu.flags.auf != V3D_QPU_UF_NONE ||
+            def->qpu.flags.muf != V3D_QPU_UF_NONE) {
+                return 0;
+        }
+
+        int cost = 1;
+        int uniforms = 0;
+        for (int i = 0; i < vir_get_nsrc(def); i++) {
+                if (def->src[i].file == QFILE_SMALL_IMM)
+                        continue;
+
+                if (def->src[i].file != QFILE_TEMP ||
+                    !vir_is_mov_uniform(c, def->src[i].index)) {
+                        return 0;
+                }
+
+                cost++;
+                uniforms++;
+        }
+
+        /* Until V3D 4.x, uniforms can only be loaded to r5, so two of them
+         * can't be live at the same time.
+         */
+        if (c->devinfo->ver < 40 && uniforms > 1)
+                return 0;
+
+        return cost;
+}
+
 static int
 v3d_choose_spill_node(struct v3d_compile *c, struct ra_graph *g,
                       uint32_t *temp_to_node)
 {
         const float tmu_scale = 5;
-        float block_scale = 1.0;
         float spill_costs[c->num_temps];
+        int remat_costs[c->num_temps];
         bool in_tmu_operation = false;
         bool started_last_seg = false;
 
-        for (unsigned i = 0; i < c->num_temps; i++)
+        for (unsigned i = 0; i < c->num_temps; i++) {
                 spill_costs[i] = 0.0;
+                remat_costs[i] = vir_remat_cost(c, i);
+        }
 
-        /* XXX: Scale the cost up when inside of a loop. */
         vir_for_each_block(block, c) {
+                /* Weight the instructions by how many times nir_to_vir
+                 * estimated the block to run from its loops' trip counts.
+                 */
+                float block_scale = block->exec_count;
+
                 vir_for_each_inst(inst, block) {
                         /* We can't insert a new TMU operation while currently
                          * in a TMU operation, and we can't insert new thread
@@ -91,8 +223,9 @@ v3d_choose_spill_node(struct v3d_compile *c, struct ra_graph *g,
                                         continue;
 
                                 int temp = inst->src[i].index;
-                                if (vir_is_mov_uniform(c, temp)) {
-                                        spill_costs[temp] += block_scale;
+                                if (remat_costs[temp]) {
+                                        spill_costs[temp] += (block_scale *
+                                                              remat_costs[temp]);
                                 } else if (!no_spilling) {
                                         spill_costs[temp] += (block_scale *
                                                               tmu_scale);
@@ -104,8 +237,8 @@ v3d_choose_spill_node(struct v3d_compile *c, struct ra_graph *g,
                         if (inst->dst.file == QFILE_TEMP) {
                                 int temp = inst->dst.index;
 
-                                if (vir_is_mov_uniform(c, temp)) {
-                                        /* We just rematerialize the unform
+                                if (remat_costs[temp]) {
+                                        /* We just rematerialize the value
                                          * later.
                                          */
                                 } else if (!no_spilling) {
@@ -137,12 +270,8 @@ v3d_choose_spill_node(struct v3d_compile *c, struct ra_graph *g,
                          * spill/fill any temps during that time, because that
                          * involves inserting a new TMU setup/LDTMU sequence.
                          */
-                        if (inst->qpu.sig.ldtmu &&
-                            is_last_ldtmu(inst, block))
-                                in_tmu_operation = false;
-
-                        if (inst->qpu.type == V3D_QPU_INSTR_TYPE_ALU &&
-                            inst->qpu.alu.add.op == V3D_QPU_A_TMUWT)
+                        if (v3d_qpu_waits_on_tmu(&inst->qpu) &&
+                            is_end_of_tmu_sequence(inst, block))
                                 in_tmu_operation = false;
 
                         if (qinst_writes_tmu(inst))
@@ -153,8 +282,19 @@ v3d_choose_spill_node(struct v3d_compile *c, struct ra_graph *g,
         for (unsigned i = 0; i < c->num_temps; i++) {
                 int node = temp_to_node[i];
 
-                if (BITSET_TEST(c->spillable, i))
-                        ra_set_node_spill_cost(g, node, spill_costs[i]);
+                if (!BITSET_TEST(c->spillable, i))
+                        continue;
+
+                /* Spilling a longer live range frees a register at more
+                 * points of the program, so at the same cost prefer it over
+                 * a short one.  The length only counts logarithmically so
+                 * that a long range with uses in a loop still isn't picked
+                 * over one outside of it.
+                 */
+                int length = MAX2(c->temp_end[i] - c->temp_start[i], 0);
+                float length_scale = util_logbase2(length + 1) + 1;
+
+                ra_set_node_spill_cost(g, node, spill_costs[i] / length_scale);
         }
 
         return ra_get_best_spill_node(g);
@@ -205,15 +345,42 @@ v3d_emit_spill_tmua(struct v3d_compile *c, uint32_t spill_offset)
                      vir_uniform_ui(c, spill_offset));
 }
 
+/* Emits the instructions computing the value of a rematerializable def at
+ * the cursor, returning the new temp holding it.
+ */
+static struct qreg
+v3d_emit_remat(struct v3d_compile *c, struct qinst *def)
+{
+        if (def->qpu.sig.ldunif) {
+                return vir_uniform(c, c->uniform_contents[def->uniform],
+                                   c->uniform_data[def->uniform]);
+        }
+
+        struct qinst *inst = vir_add_inst(V3D_QPU_A_NOP, c->undef,
+                                          c->undef, c->undef);
+        inst->qpu = def->qpu;
+
+        for (int i = 0; i < vir_get_nsrc(def); i++) {
+                if (def->src[i].file == QFILE_TEMP) {
+                        inst->src[i] = v3d_emit_remat(c,
+                                                      c->defs[def->src[i].index]);
+                } else {
+                        inst->src[i] = def->src[i];
+                }
+        }
+
+        return vir_emit_def(c, inst);
+}
+
 static void
 v3d_spill_reg(struct v3d_compile *c, int spill_temp)
 {
-        bool is_uniform = vir_is_mov_uniform(c, spill_temp);
+        bool is_remat = vir_remat_cost(c, spill_temp) != 0;
 
         uint32_t spill_offset = 0;
 
-        if (!is_uniform) {
-                uint32_t spill_offset = c->spill_size;
+        if (!is_remat) {
+                spill_offset = c->spill_size;
                 c->spill_size += V3D_CHANNELS * sizeof(uint32_t);
 
                 if (spill_offset == 0)
@@ -225,11 +392,12 @@ v3d_spill_reg(struct v3d_compile *c, int spill_temp)
 
         int start_num_temps = c->num_temps;
 
-        int uniform_index = ~0;
-        if (is_uniform) {
-                struct qinst *orig_unif = c->defs[spill_temp];
-                uniform_index = orig_unif->uniform;
-        }
+        /* The def gets removed below, so keep it around until we're done
+         * emitting copies of it.
+         */
+        struct qinst remat_def;
+        if (is_remat)
+                remat_def = *c->defs[spill_temp];
 
         vir_for_each_inst_inorder_safe(inst, c) {
                 for (int i = 0; i < vir_get_nsrc(inst); i++) {
@@ -240,12 +408,9 @@ v3d_spill_reg(struct v3d_compile *c, int spill_temp)
 
                         c->cursor = vir_before_inst(inst);
 
-                        if (is_uniform) {
-                                struct qreg unif =
-                                        vir_uniform(c,
-                                                    c->uniform_contents[uniform_index],
-                                                    c->uniform_data[uniform_index]);
-                                inst->src[i] = unif;
+                        if (is_remat) {
+                                inst->src[i] = v3d_emit_remat(c, &remat_def);
+                                c->remats++;
                         } else {
                                 v3d_emit_spill_tmua(c, spill_offset);
                                 vir_emit_thrsw(c);
@@ -256,13 +421,13 @@ v3d_spill_reg(struct v3d_compile *c, int spill_temp)
 
                 if (inst->dst.file == QFILE_TEMP &&
                     inst->dst.index == spill_temp) {
-                        if (is_uniform) {
+                        if (is_remat) {
                                 c->cursor.link = NULL;
                                 vir_remove_instruction(c, inst);
                         } else {
                                 c->cursor = vir_after_inst(inst);
 
-                                inst->dst.index = c->num_temps++;
+                                inst->dst = vir_get_temp(c);
                                 vir_MOV_dest(c, vir_reg(QFILE_MAGIC,
                                                         V3D_QPU_WADDR_TMUD),
                                              inst->dst);
@@ -279,7 +444,7 @@ v3d_spill_reg(struct v3d_compile *c, int spill_temp)
                  * right before we start the vpm/tlb sequence for the last
                  * thread segment.
                  */
-                if (!is_uniform && !last_thrsw && c->last_thrsw &&
+                if (!is_remat && !last_thrsw && c->last_thrsw &&
                     (v3d_qpu_writes_vpm(&inst->qpu) ||
                      v3d_qpu_uses_tlb(&inst->qpu))) {
                         c->cursor = vir_before_inst(inst);
@@ -417,6 +582,148 @@ node_to_temp_priority(const void *in_a, const void *in_b)
         return a->priority - b->priority;
 }
 
+struct v3d_ra_edge {
+        uint32_t a, b;
+};
+
+/* The pairs of temps with overlapping live intervals, kept across the
+ * register allocation attempts of a compile.
+ *
+ * Spilling a temp only adds instructions around its defs and uses, and
+ * dropping the thread count only removes THRSWs, so the order of the defs
+ * and uses of the other temps doesn't change and neither does their
+ * interference.  After a failed attempt, we only need to drop the edges of
+ * the temp that got spilled and find the ones of the temps it was split
+ * into.  Rematerializing an ALU result can also shorten the intervals of
+ * the uniforms it was computed from, which only leaves some edges that are
+ * no longer needed.
+ */
+struct v3d_ra_interference {
+        struct util_dynarray edges;
+
+        /* Temps below this have all their edges in the array. */
+        uint32_t num_temps;
+};
+
+static bool
+temp_is_live(struct v3d_compile *c, uint32_t temp)
+{
+        return c->temp_start[temp] <= c->temp_end[temp];
+}
+
+/**
+ * Adds the edges between temps with overlapping live intervals where
+ * either temp is new since the last attempt or flagged in @rescan.
+ *
+ * This sweeps the temps in order of interval start, keeping track of the
+ * intervals that haven't ended yet, so it runs in O(temps * max live temps)
+ * instead of comparing every pair of temps.
+ */
+static void
+v3d_ra_find_interference(struct v3d_compile *c,
+                         struct v3d_ra_interference *ri,
+                         const BITSET_WORD *rescan, uint32_t num_ips)
+{
+        uint32_t *start_offset = calloc(num_ips + 1, sizeof(uint32_t));
+        uint32_t *sorted = malloc(c->num_temps * sizeof(uint32_t));
+        uint32_t *active = malloc(c->num_temps * sizeof(uint32_t));
+        uint32_t count = 0, active_count = 0;
+
+        /* Counting sort of the live temps by the start of their interval. */
+        for (uint32_t t = 0; t < c->num_temps; t++) {
+                if (temp_is_live(c, t)) {
+                        start_offset[c->temp_start[t] + 1]++;
+                        count++;
+                }
+        }
+        for (uint32_t ip = 0; ip < num_ips; ip++)
+                start_offset[ip + 1] += start_offset[ip];
+        for (uint32_t t = 0; t < c->num_temps; t++) {
+                if (temp_is_live(c, t))
+                        sorted[start_offset[c->temp_start[t]]++] = t;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+                uint32_t t = sorted[i];
+                bool t_is_new = t >= ri->num_temps || BITSET_TEST(rescan, t);
+
+                for (uint32_t j = 0; j < active_count;) {
+                        uint32_t a = active[j];
+
+                        if (c->temp_end[a] <= c->temp_start[t]) {
+                                active[j] = active[--active_count];
+                                continue;
+                        }
+
+                        /* A value that is written but never read still
+                         * needs a register that isn't live at its def.
+                         */
+                        if (c->temp_start[a] < c->temp_end[t] &&
+                            (t_is_new || a >= ri->num_temps ||
+                             BITSET_TEST(rescan, a))) {
+                                struct v3d_ra_edge edge = { a, t };
+                                util_dynarray_append(&ri->edges,
+                                                     struct v3d_ra_edge, edge);
+                        }
+                        j++;
+                }
+
+                if (c->temp_end[t] > c->temp_start[t])
+                        active[active_count++] = t;
+        }
+
+        free(start_offset);
+        free(sorted);
+        free(active);
+}
+
+static struct v3d_ra_interference *
+v3d_ra_update_interference(struct v3d_compile *c, uint32_t num_ips)
+{
+        struct v3d_ra_interference *ri = c->ra_interference;
+        BITSET_WORD *rescan = rzalloc_array(NULL, BITSET_WORD,
+                                            BITSET_WORDS(c->num_temps));
+
+        if (!ri) {
+                ri = rzalloc(c, struct v3d_ra_interference);
+                util_dynarray_init(&ri->edges, ri);
+                c->ra_interference = ri;
+        }
+
+        /* Every fill reads the spill base, so its interval grows with each
+         * TMU spill.
+         */
+        if (c->spill_size && c->spill_base.file == QFILE_TEMP &&
+            c->spill_base.index < ri->num_temps) {
+                BITSET_SET(rescan, c->spill_base.index);
+        }
+
+        /* Drop the edges of temps that are gone (the one we just spilled)
+         * or that we are going to look at again.
+         */
+        struct v3d_ra_edge *edges = util_dynarray_begin(&ri->edges);
+        uint32_t num_edges = util_dynarray_num_elements(&ri->edges,
+                                                        struct v3d_ra_edge);
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < num_edges; i++) {
+                struct v3d_ra_edge edge = edges[i];
+
+                if (temp_is_live(c, edge.a) && temp_is_live(c, edge.b) &&
+                    !BITSET_TEST(rescan, edge.a) &&
+                    !BITSET_TEST(rescan, edge.b)) {
+                        edges[kept++] = edge;
+                }
+        }
+        util_dynarray_resize(&ri->edges, struct v3d_ra_edge, kept);
+
+        v3d_ra_find_interference(c, ri, rescan, num_ips);
+        ri->num_temps = c->num_temps;
+
+        ralloc_free(rescan);
+
+        return ri;
+}
+
 #define CLASS_BIT_PHYS			(1 << 0)
 #define CLASS_BIT_ACC			(1 << 1)
 #define CLASS_BIT_R5			(1 << 4)
@@ -448,6 +755,18 @@ v3d_register_allocate(struct v3d_compile *c, bool *spilled)
 
         vir_calculate_live_intervals(c);
 
+        uint32_t num_ips = 0;
+        vir_for_each_inst_inorder(inst, c)
+                num_ips++;
+
+        /* The number of implicit r3/r4 writes and thread switches before
+         * each ip, to find the temps live across them without walking every
+         * temp at each of them.
+         */
+        uint32_t *r3_writes = calloc(3 * (num_ips + 1), sizeof(uint32_t));
+        uint32_t *r4_writes = r3_writes + num_ips + 1;
+        uint32_t *thrsws = r4_writes + num_ips + 1;
+
         /* Convert 1, 2, 4 threads to 0, 1, 2 index.
          *
          * V3D 4.x has double the physical register space, so 64 physical regs
@@ -492,30 +811,11 @@ v3d_register_allocate(struct v3d_compile *c, bool *spilled)
 
         int ip = 0;
         vir_for_each_inst_inorder(inst, c) {
-                /* If the instruction writes r3/r4 (and optionally moves its
-                 * result to a temp), nothing else can be stored in r3/r4 across
-                 * it.
-                 */
-                if (vir_writes_r3(c->devinfo, inst)) {
-                        for (int i = 0; i < c->num_temps; i++) {
-                                if (c->temp_start[i] < ip &&
-                                    c->temp_end[i] > ip) {
-                                        ra_add_node_interference(g,
-                                                                 temp_to_node[i],
-                                                                 acc_nodes[3]);
-                                }
-                        }
-                }
-                if (vir_writes_r4(c->devinfo, inst)) {
-                        for (int i = 0; i < c->num_temps; i++) {
-                                if (c->temp_start[i] < ip &&
-                                    c->temp_end[i] > ip) {
-                                        ra_add_node_interference(g,
-                                                                 temp_to_node[i],
-                                                                 acc_nodes[4]);
-                                }
-                        }
-                }
+                r3_writes[ip + 1] = (r3_writes[ip] +
+                                     vir_writes_r3(c->devinfo, inst));
+                r4_writes[ip + 1] = (r4_writes[ip] +
+                                     vir_writes_r4(c->devinfo, inst));
+                thrsws[ip + 1] = thrsws[ip] + inst->qpu.sig.thrsw;
 
                 if (inst->qpu.type == V3D_QPU_INSTR_TYPE_ALU) {
                         switch (inst->qpu.alu.add.op) {
@@ -589,18 +889,33 @@ v3d_register_allocate(struct v3d_compile *c, bool *spilled)
                         }
                 }
 
-                if (inst->qpu.sig.thrsw) {
-                        /* All accumulators are invalidated across a thread
-                         * switch.
-                         */
-                        for (int i = 0; i < c->num_temps; i++) {
-                                if (c->temp_start[i] < ip && c->temp_end[i] > ip)
-                                        class_bits[i] &= CLASS_BIT_PHYS;
-                        }
+                ip++;
+        }
+
+        for (uint32_t i = 0; i < c->num_temps; i++) {
+                int start = c->temp_start[i], end = c->temp_end[i];
+
+                if (start >= end)
+                        continue;
+
+                /* If an instruction writes r3/r4 (and optionally moves its
+                 * result to a temp), nothing else can be stored in r3/r4
+                 * across it.
+                 */
+                if (r3_writes[end] != r3_writes[start + 1]) {
+                        ra_add_node_interference(g, temp_to_node[i],
+                                                 acc_nodes[3]);
+                }
+                if (r4_writes[end] != r4_writes[start + 1]) {
+                        ra_add_node_interference(g, temp_to_node[i],
+                                                 acc_nodes[4]);
                 }
 
-                ip++;
+                /* All accumulators are invalidated across a thread switch. */
+                if (thrsws[end] != thrsws[start + 1])
+                        class_bits[i] &= CLASS_BIT_PHYS;
         }
+        free(r3_writes);
 
         for (uint32_t i = 0; i < c->num_temps; i++) {
                 if (class_bits[i] == CLASS_BIT_PHYS) {
@@ -619,15 +934,12 @@ v3d_register_allocate(struct v3d_compile *c, bool *spilled)
                 }
         }
 
-        for (uint32_t i = 0; i < c->num_temps; i++) {
-                for (uint32_t j = i + 1; j < c->num_temps; j++) {
-                        if (!(c->temp_start[i] >= c->temp_end[j] ||
-                              c->temp_start[j] >= c->temp_end[i])) {
-                                ra_add_node_interference(g,
-                                                         temp_to_node[i],
-                                                         temp_to_node[j]);
-                        }
-                }
+        struct v3d_ra_interference *ri = v3d_ra_update_interference(c,
+                                                                    num_ips);
+        util_dynarray_foreach(&ri->edges, struct v3d_ra_edge, edge) {
+                ra_add_node_interference(g,
+                                         temp_to_node[edge->a],
+                                         temp_to_node[edge->b]);
         }
 
         /* Debug code to force a bit of register spilling, for running across
@@ -653,7 +965,7 @@ v3d_register_allocate(struct v3d_compile *c, bool *spilled)
                  * conut first.
                  */
                 if (node != -1 &&
-                    (vir_is_mov_uniform(c, map[node].temp) ||
+                    (vir_remat_cost(c, map[node].temp) ||
                      thread_index == 0)) {
                         v3d_spill_reg(c, map[node].temp);
 
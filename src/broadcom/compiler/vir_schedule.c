@@ -0,0 +1,779 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file vir_schedule.c
+ *
+ * Pre-register-allocation scheduling of the TMU accesses in VIR.
+ *
+ * nir_to_vir emits each TMU operation as its register writes, a THRSW and
+ * then its LDTMUs (or TMUWT), so a texture-heavy shader switches threads
+ * after every lookup and never has more than one of them in flight.
+ *
+ * This pass takes each straight-line region of a block that contains TMU
+ * operations, drops their THRSWs and list-schedules the region again.  It
+ * hoists the TMU requests (and the math feeding them) so that independent
+ * lookups go out together, as far as the TMU FIFOs allow at the current
+ * thread count, and sinks the LDTMUs down to where their results are
+ * needed.  A single THRSW then goes before the first LDTMU of each batch.
+ *
+ * The scheduler has two goals.  While the number of live temporaries fits
+ * in the registers available at the current thread count, it goes for
+ * latency as described above.  Once it doesn't, it picks the instructions
+ * that free the most registers instead, so that we don't end up dropping
+ * to fewer threads or spilling.
+ */
+
+#include "util/ralloc.h"
+#include "util/dag.h"
+#include "v3d_compiler.h"
+
+/* The TMU FIFOs are per QPU, so each thread gets its share of them. */
+#define V3D_TMU_INPUT_FIFO_SIZE         16
+#define V3D_TMU_OUTPUT_FIFO_SIZE        16
+#define V3D_TMU_CONFIG_FIFO_SIZE        8
+
+struct vir_schedule_node {
+        struct dag_node dag;
+        struct qinst *inst;
+
+        /* Position in the original order, used to break ties. */
+        uint32_t index;
+
+        /* The TMU lookup this instruction writes or reads, or -1. */
+        int lookup;
+        bool tmu_write;
+        bool tmu_read;
+
+        /* Whether a TMU request depends on this instruction. */
+        bool feeds_tmu;
+};
+
+struct vir_schedule_lookup {
+        uint32_t writes;
+        uint32_t reads;
+        uint32_t input_words;
+        uint32_t output_words;
+};
+
+/* When walking the instructions in reverse, we need to swap before/after in
+ * add_dep().
+ */
+enum direction { F, R };
+
+struct vir_schedule_state {
+        enum direction dir;
+        struct vir_schedule_node **last_temp;
+        struct vir_schedule_node *last_sf;
+        struct vir_schedule_node *last_ordered;
+        struct vir_schedule_node *last_tmu_write;
+        struct vir_schedule_node *last_tmu_read;
+        struct vir_schedule_node *last_tmuwt;
+};
+
+struct vir_schedule {
+        struct v3d_compile *c;
+        struct vir_schedule_state state;
+
+        /* Per-temp scratch, all zeroed between regions. */
+        uint32_t *uses;
+        BITSET_WORD *live;
+
+        struct vir_schedule_node *nodes;
+        struct vir_schedule_lookup *lookups;
+        struct qinst **order;
+        uint32_t size;
+
+        /* Original instruction order of the block being scheduled. */
+        struct qinst **insts;
+        uint32_t insts_count;
+        uint32_t insts_size;
+};
+
+static bool
+vir_writes_tmu(struct qinst *inst)
+{
+        return ((inst->dst.file == QFILE_MAGIC &&
+                 v3d_qpu_magic_waddr_is_tmu(inst->dst.index)) ||
+                inst->qpu.sig.wrtmuc);
+}
+
+/* Whether this is one of the THRSWs that nir_to_vir emits right after the
+ * register writes of a TMU operation, which we are free to move.
+ */
+static bool
+vir_is_tmu_thrsw(struct qinst *inst, struct qinst *prev)
+{
+        return (inst->qpu.sig.thrsw && !inst->is_last_thrsw &&
+                prev && vir_writes_tmu(prev));
+}
+
+/* Returns whether the instruction has to stay where it is, splitting the
+ * block into separately scheduled regions.
+ */
+static bool
+vir_is_region_barrier(struct qinst *inst, struct qinst *prev)
+{
+        if (inst->qpu.type == V3D_QPU_INSTR_TYPE_BRANCH)
+                return true;
+
+        /* The last THRSW, and the ones locking the scoreboard for TLB
+         * reads or blocking on a TSY barrier.
+         */
+        if (inst->qpu.sig.thrsw)
+                return !vir_is_tmu_thrsw(inst, prev);
+
+        if (inst->qpu.sig.ldtlb || inst->qpu.sig.ldtlbu)
+                return true;
+
+        if (inst->dst.file == QFILE_MAGIC &&
+            (v3d_qpu_magic_waddr_is_tlb(inst->dst.index) ||
+             v3d_qpu_magic_waddr_is_tsy(inst->dst.index))) {
+                return true;
+        }
+
+        return false;
+}
+
+/* Returns whether the instruction touches state other than its temps and
+ * the flags: fixed function registers, accumulators written implicitly
+ * (r4 for SFU, r5 for ldvary, rtop for MULTOP), the VPM, etc.  Those
+ * instructions are kept in their original order.
+ */
+static bool
+vir_is_ordered(struct v3d_compile *c, struct qinst *inst)
+{
+        for (int i = 0; i < vir_get_nsrc(inst); i++) {
+                switch (inst->src[i].file) {
+                case QFILE_REG:
+                case QFILE_MAGIC:
+                case QFILE_VPM:
+                        return true;
+                default:
+                        break;
+                }
+        }
+
+        if (inst->dst.file == QFILE_REG)
+                return true;
+
+        if (inst->dst.file == QFILE_MAGIC &&
+            !v3d_qpu_magic_waddr_is_tmu(inst->dst.index)) {
+                return true;
+        }
+
+        if (vir_writes_tmu(inst) || v3d_qpu_waits_on_tmu(&inst->qpu))
+                return false;
+
+        if (vir_has_side_effects(c, inst))
+                return true;
+
+        if (inst->qpu.sig.ldvpm ||
+            inst->qpu.sig.ldunifa ||
+            inst->qpu.sig.ldunifarf) {
+                return true;
+        }
+
+        if (inst->qpu.type == V3D_QPU_INSTR_TYPE_ALU) {
+                switch (inst->qpu.alu.add.op) {
+                case V3D_QPU_A_MSF:
+                case V3D_QPU_A_REVF:
+                case V3D_QPU_A_LDVPMV_IN:
+                case V3D_QPU_A_LDVPMV_OUT:
+                case V3D_QPU_A_LDVPMD_IN:
+                case V3D_QPU_A_LDVPMD_OUT:
+                case V3D_QPU_A_LDVPMP:
+                case V3D_QPU_A_LDVPMG_IN:
+                case V3D_QPU_A_LDVPMG_OUT:
+                        return true;
+                default:
+                        break;
+                }
+
+                if (inst->qpu.alu.mul.op == V3D_QPU_M_UMUL24)
+                        return true;
+        }
+
+        return false;
+}
+
+static void
+add_dep(struct vir_schedule_state *state,
+        struct vir_schedule_node *before,
+        struct vir_schedule_node *after)
+{
+        if (!before || !after || before == after)
+                return;
+
+        if (state->dir == F)
+                dag_add_edge(&before->dag, &after->dag, NULL);
+        else
+                dag_add_edge(&after->dag, &before->dag, NULL);
+}
+
+static void
+add_write_dep(struct vir_schedule_state *state,
+              struct vir_schedule_node **before,
+              struct vir_schedule_node *after)
+{
+        add_dep(state, *before, after);
+        *before = after;
+}
+
+/* Temp and flag dependencies, which need tracking in both directions to
+ * get the write-after-read edges.
+ */
+static void
+calculate_deps(struct vir_schedule_state *state, struct vir_schedule_node *n)
+{
+        struct qinst *inst = n->inst;
+
+        for (int i = 0; i < vir_get_nsrc(inst); i++) {
+                if (inst->src[i].file == QFILE_TEMP)
+                        add_dep(state, state->last_temp[inst->src[i].index], n);
+        }
+
+        if (inst->dst.file == QFILE_TEMP)
+                add_write_dep(state, &state->last_temp[inst->dst.index], n);
+
+        if (v3d_qpu_reads_flags(&inst->qpu))
+                add_dep(state, state->last_sf, n);
+
+        /* A TMU read may end up with a THRSW in front of it, after which the
+         * flags are undefined.
+         */
+        if (v3d_qpu_writes_flags(&inst->qpu) || n->tmu_read)
+                add_write_dep(state, &state->last_sf, n);
+}
+
+/* TMU ordering.  The requests go out in their original order and their
+ * results come back from a FIFO in that same order, but requests may move
+ * up past the results of earlier ones.  TMUWT waits for all the writes so
+ * far, so nothing moves across it.
+ */
+static void
+calculate_forward_deps(struct v3d_compile *c, struct vir_schedule_state *state,
+                       struct vir_schedule_node *n)
+{
+        if (n->tmu_write) {
+                add_write_dep(state, &state->last_tmu_write, n);
+                add_dep(state, state->last_tmuwt, n);
+        }
+
+        if (n->tmu_read) {
+                add_dep(state, state->last_tmu_write, n);
+                add_write_dep(state, &state->last_tmu_read, n);
+                if (n->inst->qpu.type == V3D_QPU_INSTR_TYPE_ALU &&
+                    n->inst->qpu.alu.add.op == V3D_QPU_A_TMUWT) {
+                        state->last_tmuwt = n;
+                }
+        }
+
+        /* Keep the TMU reads (and the THRSW they may need) in order with
+         * the instructions that depend on implicit state.
+         */
+        if (n->tmu_read || vir_is_ordered(c, n->inst))
+                add_write_dep(state, &state->last_ordered, n);
+}
+
+static void
+vir_schedule_reset_state(struct vir_schedule *s, enum direction dir,
+                         uint32_t count)
+{
+        struct vir_schedule_state *state = &s->state;
+
+        for (uint32_t i = 0; i < count; i++) {
+                struct qinst *inst = s->nodes[i].inst;
+
+                for (int j = 0; j < vir_get_nsrc(inst); j++) {
+                        if (inst->src[j].file == QFILE_TEMP)
+                                state->last_temp[inst->src[j].index] = NULL;
+                }
+                if (inst->dst.file == QFILE_TEMP)
+                        state->last_temp[inst->dst.index] = NULL;
+        }
+
+        state->dir = dir;
+        state->last_sf = NULL;
+        state->last_ordered = NULL;
+        state->last_tmu_write = NULL;
+        state->last_tmu_read = NULL;
+        state->last_tmuwt = NULL;
+}
+
+static bool
+vir_reads_temp_before(struct qinst *inst, int src, uint32_t temp)
+{
+        for (int i = 0; i < src; i++) {
+                if (inst->src[i].file == QFILE_TEMP &&
+                    inst->src[i].index == temp) {
+                        return true;
+                }
+        }
+
+        return false;
+}
+
+/* Change in the number of live temps if @n was scheduled next. */
+static int
+vir_pressure_delta(struct vir_schedule *s, struct vir_schedule_node *n,
+                   int end_ip)
+{
+        struct v3d_compile *c = s->c;
+        struct qinst *inst = n->inst;
+        int delta = 0;
+
+        for (int i = 0; i < vir_get_nsrc(inst); i++) {
+                if (inst->src[i].file != QFILE_TEMP ||
+                    vir_reads_temp_before(inst, i, inst->src[i].index)) {
+                        continue;
+                }
+
+                uint32_t temp = inst->src[i].index;
+                if (s->uses[temp] == 1 && BITSET_TEST(s->live, temp) &&
+                    c->temp_end[temp] <= end_ip) {
+                        delta--;
+                }
+        }
+
+        if (inst->dst.file == QFILE_TEMP && !BITSET_TEST(s->live, inst->dst.index))
+                delta++;
+
+        return delta;
+}
+
+static int
+vir_schedule_update_liveness(struct vir_schedule *s,
+                             struct vir_schedule_node *n, int end_ip)
+{
+        struct v3d_compile *c = s->c;
+        struct qinst *inst = n->inst;
+        int delta = 0;
+
+        for (int i = 0; i < vir_get_nsrc(inst); i++) {
+                if (inst->src[i].file != QFILE_TEMP ||
+                    vir_reads_temp_before(inst, i, inst->src[i].index)) {
+                        continue;
+                }
+
+                uint32_t temp = inst->src[i].index;
+                if (--s->uses[temp] == 0 && BITSET_TEST(s->live, temp) &&
+                    c->temp_end[temp] <= end_ip) {
+                        BITSET_CLEAR(s->live, temp);
+                        delta--;
+                }
+        }
+
+        if (inst->dst.file == QFILE_TEMP) {
+                uint32_t temp = inst->dst.index;
+                if (!BITSET_TEST(s->live, temp) &&
+                    (s->uses[temp] || c->temp_end[temp] > end_ip)) {
+                        BITSET_SET(s->live, temp);
+                        delta++;
+                }
+        }
+
+        return delta;
+}
+
+/* Latency goal: TMU requests and whatever feeds them first, then the rest,
+ * then the TMU reads.
+ */
+static int
+vir_latency_class(struct vir_schedule_node *n)
+{
+        if (n->tmu_read)
+                return 2;
+        if (n->tmu_write || n->feeds_tmu)
+                return 0;
+        return 1;
+}
+
+/**
+ * Schedules instructions [start, end) of s->insts, which may only contain
+ * THRSWs that are right after a TMU request.  Returns false, leaving the
+ * instructions untouched, if it couldn't find a valid order.
+ */
+static bool
+vir_schedule_region(struct vir_schedule *s, struct qblock *block,
+                    uint32_t start, uint32_t end, int start_ip)
+{
+        struct v3d_compile *c = s->c;
+        struct qinst **insts = s->insts;
+        const int end_ip = start_ip + (end - start) - 1;
+
+        struct dag *dag = dag_create(NULL);
+        uint32_t count = 0, lookup_count = 0;
+        struct vir_schedule_lookup *lookup = NULL;
+        bool last_was_read = true;
+
+        for (uint32_t i = start; i < end; i++) {
+                struct qinst *inst = insts[i];
+
+                if (inst->qpu.sig.thrsw)
+                        continue;
+
+                struct vir_schedule_node *n = &s->nodes[count];
+                memset(n, 0, sizeof(*n));
+                dag_init_node(dag, &n->dag);
+                n->inst = inst;
+                n->index = count++;
+                n->lookup = -1;
+                n->tmu_write = vir_writes_tmu(inst);
+                n->tmu_read = v3d_qpu_waits_on_tmu(&inst->qpu);
+
+                if (n->tmu_write) {
+                        if (last_was_read) {
+                                lookup = &s->lookups[lookup_count++];
+                                memset(lookup, 0, sizeof(*lookup));
+                        }
+                        lookup->writes++;
+                        if (!inst->qpu.sig.wrtmuc)
+                                lookup->input_words++;
+                        last_was_read = false;
+                } else if (n->tmu_read) {
+                        lookup->reads++;
+                        if (inst->qpu.sig.ldtmu)
+                                lookup->output_words++;
+                        last_was_read = true;
+                }
+
+                if (n->tmu_write || n->tmu_read)
+                        n->lookup = lookup_count - 1;
+        }
+
+        vir_schedule_reset_state(s, F, count);
+        for (uint32_t i = 0; i < count; i++) {
+                calculate_deps(&s->state, &s->nodes[i]);
+                calculate_forward_deps(c, &s->state, &s->nodes[i]);
+        }
+        vir_schedule_reset_state(s, R, count);
+        for (uint32_t i = count; i-- > 0;)
+                calculate_deps(&s->state, &s->nodes[i]);
+
+        /* All edges point forward in the original order. */
+        for (uint32_t i = count; i-- > 0;) {
+                struct vir_schedule_node *n = &s->nodes[i];
+
+                util_dynarray_foreach(&n->dag.edges, struct dag_edge, edge) {
+                        struct vir_schedule_node *child =
+                                (struct vir_schedule_node *)edge->child;
+                        if (child->tmu_write || child->feeds_tmu)
+                                n->feeds_tmu = true;
+                }
+        }
+
+        /* Start with what's live into the region. */
+        int pressure = 0;
+        for (uint32_t t = 0; t < c->num_temps; t++) {
+                if (c->temp_start[t] < start_ip && c->temp_end[t] >= start_ip) {
+                        BITSET_SET(s->live, t);
+                        pressure++;
+                }
+        }
+        for (uint32_t i = 0; i < count; i++) {
+                struct qinst *inst = s->nodes[i].inst;
+
+                for (int j = 0; j < vir_get_nsrc(inst); j++) {
+                        if (inst->src[j].file == QFILE_TEMP &&
+                            !vir_reads_temp_before(inst, j,
+                                                   inst->src[j].index)) {
+                                s->uses[inst->src[j].index]++;
+                        }
+                }
+        }
+
+        const bool threaded = c->threads > 1;
+        const int pressure_limit = 64 / c->threads;
+        const uint32_t max_input = V3D_TMU_INPUT_FIFO_SIZE / c->threads;
+        const uint32_t max_output = V3D_TMU_OUTPUT_FIFO_SIZE / c->threads;
+        const uint32_t max_config = V3D_TMU_CONFIG_FIFO_SIZE / c->threads;
+
+        /* The batch of lookups in flight.  Its results are read back in one
+         * go after a single THRSW, and no new lookup starts until they all
+         * are, which is also what register allocation expects when it looks
+         * for places where it can't spill.
+         */
+        uint32_t batch_input = 0, batch_output = 0, batch_lookups = 0;
+        uint32_t batch_reads_left = 0;
+        bool batch_reading = false;
+        int open_lookup = -1;
+        uint32_t writes_left = 0;
+
+        uint32_t order_count = 0;
+        bool success = true;
+
+        while (!list_is_empty(&dag->heads)) {
+                struct vir_schedule_node *chosen = NULL;
+                int chosen_delta = 0;
+                const bool pressure_goal = pressure >= pressure_limit;
+
+                list_for_each_entry(struct vir_schedule_node, n, &dag->heads,
+                                    dag.link) {
+                        if (n->tmu_read && open_lookup != -1)
+                                continue;
+
+                        if (n->tmu_write && open_lookup == -1) {
+                                const struct vir_schedule_lookup *l =
+                                        &s->lookups[n->lookup];
+
+                                if (batch_reading)
+                                        continue;
+
+                                if (batch_lookups &&
+                                    (batch_input + l->input_words > max_input ||
+                                     batch_output + l->output_words > max_output ||
+                                     batch_lookups + 1 > max_config)) {
+                                        continue;
+                                }
+                        }
+
+                        int delta = 0;
+                        if (pressure_goal) {
+                                delta = vir_pressure_delta(s, n, end_ip);
+                                if (chosen && delta != chosen_delta) {
+                                        if (delta < chosen_delta) {
+                                                chosen = n;
+                                                chosen_delta = delta;
+                                        }
+                                        continue;
+                                }
+                        }
+
+                        if (chosen) {
+                                int class = vir_latency_class(n);
+                                int chosen_class = vir_latency_class(chosen);
+
+                                if (class > chosen_class ||
+                                    (class == chosen_class &&
+                                     n->index > chosen->index)) {
+                                        continue;
+                                }
+                        }
+
+                        chosen = n;
+                        chosen_delta = delta;
+                }
+
+                if (!chosen) {
+                        success = false;
+                        break;
+                }
+
+                if (chosen->tmu_write) {
+                        const struct vir_schedule_lookup *l =
+                                &s->lookups[chosen->lookup];
+
+                        if (open_lookup == -1) {
+                                open_lookup = chosen->lookup;
+                                writes_left = l->writes;
+                                batch_input += l->input_words;
+                                batch_output += l->output_words;
+                                batch_reads_left += l->reads;
+                                batch_lookups++;
+                        }
+
+                        if (--writes_left == 0)
+                                open_lookup = -1;
+                } else if (chosen->tmu_read) {
+                        if (!batch_reading && threaded)
+                                s->order[order_count++] = NULL;
+                        batch_reading = true;
+
+                        if (--batch_reads_left == 0) {
+                                batch_input = 0;
+                                batch_output = 0;
+                                batch_lookups = 0;
+                                batch_reading = false;
+                        }
+                }
+
+                pressure += vir_schedule_update_liveness(s, chosen, end_ip);
+                s->order[order_count++] = chosen->inst;
+                dag_prune_head(dag, &chosen->dag);
+        }
+
+        /* Clear the per-temp scratch for the next region. */
+        memset(s->live, 0, BITSET_WORDS(c->num_temps) * sizeof(BITSET_WORD));
+        for (uint32_t i = 0; i < count; i++) {
+                struct qinst *inst = s->nodes[i].inst;
+
+                for (int j = 0; j < vir_get_nsrc(inst); j++) {
+                        if (inst->src[j].file == QFILE_TEMP)
+                                s->uses[inst->src[j].index] = 0;
+                }
+        }
+        ralloc_free(dag);
+
+        if (!success)
+                return false;
+
+        struct list_head *next = end < s->insts_count ?
+                &insts[end]->link : &block->instructions;
+
+        for (uint32_t i = start; i < end; i++) {
+                if (insts[i]->qpu.sig.thrsw)
+                        vir_remove_instruction(c, insts[i]);
+                else
+                        list_del(&insts[i]->link);
+        }
+
+        for (uint32_t i = 0; i < order_count; i++) {
+                struct qinst *inst = s->order[i];
+
+                if (!inst) {
+                        inst = vir_add_inst(V3D_QPU_A_NOP, c->undef,
+                                            c->undef, c->undef);
+                        inst->qpu.sig.thrsw = true;
+                }
+
+                list_addtail(&inst->link, next);
+        }
+
+        return true;
+}
+
+/* Trims [*start, *end) so that it only holds whole TMU operations: the
+ * LDTMUs at the start of a region that follows the last THRSW belong to a
+ * request before it, and the requests at the end of a region that precedes
+ * it have no LDTMU in the region.  Returns whether anything is left to
+ * schedule.
+ */
+static bool
+vir_trim_region(struct vir_schedule *s, uint32_t *start, uint32_t *end)
+{
+        struct qinst **insts = s->insts;
+        uint32_t lookup_start = *end;
+        bool seen_write = false, last_was_read = true;
+
+        for (uint32_t i = *start; i < *end; i++) {
+                struct qinst *inst = insts[i];
+
+                if (vir_writes_tmu(inst)) {
+                        if (last_was_read)
+                                lookup_start = i;
+                        seen_write = true;
+                        last_was_read = false;
+                } else if (v3d_qpu_waits_on_tmu(&inst->qpu)) {
+                        if (!seen_write)
+                                *start = i + 1;
+                        last_was_read = true;
+                }
+        }
+
+        if (!seen_write)
+                return false;
+
+        if (!last_was_read)
+                *end = lookup_start;
+
+        for (uint32_t i = *start; i < *end; i++) {
+                if (vir_writes_tmu(insts[i]))
+                        return true;
+        }
+
+        return false;
+}
+
+static void
+vir_schedule_block(struct vir_schedule *s, struct qblock *block, int *ip)
+{
+        uint32_t count = 0;
+
+        vir_for_each_inst(inst, block)
+                count++;
+
+        if (count > s->insts_size) {
+                s->insts = reralloc(s, s->insts, struct qinst *, count);
+                s->insts_size = count;
+        }
+        if (count > s->size) {
+                s->nodes = reralloc(s, s->nodes, struct vir_schedule_node,
+                                    count);
+                s->lookups = reralloc(s, s->lookups,
+                                      struct vir_schedule_lookup, count);
+                /* Room for a THRSW in front of every instruction. */
+                s->order = reralloc(s, s->order, struct qinst *, count * 2);
+                s->size = count;
+        }
+
+        /* The region boundaries and IPs refer to this snapshot, since
+         * scheduling changes the number of THRSWs in the block.
+         */
+        uint32_t i = 0;
+        vir_for_each_inst(inst, block)
+                s->insts[i++] = inst;
+        s->insts_count = count;
+
+        uint32_t region_start = 0;
+        for (i = 0; i <= count; i++) {
+                if (i < count &&
+                    !vir_is_region_barrier(s->insts[i],
+                                           i ? s->insts[i - 1] : NULL)) {
+                        continue;
+                }
+
+                uint32_t start = region_start, end = i;
+                if (vir_trim_region(s, &start, &end)) {
+                        vir_schedule_region(s, block, start, end,
+                                            *ip + start);
+                }
+
+                region_start = i + 1;
+        }
+
+        *ip += count;
+}
+
+/**
+ * Reorders the TMU operations of the program so that independent lookups
+ * are in flight together and share a single thread switch.
+ */
+void
+vir_schedule_instructions(struct v3d_compile *c)
+{
+        /* On V3D 3.x the LDTMUs go through r4, which the SFU shares. */
+        if (c->devinfo->ver < 41)
+                return;
+
+        vir_calculate_live_intervals(c);
+
+        struct vir_schedule *s = rzalloc(NULL, struct vir_schedule);
+        s->c = c;
+        s->state.last_temp = rzalloc_array(s, struct vir_schedule_node *,
+                                           c->num_temps);
+        s->uses = rzalloc_array(s, uint32_t, c->num_temps);
+        s->live = rzalloc_array(s, BITSET_WORD, BITSET_WORDS(c->num_temps));
+
+        /* We don't emit anything after this, but make sure the cursor
+         * doesn't point at an instruction we are about to remove.
+         */
+        c->cursor = vir_after_block(c->cur_block);
+
+        int ip = 0;
+        vir_for_each_block(block, c)
+                vir_schedule_block(s, block, &ip);
+
+        c->live_intervals_valid = false;
+        ralloc_free(s);
+}
@@ -420,6 +420,9 @@ v3d_vir_to_qpu(struct v3d_compile *c, struct qpu_reg *temp_registers)
                         c->failed = true;
                         return;
                 }
+
+                if (inst->qpu.sig.thrsw)
+                        c->qpu_inst_thrsw_count++;
         }
         assert(i == c->qpu_inst_count);
 
@@ -430,5 +433,7 @@ v3d_vir_to_qpu(struct v3d_compile *c, struct qpu_reg *temp_registers)
 
         qpu_validate(c);
 
+        v3d_qpu_estimate(c);
+
         free(temp_registers);
 }
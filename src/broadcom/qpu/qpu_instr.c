@@ -73,6 +73,9 @@ v3d_qpu_magic_waddr_name(enum v3d_qpu_waddr waddr)
                 [V3D_QPU_WADDR_R5REP] = "r5rep",
         };
 
+        if (waddr >= ARRAY_SIZE(waddr_magic))
+                return NULL;
+
         return waddr_magic[waddr];
 }
 
@@ -846,6 +849,28 @@ v3d_qpu_sig_writes_address(const struct v3d_device_info *devinfo,
                 sig->ldtlbu);
 }
 
+/**
+ * Returns whether any signal other than small_imm is set, which just changes
+ * how raddr_b is interpreted.
+ */
+bool
+v3d_qpu_sig_has_signals(const struct v3d_qpu_sig *sig)
+{
+        return (sig->thrsw ||
+                sig->ldunif ||
+                sig->ldunifa ||
+                sig->ldunifrf ||
+                sig->ldunifarf ||
+                sig->ldtmu ||
+                sig->ldvary ||
+                sig->ldvpm ||
+                sig->ldtlb ||
+                sig->ldtlbu ||
+                sig->ucb ||
+                sig->rotate ||
+                sig->wrtmuc);
+}
+
 bool
 v3d_qpu_reads_flags(const struct v3d_qpu_instr *inst)
 {
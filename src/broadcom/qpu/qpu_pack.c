@@ -22,6 +22,7 @@
  */
 
 #include <string.h>
+#include "c11/threads.h"
 #include "util/macros.h"
 
 #include "broadcom/common/v3d_device_info.h"
@@ -424,8 +425,13 @@ v3d_qpu_flags_pack(const struct v3d_device_info *devinfo,
                 if (flags_present & MUF)
                         *packed_cond |= cond->muf - V3D_QPU_UF_ANDZ + 4;
 
-                if (flags_present & AC)
-                        *packed_cond |= (cond->ac - V3D_QPU_COND_IFA) << 2;
+                if (flags_present & AC) {
+                        if (*packed_cond & (1 << 6))
+                                *packed_cond |= cond->ac - V3D_QPU_COND_IFA;
+                        else
+                                *packed_cond |= (cond->ac -
+                                                 V3D_QPU_COND_IFA) << 2;
+                }
 
                 if (flags_present & MC) {
                         if (*packed_cond & (1 << 6))
@@ -598,6 +604,111 @@ lookup_opcode(const struct opcode_desc *opcodes, size_t num_opcodes,
         return NULL;
 }
 
+/* Direct-indexed versions of add_ops/mul_ops, since packing and unpacking
+ * are hot in the disassembler and validator.  Each entry is one plus the
+ * index of the descriptor the linear lookups above would find, so that 0
+ * means there is none.
+ */
+static struct {
+        uint8_t add_decode[256][8][8];
+        uint8_t mul_decode[64][8][8];
+        uint8_t add_encode[V3D_QPU_A_UTOF + 1];
+        uint8_t mul_encode[V3D_QPU_M_FMUL + 1];
+} opcode_tables;
+
+static void
+init_opcode_tables_once(void)
+{
+        STATIC_ASSERT(ARRAY_SIZE(add_ops) < 255);
+        STATIC_ASSERT(ARRAY_SIZE(mul_ops) < 255);
+
+        for (int op = 0; op < 256; op++) {
+                for (int mux_b = 0; mux_b < 8; mux_b++) {
+                        for (int mux_a = 0; mux_a < 8; mux_a++) {
+                                const struct opcode_desc *desc =
+                                        lookup_opcode(add_ops,
+                                                      ARRAY_SIZE(add_ops),
+                                                      op, mux_a, mux_b);
+                                if (desc) {
+                                        opcode_tables.add_decode[op][mux_b][mux_a] =
+                                                desc - add_ops + 1;
+                                }
+
+                                if (op >= ARRAY_SIZE(opcode_tables.mul_decode))
+                                        continue;
+
+                                desc = lookup_opcode(mul_ops,
+                                                     ARRAY_SIZE(mul_ops),
+                                                     op, mux_a, mux_b);
+                                if (desc) {
+                                        opcode_tables.mul_decode[op][mux_b][mux_a] =
+                                                desc - mul_ops + 1;
+                                }
+                        }
+                }
+        }
+
+        /* Walk backwards so the first descriptor for each op wins. */
+        for (int i = ARRAY_SIZE(add_ops) - 1; i >= 0; i--) {
+                assert(add_ops[i].op < ARRAY_SIZE(opcode_tables.add_encode));
+                opcode_tables.add_encode[add_ops[i].op] = i + 1;
+        }
+        for (int i = ARRAY_SIZE(mul_ops) - 1; i >= 0; i--) {
+                assert(mul_ops[i].op < ARRAY_SIZE(opcode_tables.mul_encode));
+                opcode_tables.mul_encode[mul_ops[i].op] = i + 1;
+        }
+}
+
+static void
+init_opcode_tables(void)
+{
+        static once_flag opcode_tables_flag = ONCE_FLAG_INIT;
+
+        call_once(&opcode_tables_flag, init_opcode_tables_once);
+}
+
+static const struct opcode_desc *
+lookup_add_opcode(uint32_t opcode, uint32_t mux_a, uint32_t mux_b)
+{
+        init_opcode_tables();
+
+        uint8_t index = opcode_tables.add_decode[opcode][mux_b][mux_a];
+        return index ? &add_ops[index - 1] : NULL;
+}
+
+static const struct opcode_desc *
+lookup_mul_opcode(uint32_t opcode, uint32_t mux_a, uint32_t mux_b)
+{
+        init_opcode_tables();
+
+        uint8_t index = opcode_tables.mul_decode[opcode][mux_b][mux_a];
+        return index ? &mul_ops[index - 1] : NULL;
+}
+
+static const struct opcode_desc *
+lookup_add_op(enum v3d_qpu_add_op op)
+{
+        init_opcode_tables();
+
+        if (op >= ARRAY_SIZE(opcode_tables.add_encode))
+                return NULL;
+
+        uint8_t index = opcode_tables.add_encode[op];
+        return index ? &add_ops[index - 1] : NULL;
+}
+
+static const struct opcode_desc *
+lookup_mul_op(enum v3d_qpu_mul_op op)
+{
+        init_opcode_tables();
+
+        if (op >= ARRAY_SIZE(opcode_tables.mul_encode))
+                return NULL;
+
+        uint8_t index = opcode_tables.mul_encode[op];
+        return index ? &mul_ops[index - 1] : NULL;
+}
+
 static bool
 v3d_qpu_float32_unpack_unpack(uint32_t packed,
                               enum v3d_qpu_input_unpack *unpacked)
@@ -730,8 +841,7 @@ v3d_qpu_add_unpack(const struct v3d_device_info *devinfo, uint64_t packed_inst,
                 map_op = (map_op - 253 + 245);
 
         const struct opcode_desc *desc =
-                lookup_opcode(add_ops, ARRAY_SIZE(add_ops),
-                              map_op, mux_a, mux_b);
+                lookup_add_opcode(map_op, mux_a, mux_b);
         if (!desc)
                 return false;
 
@@ -856,6 +966,9 @@ v3d_qpu_add_unpack(const struct v3d_device_info *devinfo, uint64_t packed_inst,
                 case V3D_QPU_A_LDVPMG_IN:
                         instr->alu.add.op = V3D_QPU_A_LDVPMG_OUT;
                         break;
+                case V3D_QPU_A_LDVPMP:
+                        /* There's no _OUT version of it. */
+                        return false;
                 default:
                         instr->alu.add.magic_write = true;
                         break;
@@ -875,8 +988,7 @@ v3d_qpu_mul_unpack(const struct v3d_device_info *devinfo, uint64_t packed_inst,
 
         {
                 const struct opcode_desc *desc =
-                        lookup_opcode(mul_ops, ARRAY_SIZE(mul_ops),
-                                      op, mux_a, mux_b);
+                        lookup_mul_opcode(op, mux_a, mux_b);
                 if (!desc)
                         return false;
 
@@ -945,18 +1057,11 @@ v3d_qpu_add_pack(const struct v3d_device_info *devinfo,
         uint32_t mux_a = instr->alu.add.a;
         uint32_t mux_b = instr->alu.add.b;
         int nsrc = v3d_qpu_add_op_num_src(instr->alu.add.op);
-        const struct opcode_desc *desc;
-
-        int opcode;
-        for (desc = add_ops; desc != &add_ops[ARRAY_SIZE(add_ops)];
-             desc++) {
-                if (desc->op == instr->alu.add.op)
-                        break;
-        }
-        if (desc == &add_ops[ARRAY_SIZE(add_ops)])
+        const struct opcode_desc *desc = lookup_add_op(instr->alu.add.op);
+        if (!desc)
                 return false;
 
-        opcode = desc->opcode_first;
+        int opcode = desc->opcode_first;
 
         /* If an operation doesn't use an arg, its mux values may be used to
          * identify the operation type.
@@ -1116,7 +1221,7 @@ v3d_qpu_add_pack(const struct v3d_device_info *devinfo,
                 }
                 if (packed == 0)
                         return false;
-                opcode |= packed << 2;
+                opcode = (opcode & ~(1 << 2)) | packed << 2;
 
                 break;
 
@@ -1161,14 +1266,8 @@ v3d_qpu_mul_pack(const struct v3d_device_info *devinfo,
         uint32_t mux_a = instr->alu.mul.a;
         uint32_t mux_b = instr->alu.mul.b;
         int nsrc = v3d_qpu_mul_op_num_src(instr->alu.mul.op);
-        const struct opcode_desc *desc;
-
-        for (desc = mul_ops; desc != &mul_ops[ARRAY_SIZE(mul_ops)];
-             desc++) {
-                if (desc->op == instr->alu.mul.op)
-                        break;
-        }
-        if (desc == &mul_ops[ARRAY_SIZE(mul_ops)])
+        const struct opcode_desc *desc = lookup_mul_op(instr->alu.mul.op);
+        if (!desc)
                 return false;
 
         uint32_t opcode = desc->opcode_first;
@@ -1294,6 +1393,11 @@ v3d_qpu_instr_unpack_alu(const struct v3d_device_info *devinfo,
         instr->raddr_a = QPU_GET_FIELD(packed_instr, VC5_QPU_RADDR_A);
         instr->raddr_b = QPU_GET_FIELD(packed_instr, VC5_QPU_RADDR_B);
 
+        if (instr->sig.small_imm &&
+            instr->raddr_b >= ARRAY_SIZE(small_immediates)) {
+                return false;
+        }
+
         if (!v3d_qpu_add_unpack(devinfo, packed_instr, instr))
                 return false;
 
@@ -1461,6 +1565,15 @@ v3d_qpu_instr_pack_branch(const struct v3d_device_info *devinfo,
                 break;
         }
 
+        /* The uniform stream's new address can come from the register file
+         * too, whatever the instruction address comes from.
+         */
+        if (instr->branch.ub &&
+            instr->branch.bdu == V3D_QPU_BRANCH_DEST_REGFILE) {
+                *packed_instr |= QPU_SET_FIELD(instr->branch.raddr_a,
+                                               VC5_QPU_RADDR_A);
+        }
+
         return true;
 }
 
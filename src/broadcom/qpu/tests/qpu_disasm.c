@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <string.h>
 #include "util/macros.h"
+#include "util/ralloc.h"
 #include "broadcom/common/v3d_device_info.h"
 #include "broadcom/qpu/qpu_disasm.h"
 #include "broadcom/qpu/qpu_instr.h"
@@ -115,6 +116,67 @@ swap_pack(enum v3d_qpu_input_unpack *a, enum v3d_qpu_input_unpack *b)
         *b = t;
 }
 
+static uint64_t
+fuzz_rand(uint64_t *state)
+{
+        /* xorshift64, so that failures reproduce everywhere. */
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        return *state;
+}
+
+/* Unpacks random instruction words, and checks that packing what we got
+ * back gives an instruction that disassembles the same.  The packed bits
+ * themselves may differ, since some fields are ignored by some encodings.
+ */
+static int
+fuzz_round_trip(int ver, int count)
+{
+        struct v3d_device_info devinfo = { .ver = ver };
+        uint64_t state = 0x9e3779b97f4a7c15ull ^ ver;
+        int unpacked = 0, failures = 0;
+
+        for (int i = 0; i < count; i++) {
+                uint64_t inst = fuzz_rand(&state);
+                struct v3d_qpu_instr instr;
+
+                if (!v3d_qpu_instr_unpack(&devinfo, inst, &instr))
+                        continue;
+                unpacked++;
+
+                uint64_t repack;
+                if (!v3d_qpu_instr_pack(&devinfo, &instr, &repack)) {
+                        if (failures++ < 10) {
+                                printf("FAIL (pack) v%d.%d 0x%016llx \"%s\"\n",
+                                       ver / 10, ver % 10, (long long)inst,
+                                       v3d_qpu_disasm(&devinfo, inst));
+                        }
+                        continue;
+                }
+
+                const char *disasm = v3d_qpu_disasm(&devinfo, inst);
+                const char *redisasm = v3d_qpu_disasm(&devinfo, repack);
+                if (strcmp(disasm, redisasm) != 0) {
+                        if (failures++ < 10) {
+                                printf("FAIL (repack) v%d.%d 0x%016llx -> "
+                                       "0x%016llx\n",
+                                       ver / 10, ver % 10, (long long)inst,
+                                       (long long)repack);
+                                printf("  Expected: \"%s\"\n", disasm);
+                                printf("  Got:      \"%s\"\n", redisasm);
+                        }
+                }
+                ralloc_free((void *)disasm);
+                ralloc_free((void *)redisasm);
+        }
+
+        printf("Fuzzing v%d.%d: %d/%d words unpacked, %d failures\n",
+               ver / 10, ver % 10, unpacked, count, failures);
+
+        return failures != 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -183,5 +245,11 @@ main(int argc, char **argv)
                 printf("PASS\n");
         }
 
+        static const int fuzz_versions[] = { 33, 40, 41, 42 };
+        for (int i = 0; i < ARRAY_SIZE(fuzz_versions); i++) {
+                if (fuzz_round_trip(fuzz_versions[i], 50000))
+                        retval = 1;
+        }
+
         return retval;
 }
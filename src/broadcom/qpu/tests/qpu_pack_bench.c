@@ -0,0 +1,125 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Measures how many QPU instructions per second we can unpack, pack and
+ * disassemble, which is what bounds disassembling and validating large
+ * shaders or CLIF captures.  The corpus is made of random instruction words
+ * that unpack successfully, so that all the opcodes get exercised.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/macros.h"
+#include "util/os_time.h"
+#include "util/ralloc.h"
+#include "broadcom/common/v3d_device_info.h"
+#include "broadcom/qpu/qpu_disasm.h"
+#include "broadcom/qpu/qpu_instr.h"
+
+#define CORPUS_SIZE 65536
+
+static uint64_t
+bench_rand(uint64_t *state)
+{
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        return *state;
+}
+
+static void
+bench_report(int ver, const char *workload, int64_t elapsed, int count)
+{
+        printf("{\"bench\": \"qpu_pack\", \"ver\": %d, \"workload\": \"%s\", "
+               "\"insts\": %d, \"minsts_per_sec\": %.3f}\n",
+               ver, workload, count,
+               count / ((double)elapsed / 1000000000.0) / 1000000.0);
+        fflush(stdout);
+}
+
+static void
+bench_version(int ver, int iterations)
+{
+        struct v3d_device_info devinfo = { .ver = ver };
+        uint64_t *corpus = malloc(CORPUS_SIZE * sizeof(*corpus));
+        struct v3d_qpu_instr *instrs = malloc(CORPUS_SIZE * sizeof(*instrs));
+        uint64_t state = 0x9e3779b97f4a7c15ull ^ ver;
+
+        for (int i = 0; i < CORPUS_SIZE; ) {
+                uint64_t inst = bench_rand(&state);
+                struct v3d_qpu_instr instr;
+
+                if (v3d_qpu_instr_unpack(&devinfo, inst, &instr))
+                        corpus[i++] = inst;
+        }
+
+        int count = iterations * CORPUS_SIZE;
+        int64_t start = os_time_get_nano();
+        for (int it = 0; it < iterations; it++) {
+                for (int i = 0; i < CORPUS_SIZE; i++) {
+                        v3d_qpu_instr_unpack(&devinfo, corpus[i],
+                                             &instrs[i]);
+                }
+        }
+        bench_report(ver, "unpack", os_time_get_nano() - start, count);
+
+        uint64_t checksum = 0;
+        start = os_time_get_nano();
+        for (int it = 0; it < iterations; it++) {
+                for (int i = 0; i < CORPUS_SIZE; i++) {
+                        uint64_t packed;
+                        if (v3d_qpu_instr_pack(&devinfo, &instrs[i], &packed))
+                                checksum ^= packed;
+                }
+        }
+        bench_report(ver, "pack", os_time_get_nano() - start, count);
+
+        start = os_time_get_nano();
+        for (int i = 0; i < CORPUS_SIZE; i++) {
+                const char *disasm = v3d_qpu_disasm(&devinfo, corpus[i]);
+                checksum += disasm[0];
+                ralloc_free((void *)disasm);
+        }
+        bench_report(ver, "disasm", os_time_get_nano() - start, CORPUS_SIZE);
+
+        /* Keep the loops above from being optimized out. */
+        if (checksum == 0)
+                fprintf(stderr, "checksum is 0\n");
+
+        free(instrs);
+        free(corpus);
+}
+
+int
+main(int argc, char **argv)
+{
+        int iterations = argc > 1 ? atoi(argv[1]) : 20;
+        static const int versions[] = { 33, 41, 42 };
+
+        for (int i = 0; i < ARRAY_SIZE(versions); i++)
+                bench_version(versions[i], iterations);
+
+        return 0;
+}
@@ -29,6 +29,7 @@
 #include <vulkan/vulkan_core.h>
 #include "compiler/v3d_compiler.h"
 #include "util/debug.h"
+#include "util/u_cpu_detect.h"
 #include "vulkan/util/vk_util.h"
 #include "common.h"
 #include "device.h"
@@ -285,6 +286,21 @@ VkResult v3dvk_CreateDevice(
    }
    pthread_condattr_destroy(&condattr);
 
+   v3dvk_bo_cache_init(device);
+   for (unsigned i = 0; i < VK_MAX_MEMORY_HEAPS; i++)
+      v3dvk_memory_suballocator_init(&device->suballoc[i]);
+
+   v3dvk_pipeline_cache_init(&device->default_pipeline_cache, device,
+                             device->instance->pipeline_cache_enabled);
+
+   util_cpu_detect();
+   if (!util_queue_init(&device->compile_queue, "v3dvk_compile", 64,
+                        MAX2(util_cpu_caps.nr_cpus, 1),
+                        UTIL_QUEUE_INIT_RESIZE_IF_FULL)) {
+      result = v3dvk_error(device->instance, VK_ERROR_INITIALIZATION_FAILED);
+      goto fail_bo_cache;
+   }
+
 #if 0
    uint64_t bo_flags =
       (physical_device->supports_48bit_addresses ? EXEC_OBJECT_SUPPORTS_48B_ADDRESS : 0) |
@@ -367,7 +383,9 @@ VkResult v3dvk_CreateDevice(
       device->queue_count[qfi] = queue_create->queueCount;
 
       for (unsigned q = 0; q < queue_create->queueCount; q++) {
-         v3dvk_queue_init(device, &device->queues[qfi][q]);
+         result = v3dvk_queue_init(device, &device->queues[qfi][q]);
+         if (result != VK_SUCCESS)
+            goto fail_queues;
       }
    }
 #if 0
@@ -399,8 +417,6 @@ VkResult v3dvk_CreateDevice(
    if (result != VK_SUCCESS)
       goto fail_workaround_bo;
 
-   anv_pipeline_cache_init(&device->default_pipeline_cache, device, true);
-
    anv_device_init_blorp(device);
 
    anv_device_init_border_colors(device);
@@ -445,10 +461,12 @@ VkResult v3dvk_CreateDevice(
 #if 0
    anv_state_pool_finish(&device->dynamic_state_pool);
 #endif
+   util_queue_destroy(&device->compile_queue);
  fail_bo_cache:
-#if 0
-   anv_bo_cache_finish(&device->bo_cache);
-#endif
+   v3dvk_pipeline_cache_finish(&device->default_pipeline_cache);
+   for (unsigned i = 0; i < VK_MAX_MEMORY_HEAPS; i++)
+      v3dvk_memory_suballocator_finish(device, &device->suballoc[i]);
+   v3dvk_bo_cache_finish(device);
  fail_batch_bo_pool:
 #if 0
    anv_bo_pool_finish(&device->batch_bo_pool);
@@ -481,8 +499,6 @@ void v3dvk_DestroyDevice(
    physical_device = &device->instance->physicalDevice;
 #if 0
    anv_device_finish_blorp(device);
-
-   anv_pipeline_cache_finish(&device->default_pipeline_cache);
 #endif
 
    for (unsigned i = 0; i < V3DVK_MAX_QUEUE_FAMILIES; i++) {
@@ -509,6 +525,7 @@ void v3dvk_DestroyDevice(
    anv_vma_free(device, &device->trivial_batch_bo);
    anv_gem_close(device, device->trivial_batch_bo.gem_handle);
 #endif
+   util_queue_destroy(&device->compile_queue);
    v3d_compiler_free(device->compiler);
 #if 0
    if (device->info.gen >= 10)
@@ -520,10 +537,12 @@ void v3dvk_DestroyDevice(
    anv_state_pool_finish(&device->instruction_state_pool);
    anv_state_pool_finish(&device->dynamic_state_pool);
 
-   anv_bo_cache_finish(&device->bo_cache);
-
    anv_bo_pool_finish(&device->batch_bo_pool);
 #endif
+   v3dvk_pipeline_cache_finish(&device->default_pipeline_cache);
+   for (unsigned i = 0; i < VK_MAX_MEMORY_HEAPS; i++)
+      v3dvk_memory_suballocator_finish(device, &device->suballoc[i]);
+   v3dvk_bo_cache_finish(device);
    pthread_cond_destroy(&device->queue_submit);
    pthread_mutex_destroy(&device->mutex);
 #if 0
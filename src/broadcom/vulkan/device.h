@@ -31,7 +31,10 @@
 
 #include "common/v3d_device_info.h"
 #include "util/macros.h"
+#include "v3dvk_bo.h"
 #include "v3dvk_entrypoints.h"
+#include "v3dvk_memory.h"
+#include "v3dvk_pipeline_cache.h"
 #include "v3dvk_queue.h"
 
 struct v3d_compiler;
@@ -51,6 +54,18 @@ struct v3dvk_device {
     struct v3dvk_queue* queues[V3DVK_MAX_QUEUE_FAMILIES];
     int queue_count[V3DVK_MAX_QUEUE_FAMILIES];
 
+    struct v3dvk_bo_cache                       bo_cache;
+    uint32_t                                    bo_count;
+    uint64_t                                    bo_size;
+
+    struct v3dvk_memory_suballocator            suballoc[VK_MAX_MEMORY_HEAPS];
+
+    /* Used for pipelines created without a VkPipelineCache. */
+    struct v3dvk_pipeline_cache                 default_pipeline_cache;
+
+    /* Threads that the shader compiles of vkCreate*Pipelines() run on. */
+    struct util_queue                           compile_queue;
+
     pthread_mutex_t                             mutex;
     pthread_cond_t                              queue_submit;
     bool                                        _lost;
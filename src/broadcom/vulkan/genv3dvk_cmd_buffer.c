@@ -301,6 +301,16 @@ v3dvk_BeginCommandBuffer(
    return result;
 }
 
+VkResult
+v3dvk_EndCommandBuffer(
+    VkCommandBuffer                             commandBuffer)
+{
+   /* Nothing is recorded into the CLs yet, so there is nothing to
+    * terminate: a command buffer without an RCL is skipped at submit.
+    */
+   return VK_SUCCESS;
+}
+
 void
 v3dvk_cmd_buffer_flush_state(struct v3dvk_cmd_buffer *cmd_buffer)
 {
@@ -4,6 +4,7 @@
 #include "compiler/glsl_types.h"
 #include "device.h"
 #include "instance.h"
+#include "util/debug.h"
 #include "util/strtod.h"
 #include "vk_alloc.h"
 #include "vk_debug_report.h"
@@ -166,8 +167,8 @@ VkResult v3dvk_CreateInstance(
       return vk_error(result);
    }
 
-   // TODO: Implement pipeline cache
-   instance->pipeline_cache_enabled = false;
+   instance->pipeline_cache_enabled =
+      env_var_as_boolean("V3DVK_ENABLE_PIPELINE_CACHE", true);
 
    _mesa_locale_init();
    glsl_type_singleton_init_or_ref();
@@ -0,0 +1,116 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Shared setup for the v3dvk CPU benchmarks.  These call the driver
+ * entrypoints directly and are meant to be run against the v3d noop
+ * drm-shim, so they don't need real hardware:
+ *
+ *    LD_PRELOAD=libv3d_noop_drm_shim.so ./v3dvk_..._bench
+ */
+
+#ifndef V3DVK_BENCH_H
+#define V3DVK_BENCH_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util/os_time.h"
+#include "v3dvk_entrypoints.h"
+
+/* Exit code meson treats as a skipped test. */
+#define V3DVK_BENCH_SKIP 77
+
+static inline int
+v3dvk_bench_create_device(VkInstance *instance, VkDevice *device)
+{
+   VkPhysicalDevice physical_device;
+   uint32_t count = 1;
+
+   const VkApplicationInfo app_info = {
+      .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+      .apiVersion = VK_API_VERSION_1_1,
+   };
+   const VkInstanceCreateInfo instance_info = {
+      .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+      .pApplicationInfo = &app_info,
+   };
+   if (v3dvk_CreateInstance(&instance_info, NULL, instance) != VK_SUCCESS ||
+       v3dvk_EnumeratePhysicalDevices(*instance, &count,
+                                      &physical_device) != VK_SUCCESS ||
+       count == 0) {
+      fprintf(stderr, "no v3d device, is the drm-shim preloaded?\n");
+      return V3DVK_BENCH_SKIP;
+   }
+
+   const float priority = 1.0f;
+   const VkDeviceQueueCreateInfo queue_info = {
+      .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+      .queueFamilyIndex = 0,
+      .queueCount = 1,
+      .pQueuePriorities = &priority,
+   };
+   const VkDeviceCreateInfo device_info = {
+      .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+      .queueCreateInfoCount = 1,
+      .pQueueCreateInfos = &queue_info,
+   };
+   if (v3dvk_CreateDevice(physical_device, &device_info, NULL,
+                          device) != VK_SUCCESS) {
+      fprintf(stderr, "failed to create device\n");
+      v3dvk_DestroyInstance(*instance, NULL);
+      return 1;
+   }
+
+   return 0;
+}
+
+static inline void
+v3dvk_bench_destroy_device(VkInstance instance, VkDevice device)
+{
+   v3dvk_DestroyDevice(device, NULL);
+   v3dvk_DestroyInstance(instance, NULL);
+}
+
+/* Prints one result as a line of JSON, so that CI can parse and track the
+ * numbers across runs.
+ */
+static inline void
+v3dvk_bench_report(const char *bench, const char *workload,
+                   uint64_t calls, int64_t elapsed_ns)
+{
+   printf("{\"bench\": \"%s\", \"workload\": \"%s\", "
+          "\"calls\": %" PRIu64 ", \"ns_per_call\": %.1f}\n",
+          bench, workload, calls, (double)elapsed_ns / calls);
+   fflush(stdout);
+}
+
+/* Small deterministic PRNG, so that runs are comparable. */
+static inline uint32_t
+v3dvk_bench_rand(uint32_t *seed)
+{
+   *seed = *seed * 1103515245 + 12345;
+   return *seed >> 8;
+}
+
+#endif /* V3DVK_BENCH_H */
@@ -0,0 +1,111 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Measures the CPU cost of tracking the BOs referenced by each draw in a
+ * command buffer.
+ */
+
+#include "util/macros.h"
+#include "device.h"
+#include "v3dvk_bo.h"
+#include "v3dvk_cmd_buffer.h"
+#include "v3dvk_bench.h"
+
+#define NUM_BOS        1024
+#define BOS_PER_DRAW   12
+#define DRAWS_PER_CMD  1000
+#define NUM_CMDS       200
+
+int
+main(void)
+{
+   VkInstance instance;
+   VkDevice _device;
+   VkCommandPool pool;
+   VkCommandBuffer cmd;
+
+   int ret = v3dvk_bench_create_device(&instance, &_device);
+   if (ret)
+      return ret;
+   V3DVK_FROM_HANDLE(v3dvk_device, device, _device);
+
+   const VkCommandPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+   };
+   v3dvk_CreateCommandPool(_device, &pool_info, NULL, &pool);
+
+   const VkCommandBufferAllocateInfo cmd_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = pool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = 1,
+   };
+   v3dvk_AllocateCommandBuffers(_device, &cmd_info, &cmd);
+   V3DVK_FROM_HANDLE(v3dvk_cmd_buffer, cmd_buffer, cmd);
+
+   struct v3dvk_bo *bos = calloc(NUM_BOS, sizeof(*bos));
+   for (unsigned i = 0; i < NUM_BOS; i++) {
+      if (v3dvk_bo_init_new(device, &bos[i], 4096, "bench") != VK_SUCCESS) {
+         fprintf(stderr, "failed to create BO %u\n", i);
+         return 1;
+      }
+   }
+
+   const VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+   };
+
+   /* Each draw references a few BOs that every draw shares (CL, shader and
+    * uniform BOs), plus randomly picked per-draw ones (descriptors and
+    * vertex buffers), so both the hit and the miss paths get exercised.
+    */
+   uint32_t seed = 1;
+   int64_t start = os_time_get_nano();
+   for (unsigned c = 0; c < NUM_CMDS; c++) {
+      v3dvk_BeginCommandBuffer(cmd, &begin_info);
+      for (unsigned d = 0; d < DRAWS_PER_CMD; d++) {
+         for (unsigned b = 0; b < BOS_PER_DRAW; b++) {
+            unsigned idx = b < 4 ? b : v3dvk_bench_rand(&seed) % NUM_BOS;
+            v3dvk_cmd_buffer_add_bo(cmd_buffer, &bos[idx]);
+         }
+      }
+   }
+   int64_t elapsed = os_time_get_nano() - start;
+
+   printf("%u draws, %u BOs per draw, %u unique BOs in last command buffer\n",
+          NUM_CMDS * DRAWS_PER_CMD, BOS_PER_DRAW,
+          cmd_buffer->submit.bo_handle_count);
+   printf("%.1f ns per draw\n",
+          (double)elapsed / (NUM_CMDS * DRAWS_PER_CMD));
+
+   for (unsigned i = 0; i < NUM_BOS; i++)
+      v3dvk_bo_finish(device, &bos[i]);
+   free(bos);
+
+   v3dvk_FreeCommandBuffers(_device, pool, 1, &cmd);
+   v3dvk_DestroyCommandPool(_device, pool, NULL);
+   v3dvk_bench_destroy_device(instance, _device);
+
+   return 0;
+}
@@ -0,0 +1,364 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+/* Measures the CPU cost of the driver's hot paths on synthetic workloads.
+ * The noop drm-shim completes every job immediately, so the numbers only
+ * cover the work done on the CPU:
+ *
+ *  - record: command buffers with many render passes and pipeline binds.
+ *  - update_descriptors: vkUpdateDescriptorSets() on many buffer bindings.
+ *  - submit: lots of small vkQueueSubmit() calls, both the time the
+ *    application spends in the call and the time until the queue is idle.
+ *
+ * Each workload prints one JSON line, see v3dvk_bench_report().
+ */
+
+#include "util/macros.h"
+#include "v3dvk_bench.h"
+
+#define PASSES_PER_CMD     64
+#define BINDS_PER_PASS     32
+#define RECORD_CMDS        2000
+
+#define NUM_BUFFERS        256
+#define NUM_SETS           512
+#define UBOS_PER_SET       8
+#define SSBOS_PER_SET      4
+#define DESCRIPTOR_UPDATES 200000
+
+#define SUBMIT_CMDS        4
+#define NUM_SUBMITS        100000
+
+static VkRenderPass
+create_render_pass(VkDevice device)
+{
+   VkRenderPass pass;
+
+   const VkSubpassDescription subpass = {
+      .pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+   };
+   const VkRenderPassCreateInfo pass_info = {
+      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
+      .subpassCount = 1,
+      .pSubpasses = &subpass,
+   };
+   if (v3dvk_CreateRenderPass(device, &pass_info, NULL, &pass) != VK_SUCCESS)
+      return VK_NULL_HANDLE;
+
+   return pass;
+}
+
+static void
+record_render_passes(VkCommandBuffer cmd, VkRenderPass pass,
+                     unsigned pass_count, unsigned binds_per_pass)
+{
+   const VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+   };
+   const VkRenderPassBeginInfo pass_begin_info = {
+      .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+      .renderPass = pass,
+      .renderArea = { .extent = { 1920, 1080 } },
+   };
+
+   v3dvk_BeginCommandBuffer(cmd, &begin_info);
+   for (unsigned p = 0; p < pass_count; p++) {
+      v3dvk_CmdBeginRenderPass(cmd, &pass_begin_info,
+                               VK_SUBPASS_CONTENTS_INLINE);
+      for (unsigned b = 0; b < binds_per_pass; b++) {
+         v3dvk_CmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                               VK_NULL_HANDLE);
+      }
+      v3dvk_CmdEndRenderPass(cmd);
+   }
+   v3dvk_EndCommandBuffer(cmd);
+}
+
+/* Records the same command buffer over and over, so that after the first
+ * iteration its CL chunks come back from the pool.
+ */
+static int
+bench_record(VkDevice device, VkCommandPool pool, VkRenderPass pass)
+{
+   VkCommandBuffer cmd;
+
+   const VkCommandBufferAllocateInfo cmd_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = pool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = 1,
+   };
+   if (v3dvk_AllocateCommandBuffers(device, &cmd_info, &cmd) != VK_SUCCESS)
+      return 1;
+
+   int64_t start = os_time_get_nano();
+   for (unsigned c = 0; c < RECORD_CMDS; c++)
+      record_render_passes(cmd, pass, PASSES_PER_CMD, BINDS_PER_PASS);
+   int64_t elapsed = os_time_get_nano() - start;
+
+   /* Begin and end, plus begin/end and the binds of every render pass. */
+   uint64_t calls = (uint64_t)RECORD_CMDS *
+                    (2 + PASSES_PER_CMD * (2 + BINDS_PER_PASS));
+   v3dvk_bench_report("cpu_overhead", "record", calls, elapsed);
+
+   v3dvk_FreeCommandBuffers(device, pool, 1, &cmd);
+   return 0;
+}
+
+static int
+bench_update_descriptors(VkDevice device)
+{
+   VkDeviceMemory mem;
+   VkBuffer buffers[NUM_BUFFERS];
+   VkDescriptorSetLayout layout;
+   VkDescriptorPool pool;
+   VkDescriptorSet *sets;
+
+   const VkMemoryAllocateInfo mem_info = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+      .allocationSize = NUM_BUFFERS * 256,
+      .memoryTypeIndex = 0,
+   };
+   if (v3dvk_AllocateMemory(device, &mem_info, NULL, &mem) != VK_SUCCESS)
+      return 1;
+
+   const VkBufferCreateInfo buffer_info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+      .size = 256,
+      .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+   };
+   for (unsigned i = 0; i < NUM_BUFFERS; i++) {
+      if (v3dvk_CreateBuffer(device, &buffer_info, NULL,
+                             &buffers[i]) != VK_SUCCESS)
+         return 1;
+      v3dvk_BindBufferMemory(device, buffers[i], mem, i * 256);
+   }
+
+   const VkDescriptorSetLayoutBinding bindings[] = {
+      {
+         .binding = 0,
+         .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         .descriptorCount = UBOS_PER_SET,
+         .stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS,
+      },
+      {
+         .binding = 1,
+         .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+         .descriptorCount = SSBOS_PER_SET,
+         .stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS,
+      },
+   };
+   const VkDescriptorSetLayoutCreateInfo layout_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+      .bindingCount = ARRAY_SIZE(bindings),
+      .pBindings = bindings,
+   };
+   if (v3dvk_CreateDescriptorSetLayout(device, &layout_info, NULL,
+                                       &layout) != VK_SUCCESS)
+      return 1;
+
+   const VkDescriptorPoolSize pool_sizes[] = {
+      {
+         .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         .descriptorCount = NUM_SETS * UBOS_PER_SET,
+      },
+      {
+         .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+         .descriptorCount = NUM_SETS * SSBOS_PER_SET,
+      },
+   };
+   const VkDescriptorPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .maxSets = NUM_SETS,
+      .poolSizeCount = ARRAY_SIZE(pool_sizes),
+      .pPoolSizes = pool_sizes,
+   };
+   if (v3dvk_CreateDescriptorPool(device, &pool_info, NULL,
+                                  &pool) != VK_SUCCESS)
+      return 1;
+
+   sets = calloc(NUM_SETS, sizeof(*sets));
+   for (unsigned i = 0; i < NUM_SETS; i++) {
+      const VkDescriptorSetAllocateInfo alloc_info = {
+         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+         .descriptorPool = pool,
+         .descriptorSetCount = 1,
+         .pSetLayouts = &layout,
+      };
+      if (v3dvk_AllocateDescriptorSets(device, &alloc_info,
+                                       &sets[i]) != VK_SUCCESS)
+         return 1;
+   }
+
+   /* Like an application that rewrites a set for every draw, each update
+    * points all bindings of a random set at random buffers.
+    */
+   VkDescriptorBufferInfo ubo_infos[UBOS_PER_SET];
+   VkDescriptorBufferInfo ssbo_infos[SSBOS_PER_SET];
+   VkWriteDescriptorSet writes[] = {
+      {
+         .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+         .dstBinding = 0,
+         .descriptorCount = UBOS_PER_SET,
+         .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         .pBufferInfo = ubo_infos,
+      },
+      {
+         .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+         .dstBinding = 1,
+         .descriptorCount = SSBOS_PER_SET,
+         .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+         .pBufferInfo = ssbo_infos,
+      },
+   };
+
+   uint32_t seed = 1;
+   int64_t elapsed = 0;
+   for (unsigned i = 0; i < DESCRIPTOR_UPDATES; i++) {
+      VkDescriptorSet set = sets[v3dvk_bench_rand(&seed) % NUM_SETS];
+      for (unsigned j = 0; j < UBOS_PER_SET; j++) {
+         ubo_infos[j] = (VkDescriptorBufferInfo) {
+            .buffer = buffers[v3dvk_bench_rand(&seed) % NUM_BUFFERS],
+            .range = VK_WHOLE_SIZE,
+         };
+      }
+      for (unsigned j = 0; j < SSBOS_PER_SET; j++) {
+         ssbo_infos[j] = (VkDescriptorBufferInfo) {
+            .buffer = buffers[v3dvk_bench_rand(&seed) % NUM_BUFFERS],
+            .range = VK_WHOLE_SIZE,
+         };
+      }
+      writes[0].dstSet = set;
+      writes[1].dstSet = set;
+
+      /* Only time the driver, not the PRNG. */
+      int64_t start = os_time_get_nano();
+      v3dvk_UpdateDescriptorSets(device, ARRAY_SIZE(writes), writes, 0, NULL);
+      elapsed += os_time_get_nano() - start;
+   }
+   v3dvk_bench_report("cpu_overhead", "update_descriptors",
+                      DESCRIPTOR_UPDATES, elapsed);
+
+   free(sets);
+   v3dvk_DestroyDescriptorPool(device, pool, NULL);
+   v3dvk_DestroyDescriptorSetLayout(device, layout, NULL);
+   for (unsigned i = 0; i < NUM_BUFFERS; i++)
+      v3dvk_DestroyBuffer(device, buffers[i], NULL);
+   v3dvk_FreeMemory(device, mem, NULL);
+   return 0;
+}
+
+static int
+bench_submit(VkDevice device, VkCommandPool pool, VkRenderPass pass)
+{
+   VkCommandBuffer cmds[SUBMIT_CMDS];
+   VkQueue queue;
+
+   v3dvk_GetDeviceQueue(device, 0, 0, &queue);
+
+   const VkCommandBufferAllocateInfo cmd_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+      .commandPool = pool,
+      .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+      .commandBufferCount = SUBMIT_CMDS,
+   };
+   if (v3dvk_AllocateCommandBuffers(device, &cmd_info, cmds) != VK_SUCCESS)
+      return 1;
+
+   for (unsigned i = 0; i < SUBMIT_CMDS; i++)
+      record_render_passes(cmds[i], pass, 1, 1);
+
+   /* One small command buffer per submit, as a streaming application
+    * would do.
+    *
+    * Nothing writes an RCL yet, so the submit thread skips these command
+    * buffers without a SUBMIT_CL: this only measures the handoff to it.
+    */
+   int64_t start = os_time_get_nano();
+   for (unsigned i = 0; i < NUM_SUBMITS; i++) {
+      const VkSubmitInfo submit_info = {
+         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+         .commandBufferCount = 1,
+         .pCommandBuffers = &cmds[i % SUBMIT_CMDS],
+      };
+      if (v3dvk_QueueSubmit(queue, 1, &submit_info,
+                            VK_NULL_HANDLE) != VK_SUCCESS)
+         return 1;
+   }
+   int64_t submitted = os_time_get_nano() - start;
+   v3dvk_QueueWaitIdle(queue);
+   int64_t idle = os_time_get_nano() - start;
+
+   v3dvk_bench_report("cpu_overhead", "submit_handoff", NUM_SUBMITS,
+                      submitted);
+   v3dvk_bench_report("cpu_overhead", "submit_handoff_until_idle",
+                      NUM_SUBMITS, idle);
+
+   v3dvk_FreeCommandBuffers(device, pool, SUBMIT_CMDS, cmds);
+   return 0;
+}
+
+int
+main(void)
+{
+   VkInstance instance;
+   VkDevice device;
+   VkCommandPool pool;
+
+   int ret = v3dvk_bench_create_device(&instance, &device);
+   if (ret)
+      return ret;
+
+   const VkCommandPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+   };
+   v3dvk_CreateCommandPool(device, &pool_info, NULL, &pool);
+
+   VkRenderPass pass = create_render_pass(device);
+   if (pass == VK_NULL_HANDLE) {
+      fprintf(stderr, "failed to create render pass\n");
+      return 1;
+   }
+
+   if (bench_record(device, pool, pass)) {
+      fprintf(stderr, "record workload failed\n");
+      ret = 1;
+   }
+   if (bench_update_descriptors(device)) {
+      fprintf(stderr, "descriptor workload failed\n");
+      ret = 1;
+   }
+   if (bench_submit(device, pool, pass)) {
+      fprintf(stderr, "submit workload failed\n");
+      ret = 1;
+   }
+
+   v3dvk_DestroyRenderPass(device, pass, NULL);
+   v3dvk_DestroyCommandPool(device, pool, NULL);
+   v3dvk_bench_destroy_device(instance, device);
+
+   return ret;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Measures descriptor set allocation throughput in a
+ * FREE_DESCRIPTOR_SET pool with thousands of live sets of mixed sizes, once
+ * the bump allocator is exhausted and every allocation has to reuse a hole
+ * left by a freed set.
+ */
+
+#include "util/macros.h"
+#include "v3dvk_bench.h"
+
+#define MAX_SETS      8192
+#define LIVE_SETS     6000
+#define ITERATIONS    1000000
+
+static const uint32_t set_sizes[] = { 1, 2, 3, 5, 8 };
+
+int
+main(void)
+{
+   VkInstance instance;
+   VkDevice device;
+   VkDescriptorSetLayout layouts[ARRAY_SIZE(set_sizes)];
+   VkDescriptorPool pool;
+
+   int ret = v3dvk_bench_create_device(&instance, &device);
+   if (ret)
+      return ret;
+
+   uint32_t max_size = 0;
+   for (unsigned i = 0; i < ARRAY_SIZE(set_sizes); i++) {
+      const VkDescriptorSetLayoutBinding binding = {
+         .binding = 0,
+         .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+         .descriptorCount = set_sizes[i],
+         .stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS,
+      };
+      const VkDescriptorSetLayoutCreateInfo layout_info = {
+         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+         .bindingCount = 1,
+         .pBindings = &binding,
+      };
+      v3dvk_CreateDescriptorSetLayout(device, &layout_info, NULL, &layouts[i]);
+      max_size = MAX2(max_size, set_sizes[i]);
+   }
+
+   /* Sized so that the live sets fill most of the pool. */
+   const VkDescriptorPoolSize pool_size = {
+      .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+      .descriptorCount = LIVE_SETS * 4,
+   };
+   const VkDescriptorPoolCreateInfo pool_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+      .flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+      .maxSets = MAX_SETS,
+      .poolSizeCount = 1,
+      .pPoolSizes = &pool_size,
+   };
+   if (v3dvk_CreateDescriptorPool(device, &pool_info, NULL,
+                                  &pool) != VK_SUCCESS) {
+      fprintf(stderr, "failed to create descriptor pool\n");
+      return 1;
+   }
+
+   VkDescriptorSet *sets = calloc(LIVE_SETS, sizeof(*sets));
+   uint32_t seed = 1;
+
+   for (unsigned i = 0; i < LIVE_SETS; i++) {
+      VkDescriptorSetAllocateInfo alloc_info = {
+         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+         .descriptorPool = pool,
+         .descriptorSetCount = 1,
+         .pSetLayouts = &layouts[i % ARRAY_SIZE(set_sizes)],
+      };
+      if (v3dvk_AllocateDescriptorSets(device, &alloc_info,
+                                       &sets[i]) != VK_SUCCESS) {
+         fprintf(stderr, "initial allocation %u failed\n", i);
+         return 1;
+      }
+   }
+
+   /* Replace a random live set with one of a random size.  Allocations
+    * that don't fit anywhere are counted, but are not an error since the
+    * pool can legitimately get fragmented.
+    */
+   unsigned failures = 0;
+   int64_t start = os_time_get_nano();
+   for (unsigned i = 0; i < ITERATIONS; i++) {
+      unsigned victim = v3dvk_bench_rand(&seed) % LIVE_SETS;
+      unsigned layout = v3dvk_bench_rand(&seed) % ARRAY_SIZE(set_sizes);
+
+      if (sets[victim] != VK_NULL_HANDLE)
+         v3dvk_FreeDescriptorSets(device, pool, 1, &sets[victim]);
+
+      VkDescriptorSetAllocateInfo alloc_info = {
+         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+         .descriptorPool = pool,
+         .descriptorSetCount = 1,
+         .pSetLayouts = &layouts[layout],
+      };
+      if (v3dvk_AllocateDescriptorSets(device, &alloc_info,
+                                       &sets[victim]) != VK_SUCCESS)
+         failures++;
+   }
+   int64_t elapsed = os_time_get_nano() - start;
+
+   printf("%u live sets, %u free/allocate pairs, %u failed allocations\n",
+          LIVE_SETS, ITERATIONS, failures);
+   printf("%.0f allocations per second\n",
+          ITERATIONS / (elapsed / 1e9));
+
+   free(sets);
+   v3dvk_DestroyDescriptorPool(device, pool, NULL);
+   for (unsigned i = 0; i < ARRAY_SIZE(set_sizes); i++)
+      v3dvk_DestroyDescriptorSetLayout(device, layouts[i], NULL);
+   v3dvk_bench_destroy_device(instance, device);
+
+   return 0;
+}
@@ -1,8 +1,13 @@
 
+#include <stdio.h>
+#include <stdlib.h>
+
 #include "device.h"
 #include "v3d_cl.inl"
 #include "common/v3d_macros.h"
 #include "cle/v3d_packet_v42_pack.h"
+#include "util/u_math.h"
+#include "v3dvk_cmd_pool.h"
 #include "vk_alloc.h"
 
 
@@ -12,53 +17,115 @@ v3d_init_cl(struct v3dvk_cmd_buffer *cmd, struct v3d_cl *cl)
    cl->base = NULL;
    cl->next = cl->base;
    cl->size = 0;
+   cl->bo = NULL;
+   cl->start = 0;
    cl->cmd = cmd;
 }
 
+/* Returns a mapped chunk of at least @size bytes, preferably one the command
+ * pool has already recycled.  Chunks only return to the pool once their
+ * command buffer has been reset, at which point the application guarantees
+ * that the GPU is done with them, so they never need to be waited on.
+ */
+static struct v3d_cl_chunk *
+v3d_cl_get_chunk(struct v3dvk_cmd_buffer *cmd, uint32_t size)
+{
+   struct v3dvk_device *dev = cmd->device;
+   struct v3d_cl_chunk *chunk = NULL;
+
+   if (cmd->pool) {
+      list_for_each_entry(struct v3d_cl_chunk, entry,
+                          &cmd->pool->free_cl_chunks, link) {
+         if (entry->bo.size >= size) {
+            chunk = entry;
+            list_del(&chunk->link);
+            break;
+         }
+      }
+   }
+
+   if (!chunk) {
+      chunk = vk_alloc(&dev->alloc, sizeof(*chunk), 8,
+                       VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+      if (!chunk)
+         return NULL;
+
+      if (v3dvk_bo_init_new(dev, &chunk->bo, size, "CL") != VK_SUCCESS) {
+         vk_free(&dev->alloc, chunk);
+         return NULL;
+      }
+
+      v3dvk_bo_map_unsynchronized(&chunk->bo);
+   }
+
+   list_addtail(&chunk->link, &cmd->cl_chunks);
+   v3dvk_cmd_buffer_add_bo(cmd, &chunk->bo);
+
+   return chunk;
+}
+
 void
 v3d_cl_ensure_space_with_branch(struct v3d_cl *cl, uint32_t space)
 {
    if (cl_offset(cl) + space + cl_packet_length(BRANCH) <= cl->size)
       return;
 
-   struct v3dvk_bo *new_bo = vk_alloc2(&cl->cmd->device->alloc, NULL, sizeof(*new_bo), 8,
-      VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
-
-   if (!new_bo)
-      return; // FIXME: Handle this properly
-
-        VkResult result = v3dvk_bo_init_new(cl->cmd->device, new_bo, space, "CL");
-        if (result != VK_SUCCESS) {
-           // FIXME: Properly handle this
-           assert(false);
-        }
-
-        assert(space <= new_bo->size);
-
-        /* Chain to the new BO from the old one. */
-        if (cl->bo) {
-                cl_emit(cl, BRANCH, branch) {
-                        branch.address = cl_address(new_bo, 0);
-                }
-#if 0
-                v3d_bo_unreference(&cl->bo);
-#endif
-        } else {
-                /* Root the first RCL/BCL BO in the job. */
-                v3dvk_cmd_buffer_add_bo(cl->cmd, cl->bo);
-        }
-
-        cl->bo = new_bo;
-        v3dvk_bo_map(cl->bo);
-        cl->base = cl->bo->map;
-        cl->size = cl->bo->size;
-        cl->next = cl->base;
+   uint32_t size = CLAMP(cl->size * 2,
+                         V3D_CL_MIN_CHUNK_SIZE, V3D_CL_MAX_CHUNK_SIZE);
+   size = MAX2(size, align(space + cl_packet_length(BRANCH), 4096));
+
+   struct v3d_cl_chunk *chunk = v3d_cl_get_chunk(cl->cmd, size);
+   if (!chunk) {
+      fprintf(stderr, "Failed to allocate %u bytes of CL\n", size);
+      abort();
+   }
+
+   /* Chain to the new BO from the old one. */
+   if (cl->bo) {
+      cl_emit(cl, BRANCH, branch) {
+         branch.address = cl_address(&chunk->bo, 0);
+      }
+   } else {
+      cl->start = chunk->bo.offset;
+   }
+
+   cl->bo = &chunk->bo;
+   cl->base = cl->bo->map;
+   cl->size = cl->bo->size;
+   cl->next = cl->base;
 }
 
 void
 v3d_destroy_cl(struct v3d_cl *cl)
 {
-#if 0
-   v3d_bo_unreference(&cl->bo);
-#endif
+   /* The chunks belong to the command buffer and are released with it. */
+   cl->bo = NULL;
+   cl->base = NULL;
+   cl->next = NULL;
+   cl->size = 0;
+   cl->start = 0;
+}
+
+/* Hands all of a command buffer's CL chunks back to its pool, or frees them
+ * if the command buffer doesn't have one.
+ */
+void
+v3d_cl_release_chunks(struct v3dvk_cmd_buffer *cmd)
+{
+   if (cmd->pool)
+      list_splice(&cmd->cl_chunks, &cmd->pool->free_cl_chunks);
+   else
+      v3d_cl_free_chunks(cmd->device, &cmd->cl_chunks);
+
+   list_inithead(&cmd->cl_chunks);
+}
+
+void
+v3d_cl_free_chunks(struct v3dvk_device *dev, struct list_head *chunks)
+{
+   list_for_each_entry_safe(struct v3d_cl_chunk, chunk, chunks, link) {
+      list_del(&chunk->link);
+      v3dvk_bo_finish(dev, &chunk->bo);
+      vk_free(&dev->alloc, chunk);
+   }
 }
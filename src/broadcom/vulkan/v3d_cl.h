@@ -25,6 +25,7 @@
 #define VC5_CL_H
 
 #include <stdint.h>
+#include "util/list.h"
 #include "v3dvk_bo.h"
 
 #include "broadcom/cle/v3d_packet_helpers.h"
@@ -63,17 +64,39 @@ static inline void cl_pack_emit_reloc(struct v3d_cl *cl, const struct v3d_cl_rel
 #define __gen_emit_reloc cl_pack_emit_reloc
 #define __gen_unpack_address(cl, s, e) __unpack_address(cl, s, e)
 
+/* Chunks grow geometrically from the minimum size as a CL overflows, so
+ * that long CLs don't need a branch every few packets.
+ */
+#define V3D_CL_MIN_CHUNK_SIZE (4 * 1024)
+#define V3D_CL_MAX_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * A BO backing part of a CL.  Chunks are owned by the command pool: they are
+ * handed to a command buffer while it records, and go back to the pool's
+ * free list when the command buffer is reset, already mapped for the next
+ * user.
+ */
+struct v3d_cl_chunk {
+        struct list_head link;
+        struct v3dvk_bo bo;
+};
+
 struct v3d_cl {
         void *base;
         struct v3dvk_cmd_buffer *cmd;
         struct v3d_cl_out *next;
         struct v3dvk_bo *bo;
         uint32_t size;
+        /** GPU address of the first packet, where execution starts. */
+        uint32_t start;
 };
 
 void v3d_init_cl(struct v3dvk_cmd_buffer *cmd, struct v3d_cl *cl);
 void v3d_destroy_cl(struct v3d_cl *cl);
 
+void v3d_cl_release_chunks(struct v3dvk_cmd_buffer *cmd);
+void v3d_cl_free_chunks(struct v3dvk_device *dev, struct list_head *chunks);
+
 void v3d_cl_ensure_space_with_branch(struct v3d_cl *cl, uint32_t size);
 
 #define cl_packet_header(packet) V3D42_ ## packet ## _header
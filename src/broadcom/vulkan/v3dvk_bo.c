@@ -8,8 +8,11 @@
 #include <xf86drm.h>
 #include <drm-uapi/v3d_drm.h>
 #include <vulkan/vulkan.h>
+#include "util/u_atomic.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
+#include "vulkan/util/vk_alloc.h"
+#include "common/v3d_debug.h"
 #include "common.h"
 #include "instance.h"
 #include "device.h"
@@ -24,8 +27,236 @@
 #define VG(x)
 #endif
 
-// FIXME: Disable this once we are more stable
-static bool dump_stats = true;
+static bool
+v3dvk_bo_wait(const struct v3dvk_bo *bo, uint64_t timeout_ns, const char *reason);
+
+static void
+v3dvk_bo_cache_dump_stats(struct v3dvk_device *dev)
+{
+   struct v3dvk_bo_cache *cache = &dev->bo_cache;
+
+   fprintf(stderr, "  BOs allocated:   %d\n", dev->bo_count);
+   fprintf(stderr, "  BOs size:        %llukb\n",
+           (unsigned long long)dev->bo_size / 1024);
+   fprintf(stderr, "  BOs cached:      %d\n", cache->cached_count);
+   fprintf(stderr, "  BOs cached size: %llukb\n",
+           (unsigned long long)cache->cached_size / 1024);
+   fprintf(stderr, "  cache hits:      %llu\n",
+           (unsigned long long)cache->stats.hits);
+   fprintf(stderr, "  cache misses:    %llu\n",
+           (unsigned long long)cache->stats.misses);
+   fprintf(stderr, "  cache evictions: %llu\n",
+           (unsigned long long)cache->stats.evictions);
+}
+
+static time_t
+v3dvk_bo_cache_time(void)
+{
+   struct timespec time;
+   clock_gettime(CLOCK_MONOTONIC, &time);
+   return time.tv_sec;
+}
+
+/* Releases the kernel object and CPU mapping behind a BO. */
+static void
+v3dvk_bo_free(struct v3dvk_device *dev, struct v3dvk_bo *bo)
+{
+   if (bo->map) {
+      munmap(bo->map, bo->size);
+      VG(VALGRIND_FREELIKE_BLOCK(bo->map, 0));
+      bo->map = NULL;
+   }
+
+   v3dvk_gem_close(dev, bo->handle);
+
+   p_atomic_dec(&dev->bo_count);
+   p_atomic_add(&dev->bo_size, -(int64_t)bo->size);
+}
+
+static void
+v3dvk_bo_remove_from_cache(struct v3dvk_bo_cache *cache, struct v3dvk_bo *bo)
+{
+   list_del(&bo->time_list);
+   list_del(&bo->size_list);
+   cache->cached_count--;
+   cache->cached_size -= bo->size;
+}
+
+/* Frees cache entries that have gone unused for more than a couple of
+ * seconds.  Must be called with the cache lock held.
+ */
+static void
+v3dvk_bo_cache_free_stale(struct v3dvk_device *dev, time_t time)
+{
+   struct v3dvk_bo_cache *cache = &dev->bo_cache;
+
+   list_for_each_entry_safe(struct v3dvk_bo, entry, &cache->time_list,
+                            time_list) {
+      if (time - entry->free_time <= 2)
+         break;
+
+      v3dvk_bo_remove_from_cache(cache, entry);
+      v3dvk_bo_free(dev, entry);
+      vk_free(&dev->alloc, entry);
+      cache->stats.evictions++;
+   }
+}
+
+static void
+v3dvk_bo_cache_free_all(struct v3dvk_device *dev)
+{
+   struct v3dvk_bo_cache *cache = &dev->bo_cache;
+
+   pthread_mutex_lock(&cache->lock);
+   list_for_each_entry_safe(struct v3dvk_bo, entry, &cache->time_list,
+                            time_list) {
+      v3dvk_bo_remove_from_cache(cache, entry);
+      v3dvk_bo_free(dev, entry);
+      vk_free(&dev->alloc, entry);
+   }
+   pthread_mutex_unlock(&cache->lock);
+}
+
+/* Fills in @bo from an idle cached BO of exactly @size bytes, returning
+ * false if there is none.
+ */
+static bool
+v3dvk_bo_from_cache(struct v3dvk_device *dev, struct v3dvk_bo *bo,
+                    uint32_t size, const char *name)
+{
+   struct v3dvk_bo_cache *cache = &dev->bo_cache;
+   uint32_t page_index = size / 4096 - 1;
+   bool found = false;
+
+   pthread_mutex_lock(&cache->lock);
+   if (page_index < cache->size_list_size &&
+       !list_is_empty(&cache->size_list[page_index])) {
+      struct v3dvk_bo *entry =
+         list_first_entry(&cache->size_list[page_index],
+                          struct v3dvk_bo, size_list);
+
+      /* Check that the BO has gone idle.  If not, then we want to
+       * allocate something new instead, since we assume that the
+       * user will proceed to CPU map it and fill it with stuff.
+       */
+      if (v3dvk_bo_wait(entry, 0, NULL)) {
+         v3dvk_bo_remove_from_cache(cache, entry);
+         *bo = *entry;
+         bo->name = name;
+         vk_free(&dev->alloc, entry);
+         found = true;
+      }
+   }
+
+   if (found)
+      cache->stats.hits++;
+   else
+      cache->stats.misses++;
+   pthread_mutex_unlock(&cache->lock);
+
+   return found;
+}
+
+/* Hands a private BO to the cache.  Returns false if it could not be
+ * cached, in which case the caller still owns it.
+ */
+static bool
+v3dvk_bo_cache_put(struct v3dvk_device *dev, struct v3dvk_bo *bo)
+{
+   struct v3dvk_bo_cache *cache = &dev->bo_cache;
+   uint32_t page_index = bo->size / 4096 - 1;
+
+   struct v3dvk_bo *entry =
+      vk_alloc(&dev->alloc, sizeof(*entry), 8,
+               VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+   if (!entry)
+      return false;
+
+   pthread_mutex_lock(&cache->lock);
+
+   if (cache->size_list_size <= page_index) {
+      struct list_head *new_list =
+         vk_alloc(&dev->alloc,
+                  (page_index + 1) * sizeof(*new_list), 8,
+                  VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+      if (!new_list) {
+         pthread_mutex_unlock(&cache->lock);
+         vk_free(&dev->alloc, entry);
+         return false;
+      }
+
+      /* Move old list contents over (since the array has moved, and
+       * therefore the pointers to the list heads have to change).
+       */
+      for (uint32_t i = 0; i < cache->size_list_size; i++) {
+         struct list_head *old_head = &cache->size_list[i];
+         if (list_is_empty(old_head)) {
+            list_inithead(&new_list[i]);
+         } else {
+            new_list[i].next = old_head->next;
+            new_list[i].prev = old_head->prev;
+            new_list[i].next->prev = &new_list[i];
+            new_list[i].prev->next = &new_list[i];
+         }
+      }
+      for (uint32_t i = cache->size_list_size; i < page_index + 1; i++)
+         list_inithead(&new_list[i]);
+
+      vk_free(&dev->alloc, cache->size_list);
+      cache->size_list = new_list;
+      cache->size_list_size = page_index + 1;
+   }
+
+   time_t time = v3dvk_bo_cache_time();
+
+   *entry = *bo;
+   entry->name = NULL;
+   entry->free_time = time;
+   list_addtail(&entry->size_list, &cache->size_list[page_index]);
+   list_addtail(&entry->time_list, &cache->time_list);
+   cache->cached_count++;
+   cache->cached_size += entry->size;
+
+   v3dvk_bo_cache_free_stale(dev, time);
+
+   pthread_mutex_unlock(&cache->lock);
+
+   return true;
+}
+
+void
+v3dvk_bo_cache_init(struct v3dvk_device *dev)
+{
+   struct v3dvk_bo_cache *cache = &dev->bo_cache;
+
+   memset(cache, 0, sizeof(*cache));
+   list_inithead(&cache->time_list);
+   pthread_mutex_init(&cache->lock, NULL);
+}
+
+void
+v3dvk_bo_cache_finish(struct v3dvk_device *dev)
+{
+   struct v3dvk_bo_cache *cache = &dev->bo_cache;
+
+   if (unlikely(V3D_DEBUG & V3D_DEBUG_PERF)) {
+      fprintf(stderr, "BO cache stats:\n");
+      v3dvk_bo_cache_dump_stats(dev);
+   }
+
+   v3dvk_bo_cache_free_all(dev);
+   vk_free(&dev->alloc, cache->size_list);
+   pthread_mutex_destroy(&cache->lock);
+}
+
+void
+v3dvk_bo_cache_get_stats(struct v3dvk_device *dev,
+                         struct v3dvk_bo_cache_stats *stats)
+{
+   pthread_mutex_lock(&dev->bo_cache.lock);
+   *stats = dev->bo_cache.stats;
+   pthread_mutex_unlock(&dev->bo_cache.lock);
+}
 
 static VkResult
 v3dvk_bo_init(struct v3dvk_bo *bo,
@@ -51,6 +282,9 @@ v3dvk_bo_init_new(struct v3dvk_device *dev, struct v3dvk_bo *bo, uint64_t size,
 
    size = align(size, 4096);
 
+   if (v3dvk_bo_from_cache(dev, bo, size, name))
+      return VK_SUCCESS;
+
    VkResult result = v3dvk_bo_init(bo, name, size);
    if (result != VK_SUCCESS) {
       return result;
@@ -58,22 +292,35 @@ v3dvk_bo_init_new(struct v3dvk_device *dev, struct v3dvk_bo *bo, uint64_t size,
 
    bo->private = true;
 
-   struct drm_v3d_create_bo create = {
+   bool cleared_and_retried = false;
+   struct drm_v3d_create_bo create;
+ retry:
+   create = (struct drm_v3d_create_bo) {
       .flags = 0,
       .size = size
    };
 
    int ret = drmIoctl(dev->fd, DRM_IOCTL_V3D_CREATE_BO, &create);
-   if (ret != 0)
+   if (ret != 0) {
+      /* Give the memory held by the cache back to the kernel and try
+       * once more before failing the allocation.
+       */
+      if (!cleared_and_retried && dev->bo_cache.cached_count) {
+         cleared_and_retried = true;
+         v3dvk_bo_cache_free_all(dev);
+         goto retry;
+      }
+
       fprintf(stderr, "create object %s: %s\n", bo->name, strerror(errno));
+      return vk_error(VK_ERROR_OUT_OF_DEVICE_MEMORY);
+   }
 
    bo->handle = create.handle;
    bo->offset = create.offset;
    bo->dev    = dev;
 
-   if (dump_stats) {
-           fprintf(stderr, "Allocated %s %llukb:\n", bo->name, size / 1024);
-   }
+   p_atomic_inc(&dev->bo_count);
+   p_atomic_add(&dev->bo_size, bo->size);
 
    return VK_SUCCESS;
 }
@@ -81,14 +328,10 @@ v3dvk_bo_init_new(struct v3dvk_device *dev, struct v3dvk_bo *bo, uint64_t size,
 void
 v3dvk_bo_finish(struct v3dvk_device *dev, struct v3dvk_bo *bo)
 {
-        v3dvk_gem_close(dev, bo->handle);
+   if (bo->private && v3dvk_bo_cache_put(dev, bo))
+      return;
 
-        if (dump_stats) {
-                fprintf(stderr, "Freed %s%s%dkb:\n",
-                        bo->name ? bo->name : "",
-                        bo->name ? " " : "",
-                        bo->size / 1024);
-        }
+   v3dvk_bo_free(dev, bo);
 }
 
 static int v3dvk_wait_bo_ioctl(int fd, uint32_t handle, uint64_t timeout_ns)
@@ -127,7 +370,7 @@ v3dvk_bo_wait(const struct v3dvk_bo *bo, uint64_t timeout_ns, const char *reason
    return true;
 }
 
-void
+void *
 v3dvk_bo_map_unsynchronized(struct v3dvk_bo *bo)
 {
    uint64_t offset;
@@ -158,14 +401,16 @@ v3dvk_bo_map_unsynchronized(struct v3dvk_bo *bo)
    return bo->map;
 }
 
-void
+void *
 v3dvk_bo_map(struct v3dvk_bo *bo)
 {
-   v3dvk_bo_map_unsynchronized(bo);
+   void *map = v3dvk_bo_map_unsynchronized(bo);
 
    bool ok = v3dvk_bo_wait(bo, PIPE_TIMEOUT_INFINITE, "bo map");
    if (!ok) {
       fprintf(stderr, "BO wait for map failed\n");
       abort();
    }
+
+   return map;
 }
@@ -24,6 +24,7 @@
 #ifndef V3DVK_BO_H
 #define V3DVK_BO_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
@@ -59,16 +60,53 @@ struct v3dvk_bo {
 };
 
 
+/**
+ * Cache of idle, private BOs that can be handed back out by
+ * v3dvk_bo_init_new() instead of going to the kernel.  BOs are bucketed by
+ * page count and evicted once they have been sitting unused for a couple of
+ * seconds.  Cached BOs keep their CPU mapping.
+ */
+struct v3dvk_bo_cache {
+        /** List of struct v3dvk_bo freed, by age. */
+        struct list_head time_list;
+        /** List of struct v3dvk_bo freed, per size, by age. */
+        struct list_head *size_list;
+        uint32_t size_list_size;
+
+        /** Number of BOs and bytes currently held by the cache. */
+        uint32_t cached_count;
+        uint64_t cached_size;
+
+        pthread_mutex_t lock;
+
+        struct v3dvk_bo_cache_stats {
+                /** Allocations served from the cache. */
+                uint64_t hits;
+                /** Allocations that had to create a new kernel BO. */
+                uint64_t misses;
+                /** BOs closed because they went stale in the cache. */
+                uint64_t evictions;
+        } stats;
+};
+
+void
+v3dvk_bo_cache_init(struct v3dvk_device *dev);
+void
+v3dvk_bo_cache_finish(struct v3dvk_device *dev);
+void
+v3dvk_bo_cache_get_stats(struct v3dvk_device *dev,
+                         struct v3dvk_bo_cache_stats *stats);
+
 VkResult
 v3dvk_bo_init_new(struct v3dvk_device *dev, struct v3dvk_bo *bo, uint64_t size, const char* name);
 void
 v3dvk_bo_finish(struct v3dvk_device *dev, struct v3dvk_bo *bo);
 
 
-void
+void *
 v3dvk_bo_map(struct v3dvk_bo *bo);
 
-void
+void *
 v3dvk_bo_map_unsynchronized(struct v3dvk_bo *bo);
 
 #endif /* V3DVK_BO_H */
@@ -64,8 +64,8 @@ v3dvk_BindBufferMemory2(VkDevice device,
       V3DVK_FROM_HANDLE(v3dvk_buffer, buffer, pBindInfos[i].buffer);
 
       if (mem) {
-         buffer->bo = &mem->bo;
-         buffer->bo_offset = pBindInfos[i].memoryOffset;
+         buffer->bo = mem->bo;
+         buffer->bo_offset = mem->bo_offset + pBindInfos[i].memoryOffset;
       } else {
          buffer->bo = NULL;
       }
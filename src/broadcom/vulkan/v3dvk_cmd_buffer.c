@@ -23,14 +23,12 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <xf86drm.h>
 
 #include "common/v3d_macros.h"
 #include "v3d_cl.inl"
 #include <cle/v3d_packet_v42_pack.h>
 #include "util/macros.h"
-#include "util/set.h"
-#include "util/ralloc.h"
-#include "util/hash_table.h"
 #include "common.h"
 #include "device.h"
 #include "vk_alloc.h"
@@ -108,32 +106,98 @@ v3dvk_cmd_state_reset(struct v3dvk_cmd_buffer *cmd_buffer)
    v3dvk_cmd_state_init(cmd_buffer);
 }
 
+static bool
+v3dvk_cmd_buffer_grow_bo_handle_set(struct v3dvk_cmd_buffer *cmd,
+                                    uint32_t handle)
+{
+   uint32_t old_words = cmd->bo_handle_set_words;
+   uint32_t words = MAX2(BITSET_WORDS(handle + 1), old_words * 2);
+
+   BITSET_WORD *set = vk_realloc(&cmd->device->alloc, cmd->bo_handle_set,
+                                 words * sizeof(BITSET_WORD), 8,
+                                 VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+   if (!set)
+      return false;
+
+   memset(set + old_words, 0, (words - old_words) * sizeof(BITSET_WORD));
+   cmd->bo_handle_set = set;
+   cmd->bo_handle_set_words = words;
+
+   return true;
+}
+
+static bool
+v3dvk_cmd_buffer_grow_bo_list(struct v3dvk_cmd_buffer *cmd)
+{
+   uint32_t size = MAX2(64, cmd->bo_handles_size * 2);
+
+   struct v3dvk_bo **bos = vk_realloc(&cmd->device->alloc, cmd->bos,
+                                      size * sizeof(*bos), 8,
+                                      VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+   if (!bos)
+      return false;
+   cmd->bos = bos;
+
+   uint32_t *bo_handles = vk_realloc(&cmd->device->alloc,
+                                     (void *)(uintptr_t)cmd->submit.bo_handles,
+                                     size * sizeof(*bo_handles), 8,
+                                     VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+   if (!bo_handles)
+      return false;
+   cmd->submit.bo_handles = (uintptr_t)(void *)bo_handles;
+
+   cmd->bo_handles_size = size;
+   return true;
+}
+
 void
 v3dvk_cmd_buffer_add_bo(struct v3dvk_cmd_buffer *cmd, struct v3dvk_bo *bo)
 {
    if (!bo)
       return;
 
-   if (_mesa_set_search(cmd->bos, bo))
-       return;
+   if (bo->handle < cmd->bo_handle_set_words * BITSET_WORDBITS) {
+      if (BITSET_TEST(cmd->bo_handle_set, bo->handle))
+         return;
+   } else if (!v3dvk_cmd_buffer_grow_bo_handle_set(cmd, bo->handle)) {
+      v3dvk_error(cmd->device->instance, VK_ERROR_OUT_OF_HOST_MEMORY);
+      return;
+   }
+
+   if (cmd->submit.bo_handle_count >= cmd->bo_handles_size &&
+       !v3dvk_cmd_buffer_grow_bo_list(cmd)) {
+      v3dvk_error(cmd->device->instance, VK_ERROR_OUT_OF_HOST_MEMORY);
+      return;
+   }
 #if 0
    v3d_bo_reference(bo);
-#endif
-   _mesa_set_add(cmd->bos, bo);
-#if 0
-        job->referenced_size += bo->size;
+   job->referenced_size += bo->size;
 #endif
    uint32_t *bo_handles = (void *)(uintptr_t)cmd->submit.bo_handles;
 
-   if (cmd->submit.bo_handle_count >= cmd->bo_handles_size) {
-      cmd->bo_handles_size = MAX2(4, cmd->bo_handles_size * 2);
-      bo_handles = reralloc(cmd, bo_handles,
-                            uint32_t, cmd->bo_handles_size);
-      cmd->submit.bo_handles = (uintptr_t)(void *)bo_handles;
-   }
+   BITSET_SET(cmd->bo_handle_set, bo->handle);
+   cmd->bos[cmd->submit.bo_handle_count] = bo;
    bo_handles[cmd->submit.bo_handle_count++] = bo->handle;
 }
 
+/* Empties the BO list while keeping its storage around for the next
+ * recording.
+ */
+static void
+v3dvk_cmd_buffer_reset_bo_list(struct v3dvk_cmd_buffer *cmd)
+{
+   const uint32_t *bo_handles = (void *)(uintptr_t)cmd->submit.bo_handles;
+
+   for (uint32_t i = 0; i < cmd->submit.bo_handle_count; i++) {
+#if 0
+      v3d_bo_unreference(&cmd->bos[i]);
+#endif
+      BITSET_CLEAR(cmd->bo_handle_set, bo_handles[i]);
+   }
+
+   cmd->submit.bo_handle_count = 0;
+}
+
 static VkResult
 v3dvk_create_cmd_buffer(struct v3dvk_device *device,
                         struct v3dvk_cmd_pool *pool,
@@ -179,11 +243,14 @@ v3dvk_cmd_buffer_init(struct v3dvk_cmd_buffer *cmd_buffer,
    }
 
 
-   // _mesa_set_create uses ralloc details for ctx. Thus no sense to pass our
-   // non-ralloced cmd_buffer
-   cmd_buffer->bos = _mesa_set_create(NULL,
-                                      _mesa_hash_pointer,
-                                      _mesa_key_pointer_equal);
+   cmd_buffer->bos = NULL;
+   cmd_buffer->bo_handles_size = 0;
+   cmd_buffer->bo_handle_set = NULL;
+   cmd_buffer->bo_handle_set_words = 0;
+   cmd_buffer->submit.bo_handles = 0;
+   cmd_buffer->submit.bo_handle_count = 0;
+
+   list_inithead(&cmd_buffer->cl_chunks);
    v3d_init_cl(cmd_buffer, &cmd_buffer->bcl);
    v3d_init_cl(cmd_buffer, &cmd_buffer->rcl);
    v3d_init_cl(cmd_buffer, &cmd_buffer->indirect);
@@ -216,13 +283,13 @@ v3dvk_cmd_buffer_destroy(struct v3dvk_cmd_buffer *cmd_buffer)
    v3d_destroy_cl(&cmd_buffer->bcl);
    v3d_destroy_cl(&cmd_buffer->rcl);
    v3d_destroy_cl(&cmd_buffer->indirect);
+   v3d_cl_release_chunks(cmd_buffer);
 
-   set_foreach(cmd_buffer->bos, entry) {
-      struct v3d_bo *bo = (struct v3d_bo *)entry->key;
-#if 0
-      v3d_bo_unreference(&bo);
-#endif
-   }
+   v3dvk_cmd_buffer_reset_bo_list(cmd_buffer);
+   vk_free(&cmd_buffer->device->alloc, cmd_buffer->bos);
+   vk_free(&cmd_buffer->device->alloc,
+           (void *)(uintptr_t)cmd_buffer->submit.bo_handles);
+   vk_free(&cmd_buffer->device->alloc, cmd_buffer->bo_handle_set);
 #if 0
    vk_free(&cmd_buffer->pool->alloc, cmd_buffer);
 #endif
@@ -231,9 +298,21 @@ v3dvk_cmd_buffer_destroy(struct v3dvk_cmd_buffer *cmd_buffer)
 VkResult
 v3dvk_cmd_buffer_reset(struct v3dvk_cmd_buffer *cmd_buffer)
 {
+   v3d_destroy_cl(&cmd_buffer->bcl);
+   v3d_destroy_cl(&cmd_buffer->rcl);
+   v3d_destroy_cl(&cmd_buffer->indirect);
+   v3d_cl_release_chunks(cmd_buffer);
+
+   /* Keep the BO list storage so that re-recording doesn't have to grow it
+    * again.
+    */
+   v3dvk_cmd_buffer_reset_bo_list(cmd_buffer);
 
-   v3dvk_cmd_buffer_destroy(cmd_buffer);
-   return v3dvk_cmd_buffer_init(cmd_buffer, cmd_buffer->device, cmd_buffer->pool, cmd_buffer->level);
+   v3d_init_cl(cmd_buffer, &cmd_buffer->bcl);
+   v3d_init_cl(cmd_buffer, &cmd_buffer->rcl);
+   v3d_init_cl(cmd_buffer, &cmd_buffer->indirect);
+
+   return VK_SUCCESS;
 }
 
 void v3dvk_CmdBindTransformFeedbackBuffersEXT(
@@ -329,6 +408,8 @@ v3dvk_FreeCommandBuffers(VkDevice device,
 
       if (cmd_buffer) {
          if (cmd_buffer->pool) {
+            /* Give the CL chunks back to the pool right away. */
+            v3dvk_cmd_buffer_reset(cmd_buffer);
             list_del(&cmd_buffer->pool_link);
             list_addtail(&cmd_buffer->pool_link,
                          &cmd_buffer->pool->free_cmd_buffers);
@@ -339,247 +420,50 @@ v3dvk_FreeCommandBuffers(VkDevice device,
 }
 
 VkResult
-v3dvk_cmd_buffer_execbuf(struct v3dvk_device *device,
-                       struct v3dvk_cmd_buffer *cmd_buffer,
-                       const VkSemaphore *in_semaphores,
-                       uint32_t num_in_semaphores,
-                       const VkSemaphore *out_semaphores,
-                       uint32_t num_out_semaphores,
-                       VkFence _fence)
+v3dvk_ResetCommandBuffer(VkCommandBuffer commandBuffer,
+                         VkCommandBufferResetFlags flags)
 {
-   V3DVK_FROM_HANDLE(v3dvk_fence, fence, _fence);
-#if 0
-   UNUSED struct anv_physical_device *pdevice = &device->instance->physicalDevice;
-
-   struct anv_execbuf execbuf;
-   anv_execbuf_init(&execbuf);
-
-   int in_fence = -1;
-#endif
-   VkResult result = VK_SUCCESS;
-#if 0
-   for (uint32_t i = 0; i < num_in_semaphores; i++) {
-      ANV_FROM_HANDLE(anv_semaphore, semaphore, in_semaphores[i]);
-      struct anv_semaphore_impl *impl =
-         semaphore->temporary.type != ANV_SEMAPHORE_TYPE_NONE ?
-         &semaphore->temporary : &semaphore->permanent;
-
-      switch (impl->type) {
-      case ANV_SEMAPHORE_TYPE_BO:
-         assert(!pdevice->has_syncobj);
-         result = anv_execbuf_add_bo(&execbuf, impl->bo, NULL,
-                                     0, &device->alloc);
-         if (result != VK_SUCCESS)
-            return result;
-         break;
-
-      case ANV_SEMAPHORE_TYPE_SYNC_FILE:
-         assert(!pdevice->has_syncobj);
-         if (in_fence == -1) {
-            in_fence = impl->fd;
-         } else {
-            int merge = anv_gem_sync_file_merge(device, in_fence, impl->fd);
-            if (merge == -1)
-               return vk_error(VK_ERROR_INVALID_EXTERNAL_HANDLE);
-
-            close(impl->fd);
-            close(in_fence);
-            in_fence = merge;
-         }
-
-         impl->fd = -1;
-         break;
-
-      case ANV_SEMAPHORE_TYPE_DRM_SYNCOBJ:
-         result = anv_execbuf_add_syncobj(&execbuf, impl->syncobj,
-                                          I915_EXEC_FENCE_WAIT,
-                                          &device->alloc);
-         if (result != VK_SUCCESS)
-            return result;
-         break;
-
-      default:
-         break;
-      }
-   }
-
-   bool need_out_fence = false;
-   for (uint32_t i = 0; i < num_out_semaphores; i++) {
-      ANV_FROM_HANDLE(anv_semaphore, semaphore, out_semaphores[i]);
-
-      /* Under most circumstances, out fences won't be temporary.  However,
-       * the spec does allow it for opaque_fd.  From the Vulkan 1.0.53 spec:
-       *
-       *    "If the import is temporary, the implementation must restore the
-       *    semaphore to its prior permanent state after submitting the next
-       *    semaphore wait operation."
-       *
-       * The spec says nothing whatsoever about signal operations on
-       * temporarily imported semaphores so it appears they are allowed.
-       * There are also CTS tests that require this to work.
-       */
-      struct anv_semaphore_impl *impl =
-         semaphore->temporary.type != ANV_SEMAPHORE_TYPE_NONE ?
-         &semaphore->temporary : &semaphore->permanent;
-
-      switch (impl->type) {
-      case ANV_SEMAPHORE_TYPE_BO:
-         assert(!pdevice->has_syncobj);
-         result = anv_execbuf_add_bo(&execbuf, impl->bo, NULL,
-                                     EXEC_OBJECT_WRITE, &device->alloc);
-         if (result != VK_SUCCESS)
-            return result;
-         break;
-
-      case ANV_SEMAPHORE_TYPE_SYNC_FILE:
-         assert(!pdevice->has_syncobj);
-         need_out_fence = true;
-         break;
-
-      case ANV_SEMAPHORE_TYPE_DRM_SYNCOBJ:
-         result = anv_execbuf_add_syncobj(&execbuf, impl->syncobj,
-                                          I915_EXEC_FENCE_SIGNAL,
-                                          &device->alloc);
-         if (result != VK_SUCCESS)
-            return result;
-         break;
-
-      default:
-         break;
-      }
-   }
-
-   if (fence) {
-      /* Under most circumstances, out fences won't be temporary.  However,
-       * the spec does allow it for opaque_fd.  From the Vulkan 1.0.53 spec:
-       *
-       *    "If the import is temporary, the implementation must restore the
-       *    semaphore to its prior permanent state after submitting the next
-       *    semaphore wait operation."
-       *
-       * The spec says nothing whatsoever about signal operations on
-       * temporarily imported semaphores so it appears they are allowed.
-       * There are also CTS tests that require this to work.
-       */
-      struct anv_fence_impl *impl =
-         fence->temporary.type != ANV_FENCE_TYPE_NONE ?
-         &fence->temporary : &fence->permanent;
-
-      switch (impl->type) {
-      case ANV_FENCE_TYPE_BO:
-         assert(!pdevice->has_syncobj_wait);
-         result = anv_execbuf_add_bo(&execbuf, &impl->bo.bo, NULL,
-                                     EXEC_OBJECT_WRITE, &device->alloc);
-         if (result != VK_SUCCESS)
-            return result;
-         break;
-
-      case ANV_FENCE_TYPE_SYNCOBJ:
-         result = anv_execbuf_add_syncobj(&execbuf, impl->syncobj,
-                                          I915_EXEC_FENCE_SIGNAL,
-                                          &device->alloc);
-         if (result != VK_SUCCESS)
-            return result;
-         break;
-
-      default:
-         unreachable("Invalid fence type");
-      }
-   }
-
-   if (cmd_buffer) {
-      if (unlikely(INTEL_DEBUG & DEBUG_BATCH)) {
-         struct anv_batch_bo **bo = u_vector_head(&cmd_buffer->seen_bbos);
+   V3DVK_FROM_HANDLE(v3dvk_cmd_buffer, cmd_buffer, commandBuffer);
+   return v3dvk_cmd_buffer_reset(cmd_buffer);
+}
 
-         device->cmd_buffer_being_decoded = cmd_buffer;
-         gen_print_batch(&device->decoder_ctx, (*bo)->bo.map,
-                         (*bo)->bo.size, (*bo)->bo.offset, false);
-         device->cmd_buffer_being_decoded = NULL;
-      }
+/**
+ * Submits the command buffer's CLs to the kernel.  The job waits for
+ * @in_sync (if not 0) and signals @out_sync when done.  Called from the
+ * queue's submit thread.
+ */
+VkResult
+v3dvk_cmd_buffer_execbuf(struct v3dvk_device *device,
+                         struct v3dvk_cmd_buffer *cmd_buffer,
+                         uint32_t in_sync,
+                         uint32_t out_sync)
+{
+   struct drm_v3d_submit_cl *submit = &cmd_buffer->submit;
 
-      result = setup_execbuf_for_cmd_buffer(&execbuf, cmd_buffer);
+   /* No binning is fine, the kernel then only creates a render job. */
+   if (cmd_buffer->bcl.bo) {
+      submit->bcl_start = cmd_buffer->bcl.start;
+      submit->bcl_end = cmd_buffer->bcl.bo->offset +
+                        cl_offset(&cmd_buffer->bcl);
    } else {
-      result = setup_empty_execbuf(&execbuf, device);
-   }
-
-   if (result != VK_SUCCESS)
-      return result;
-
-   if (execbuf.fence_count > 0) {
-      assert(device->instance->physicalDevice.has_syncobj);
-      execbuf.execbuf.flags |= I915_EXEC_FENCE_ARRAY;
-      execbuf.execbuf.num_cliprects = execbuf.fence_count;
-      execbuf.execbuf.cliprects_ptr = (uintptr_t) execbuf.fences;
-   }
-
-   if (in_fence != -1) {
-      execbuf.execbuf.flags |= I915_EXEC_FENCE_IN;
-      execbuf.execbuf.rsvd2 |= (uint32_t)in_fence;
-   }
-
-   if (need_out_fence)
-      execbuf.execbuf.flags |= I915_EXEC_FENCE_OUT;
-
-   result = anv_device_execbuf(device, &execbuf.execbuf, execbuf.bos);
-
-   /* Execbuf does not consume the in_fence.  It's our job to close it. */
-   if (in_fence != -1)
-      close(in_fence);
-
-   for (uint32_t i = 0; i < num_in_semaphores; i++) {
-      ANV_FROM_HANDLE(anv_semaphore, semaphore, in_semaphores[i]);
-      /* From the Vulkan 1.0.53 spec:
-       *
-       *    "If the import is temporary, the implementation must restore the
-       *    semaphore to its prior permanent state after submitting the next
-       *    semaphore wait operation."
-       *
-       * This has to happen after the execbuf in case we close any syncobjs in
-       * the process.
-       */
-      anv_semaphore_reset_temporary(device, semaphore);
+      submit->bcl_start = 0;
+      submit->bcl_end = 0;
    }
 
-   if (fence && fence->permanent.type == ANV_FENCE_TYPE_BO) {
-      assert(!pdevice->has_syncobj_wait);
-      /* BO fences can't be shared, so they can't be temporary. */
-      assert(fence->temporary.type == ANV_FENCE_TYPE_NONE);
+   assert(cmd_buffer->rcl.bo);
+   submit->rcl_start = cmd_buffer->rcl.start;
+   submit->rcl_end = cmd_buffer->rcl.bo->offset +
+                     cl_offset(&cmd_buffer->rcl);
 
-      /* Once the execbuf has returned, we need to set the fence state to
-       * SUBMITTED.  We can't do this before calling execbuf because
-       * anv_GetFenceStatus does take the global device lock before checking
-       * fence->state.
-       *
-       * We set the fence state to SUBMITTED regardless of whether or not the
-       * execbuf succeeds because we need to ensure that vkWaitForFences() and
-       * vkGetFenceStatus() return a valid result (VK_ERROR_DEVICE_LOST or
-       * VK_SUCCESS) in a finite amount of time even if execbuf fails.
-       */
-      fence->permanent.bo.state = ANV_BO_FENCE_STATE_SUBMITTED;
-   }
+   submit->in_sync_bcl = in_sync;
+   submit->in_sync_rcl = in_sync;
+   submit->out_sync = out_sync;
 
-   if (result == VK_SUCCESS && need_out_fence) {
-      assert(!pdevice->has_syncobj_wait);
-      int out_fence = execbuf.execbuf.rsvd2 >> 32;
-      for (uint32_t i = 0; i < num_out_semaphores; i++) {
-         ANV_FROM_HANDLE(anv_semaphore, semaphore, out_semaphores[i]);
-         /* Out fences can't have temporary state because that would imply
-          * that we imported a sync file and are trying to signal it.
-          */
-         assert(semaphore->temporary.type == ANV_SEMAPHORE_TYPE_NONE);
-         struct anv_semaphore_impl *impl = &semaphore->permanent;
-
-         if (impl->type == ANV_SEMAPHORE_TYPE_SYNC_FILE) {
-            assert(impl->fd == -1);
-            impl->fd = dup(out_fence);
-         }
-      }
-      close(out_fence);
-   }
+   int ret = drmIoctl(device->fd, DRM_IOCTL_V3D_SUBMIT_CL, submit);
+   if (ret)
+      return v3dvk_device_set_lost(device, "SUBMIT_CL failed: %m");
 
-   anv_execbuf_finish(&execbuf, &device->alloc);
-#endif
-   return result;
+   return VK_SUCCESS;
 }
 
 void
@@ -28,6 +28,7 @@
 #include <vulkan/vk_icd.h>
 #include <vulkan/vulkan.h>
 #include <drm-uapi/v3d_drm.h>
+#include "util/bitset.h"
 #include "util/list.h"
 #include "v3d_cl.h"
 #include "v3dvk_defines.h"
@@ -320,17 +321,30 @@ struct v3dvk_cmd_buffer {
    struct v3d_cl rcl;
    struct v3d_cl indirect;
 
+   /* The v3d_cl_chunks backing the CLs above. */
+   struct list_head cl_chunks;
+
    struct drm_v3d_submit_cl submit;
 
    /**
-    * Set of all BOs referenced by the command buffer. This will be used for making
-    * the list of BOs that the kernel will need to have paged in to
-    * execute our command buffer.
+    * All BOs referenced by the command buffer, in the order they were first
+    * added.  submit.bo_handles holds the matching GEM handles, which is the
+    * list of BOs the kernel will need to have paged in to execute our
+    * command buffer.
     */
-   struct set *bos;
+   struct v3dvk_bo **bos;
 
-   /* Size of the submit.bo_handles array. */
+   /* Size of the bos and submit.bo_handles arrays. */
    uint32_t bo_handles_size;
+
+   /**
+    * Bitset indexed by GEM handle of the BOs in ::bos.  GEM handles are
+    * small, densely allocated integers, so this gives us O(1) duplicate
+    * detection in v3dvk_cmd_buffer_add_bo() without hashing.  Only the bits
+    * of the BOs in ::bos are ever set, so a reset only has to walk those.
+    */
+   BITSET_WORD *bo_handle_set;
+   uint32_t bo_handle_set_words;
 };
 
 
@@ -393,10 +407,7 @@ v3dvk_cmd_buffer_add_bo(struct v3dvk_cmd_buffer *cmd, struct v3dvk_bo *bo);
 
 VkResult v3dvk_cmd_buffer_execbuf(struct v3dvk_device *device,
                                   struct v3dvk_cmd_buffer *cmd_buffer,
-                                  const VkSemaphore *in_semaphores,
-                                  uint32_t num_in_semaphores,
-                                  const VkSemaphore *out_semaphores,
-                                  uint32_t num_out_semaphores,
-                                  VkFence fence);
+                                  uint32_t in_sync,
+                                  uint32_t out_sync);
 
 #endif // V3DVK_CMD_BUFFER_H
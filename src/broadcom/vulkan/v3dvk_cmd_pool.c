@@ -26,6 +26,7 @@ VkResult v3dvk_CreateCommandPool(
 
    list_inithead(&pool->cmd_buffers);
    list_inithead(&pool->free_cmd_buffers);
+   list_inithead(&pool->free_cl_chunks);
 
    *pCmdPool = v3dvk_cmd_pool_to_handle(pool);
 
@@ -54,5 +55,42 @@ void v3dvk_DestroyCommandPool(
       v3dvk_cmd_buffer_destroy(cmd_buffer);
    }
 
+   v3d_cl_free_chunks(device, &pool->free_cl_chunks);
+
    vk_free2(&device->alloc, pAllocator, pool);
 }
+
+VkResult v3dvk_ResetCommandPool(
+    VkDevice                                    _device,
+    VkCommandPool                               commandPool,
+    VkCommandPoolResetFlags                     flags)
+{
+   V3DVK_FROM_HANDLE(v3dvk_device, device, _device);
+   V3DVK_FROM_HANDLE(v3dvk_cmd_pool, pool, commandPool);
+
+   list_for_each_entry(struct v3dvk_cmd_buffer, cmd_buffer,
+                       &pool->cmd_buffers, pool_link) {
+      VkResult result = v3dvk_cmd_buffer_reset(cmd_buffer);
+      if (result != VK_SUCCESS)
+         return result;
+   }
+
+   if (flags & VK_COMMAND_POOL_RESET_RELEASE_RESOURCES_BIT)
+      v3d_cl_free_chunks(device, &pool->free_cl_chunks);
+
+   return VK_SUCCESS;
+}
+
+void v3dvk_TrimCommandPool(
+    VkDevice                                    _device,
+    VkCommandPool                               commandPool,
+    VkCommandPoolTrimFlags                      flags)
+{
+   V3DVK_FROM_HANDLE(v3dvk_device, device, _device);
+   V3DVK_FROM_HANDLE(v3dvk_cmd_pool, pool, commandPool);
+
+   if (!pool)
+      return;
+
+   v3d_cl_free_chunks(device, &pool->free_cl_chunks);
+}
@@ -32,6 +32,11 @@ struct v3dvk_cmd_pool {
    VkAllocationCallbacks alloc;
    struct list_head cmd_buffers;
    struct list_head free_cmd_buffers;
+
+   /* Mapped v3d_cl_chunks released by reset command buffers, ready to be
+    * reused without allocating or waiting on a BO.
+    */
+   struct list_head free_cl_chunks;
    uint32_t queue_family_index;
 };
 
@@ -317,6 +317,153 @@ v3dvk_DestroyPipelineLayout(VkDevice _device,
    vk_free2(&device->alloc, pAllocator, pipeline_layout);
 }
 
+static int
+pool_hole_compare_offset(const struct rb_node *a, const struct rb_node *b)
+{
+   const struct v3dvk_descriptor_pool_hole *ha =
+      rb_node_data(struct v3dvk_descriptor_pool_hole, a, offset_node);
+   const struct v3dvk_descriptor_pool_hole *hb =
+      rb_node_data(struct v3dvk_descriptor_pool_hole, b, offset_node);
+
+   /* rb_tree wants the sign of b - a. */
+   return (hb->offset > ha->offset) - (hb->offset < ha->offset);
+}
+
+static int
+pool_hole_compare_size(const struct rb_node *a, const struct rb_node *b)
+{
+   const struct v3dvk_descriptor_pool_hole *ha =
+      rb_node_data(struct v3dvk_descriptor_pool_hole, a, size_node);
+   const struct v3dvk_descriptor_pool_hole *hb =
+      rb_node_data(struct v3dvk_descriptor_pool_hole, b, size_node);
+
+   if (ha->size != hb->size)
+      return hb->size > ha->size ? 1 : -1;
+   return (hb->offset > ha->offset) - (hb->offset < ha->offset);
+}
+
+static void
+pool_insert_hole(struct v3dvk_descriptor_pool *pool,
+                 uint32_t offset, uint32_t size)
+{
+   struct v3dvk_descriptor_pool_hole *hole = pool->free_holes;
+
+   assert(hole);
+   pool->free_holes = hole->next_free;
+
+   hole->offset = offset;
+   hole->size = size;
+   rb_tree_insert(&pool->holes_by_offset, &hole->offset_node,
+                  pool_hole_compare_offset);
+   rb_tree_insert(&pool->holes_by_size, &hole->size_node,
+                  pool_hole_compare_size);
+}
+
+static void
+pool_remove_hole(struct v3dvk_descriptor_pool *pool,
+                 struct v3dvk_descriptor_pool_hole *hole)
+{
+   rb_tree_remove(&pool->holes_by_offset, &hole->offset_node);
+   rb_tree_remove(&pool->holes_by_size, &hole->size_node);
+
+   hole->next_free = pool->free_holes;
+   pool->free_holes = hole;
+}
+
+/* Returns the smallest hole of at least @size bytes, or NULL. */
+static struct v3dvk_descriptor_pool_hole *
+pool_find_hole(struct v3dvk_descriptor_pool *pool, uint32_t size)
+{
+   struct v3dvk_descriptor_pool_hole *best = NULL;
+   struct rb_node *node = pool->holes_by_size.root;
+
+   while (node) {
+      struct v3dvk_descriptor_pool_hole *hole =
+         rb_node_data(struct v3dvk_descriptor_pool_hole, node, size_node);
+
+      if (hole->size >= size) {
+         best = hole;
+         node = node->left;
+      } else {
+         node = node->right;
+      }
+   }
+
+   return best;
+}
+
+static bool
+v3dvk_descriptor_pool_alloc_range(struct v3dvk_descriptor_pool *pool,
+                                  uint32_t size, uint32_t *offset)
+{
+   /* Try to allocate linearly first, so that we don't touch the holes at
+    * all if the app only allocates & resets via the pool.
+    */
+   if (pool->current_offset + size <= pool->size) {
+      *offset = pool->current_offset;
+      pool->current_offset += size;
+      return true;
+   }
+
+   struct v3dvk_descriptor_pool_hole *hole = pool_find_hole(pool, size);
+   if (!hole)
+      return false;
+
+   *offset = hole->offset;
+
+   if (hole->size == size) {
+      pool_remove_hole(pool, hole);
+   } else {
+      /* Shrinking the hole from the start keeps its place in the offset
+       * tree, only its place by size changes.
+       */
+      rb_tree_remove(&pool->holes_by_size, &hole->size_node);
+      hole->offset += size;
+      hole->size -= size;
+      rb_tree_insert(&pool->holes_by_size, &hole->size_node,
+                     pool_hole_compare_size);
+   }
+
+   return true;
+}
+
+static void
+v3dvk_descriptor_pool_free_range(struct v3dvk_descriptor_pool *pool,
+                                 uint32_t offset, uint32_t size)
+{
+   struct v3dvk_descriptor_pool_hole *prev = NULL, *next = NULL;
+   struct rb_node *node = pool->holes_by_offset.root;
+
+   while (node) {
+      struct v3dvk_descriptor_pool_hole *hole =
+         rb_node_data(struct v3dvk_descriptor_pool_hole, node, offset_node);
+
+      if (hole->offset < offset) {
+         prev = hole;
+         node = node->right;
+      } else {
+         next = hole;
+         node = node->left;
+      }
+   }
+
+   if (prev && prev->offset + prev->size == offset) {
+      offset = prev->offset;
+      size += prev->size;
+      pool_remove_hole(pool, prev);
+   }
+
+   if (next && offset + size == next->offset) {
+      size += next->size;
+      pool_remove_hole(pool, next);
+   }
+
+   if (offset + size == pool->current_offset)
+      pool->current_offset = offset;
+   else
+      pool_insert_hole(pool, offset, size);
+}
+
 static VkResult
 v3dvk_descriptor_set_create(struct v3dvk_device *device,
                             struct v3dvk_descriptor_pool *pool,
@@ -361,7 +508,6 @@ v3dvk_descriptor_set_create(struct v3dvk_device *device,
 
    set->layout = layout;
    uint32_t layout_size = layout->size;
-   fprintf(stderr, "DS: Layout %d\n", layout_size);
    if (variable_count) {
       assert(layout->has_variable_descriptors);
       uint32_t stride = layout->binding[layout->binding_count - 1].size;
@@ -370,63 +516,31 @@ v3dvk_descriptor_set_create(struct v3dvk_device *device,
 
       layout_size = layout->binding[layout->binding_count - 1].offset +
                     *variable_count * stride;
-      fprintf(stderr, "DS: Layout mod %d\n", layout_size);
+   }
+
+   if (!pool->host_memory_base && pool->entry_count == pool->max_entry_count) {
+      vk_free2(&device->alloc, NULL, set);
+      return v3dvk_error(device->instance, VK_ERROR_OUT_OF_POOL_MEMORY);
    }
 
    if (layout_size) {
+      uint32_t offset;
+
       set->size = layout_size;
 
-      if (!pool->host_memory_base && pool->entry_count == pool->max_entry_count) {
-         vk_free2(&device->alloc, NULL, set);
+      if (!v3dvk_descriptor_pool_alloc_range(pool, layout_size, &offset)) {
+         if (!pool->host_memory_base)
+            vk_free2(&device->alloc, NULL, set);
          return v3dvk_error(device->instance, VK_ERROR_OUT_OF_POOL_MEMORY);
       }
 
-      fprintf(stderr, "DS: Offset %llu %llu\n", pool->current_offset, pool->size);
-
-      /* try to allocate linearly first, so that we don't spend
-       * time looking for gaps if the app only allocates &
-       * resets via the pool. */
-      if (pool->current_offset + layout_size <= pool->size) {
-         set->mapped_ptr = (uint32_t*)(pool->bo.map + pool->current_offset);
-         set->offset = pool->bo.offset + pool->current_offset;
-
-         if (!pool->host_memory_base) {
-            pool->entries[pool->entry_count].offset = pool->current_offset;
-            pool->entries[pool->entry_count].size = layout_size;
-            pool->entries[pool->entry_count].set = set;
-            pool->entry_count++;
-         }
-         pool->current_offset += layout_size;
-      } else if (!pool->host_memory_base) {
-         uint64_t offset = 0;
-         int index;
-
-         fprintf(stderr, "DS: Entry %d\n", pool->entry_count);
-
-         for (index = 0; index < pool->entry_count; ++index) {
-            if (pool->entries[index].offset - offset >= layout_size)
-               break;
-            offset = pool->entries[index].offset + pool->entries[index].size;
-            fprintf(stderr, "DS: Entry Offset %llu\n", offset);
-         }
-
-         if (pool->size - offset < layout_size) {
-            vk_free2(&device->alloc, NULL, set);
-            assert(false);
-            return v3dvk_error(device->instance, VK_ERROR_OUT_OF_POOL_MEMORY);
-         }
-
-         set->mapped_ptr = (uint32_t*)(pool->bo.map + offset);
-         set->offset = pool->bo.offset + offset;
+      set->mapped_ptr = (uint32_t*)((uint8_t*)pool->bo.map + offset);
+      set->offset = pool->bo.offset + offset;
+   }
 
-         memmove(&pool->entries[index + 1], &pool->entries[index],
-            sizeof(pool->entries[0]) * (pool->entry_count - index));
-         pool->entries[index].offset = offset;
-         pool->entries[index].size = layout_size;
-         pool->entries[index].set = set;
-         pool->entry_count++;
-      } else
-         return v3dvk_error(device->instance, VK_ERROR_OUT_OF_POOL_MEMORY);
+   if (!pool->host_memory_base) {
+      list_addtail(&set->pool_link, &pool->sets);
+      pool->entry_count++;
    }
 
    *out_set = set;
@@ -436,25 +550,46 @@ v3dvk_descriptor_set_create(struct v3dvk_device *device,
 static void
 v3dvk_descriptor_set_destroy(struct v3dvk_device *device,
                              struct v3dvk_descriptor_pool *pool,
-                             struct v3dvk_descriptor_set *set,
-                             bool free_bo)
+                             struct v3dvk_descriptor_set *set)
 {
    assert(!pool->host_memory_base);
 
-   if (free_bo && set->size && !pool->host_memory_base) {
+   if (set->size) {
       uint32_t offset = (uint8_t*)set->mapped_ptr - (uint8_t*)pool->bo.map;
-      for (int i = 0; i < pool->entry_count; ++i) {
-         if (pool->entries[i].offset == offset) {
-            memmove(&pool->entries[i], &pool->entries[i+1],
-               sizeof(pool->entries[i]) * (pool->entry_count - i - 1));
-            --pool->entry_count;
-            break;
-         }
-      }
+      v3dvk_descriptor_pool_free_range(pool, offset, set->size);
    }
+
+   list_del(&set->pool_link);
+   pool->entry_count--;
+
    vk_free2(&device->alloc, NULL, set);
 }
 
+static void
+v3dvk_descriptor_pool_reset(struct v3dvk_device *device,
+                            struct v3dvk_descriptor_pool *pool)
+{
+   if (!pool->host_memory_base) {
+      list_for_each_entry_safe(struct v3dvk_descriptor_set, set,
+                               &pool->sets, pool_link) {
+         vk_free2(&device->alloc, NULL, set);
+      }
+      list_inithead(&pool->sets);
+      pool->entry_count = 0;
+
+      rb_tree_init(&pool->holes_by_offset);
+      rb_tree_init(&pool->holes_by_size);
+      pool->free_holes = NULL;
+      for (uint32_t i = pool->max_entry_count; i-- > 0; ) {
+         pool->holes[i].next_free = pool->free_holes;
+         pool->free_holes = &pool->holes[i];
+      }
+   }
+
+   pool->host_memory_ptr = pool->host_memory_base;
+   pool->current_offset = 0;
+}
+
 VkResult
 v3dvk_CreateDescriptorPool(VkDevice _device,
                            const VkDescriptorPoolCreateInfo *pCreateInfo,
@@ -488,7 +623,7 @@ v3dvk_CreateDescriptorPool(VkDevice _device,
       host_size += sizeof(struct v3dvk_descriptor_range) * range_count;
       size += host_size;
    } else {
-      size += sizeof(struct v3dvk_descriptor_pool_entry) * pCreateInfo->maxSets;
+      size += sizeof(struct v3dvk_descriptor_pool_hole) * pCreateInfo->maxSets;
    }
 
    pool = vk_alloc2(&device->alloc, pAllocator, size, 8,
@@ -497,6 +632,8 @@ v3dvk_CreateDescriptorPool(VkDevice _device,
       return v3dvk_error(device->instance, VK_ERROR_OUT_OF_HOST_MEMORY);
 
    memset(pool, 0, sizeof(*pool));
+   /* The reset below frees the sets on the list, so it has to be valid. */
+   list_inithead(&pool->sets);
 
    if (!(pCreateInfo->flags & VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT)) {
       pool->host_memory_base = (uint8_t*)pool + sizeof(struct v3dvk_descriptor_pool);
@@ -507,14 +644,17 @@ v3dvk_CreateDescriptorPool(VkDevice _device,
    if (bo_size) {
       VkResult ret;
 
-      fprintf(stderr, "POOL SIZE %llu\n", bo_size);
       ret = v3dvk_bo_init_new(device, &pool->bo, bo_size, "pool");
-      assert(ret == VK_SUCCESS);
+      if (ret != VK_SUCCESS) {
+         vk_free2(&device->alloc, pAllocator, pool);
+         return ret;
+      }
 
       v3dvk_bo_map(&pool->bo);
    }
    pool->size = bo_size;
    pool->max_entry_count = pCreateInfo->maxSets;
+   v3dvk_descriptor_pool_reset(device, pool);
 
    *pDescriptorPool = v3dvk_descriptor_pool_to_handle(pool);
    return VK_SUCCESS;
@@ -530,18 +670,27 @@ v3dvk_DestroyDescriptorPool(VkDevice _device,
 
    if (!pool)
       return;
-#if 0
-   if (!pool->host_memory_base) {
-      for(int i = 0; i < pool->entry_count; ++i) {
-         v3dvk_descriptor_set_destroy(device, pool, pool->entries[i].set, false);
-      }
-   }
-#endif
+
+   v3dvk_descriptor_pool_reset(device, pool);
+
    if (pool->size)
       v3dvk_bo_finish(device, &pool->bo);
    vk_free2(&device->alloc, pAllocator, pool);
 }
 
+VkResult
+v3dvk_ResetDescriptorPool(VkDevice _device,
+                          VkDescriptorPool descriptorPool,
+                          VkDescriptorPoolResetFlags flags)
+{
+   V3DVK_FROM_HANDLE(v3dvk_device, device, _device);
+   V3DVK_FROM_HANDLE(v3dvk_descriptor_pool, pool, descriptorPool);
+
+   v3dvk_descriptor_pool_reset(device, pool);
+
+   return VK_SUCCESS;
+}
+
 VkResult
 v3dvk_AllocateDescriptorSets(VkDevice _device,
                              const VkDescriptorSetAllocateInfo *pAllocateInfo,
@@ -603,7 +752,7 @@ v3dvk_FreeDescriptorSets(VkDevice _device,
       V3DVK_FROM_HANDLE(v3dvk_descriptor_set, set, pDescriptorSets[i]);
 
       if (set && !pool->host_memory_base)
-         v3dvk_descriptor_set_destroy(device, pool, set, true);
+         v3dvk_descriptor_set_destroy(device, pool, set);
    }
    return VK_SUCCESS;
 }
@@ -4,6 +4,8 @@
 
 #include <stdint.h>
 #include <vulkan/vulkan.h>
+#include "util/list.h"
+#include "util/rb_tree.h"
 #include "v3dvk_bo.h"
 #include "v3dvk_constants.h"
 
@@ -22,6 +24,9 @@ struct v3dvk_descriptor_set
    uint32_t *mapped_ptr;
    struct v3dvk_descriptor_range *dynamic_descriptors;
 
+   /* Link in v3dvk_descriptor_pool::sets, for pools that can free sets. */
+   struct list_head pool_link;
+
    struct v3dvk_bo *descriptors[0];
 };
 
@@ -111,11 +116,19 @@ v3dvk_immutable_samplers(const struct v3dvk_descriptor_set_layout *set,
                               binding->immutable_samplers_offset);
 }
 
-struct v3dvk_descriptor_pool_entry
+/* A free range of the pool's BO, below v3dvk_descriptor_pool::current_offset.
+ * Holes are in two trees: one ordered by offset, to find the neighbours to
+ * coalesce with on free, and one ordered by size, for best-fit allocation.
+ */
+struct v3dvk_descriptor_pool_hole
 {
+   struct rb_node offset_node;
+   struct rb_node size_node;
    uint32_t offset;
    uint32_t size;
-   struct v3dvk_descriptor_set *set;
+
+   /* Next unused hole in v3dvk_descriptor_pool::free_holes. */
+   struct v3dvk_descriptor_pool_hole *next_free;
 };
 
 struct v3dvk_descriptor_pool
@@ -128,9 +141,21 @@ struct v3dvk_descriptor_pool
    uint8_t *host_memory_ptr;
    uint8_t *host_memory_end;
 
+   /* Everything below is only used by pools created with
+    * VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT.
+    */
+   struct list_head sets;
    uint32_t entry_count;
    uint32_t max_entry_count;
-   struct v3dvk_descriptor_pool_entry entries[0];
+
+   struct rb_tree holes_by_offset;
+   struct rb_tree holes_by_size;
+   struct v3dvk_descriptor_pool_hole *free_holes;
+
+   /* Every hole is followed by a live set, so there are never more than
+    * max_entry_count of them.
+    */
+   struct v3dvk_descriptor_pool_hole holes[0];
 };
 
 struct v3dvk_descriptor_update_template_entry
@@ -63,6 +63,7 @@ MAX_API_VERSION = None # Computed later
 # the those extension strings, then tests dEQP-VK.api.info.instance.extensions
 # and dEQP-VK.api.info.device fail due to the duplicated strings.
 EXTENSIONS = [
+    Extension('VK_KHR_pipeline_executable_properties',    1, True),
     Extension('VK_EXT_transform_feedback',                1, True),
 ]
 
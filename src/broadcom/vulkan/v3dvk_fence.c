@@ -115,6 +115,15 @@ v3dvk_fence_wait_idle(struct v3dvk_fence *fence)
    }
 }
 
+/**
+ * Makes the fence pending on a sync file, taking ownership of @fd.
+ */
+void
+v3dvk_fence_set_sync_file(struct v3dvk_fence *fence, int fd)
+{
+   v3dvk_fence_set_state(fence, V3DVK_FENCE_STATE_PENDING, fd);
+}
+
 VkResult
 v3dvk_CreateFence(VkDevice _device,
                   const VkFenceCreateInfo *pCreateInfo,
@@ -39,5 +39,7 @@ void
 v3dvk_fence_finish(struct v3dvk_fence *fence);
 void
 v3dvk_fence_wait_idle(struct v3dvk_fence *fence);
+void
+v3dvk_fence_set_sync_file(struct v3dvk_fence *fence, int fd);
 
 #endif
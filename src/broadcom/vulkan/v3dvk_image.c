@@ -769,8 +769,8 @@ v3dvk_BindImageMemory2(VkDevice device,
       V3DVK_FROM_HANDLE(v3dvk_device_memory, mem, pBindInfos[i].memory);
 
       if (mem) {
-         image->bo = &mem->bo;
-         image->bo_offset = pBindInfos[i].memoryOffset;
+         image->bo = mem->bo;
+         image->bo_offset = mem->bo_offset + pBindInfos[i].memoryOffset;
       } else {
          image->bo = NULL;
          image->bo_offset = 0;
@@ -1,12 +1,204 @@
 
+#include <string.h>
 #include <vulkan/vulkan_core.h>
+#include "util/u_math.h"
 #include "vk_alloc.h"
+#include "vk_util.h"
 #include "common.h"
 #include "device.h"
+#include "instance.h"
 #include "v3dvk_bo.h"
 #include "v3dvk_error.h"
 #include "v3dvk_memory.h"
 
+/* util_vma_heap uses 0 to signal failure, so block offsets are biased by
+ * this much inside the vma heap.
+ */
+#define V3DVK_MEMORY_BLOCK_VMA_BASE 4096
+
+void
+v3dvk_memory_suballocator_init(struct v3dvk_memory_suballocator *suballoc)
+{
+   memset(suballoc, 0, sizeof(*suballoc));
+   pthread_mutex_init(&suballoc->lock, NULL);
+   list_inithead(&suballoc->blocks);
+}
+
+static void
+v3dvk_memory_block_destroy(struct v3dvk_device *device,
+                           struct v3dvk_memory_suballocator *suballoc,
+                           struct v3dvk_memory_block *block)
+{
+   list_del(&block->link);
+   suballoc->stats.block_count--;
+   suballoc->stats.block_size -= block->bo.size;
+
+   util_vma_heap_finish(&block->vma);
+   v3dvk_bo_finish(device, &block->bo);
+   vk_free(&device->alloc, block);
+}
+
+void
+v3dvk_memory_suballocator_finish(struct v3dvk_device *device,
+                                 struct v3dvk_memory_suballocator *suballoc)
+{
+   list_for_each_entry_safe(struct v3dvk_memory_block, block,
+                            &suballoc->blocks, link) {
+      v3dvk_memory_block_destroy(device, suballoc, block);
+   }
+   pthread_mutex_destroy(&suballoc->lock);
+}
+
+void
+v3dvk_memory_get_heap_stats(struct v3dvk_device *device, uint32_t heap_index,
+                            struct v3dvk_memory_heap_stats *stats)
+{
+   struct v3dvk_memory_suballocator *suballoc = &device->suballoc[heap_index];
+
+   pthread_mutex_lock(&suballoc->lock);
+   *stats = suballoc->stats;
+   pthread_mutex_unlock(&suballoc->lock);
+}
+
+static struct v3dvk_memory_block *
+v3dvk_memory_block_create(struct v3dvk_device *device,
+                          struct v3dvk_memory_suballocator *suballoc)
+{
+   struct v3dvk_memory_block *block =
+      vk_alloc(&device->alloc, sizeof(*block), 8,
+               VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+   if (!block)
+      return NULL;
+
+   memset(block, 0, sizeof(*block));
+   if (v3dvk_bo_init_new(device, &block->bo, V3DVK_MEMORY_BLOCK_SIZE,
+                         "suballoc") != VK_SUCCESS) {
+      vk_free(&device->alloc, block);
+      return NULL;
+   }
+
+   /* Keep blocks persistently mapped.  Vulkan leaves synchronization of
+    * mapped memory to the application, so there is no need to wait on the
+    * other allocations sharing the BO.
+    */
+   v3dvk_bo_map_unsynchronized(&block->bo);
+
+   util_vma_heap_init(&block->vma, V3DVK_MEMORY_BLOCK_VMA_BASE,
+                      block->bo.size);
+
+   list_add(&block->link, &suballoc->blocks);
+   suballoc->stats.block_count++;
+   suballoc->stats.block_size += block->bo.size;
+
+   return block;
+}
+
+/* Carves @mem out of one of the heap's backing BOs.  The allocation is
+ * naturally aligned up to a page, which covers any alignment we report in
+ * the memory requirements of resources that fit in it, and to at least
+ * minMemoryMapAlignment, since all our memory types are host visible.
+ */
+static VkResult
+v3dvk_memory_suballoc(struct v3dvk_device *device,
+                      struct v3dvk_device_memory *mem,
+                      VkDeviceSize size)
+{
+   struct v3dvk_memory_suballocator *suballoc =
+      &device->suballoc[mem->heap_index];
+   VkDeviceSize alignment = CLAMP(util_next_power_of_two64(size),
+                                  V3DVK_MEMORY_MIN_MAP_ALIGNMENT, 4096);
+   uint64_t addr = 0;
+
+   size = align64(size, alignment);
+
+   pthread_mutex_lock(&suballoc->lock);
+
+   struct v3dvk_memory_block *block = NULL;
+   VkDeviceSize free_space = 0;
+   list_for_each_entry(struct v3dvk_memory_block, b, &suballoc->blocks, link) {
+      free_space += b->bo.size - b->used;
+      if (b->bo.size - b->used < size)
+         continue;
+
+      addr = util_vma_heap_alloc(&b->vma, size, alignment);
+      if (addr) {
+         block = b;
+         break;
+      }
+   }
+
+   if (!block) {
+      if (free_space >= size)
+         suballoc->stats.fragmented_misses++;
+
+      block = v3dvk_memory_block_create(device, suballoc);
+      if (!block) {
+         pthread_mutex_unlock(&suballoc->lock);
+         return vk_error(VK_ERROR_OUT_OF_DEVICE_MEMORY);
+      }
+
+      addr = util_vma_heap_alloc(&block->vma, size, alignment);
+      assert(addr);
+   }
+
+   block->used += size;
+   block->alloc_count++;
+   suballoc->stats.used += size;
+   suballoc->stats.alloc_count++;
+
+   pthread_mutex_unlock(&suballoc->lock);
+
+   mem->block = block;
+   mem->block_size = size;
+   mem->bo = &block->bo;
+   mem->bo_offset = addr - V3DVK_MEMORY_BLOCK_VMA_BASE;
+
+   return VK_SUCCESS;
+}
+
+static void
+v3dvk_memory_subfree(struct v3dvk_device *device,
+                     struct v3dvk_device_memory *mem)
+{
+   struct v3dvk_memory_suballocator *suballoc =
+      &device->suballoc[mem->heap_index];
+   struct v3dvk_memory_block *block = mem->block;
+
+   pthread_mutex_lock(&suballoc->lock);
+
+   util_vma_heap_free(&block->vma,
+                      mem->bo_offset + V3DVK_MEMORY_BLOCK_VMA_BASE,
+                      mem->block_size);
+   block->used -= mem->block_size;
+   block->alloc_count--;
+   suballoc->stats.used -= mem->block_size;
+   suballoc->stats.alloc_count--;
+
+   /* Empty blocks go back to the BO cache, which keeps them around for a
+    * while in case the app is just cycling allocations.
+    */
+   if (block->alloc_count == 0)
+      v3dvk_memory_block_destroy(device, suballoc, block);
+
+   pthread_mutex_unlock(&suballoc->lock);
+}
+
+static bool
+v3dvk_memory_needs_dedicated_bo(const VkMemoryAllocateInfo *pAllocateInfo)
+{
+   if (pAllocateInfo->allocationSize > V3DVK_MEMORY_SUBALLOC_MAX_SIZE)
+      return true;
+
+   /* Exported memory and dedicated allocations need a BO of their own. */
+   if (vk_find_struct_const(pAllocateInfo->pNext, EXPORT_MEMORY_ALLOCATE_INFO))
+      return true;
+   if (vk_find_struct_const(pAllocateInfo->pNext,
+                            MEMORY_DEDICATED_ALLOCATE_INFO))
+      return true;
+
+   return false;
+}
+
 static VkResult
 v3dvk_alloc_memory(struct v3dvk_device *device,
                 const VkMemoryAllocateInfo *pAllocateInfo,
@@ -22,7 +214,10 @@ v3dvk_alloc_memory(struct v3dvk_device *device,
                     VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
    if (mem == NULL)
       return v3dvk_error(device->instance, VK_ERROR_OUT_OF_HOST_MEMORY);
-   memset(&mem->bo, 0, sizeof(mem->bo));
+   memset(mem, 0, sizeof(*mem));
+
+   mem->heap_index = device->instance->physicalDevice.memory.types[
+      pAllocateInfo->memoryTypeIndex].heapIndex;
 #if 0
    const VkImportMemoryFdInfoKHR *fd_info =
       vk_find_struct_const(pAllocateInfo->pNext, IMPORT_MEMORY_FD_INFO_KHR);
@@ -48,13 +243,23 @@ v3dvk_alloc_memory(struct v3dvk_device *device,
       }
    } else {
 #endif
-   if (pAllocateInfo->allocationSize == 0) {
+   if (v3dvk_memory_needs_dedicated_bo(pAllocateInfo)) {
       result =
-         v3dvk_bo_init_new(device, &mem->bo, 1, "alloc");
-    } else {
-      result =
-         v3dvk_bo_init_new(device, &mem->bo, pAllocateInfo->allocationSize, "alloc");
-    }
+         v3dvk_bo_init_new(device, &mem->dedicated_bo,
+                           pAllocateInfo->allocationSize, "alloc");
+      mem->bo = &mem->dedicated_bo;
+      mem->bo_offset = 0;
+      if (result == VK_SUCCESS) {
+         struct v3dvk_memory_suballocator *suballoc =
+            &device->suballoc[mem->heap_index];
+         pthread_mutex_lock(&suballoc->lock);
+         suballoc->stats.dedicated_count++;
+         pthread_mutex_unlock(&suballoc->lock);
+      }
+   } else {
+      result = v3dvk_memory_suballoc(device, mem,
+                                     MAX2(pAllocateInfo->allocationSize, 1));
+   }
 #if 0
    }
 #endif
@@ -96,7 +301,17 @@ v3dvk_FreeMemory(VkDevice _device,
    if (mem == NULL)
       return;
 
-   v3dvk_bo_finish(device, &mem->bo);
+   if (mem->block) {
+      v3dvk_memory_subfree(device, mem);
+   } else {
+      struct v3dvk_memory_suballocator *suballoc =
+         &device->suballoc[mem->heap_index];
+      pthread_mutex_lock(&suballoc->lock);
+      suballoc->stats.dedicated_count--;
+      pthread_mutex_unlock(&suballoc->lock);
+
+      v3dvk_bo_finish(device, &mem->dedicated_bo);
+   }
    vk_free2(&device->alloc, pAllocator, mem);
 }
 
@@ -120,9 +335,10 @@ v3dvk_MapMemory(VkDevice _device,
    if (mem->user_ptr) {
       *ppData = mem->user_ptr;
    } else if (!mem->map) {
-      v3dvk_bo_map(&mem->bo);
-      assert(mem->bo.map != NULL);
-      *ppData = mem->map = mem->bo.map;
+      if (!mem->block)
+         v3dvk_bo_map(mem->bo);
+      assert(mem->bo->map != NULL);
+      *ppData = mem->map = (uint8_t *)mem->bo->map + mem->bo_offset;
    } else
       *ppData = mem->map;
 
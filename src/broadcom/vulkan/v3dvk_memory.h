@@ -24,9 +24,27 @@
 #ifndef V3DVK_MEMORY_H
 #define V3DVK_MEMORY_H
 
+#include <pthread.h>
 #include <vulkan/vulkan.h>
+#include "util/list.h"
+#include "util/vma.h"
 #include "v3dvk_bo.h"
 
+struct v3dvk_device;
+
+/* Allocations up to this size are carved out of shared backing BOs instead
+ * of getting a kernel BO of their own.
+ */
+#define V3DVK_MEMORY_SUBALLOC_MAX_SIZE (256 * 1024)
+
+/* Size of the backing BOs that small allocations are carved from. */
+#define V3DVK_MEMORY_BLOCK_SIZE (2 * 1024 * 1024)
+
+/* Smallest alignment of the suballocations, which vkMapMemory() returns
+ * pointers into, and so what we advertise as minMemoryMapAlignment.
+ */
+#define V3DVK_MEMORY_MIN_MAP_ALIGNMENT 64
+
 struct v3dvk_memory_type {
    /* Standard bits passed on to the client */
    VkMemoryPropertyFlags   propertyFlags;
@@ -52,9 +70,64 @@ struct v3dvk_memory_heap {
    VkDeviceSize      used;
 };
 
+/* One backing BO of a v3dvk_memory_suballocator.  The BO stays mapped for
+ * its whole lifetime.
+ */
+struct v3dvk_memory_block {
+   struct list_head link;
+   struct v3dvk_bo bo;
+   struct util_vma_heap vma;
+   /* Bytes handed out from this block, including alignment padding. */
+   VkDeviceSize used;
+   uint32_t alloc_count;
+};
+
+struct v3dvk_memory_heap_stats {
+   uint32_t block_count;
+   uint32_t alloc_count;
+   uint32_t dedicated_count;
+   /* Bytes of backing BOs owned by the suballocator. */
+   VkDeviceSize block_size;
+   /* Bytes handed out from backing BOs. */
+   VkDeviceSize used;
+   /* Number of times a new block had to be created even though the existing
+    * ones had enough free space in total, i.e. failures due to
+    * fragmentation.
+    */
+   uint64_t fragmented_misses;
+};
+
+/* Per-heap suballocator for small VkDeviceMemory allocations. */
+struct v3dvk_memory_suballocator {
+   pthread_mutex_t lock;
+   struct list_head blocks;
+   struct v3dvk_memory_heap_stats stats;
+};
+
+void
+v3dvk_memory_suballocator_init(struct v3dvk_memory_suballocator *suballoc);
+void
+v3dvk_memory_suballocator_finish(struct v3dvk_device *device,
+                                 struct v3dvk_memory_suballocator *suballoc);
+void
+v3dvk_memory_get_heap_stats(struct v3dvk_device *device, uint32_t heap_index,
+                            struct v3dvk_memory_heap_stats *stats);
+
 struct v3dvk_device_memory
 {
-   struct v3dvk_bo bo;
+   /* BO backing the allocation and the offset of the allocation in it.
+    * For dedicated allocations this points at dedicated_bo, otherwise at the
+    * BO of a shared block.
+    */
+   struct v3dvk_bo *bo;
+   VkDeviceSize bo_offset;
+
+   struct v3dvk_bo dedicated_bo;
+   struct v3dvk_memory_block *block;
+   /* Size reserved in the block, including alignment padding. */
+   VkDeviceSize block_size;
+   uint32_t heap_index;
+
    VkDeviceSize size;
 #if 0
    /* for dedicated allocations */
@@ -40,6 +40,7 @@
 #include "ioctl.h"
 #include <common/v3d_debug.h>
 #include <util/build_id.h>
+#include <util/disk_cache.h>
 #include <util/macros.h>
 #include <util/mesa-sha1.h>
 #include <util/ralloc.h>
@@ -182,6 +183,33 @@ v3dvk_physical_device_init_uuids(struct v3dvk_physical_device *device)
    return VK_SUCCESS;
 }
 
+static void
+v3dvk_physical_device_init_disk_cache(struct v3dvk_physical_device *device)
+{
+#ifdef ENABLE_SHADER_CACHE
+   char renderer[10];
+   snprintf(renderer, sizeof(renderer), "v3dvk_%02d", device->info.ver);
+
+   char timestamp[41];
+   _mesa_sha1_format(timestamp, device->driver_build_sha1);
+
+   device->disk_cache = disk_cache_create(renderer, timestamp, 0);
+#else
+   device->disk_cache = NULL;
+#endif
+}
+
+static void
+v3dvk_physical_device_free_disk_cache(struct v3dvk_physical_device *device)
+{
+#ifdef ENABLE_SHADER_CACHE
+   if (device->disk_cache)
+      disk_cache_destroy(device->disk_cache);
+#else
+   assert(device->disk_cache == NULL);
+#endif
+}
+
 VkResult
 v3dvk_physical_device_init(struct v3dvk_physical_device *device,
                          struct v3dvk_instance *instance,
@@ -278,8 +306,11 @@ v3dvk_physical_device_init(struct v3dvk_physical_device *device,
    if (result != VK_SUCCESS)
       goto fail;
 
+   v3dvk_physical_device_init_disk_cache(device);
+
    result = v3dvk_init_wsi(device);
    if (result != VK_SUCCESS) {
+      v3dvk_physical_device_free_disk_cache(device);
       goto fail;
    }
 
@@ -296,6 +327,7 @@ void
 v3dvk_physical_device_finish(struct v3dvk_physical_device *device)
 {
    v3dvk_finish_wsi(device);
+   v3dvk_physical_device_free_disk_cache(device);
    v3d_compiler_free(device->compiler);
    close(device->local_fd);
    if (device->master_fd >= 0)
@@ -483,6 +515,13 @@ void v3dvk_GetPhysicalDeviceFeatures2(
          break;
       }
 
+      case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PIPELINE_EXECUTABLE_PROPERTIES_FEATURES_KHR: {
+         VkPhysicalDevicePipelineExecutablePropertiesFeaturesKHR *features =
+            (VkPhysicalDevicePipelineExecutablePropertiesFeaturesKHR *)ext;
+         features->pipelineExecutableInfo = true;
+         break;
+      }
+
       case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROTECTED_MEMORY_FEATURES: {
          VkPhysicalDeviceProtectedMemoryFeatures *features = (void *)ext;
          features->protectedMemory = false;
@@ -668,7 +707,7 @@ void v3dvk_GetPhysicalDeviceProperties(
       .maxViewportDimensions                    = { 4096, 4096 },
       .viewportBoundsRange                      = { INT16_MIN, INT16_MAX },
       .viewportSubPixelBits                     = 0.0f,
-      .minMemoryMapAlignment                    = 4096,
+      .minMemoryMapAlignment                    = V3DVK_MEMORY_MIN_MAP_ALIGNMENT,
       .minTexelBufferOffsetAlignment            = 1,
       .minUniformBufferOffsetAlignment          = 1,
       .minStorageBufferOffsetAlignment          = 1,
@@ -69,10 +69,8 @@ struct v3dvk_physical_device {
     uint8_t                                     pipeline_cache_uuid[VK_UUID_SIZE];
     uint8_t                                     driver_uuid[VK_UUID_SIZE];
     uint8_t                                     device_uuid[VK_UUID_SIZE];
-#if 0
 
     struct disk_cache *                         disk_cache;
-#endif
     struct wsi_device                           wsi_device;
 
     int                                         local_fd;
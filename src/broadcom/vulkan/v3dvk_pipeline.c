@@ -1,18 +1,50 @@
 
 #include "compiler/shader_enums.h"
+#include "qpu/qpu_disasm.h"
+#include "util/ralloc.h"
+#include "util/u_queue.h"
 #include "vk_alloc.h"
+#include "vk_util.h"
 #include "common.h"
 #include "device.h"
 #include "v3dvk_constants.h"
+#include "v3dvk_descriptor_set.h"
 #include "v3dvk_pass.h"
 #include "v3dvk_pipeline.h"
 #include "v3dvk_shader.h"
 
+/* The shaders of all the pipelines in one vkCreate*Pipelines() call get
+ * compiled on the device's compile queue, one job per stage.  Each job only
+ * writes to its own shader and result, and the results are gathered in
+ * pCreateInfos order once all of them are done, so neither the compiled
+ * code nor the returned error depend on the order the jobs ran in.
+ */
+struct v3dvk_pipeline_stage_job
+{
+   struct v3dvk_device *device;
+   struct v3dvk_pipeline_cache *cache;
+   struct v3dvk_pipeline *pipeline;
+   /* Index of the pipeline in pCreateInfos. */
+   uint32_t pipeline_index;
+   const VkPipelineShaderStageCreateInfo *info;
+   const VkAllocationCallbacks *alloc;
+   gl_shader_stage stage;
+
+   struct v3dvk_shader_compile_options options;
+   VkResult result;
+
+   struct util_queue_fence fence;
+};
+
 static void
 v3dvk_pipeline_finish(struct v3dvk_pipeline *pipeline,
                       struct v3dvk_device *dev,
                       const VkAllocationCallbacks *alloc)
 {
+   for (unsigned i = 0; i < MESA_SHADER_STAGES; i++) {
+      if (pipeline->shaders[i])
+         v3dvk_shader_destroy(dev, pipeline->shaders[i], alloc);
+   }
 #if 0
    tu_cs_finish(dev, &pipeline->cs);
 
@@ -21,14 +53,278 @@ v3dvk_pipeline_finish(struct v3dvk_pipeline *pipeline,
 #endif
 }
 
+/* Translates the stage to NIR and compiles it with the job's options. */
+static void
+v3dvk_pipeline_stage_create(void *data, int thread_index)
+{
+   struct v3dvk_pipeline_stage_job *job = data;
+
+   struct v3dvk_shader *shader =
+      v3dvk_shader_create(job->device, job->stage, job->info, job->alloc);
+   if (!shader) {
+      job->result = vk_error(VK_ERROR_OUT_OF_HOST_MEMORY);
+      return;
+   }
+   job->pipeline->shaders[job->stage] = shader;
+
+   job->result = v3dvk_shader_compile(job->device, job->cache, shader, NULL,
+                                      &job->options, job->alloc);
+}
+
+/* Compiles an already translated stage again with the job's options. */
+static void
+v3dvk_pipeline_stage_compile(void *data, int thread_index)
+{
+   struct v3dvk_pipeline_stage_job *job = data;
+
+   job->result = v3dvk_shader_compile(job->device, job->cache,
+                                      job->pipeline->shaders[job->stage],
+                                      NULL, &job->options, job->alloc);
+}
+
+/* Runs the jobs on the compile queue, with the calling thread taking the
+ * last one instead of just waiting, and returns once all of them are done.
+ */
+static void
+v3dvk_pipeline_run_jobs(struct v3dvk_device *device,
+                        struct v3dvk_pipeline_stage_job **jobs,
+                        uint32_t count,
+                        util_queue_execute_func execute)
+{
+   if (count == 0)
+      return;
+
+   for (uint32_t i = 0; i < count - 1; i++) {
+      util_queue_fence_init(&jobs[i]->fence);
+      util_queue_add_job(&device->compile_queue, jobs[i], &jobs[i]->fence,
+                         execute, NULL, 0);
+   }
+
+   execute(jobs[count - 1], 0);
+
+   for (uint32_t i = 0; i < count - 1; i++) {
+      util_queue_fence_wait(&jobs[i]->fence);
+      util_queue_fence_destroy(&jobs[i]->fence);
+   }
+}
+
+static struct v3dvk_pipeline *
+v3dvk_pipeline_alloc(struct v3dvk_device *device,
+                     VkPipelineLayout layout,
+                     const VkAllocationCallbacks *alloc)
+{
+   struct v3dvk_pipeline *pipeline =
+      vk_zalloc2(&device->alloc, alloc, sizeof(*pipeline), 8,
+                 VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+   if (!pipeline)
+      return NULL;
+
+   pipeline->layout = v3dvk_pipeline_layout_from_handle(layout);
+
+   return pipeline;
+}
+
+/* Hands out the pipelines whose jobs all succeeded and destroys the others.
+ * Like a serial loop over pCreateInfos, returns the error of the last
+ * pipeline that failed.
+ */
 static VkResult
-v3dvk_compute_pipeline_create(VkDevice _device,
-                              VkPipelineCache _cache,
-                              const VkComputePipelineCreateInfo *pCreateInfo,
+v3dvk_pipeline_finish_create(struct v3dvk_device *device,
+                             struct v3dvk_pipeline **pipelines,
+                             VkResult *results,
+                             uint32_t count,
+                             const VkAllocationCallbacks *alloc,
+                             VkPipeline *pPipelines)
+{
+   VkResult result = VK_SUCCESS;
+
+   for (uint32_t i = 0; i < count; i++) {
+      if (results[i] == VK_SUCCESS) {
+         pPipelines[i] = v3dvk_pipeline_to_handle(pipelines[i]);
+         continue;
+      }
+
+      if (pipelines[i]) {
+         v3dvk_pipeline_finish(pipelines[i], device, alloc);
+         vk_free2(&device->alloc, alloc, pipelines[i]);
+      }
+      pPipelines[i] = VK_NULL_HANDLE;
+      result = results[i];
+   }
+
+   return result;
+}
+
+static void
+v3dvk_pipeline_init_fs_key(union v3dvk_shader_key *key,
+                           const VkGraphicsPipelineCreateInfo *info)
+{
+   V3DVK_FROM_HANDLE(v3dvk_render_pass, pass, info->renderPass);
+   const struct v3dvk_subpass *subpass = &pass->subpasses[info->subpass];
+   const VkPrimitiveTopology topology =
+      info->pInputAssemblyState->topology;
+
+   v3dvk_shader_key_init(key);
+
+   key->fs.is_points = topology == VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+   key->fs.is_lines = (topology >= VK_PRIMITIVE_TOPOLOGY_LINE_LIST &&
+                       topology <= VK_PRIMITIVE_TOPOLOGY_LINE_STRIP);
+   key->fs.msaa = (info->pMultisampleState &&
+                   info->pMultisampleState->rasterizationSamples >
+                   VK_SAMPLE_COUNT_1_BIT);
+   key->fs.depth_enabled =
+      (subpass->depth_stencil_attachment.attachment != VK_ATTACHMENT_UNUSED);
+
+   for (uint32_t i = 0; i < subpass->color_count; i++) {
+      if (subpass->color_attachments[i].attachment != VK_ATTACHMENT_UNUSED)
+         key->fs.cbufs |= 1 << i;
+   }
+}
+
+static void
+v3dvk_pipeline_init_vs_key(union v3dvk_shader_key *key,
+                           const VkGraphicsPipelineCreateInfo *info,
+                           bool is_coord)
+{
+   v3dvk_shader_key_init(key);
+
+   key->base.is_last_geometry_stage = true;
+   key->vs.is_coord = is_coord;
+   key->vs.per_vertex_point_size =
+      info->pInputAssemblyState->topology == VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+}
+
+VkResult
+v3dvk_CreateGraphicsPipelines(VkDevice _device,
+                              VkPipelineCache pipelineCache,
+                              uint32_t count,
+                              const VkGraphicsPipelineCreateInfo *pCreateInfos,
                               const VkAllocationCallbacks *pAllocator,
-                              VkPipeline *pPipeline)
+                              VkPipeline *pPipelines)
 {
-   return VK_SUCCESS;
+   V3DVK_FROM_HANDLE(v3dvk_device, device, _device);
+   V3DVK_FROM_HANDLE(v3dvk_pipeline_cache, cache, pipelineCache);
+
+   uint32_t stage_count = 0;
+   for (uint32_t i = 0; i < count; i++)
+      stage_count += pCreateInfos[i].stageCount;
+
+   struct v3dvk_pipeline **pipelines;
+   VkResult *results;
+   struct v3dvk_pipeline_stage_job *jobs;
+   struct v3dvk_pipeline_stage_job **wave;
+
+   void *mem = vk_alloc(&device->alloc,
+                        count * (sizeof(*pipelines) + sizeof(*results)) +
+                        stage_count * (sizeof(*jobs) + sizeof(*wave)), 8,
+                        VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+   if (!mem)
+      return vk_error(VK_ERROR_OUT_OF_HOST_MEMORY);
+
+   jobs = mem;
+   wave = (void *)(jobs + stage_count);
+   pipelines = (void *)(wave + stage_count);
+   results = (void *)(pipelines + count);
+
+   /* The first wave translates every stage and compiles the ones that only
+    * depend on pipeline state: the fragment shader, and the coordinate
+    * shader since it only outputs the position.  The vertex shader has to
+    * write the varyings in the order the compiled fragment shader reads
+    * them in, so it is compiled in a second wave.
+    */
+   uint32_t job_count = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      const VkGraphicsPipelineCreateInfo *info = &pCreateInfos[i];
+
+      assert(info->sType == VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO);
+
+      pipelines[i] = v3dvk_pipeline_alloc(device, info->layout, pAllocator);
+      if (!pipelines[i]) {
+         results[i] = vk_error(VK_ERROR_OUT_OF_HOST_MEMORY);
+         continue;
+      }
+      results[i] = VK_SUCCESS;
+
+      for (uint32_t s = 0; s < info->stageCount; s++) {
+         const VkPipelineShaderStageCreateInfo *stage_info =
+            &info->pStages[s];
+         struct v3dvk_pipeline_stage_job *job = &jobs[job_count];
+
+         *job = (struct v3dvk_pipeline_stage_job) {
+            .device = device,
+            .cache = cache,
+            .pipeline = pipelines[i],
+            .pipeline_index = i,
+            .info = stage_info,
+            .alloc = pAllocator,
+            .stage = vk_to_mesa_shader_stage(stage_info->stage),
+         };
+
+         switch (job->stage) {
+         case MESA_SHADER_VERTEX:
+            v3dvk_pipeline_init_vs_key(&job->options.key, info, true);
+            break;
+         case MESA_SHADER_FRAGMENT:
+            v3dvk_pipeline_init_fs_key(&job->options.key, info);
+            break;
+         default:
+            unreachable("unsupported graphics shader stage");
+         }
+
+         pipelines[i]->active_stages |= stage_info->stage;
+         wave[job_count] = job;
+         job_count++;
+      }
+   }
+
+   v3dvk_pipeline_run_jobs(device, wave, job_count,
+                           v3dvk_pipeline_stage_create);
+
+   uint32_t wave_count = 0;
+   for (uint32_t j = 0; j < job_count; j++) {
+      struct v3dvk_pipeline_stage_job *job = &jobs[j];
+      struct v3dvk_pipeline *pipeline = job->pipeline;
+
+      if (job->stage != MESA_SHADER_VERTEX || job->result != VK_SUCCESS)
+         continue;
+
+      v3dvk_pipeline_init_vs_key(&job->options.key,
+                                 &pCreateInfos[job->pipeline_index], false);
+
+      struct v3dvk_shader *fs = pipeline->shaders[MESA_SHADER_FRAGMENT];
+      if (fs && fs->variant) {
+         const struct v3d_fs_prog_data *fs_prog_data =
+            (const struct v3d_fs_prog_data *)fs->variant->prog_data;
+
+         STATIC_ASSERT(sizeof(job->options.key.vs.used_outputs) ==
+                       sizeof(fs_prog_data->input_slots));
+         job->options.key.vs.num_used_outputs = fs_prog_data->num_inputs;
+         memcpy(job->options.key.vs.used_outputs, fs_prog_data->input_slots,
+                sizeof(job->options.key.vs.used_outputs));
+      }
+
+      wave[wave_count++] = job;
+   }
+
+   v3dvk_pipeline_run_jobs(device, wave, wave_count,
+                           v3dvk_pipeline_stage_compile);
+
+   /* Jobs are in pCreateInfos and pStages order, so this picks the first
+    * failing stage of each pipeline.
+    */
+   for (uint32_t j = 0; j < job_count; j++) {
+      uint32_t i = jobs[j].pipeline_index;
+      if (results[i] == VK_SUCCESS)
+         results[i] = jobs[j].result;
+   }
+
+   VkResult result = v3dvk_pipeline_finish_create(device, pipelines, results,
+                                                  count, pAllocator,
+                                                  pPipelines);
+
+   vk_free(&device->alloc, mem);
+
+   return result;
 }
 
 VkResult
@@ -39,17 +335,68 @@ v3dvk_CreateComputePipelines(VkDevice _device,
                              const VkAllocationCallbacks *pAllocator,
                              VkPipeline *pPipelines)
 {
-   VkResult result = VK_SUCCESS;
+   V3DVK_FROM_HANDLE(v3dvk_device, device, _device);
+   V3DVK_FROM_HANDLE(v3dvk_pipeline_cache, cache, pipelineCache);
+
+   struct v3dvk_pipeline **pipelines;
+   VkResult *results;
+   struct v3dvk_pipeline_stage_job *jobs;
+   struct v3dvk_pipeline_stage_job **wave;
+
+   void *mem = vk_alloc(&device->alloc,
+                        count * (sizeof(*pipelines) + sizeof(*results) +
+                                 sizeof(*jobs) + sizeof(*wave)), 8,
+                        VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+   if (!mem)
+      return vk_error(VK_ERROR_OUT_OF_HOST_MEMORY);
+
+   jobs = mem;
+   wave = (void *)(jobs + count);
+   pipelines = (void *)(wave + count);
+   results = (void *)(pipelines + count);
 
-   for (unsigned i = 0; i < count; i++) {
-      VkResult r = v3dvk_compute_pipeline_create(_device, pipelineCache, &pCreateInfos[i],
-                                                 pAllocator, &pPipelines[i]);
-      if (r != VK_SUCCESS) {
-         result = r;
+   uint32_t job_count = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      const VkComputePipelineCreateInfo *info = &pCreateInfos[i];
+
+      assert(info->sType == VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO);
+      assert(info->stage.stage == VK_SHADER_STAGE_COMPUTE_BIT);
+
+      pipelines[i] = v3dvk_pipeline_alloc(device, info->layout, pAllocator);
+      if (!pipelines[i]) {
+         results[i] = vk_error(VK_ERROR_OUT_OF_HOST_MEMORY);
+         continue;
       }
-      pPipelines[i] = VK_NULL_HANDLE;
+      pipelines[i]->active_stages = VK_SHADER_STAGE_COMPUTE_BIT;
+      results[i] = VK_SUCCESS;
+
+      struct v3dvk_pipeline_stage_job *job = &jobs[job_count];
+      *job = (struct v3dvk_pipeline_stage_job) {
+         .device = device,
+         .cache = cache,
+         .pipeline = pipelines[i],
+         .pipeline_index = i,
+         .info = &info->stage,
+         .alloc = pAllocator,
+         .stage = MESA_SHADER_COMPUTE,
+      };
+      v3dvk_shader_key_init(&job->options.key);
+
+      wave[job_count++] = job;
    }
 
+   v3dvk_pipeline_run_jobs(device, wave, job_count,
+                           v3dvk_pipeline_stage_create);
+
+   for (uint32_t j = 0; j < job_count; j++)
+      results[jobs[j].pipeline_index] = jobs[j].result;
+
+   VkResult result = v3dvk_pipeline_finish_create(device, pipelines, results,
+                                                  count, pAllocator,
+                                                  pPipelines);
+
+   vk_free(&device->alloc, mem);
+
    return result;
 }
 
@@ -67,3 +414,201 @@ v3dvk_DestroyPipeline(VkDevice _device,
    v3dvk_pipeline_finish(pipeline, dev, pAllocator);
    vk_free2(&dev->alloc, pAllocator, pipeline);
 }
+
+/* VK_KHR_pipeline_executable_properties: every compiled variant of the
+ * pipeline's shaders is an executable, with the binning variant of the
+ * vertex shader following the rendering one.
+ */
+static const struct v3dvk_shader_variant *
+v3dvk_pipeline_get_executable(const struct v3dvk_pipeline *pipeline,
+                              uint32_t index, bool *binning)
+{
+   for (unsigned i = 0; i < MESA_SHADER_STAGES; i++) {
+      const struct v3dvk_shader *shader = pipeline->shaders[i];
+      if (!shader)
+         continue;
+
+      if (shader->variant) {
+         if (index-- == 0) {
+            *binning = false;
+            return shader->variant;
+         }
+      }
+
+      if (shader->binning_variant) {
+         if (index-- == 0) {
+            *binning = true;
+            return shader->binning_variant;
+         }
+      }
+   }
+
+   return NULL;
+}
+
+#define WRITE_STR(field, ...) ({                               \
+   memset(field, 0, sizeof(field));                            \
+   UNUSED int i = snprintf(field, sizeof(field), __VA_ARGS__); \
+   assert(i > 0 && i < sizeof(field));                         \
+})
+
+VkResult
+v3dvk_GetPipelineExecutablePropertiesKHR(
+    VkDevice                                    device,
+    const VkPipelineInfoKHR*                    pPipelineInfo,
+    uint32_t*                                   pExecutableCount,
+    VkPipelineExecutablePropertiesKHR*          pProperties)
+{
+   V3DVK_FROM_HANDLE(v3dvk_pipeline, pipeline, pPipelineInfo->pipeline);
+   VK_OUTARRAY_MAKE(out, pProperties, pExecutableCount);
+
+   const struct v3dvk_shader_variant *variant;
+   bool binning;
+   for (uint32_t i = 0;
+        (variant = v3dvk_pipeline_get_executable(pipeline, i, &binning));
+        i++) {
+      vk_outarray_append(&out, props) {
+         props->stages = 1 << variant->stage;
+         WRITE_STR(props->name, "%s%s",
+                   _mesa_shader_stage_to_abbrev(variant->stage),
+                   binning ? " (binning)" : "");
+         WRITE_STR(props->description, "%s%s shader",
+                   _mesa_shader_stage_to_string(variant->stage),
+                   binning ? " binning" : "");
+         props->subgroupSize = 16;
+      }
+   }
+
+   return vk_outarray_status(&out);
+}
+
+VkResult
+v3dvk_GetPipelineExecutableStatisticsKHR(
+    VkDevice                                    device,
+    const VkPipelineExecutableInfoKHR*          pExecutableInfo,
+    uint32_t*                                   pStatisticCount,
+    VkPipelineExecutableStatisticKHR*           pStatistics)
+{
+   V3DVK_FROM_HANDLE(v3dvk_pipeline, pipeline, pExecutableInfo->pipeline);
+   VK_OUTARRAY_MAKE(out, pStatistics, pStatisticCount);
+
+   bool binning;
+   const struct v3dvk_shader_variant *variant =
+      v3dvk_pipeline_get_executable(pipeline,
+                                    pExecutableInfo->executableIndex,
+                                    &binning);
+   assert(variant);
+
+   const struct v3d_prog_data *prog_data = variant->prog_data;
+   const struct v3d_qpu_estimate *estimate = &prog_data->estimate;
+   const struct {
+      const char *name;
+      const char *description;
+      uint64_t value;
+   } stats[] = {
+      { "Instruction Count",
+        "Number of QPU instructions in the final generated shader",
+        variant->qpu_size / sizeof(uint64_t) },
+      { "Threads",
+        "Number of threads the shader runs with on each QPU",
+        prog_data->threads },
+      { "Spill Size",
+        "Bytes of scratch space per thread used for spilled registers",
+        prog_data->spill_size },
+      { "Estimated Cycles",
+        "Estimated cycles per thread, with loops weighted by their trip "
+        "counts and the stalls not hidden by other threads",
+        estimate->cycles },
+      { "Critical Path",
+        "Estimated cycles of the longest chain of dependent instructions",
+        estimate->critical_path },
+      { "TMU Stall Cycles",
+        "Estimated cycles spent waiting on texture and memory lookups",
+        estimate->tmu_stall_cycles },
+      { "Latency Stall Cycles",
+        "Estimated cycles spent waiting on other instruction latencies",
+        estimate->latency_stall_cycles },
+      { "TMU Reads",
+        "Estimated number of TMU results read per thread",
+        estimate->tmu_reads },
+      { "SFU Operations",
+        "Estimated number of special function unit operations per thread",
+        estimate->sfu_ops },
+      { "Unknown Loops",
+        "Number of loops whose trip count had to be guessed",
+        estimate->unknown_loops },
+   };
+
+   for (unsigned i = 0; i < ARRAY_SIZE(stats); i++) {
+      vk_outarray_append(&out, stat) {
+         WRITE_STR(stat->name, "%s", stats[i].name);
+         WRITE_STR(stat->description, "%s", stats[i].description);
+         stat->format = VK_PIPELINE_EXECUTABLE_STATISTIC_FORMAT_UINT64_KHR;
+         stat->value.u64 = stats[i].value;
+      }
+   }
+
+   return vk_outarray_status(&out);
+}
+
+static bool
+write_ir_text(VkPipelineExecutableInternalRepresentationKHR *ir,
+              const char *data)
+{
+   ir->isText = VK_TRUE;
+
+   size_t data_len = strlen(data) + 1;
+
+   if (ir->pData == NULL) {
+      ir->dataSize = data_len;
+      return true;
+   }
+
+   strncpy(ir->pData, data, ir->dataSize);
+   if (ir->dataSize < data_len)
+      return false;
+
+   ir->dataSize = data_len;
+   return true;
+}
+
+VkResult
+v3dvk_GetPipelineExecutableInternalRepresentationsKHR(
+    VkDevice                                    _device,
+    const VkPipelineExecutableInfoKHR*          pExecutableInfo,
+    uint32_t*                                   pInternalRepresentationCount,
+    VkPipelineExecutableInternalRepresentationKHR* pInternalRepresentations)
+{
+   V3DVK_FROM_HANDLE(v3dvk_device, device, _device);
+   V3DVK_FROM_HANDLE(v3dvk_pipeline, pipeline, pExecutableInfo->pipeline);
+   VK_OUTARRAY_MAKE(out, pInternalRepresentations,
+                    pInternalRepresentationCount);
+   bool incomplete_text = false;
+
+   bool binning;
+   const struct v3dvk_shader_variant *variant =
+      v3dvk_pipeline_get_executable(pipeline,
+                                    pExecutableInfo->executableIndex,
+                                    &binning);
+   assert(variant);
+
+   vk_outarray_append(&out, ir) {
+      WRITE_STR(ir->name, "QPU Assembly");
+      WRITE_STR(ir->description, "Final QPU instructions of the shader");
+
+      char *text = ralloc_strdup(NULL, "");
+      for (uint32_t i = 0; i < variant->qpu_size / sizeof(uint64_t); i++) {
+         const char *inst = v3d_qpu_disasm(&device->info,
+                                           variant->qpu_insts[i]);
+         ralloc_asprintf_append(&text, "%s\n", inst);
+         ralloc_free((char *)inst);
+      }
+
+      if (!write_ir_text(ir, text))
+         incomplete_text = true;
+
+      ralloc_free(text);
+   }
+
+   return incomplete_text ? VK_INCOMPLETE : vk_outarray_status(&out);
+}
@@ -1,8 +1,18 @@
 #ifndef V3DVK_PIPELINE_H
 #define V3DVK_PIPELINE_H
 
+#include <vulkan/vulkan.h>
+#include "compiler/shader_enums.h"
+
+struct v3dvk_pipeline_layout;
+struct v3dvk_shader;
+
 struct v3dvk_pipeline
 {
+   struct v3dvk_pipeline_layout *layout;
+
+   VkShaderStageFlags active_stages;
+   struct v3dvk_shader *shaders[MESA_SHADER_STAGES];
 #if 0
    struct tu_cs cs;
 
@@ -1,47 +1,330 @@
 
 #include <assert.h>
+#include <string.h>
+#include "compiler/v3d_compiler.h"
+#include "util/blob.h"
+#include "util/disk_cache.h"
+#include "util/hash_table.h"
+#include "util/ralloc.h"
+#include "util/u_atomic.h"
 #include "vk_alloc.h"
 #include "common.h"
 #include "device.h"
+#include "instance.h"
 #include "v3dvk_error.h"
 #include "v3dvk_pipeline_cache.h"
 
-static void
+struct cache_header {
+   uint32_t header_size;
+   uint32_t header_version;
+   uint32_t vendor_id;
+   uint32_t device_id;
+   uint8_t  uuid[VK_UUID_SIZE];
+};
+
+static uint32_t
+sha1_hash_func(const void *sha1)
+{
+   return _mesa_hash_data(sha1, 20);
+}
+
+static bool
+sha1_compare_func(const void *sha1_a, const void *sha1_b)
+{
+   return memcmp(sha1_a, sha1_b, 20) == 0;
+}
+
+static size_t
+v3dvk_prog_data_size(gl_shader_stage stage)
+{
+   switch (stage) {
+   case MESA_SHADER_VERTEX:
+      return sizeof(struct v3d_vs_prog_data);
+   case MESA_SHADER_GEOMETRY:
+      return sizeof(struct v3d_gs_prog_data);
+   case MESA_SHADER_FRAGMENT:
+      return sizeof(struct v3d_fs_prog_data);
+   case MESA_SHADER_COMPUTE:
+      return sizeof(struct v3d_compute_prog_data);
+   default:
+      unreachable("unsupported shader stage");
+   }
+}
+
+static struct v3dvk_shader_variant *
+v3dvk_shader_variant_create(const unsigned char sha1[20],
+                            gl_shader_stage stage,
+                            struct v3d_prog_data *prog_data,
+                            const uint64_t *qpu_insts,
+                            uint32_t qpu_size)
+{
+   struct v3dvk_shader_variant *variant =
+      rzalloc(NULL, struct v3dvk_shader_variant);
+   if (!variant)
+      return NULL;
+
+   variant->ref_cnt = 1;
+   memcpy(variant->sha1, sha1, sizeof(variant->sha1));
+   variant->stage = stage;
+   variant->prog_data = prog_data;
+   ralloc_steal(variant, prog_data);
+
+   variant->qpu_size = qpu_size;
+   variant->qpu_insts = ralloc_size(variant, MAX2(qpu_size, 1));
+   if (!variant->qpu_insts) {
+      ralloc_free(variant);
+      return NULL;
+   }
+   memcpy(variant->qpu_insts, qpu_insts, qpu_size);
+
+   return variant;
+}
+
+struct v3dvk_shader_variant *
+v3dvk_shader_variant_ref(struct v3dvk_shader_variant *variant)
+{
+   assert(variant && variant->ref_cnt >= 1);
+   p_atomic_inc(&variant->ref_cnt);
+   return variant;
+}
+
+void
+v3dvk_shader_variant_unref(struct v3dvk_shader_variant *variant)
+{
+   assert(variant && variant->ref_cnt >= 1);
+   if (p_atomic_dec_zero(&variant->ref_cnt))
+      ralloc_free(variant);
+}
+
+void
+v3dvk_shader_variant_serialize(const struct v3dvk_shader_variant *variant,
+                               struct blob *blob)
+{
+   const struct v3d_uniform_list *ulist = &variant->prog_data->uniforms;
+
+   blob_write_bytes(blob, variant->sha1, sizeof(variant->sha1));
+   blob_write_uint32(blob, variant->stage);
+
+   /* The uniform list pointers are meaningless outside of this process, the
+    * arrays follow the struct and get patched back in on load.
+    */
+   blob_write_bytes(blob, variant->prog_data,
+                    v3dvk_prog_data_size(variant->stage));
+   blob_write_uint32(blob, ulist->count);
+   blob_write_bytes(blob, ulist->contents,
+                    ulist->count * sizeof(*ulist->contents));
+   blob_write_bytes(blob, ulist->data, ulist->count * sizeof(*ulist->data));
+
+   blob_write_uint32(blob, variant->qpu_size);
+   blob_write_bytes(blob, variant->qpu_insts, variant->qpu_size);
+}
+
+struct v3dvk_shader_variant *
+v3dvk_shader_variant_deserialize(struct blob_reader *blob)
+{
+   const unsigned char *sha1 = blob_read_bytes(blob, 20);
+   gl_shader_stage stage = blob_read_uint32(blob);
+   if (blob->overrun)
+      return NULL;
+
+   switch (stage) {
+   case MESA_SHADER_VERTEX:
+   case MESA_SHADER_GEOMETRY:
+   case MESA_SHADER_FRAGMENT:
+   case MESA_SHADER_COMPUTE:
+      break;
+   default:
+      blob->overrun = true;
+      return NULL;
+   }
+
+   size_t prog_data_size = v3dvk_prog_data_size(stage);
+   const void *prog_data_bytes = blob_read_bytes(blob, prog_data_size);
+   uint32_t uniform_count = blob_read_uint32(blob);
+   if (uniform_count > (blob->end - blob->current) / sizeof(uint32_t)) {
+      blob->overrun = true;
+      return NULL;
+   }
+   const void *contents =
+      blob_read_bytes(blob, uniform_count * sizeof(enum quniform_contents));
+   const void *data = blob_read_bytes(blob, uniform_count * sizeof(uint32_t));
+   uint32_t qpu_size = blob_read_uint32(blob);
+   const void *qpu_insts = blob_read_bytes(blob, qpu_size);
+   if (blob->overrun)
+      return NULL;
+
+   struct v3d_prog_data *prog_data = ralloc_size(NULL, prog_data_size);
+   if (!prog_data)
+      return NULL;
+   memcpy(prog_data, prog_data_bytes, prog_data_size);
+
+   struct v3d_uniform_list *ulist = &prog_data->uniforms;
+   ulist->count = uniform_count;
+   ulist->contents =
+      ralloc_array(prog_data, enum quniform_contents, uniform_count);
+   ulist->data = ralloc_array(prog_data, uint32_t, uniform_count);
+   if (uniform_count && (!ulist->contents || !ulist->data)) {
+      ralloc_free(prog_data);
+      return NULL;
+   }
+   memcpy(ulist->contents, contents,
+          uniform_count * sizeof(enum quniform_contents));
+   memcpy(ulist->data, data, uniform_count * sizeof(uint32_t));
+
+   struct v3dvk_shader_variant *variant =
+      v3dvk_shader_variant_create(sha1, stage, prog_data, qpu_insts, qpu_size);
+   if (!variant)
+      ralloc_free(prog_data);
+
+   return variant;
+}
+
+void
 v3dvk_pipeline_cache_init(struct v3dvk_pipeline_cache *cache,
-                          struct v3dvk_device *device)
+                          struct v3dvk_device *device,
+                          bool cache_enabled)
 {
    cache->device = device;
-#if 0
    pthread_mutex_init(&cache->mutex, NULL);
 
    cache->modified = false;
-   cache->kernel_count = 0;
-   cache->total_size = 0;
-   cache->table_size = 1024;
-   const size_t byte_size = cache->table_size * sizeof(cache->hash_table[0]);
-   cache->hash_table = malloc(byte_size);
-
-   /* We don't consider allocation failure fatal, we just start with a 0-sized
-    * cache. Disable caching when we want to keep shader debug info, since
-    * we don't get the debug info on cached shaders. */
-   if (cache->hash_table == NULL)
-      cache->table_size = 0;
-   else
-      memset(cache->hash_table, 0, byte_size);
-#endif
+
+   /* We don't consider allocation failure fatal, we just run without an
+    * in-memory cache.
+    */
+   if (cache_enabled) {
+      cache->variants = _mesa_hash_table_create(NULL, sha1_hash_func,
+                                                sha1_compare_func);
+   } else {
+      cache->variants = NULL;
+   }
 }
 
-static void
+void
 v3dvk_pipeline_cache_finish(struct v3dvk_pipeline_cache *cache)
 {
-#if 0
-   for (unsigned i = 0; i < cache->table_size; ++i)
-      if (cache->hash_table[i]) {
-         vk_free(&cache->alloc, cache->hash_table[i]);
-      }
    pthread_mutex_destroy(&cache->mutex);
-   free(cache->hash_table);
+
+   if (cache->variants) {
+      hash_table_foreach(cache->variants, entry)
+         v3dvk_shader_variant_unref(entry->data);
+
+      _mesa_hash_table_destroy(cache->variants, NULL);
+   }
+}
+
+/* Adds a reference to @variant to the cache, unless the cache already has a
+ * variant with the same hash.  Must be called with the cache mutex held.
+ */
+static void
+v3dvk_pipeline_cache_add_variant_locked(struct v3dvk_pipeline_cache *cache,
+                                        struct v3dvk_shader_variant *variant)
+{
+   if (_mesa_hash_table_search(cache->variants, variant->sha1))
+      return;
+
+   v3dvk_shader_variant_ref(variant);
+   _mesa_hash_table_insert(cache->variants, variant->sha1, variant);
+   cache->modified = true;
+}
+
+#ifdef ENABLE_SHADER_CACHE
+static struct disk_cache *
+v3dvk_pipeline_cache_disk_cache(struct v3dvk_pipeline_cache *cache)
+{
+   return cache->device->instance->physicalDevice.disk_cache;
+}
 #endif
+
+struct v3dvk_shader_variant *
+v3dvk_pipeline_cache_search(struct v3dvk_pipeline_cache *cache,
+                            const unsigned char sha1[20])
+{
+   struct v3dvk_shader_variant *variant = NULL;
+
+   if (cache->variants) {
+      pthread_mutex_lock(&cache->mutex);
+
+      struct hash_entry *entry =
+         _mesa_hash_table_search(cache->variants, sha1);
+      if (entry)
+         variant = v3dvk_shader_variant_ref(entry->data);
+
+      pthread_mutex_unlock(&cache->mutex);
+
+      if (variant)
+         return variant;
+   }
+
+#ifdef ENABLE_SHADER_CACHE
+   struct disk_cache *disk_cache = v3dvk_pipeline_cache_disk_cache(cache);
+   if (disk_cache) {
+      cache_key cache_key;
+      disk_cache_compute_key(disk_cache, sha1, 20, cache_key);
+
+      size_t buffer_size;
+      uint8_t *buffer = disk_cache_get(disk_cache, cache_key, &buffer_size);
+      if (buffer) {
+         struct blob_reader blob;
+         blob_reader_init(&blob, buffer, buffer_size);
+         variant = v3dvk_shader_variant_deserialize(&blob);
+         free(buffer);
+
+         /* A hash mismatch means a key collision or a corrupt entry. */
+         if (variant && memcmp(variant->sha1, sha1, 20) != 0) {
+            v3dvk_shader_variant_unref(variant);
+            variant = NULL;
+         }
+
+         if (variant && cache->variants) {
+            pthread_mutex_lock(&cache->mutex);
+            v3dvk_pipeline_cache_add_variant_locked(cache, variant);
+            pthread_mutex_unlock(&cache->mutex);
+         }
+      }
+   }
+#endif
+
+   return variant;
+}
+
+struct v3dvk_shader_variant *
+v3dvk_pipeline_cache_upload(struct v3dvk_pipeline_cache *cache,
+                            const unsigned char sha1[20],
+                            gl_shader_stage stage,
+                            struct v3d_prog_data *prog_data,
+                            const uint64_t *qpu_insts,
+                            uint32_t qpu_size)
+{
+   struct v3dvk_shader_variant *variant =
+      v3dvk_shader_variant_create(sha1, stage, prog_data, qpu_insts, qpu_size);
+   if (!variant) {
+      ralloc_free(prog_data);
+      return NULL;
+   }
+
+   if (cache->variants) {
+      pthread_mutex_lock(&cache->mutex);
+      v3dvk_pipeline_cache_add_variant_locked(cache, variant);
+      pthread_mutex_unlock(&cache->mutex);
+   }
+
+#ifdef ENABLE_SHADER_CACHE
+   struct disk_cache *disk_cache = v3dvk_pipeline_cache_disk_cache(cache);
+   if (disk_cache) {
+      struct blob binary;
+      blob_init(&binary);
+      v3dvk_shader_variant_serialize(variant, &binary);
+      if (!binary.out_of_memory) {
+         cache_key cache_key;
+         disk_cache_compute_key(disk_cache, sha1, 20, cache_key);
+         disk_cache_put(disk_cache, cache_key, binary.data, binary.size, NULL);
+      }
+      blob_finish(&binary);
+   }
+#endif
+
+   return variant;
 }
 
 static void
@@ -50,45 +333,42 @@ v3dvk_pipeline_cache_load(struct v3dvk_pipeline_cache *cache,
                           size_t size)
 {
    struct v3dvk_device *device = cache->device;
-#if 0
-   struct cache_header header;
+   struct v3dvk_physical_device *pdevice = &device->instance->physicalDevice;
+
+   if (cache->variants == NULL)
+      return;
+
+   struct blob_reader blob;
+   blob_reader_init(&blob, data, size);
 
-   if (size < sizeof(header))
+   struct cache_header header;
+   blob_copy_bytes(&blob, &header, sizeof(header));
+   uint32_t count = blob_read_uint32(&blob);
+   if (blob.overrun)
       return;
-   memcpy(&header, data, sizeof(header));
+
    if (header.header_size < sizeof(header))
       return;
    if (header.header_version != VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
       return;
-   if (header.vendor_id != 0 /* TODO */)
+   if (header.vendor_id != 0)
       return;
-   if (header.device_id != 0 /* TODO */)
+   if (header.device_id != pdevice->info.ver)
       return;
-   if (memcmp(header.uuid, device->physical_device->cache_uuid,
-              VK_UUID_SIZE) != 0)
+   if (memcmp(header.uuid, pdevice->pipeline_cache_uuid, VK_UUID_SIZE) != 0)
       return;
 
-   char *end = (void *) data + size;
-   char *p = (void *) data + header.header_size;
-
-   while (end - p >= sizeof(struct cache_entry)) {
-      struct cache_entry *entry = (struct cache_entry *) p;
-      struct cache_entry *dest_entry;
-      size_t size = entry_size(entry);
-      if (end - p < size)
+   pthread_mutex_lock(&cache->mutex);
+   for (uint32_t i = 0; i < count; i++) {
+      struct v3dvk_shader_variant *variant =
+         v3dvk_shader_variant_deserialize(&blob);
+      if (!variant)
          break;
 
-      dest_entry =
-         vk_alloc(&cache->alloc, size, 8, VK_SYSTEM_ALLOCATION_SCOPE_CACHE);
-      if (dest_entry) {
-         memcpy(dest_entry, entry, size);
-         for (int i = 0; i < MESA_SHADER_STAGES; ++i)
-            dest_entry->variants[i] = NULL;
-         tu_pipeline_cache_add_entry(cache, dest_entry);
-      }
-      p += size;
+      v3dvk_pipeline_cache_add_variant_locked(cache, variant);
+      v3dvk_shader_variant_unref(variant);
    }
-#endif
+   pthread_mutex_unlock(&cache->mutex);
 }
 
 VkResult
@@ -113,7 +393,8 @@ v3dvk_CreatePipelineCache(VkDevice _device,
    else
       cache->alloc = device->alloc;
 
-   v3dvk_pipeline_cache_init(cache, device);
+   v3dvk_pipeline_cache_init(cache, device,
+                             device->instance->pipeline_cache_enabled);
 
    if (pCreateInfo->initialDataSize > 0) {
       v3dvk_pipeline_cache_load(cache, pCreateInfo->pInitialData,
@@ -139,3 +420,112 @@ v3dvk_DestroyPipelineCache(VkDevice _device,
 
    vk_free2(&device->alloc, pAllocator, cache);
 }
+
+VkResult
+v3dvk_GetPipelineCacheData(VkDevice _device,
+                           VkPipelineCache _cache,
+                           size_t *pDataSize,
+                           void *pData)
+{
+   V3DVK_FROM_HANDLE(v3dvk_device, device, _device);
+   V3DVK_FROM_HANDLE(v3dvk_pipeline_cache, cache, _cache);
+   struct v3dvk_physical_device *pdevice = &device->instance->physicalDevice;
+
+   /* A NULL pData makes the blob only count the bytes written. */
+   struct blob blob;
+   if (pData) {
+      blob_init_fixed(&blob, pData, *pDataSize);
+   } else {
+      blob_init_fixed(&blob, NULL, SIZE_MAX);
+   }
+
+   struct cache_header header = {
+      .header_size = sizeof(struct cache_header),
+      .header_version = VK_PIPELINE_CACHE_HEADER_VERSION_ONE,
+      .vendor_id = 0,
+      .device_id = pdevice->info.ver,
+   };
+   memcpy(header.uuid, pdevice->pipeline_cache_uuid, VK_UUID_SIZE);
+   blob_write_bytes(&blob, &header, sizeof(header));
+
+   uint32_t count = 0;
+   intptr_t count_offset = blob_reserve_uint32(&blob);
+   if (count_offset < 0) {
+      *pDataSize = 0;
+      blob_finish(&blob);
+      return VK_INCOMPLETE;
+   }
+
+   VkResult result = VK_SUCCESS;
+   if (cache->variants) {
+      pthread_mutex_lock(&cache->mutex);
+      hash_table_foreach(cache->variants, entry) {
+         size_t save_size = blob.size;
+         v3dvk_shader_variant_serialize(entry->data, &blob);
+         if (blob.out_of_memory) {
+            /* Only hand out whole entries. */
+            blob.size = save_size;
+            result = VK_INCOMPLETE;
+            break;
+         }
+         count++;
+      }
+      pthread_mutex_unlock(&cache->mutex);
+   }
+
+   blob_overwrite_uint32(&blob, count_offset, count);
+
+   *pDataSize = blob.size;
+
+   blob_finish(&blob);
+
+   return result;
+}
+
+VkResult
+v3dvk_MergePipelineCaches(VkDevice _device,
+                          VkPipelineCache destCache,
+                          uint32_t srcCacheCount,
+                          const VkPipelineCache *pSrcCaches)
+{
+   V3DVK_FROM_HANDLE(v3dvk_pipeline_cache, dst, destCache);
+
+   if (!dst->variants)
+      return VK_SUCCESS;
+
+   /* Copy each source's variants out under its own lock, and only then add
+    * them under the destination's, so that merges in opposite directions
+    * on other threads can't deadlock.
+    */
+   for (uint32_t i = 0; i < srcCacheCount; i++) {
+      V3DVK_FROM_HANDLE(v3dvk_pipeline_cache, src, pSrcCaches[i]);
+      if (!src->variants)
+         continue;
+
+      pthread_mutex_lock(&src->mutex);
+      uint32_t count = 0;
+      struct v3dvk_shader_variant **variants =
+         vk_alloc(&dst->alloc,
+                  MAX2(src->variants->entries, 1) * sizeof(*variants), 8,
+                  VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+      if (!variants) {
+         pthread_mutex_unlock(&src->mutex);
+         return v3dvk_error(dst->device->instance,
+                            VK_ERROR_OUT_OF_HOST_MEMORY);
+      }
+      hash_table_foreach(src->variants, entry)
+         variants[count++] = v3dvk_shader_variant_ref(entry->data);
+      pthread_mutex_unlock(&src->mutex);
+
+      pthread_mutex_lock(&dst->mutex);
+      for (uint32_t j = 0; j < count; j++)
+         v3dvk_pipeline_cache_add_variant_locked(dst, variants[j]);
+      pthread_mutex_unlock(&dst->mutex);
+
+      for (uint32_t j = 0; j < count; j++)
+         v3dvk_shader_variant_unref(variants[j]);
+      vk_free(&dst->alloc, variants);
+   }
+
+   return VK_SUCCESS;
+}
@@ -2,21 +2,89 @@
 #ifndef V3DVK_PIPELINE_CACHE_H
 #define V3DVK_PIPELINE_CACHE_H
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <vulkan/vulkan.h>
+#include "compiler/shader_enums.h"
+
+struct blob;
+struct blob_reader;
+struct hash_table;
+struct v3d_prog_data;
+struct v3dvk_device;
+
+/* A compiled shader, as stored in a pipeline cache.  Variants are reference
+ * counted so that pipelines can keep using them after the cache they came
+ * from has been destroyed.
+ */
+struct v3dvk_shader_variant
+{
+   uint32_t ref_cnt;
+
+   /* Hash of the SPIR-V, entrypoint, specialization constants and
+    * v3d_key the variant was compiled from.
+    */
+   unsigned char sha1[20];
+   gl_shader_stage stage;
+
+   /* ralloc'ed, owns the uniform list arrays. */
+   struct v3d_prog_data *prog_data;
+
+   uint64_t *qpu_insts;
+   uint32_t qpu_size;
+};
 
 struct v3dvk_pipeline_cache
 {
    struct v3dvk_device *device;
-#if 0
    pthread_mutex_t mutex;
 
-   uint32_t total_size;
-   uint32_t table_size;
-   uint32_t kernel_count;
-   struct cache_entry **hash_table;
+   /* sha1 -> struct v3dvk_shader_variant, NULL if caching is disabled. */
+   struct hash_table *variants;
    bool modified;
-#endif
+
    VkAllocationCallbacks alloc;
 };
 
+void
+v3dvk_pipeline_cache_init(struct v3dvk_pipeline_cache *cache,
+                          struct v3dvk_device *device,
+                          bool cache_enabled);
+
+void
+v3dvk_pipeline_cache_finish(struct v3dvk_pipeline_cache *cache);
+
+/* Looks up a variant in @cache and then in the on-disk cache.  Returns a
+ * new reference or NULL.
+ */
+struct v3dvk_shader_variant *
+v3dvk_pipeline_cache_search(struct v3dvk_pipeline_cache *cache,
+                            const unsigned char sha1[20]);
+
+/* Creates a variant from the output of v3d_compile() and adds it to @cache
+ * and to the on-disk cache.  Takes ownership of @prog_data.  Returns a new
+ * reference or NULL on allocation failure.
+ */
+struct v3dvk_shader_variant *
+v3dvk_pipeline_cache_upload(struct v3dvk_pipeline_cache *cache,
+                            const unsigned char sha1[20],
+                            gl_shader_stage stage,
+                            struct v3d_prog_data *prog_data,
+                            const uint64_t *qpu_insts,
+                            uint32_t qpu_size);
+
+struct v3dvk_shader_variant *
+v3dvk_shader_variant_ref(struct v3dvk_shader_variant *variant);
+
+void
+v3dvk_shader_variant_unref(struct v3dvk_shader_variant *variant);
+
+void
+v3dvk_shader_variant_serialize(const struct v3dvk_shader_variant *variant,
+                               struct blob *blob);
+
+struct v3dvk_shader_variant *
+v3dvk_shader_variant_deserialize(struct blob_reader *blob);
+
 #endif
@@ -1,10 +1,209 @@
 
 #include <assert.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <libsync.h>
 #include <vulkan/vulkan.h>
 #include "common.h"
 #include "device.h"
+#include "vk_alloc.h"
 #include "v3dvk_cmd_buffer.h"
+#include "v3dvk_error.h"
+#include "v3dvk_fence.h"
 #include "v3dvk_queue.h"
+#include "v3dvk_semaphore.h"
+
+/* One VkSubmitInfo, with the handles resolved. */
+struct v3dvk_queue_batch {
+   uint32_t wait_count;
+   uint32_t cmd_buffer_count;
+   uint32_t signal_count;
+   struct v3dvk_semaphore **waits;
+   struct v3dvk_cmd_buffer **cmd_buffers;
+   struct v3dvk_semaphore **signals;
+};
+
+/* A vkQueueSubmit() call, as handed to the submit thread.  The batches and
+ * the arrays they point to live in the same allocation, right after it.
+ */
+struct v3dvk_queue_submit {
+   struct v3dvk_queue *queue;
+   struct util_queue_fence fence;
+
+   struct v3dvk_fence *vk_fence;
+
+   uint32_t batch_count;
+   struct v3dvk_queue_batch batches[0];
+};
+
+static uint32_t
+v3dvk_semaphore_syncobj(const struct v3dvk_semaphore *sem)
+{
+   const struct v3dvk_semaphore_impl *impl =
+      sem->temporary.type != V3DVK_SEMAPHORE_TYPE_NONE ?
+      &sem->temporary : &sem->permanent;
+
+   return impl->type == V3DVK_SEMAPHORE_TYPE_DRM_SYNCOBJ ? impl->syncobj : 0;
+}
+
+/* Returns a sync file that signals once everything submitted to the queue
+ * so far, including waits not consumed by a job yet, is done.
+ */
+static int
+v3dvk_queue_export_sync_file(struct v3dvk_queue *queue)
+{
+   int fd = queue->device->fd;
+   int sync_fd, wait_fd, merged_fd;
+
+   if (drmSyncobjExportSyncFile(fd, queue->last_job_syncobj, &sync_fd))
+      return -1;
+
+   if (!queue->has_pending_wait)
+      return sync_fd;
+
+   if (drmSyncobjExportSyncFile(fd, queue->wait_syncobj, &wait_fd)) {
+      close(sync_fd);
+      return -1;
+   }
+
+   merged_fd = sync_merge("v3dvk", sync_fd, wait_fd);
+   close(sync_fd);
+   close(wait_fd);
+
+   return merged_fd;
+}
+
+/* Folds the fence currently in @syncobj into the wait of the next job. */
+static VkResult
+v3dvk_queue_add_wait(struct v3dvk_queue *queue, uint32_t syncobj)
+{
+   struct v3dvk_device *device = queue->device;
+   int sync_fd;
+
+   if (drmSyncobjExportSyncFile(device->fd, syncobj, &sync_fd))
+      return v3dvk_device_set_lost(device, "semaphore export failed: %m");
+
+   if (queue->has_pending_wait) {
+      int wait_fd, merged_fd;
+
+      if (drmSyncobjExportSyncFile(device->fd, queue->wait_syncobj,
+                                   &wait_fd)) {
+         close(sync_fd);
+         return v3dvk_device_set_lost(device, "wait export failed: %m");
+      }
+
+      merged_fd = sync_merge("v3dvk", wait_fd, sync_fd);
+      close(wait_fd);
+      close(sync_fd);
+      if (merged_fd < 0)
+         return v3dvk_device_set_lost(device, "sync_merge failed: %m");
+
+      sync_fd = merged_fd;
+   }
+
+   int ret = drmSyncobjImportSyncFile(device->fd, queue->wait_syncobj,
+                                      sync_fd);
+   close(sync_fd);
+   if (ret)
+      return v3dvk_device_set_lost(device, "wait import failed: %m");
+
+   queue->has_pending_wait = true;
+
+   return VK_SUCCESS;
+}
+
+static VkResult
+v3dvk_queue_submit_batch(struct v3dvk_queue *queue,
+                         const struct v3dvk_queue_batch *batch)
+{
+   struct v3dvk_device *device = queue->device;
+   VkResult result;
+
+   for (uint32_t i = 0; i < batch->wait_count; i++) {
+      uint32_t syncobj = v3dvk_semaphore_syncobj(batch->waits[i]);
+      if (!syncobj)
+         continue;
+
+      result = v3dvk_queue_add_wait(queue, syncobj);
+      if (result != VK_SUCCESS)
+         return result;
+
+      /* Waiting on a semaphore unsignals it. */
+      drmSyncobjReset(device->fd, &syncobj, 1);
+   }
+
+   /* The kernel runs our jobs in submission order, so only the first job
+    * after a wait needs to depend on it, and every job signals the same
+    * queue syncobj.
+    */
+   for (uint32_t i = 0; i < batch->cmd_buffer_count; i++) {
+      struct v3dvk_cmd_buffer *cmd_buffer = batch->cmd_buffers[i];
+
+      /* Nothing was rendered, there is no job to submit. */
+      if (!cmd_buffer->rcl.bo)
+         continue;
+
+      uint32_t in_sync = queue->has_pending_wait ? queue->wait_syncobj : 0;
+      result = v3dvk_cmd_buffer_execbuf(device, cmd_buffer, in_sync,
+                                        queue->last_job_syncobj);
+      if (result != VK_SUCCESS)
+         return result;
+
+      queue->has_pending_wait = false;
+   }
+
+   if (batch->signal_count == 0)
+      return VK_SUCCESS;
+
+   int sync_fd = v3dvk_queue_export_sync_file(queue);
+   if (sync_fd < 0)
+      return v3dvk_device_set_lost(device, "queue export failed: %m");
+
+   for (uint32_t i = 0; i < batch->signal_count; i++) {
+      uint32_t syncobj = v3dvk_semaphore_syncobj(batch->signals[i]);
+      if (syncobj && drmSyncobjImportSyncFile(device->fd, syncobj, sync_fd)) {
+         close(sync_fd);
+         return v3dvk_device_set_lost(device, "semaphore import failed: %m");
+      }
+   }
+   close(sync_fd);
+
+   return VK_SUCCESS;
+}
+
+static void
+v3dvk_queue_submit_execute(void *job, int thread_index)
+{
+   struct v3dvk_queue_submit *submit = job;
+   struct v3dvk_queue *queue = submit->queue;
+   VkResult result = VK_SUCCESS;
+
+   if (v3dvk_device_is_lost(queue->device))
+      return;
+
+   for (uint32_t i = 0; i < submit->batch_count; i++) {
+      result = v3dvk_queue_submit_batch(queue, &submit->batches[i]);
+      if (result != VK_SUCCESS)
+         return;
+   }
+
+   if (submit->vk_fence) {
+      int sync_fd = v3dvk_queue_export_sync_file(queue);
+      if (sync_fd < 0) {
+         v3dvk_device_set_lost(queue->device, "fence export failed: %m");
+         return;
+      }
+      v3dvk_fence_set_sync_file(submit->vk_fence, sync_fd);
+   }
+}
+
+static void
+v3dvk_queue_submit_cleanup(void *job, int thread_index)
+{
+   struct v3dvk_queue_submit *submit = job;
+
+   vk_free(&submit->queue->device->alloc, submit);
+}
 
 VkResult v3dvk_QueueSubmit(
     VkQueue                                     _queue,
@@ -18,153 +217,128 @@ VkResult v3dvk_QueueSubmit(
    /* Query for device status prior to submitting.  Technically, we don't need
     * to do this.  However, if we have a client that's submitting piles of
     * garbage, we would rather break as early as possible to keep the GPU
-    * hanging contained.  If we don't check here, we'll either be waiting for
-    * the kernel to kick us or we'll have to wait until the client waits on a
-    * fence before we actually know whether or not we've hung.
+    * hanging contained.
     */
    VkResult result = v3dvk_device_query_status(device);
    if (result != VK_SUCCESS)
       return result;
 
-#if 0
-   /* We lock around QueueSubmit for three main reasons:
-    *
-    *  1) When a block pool is resized, we create a new gem handle with a
-    *     different size and, in the case of surface states, possibly a
-    *     different center offset but we re-use the same anv_bo struct when
-    *     we do so.  If this happens in the middle of setting up an execbuf,
-    *     we could end up with our list of BOs out of sync with our list of
-    *     gem handles.
-    *
-    *  2) The algorithm we use for building the list of unique buffers isn't
-    *     thread-safe.  While the client is supposed to syncronize around
-    *     QueueSubmit, this would be extremely difficult to debug if it ever
-    *     came up in the wild due to a broken app.  It's better to play it
-    *     safe and just lock around QueueSubmit.
-    *
-    *  3)  The anv_cmd_buffer_execbuf function may perform relocations in
-    *      userspace.  Due to the fact that the surface state buffer is shared
-    *      between batches, we can't afford to have that happen from multiple
-    *      threads at the same time.  Even though the user is supposed to
-    *      ensure this doesn't happen, we play it safe as in (2) above.
-    *
-    * Since the only other things that ever take the device lock such as block
-    * pool resize only rarely happen, this will almost never be contended so
-    * taking a lock isn't really an expensive operation in this case.
+   /* The application may free its arrays as soon as we return, so copy
+    * everything the submit thread needs into a single allocation.
     */
-   pthread_mutex_lock(&device->mutex);
-#endif
-   if (fence && submitCount == 0) {
-      /* If we don't have any command buffers, we need to submit a dummy
-       * batch to give GEM something to wait on.  We could, potentially,
-       * come up with something more efficient but this shouldn't be a
-       * common case.
-       */
-      result = v3dvk_cmd_buffer_execbuf(device, NULL, NULL, 0, NULL, 0, fence);
-      goto out;
+   size_t size = sizeof(struct v3dvk_queue_submit) +
+                 submitCount * sizeof(struct v3dvk_queue_batch);
+   for (uint32_t i = 0; i < submitCount; i++) {
+      size += (pSubmits[i].waitSemaphoreCount +
+               pSubmits[i].commandBufferCount +
+               pSubmits[i].signalSemaphoreCount) * sizeof(void *);
    }
 
+   struct v3dvk_queue_submit *submit =
+      vk_alloc(&device->alloc, size, 8, VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+   if (!submit)
+      return v3dvk_error(device->instance, VK_ERROR_OUT_OF_HOST_MEMORY);
+
+   submit->queue = queue;
+   submit->vk_fence = v3dvk_fence_from_handle(fence);
+   submit->batch_count = submitCount;
+   util_queue_fence_init(&submit->fence);
+
+   void **ptrs = (void **)&submit->batches[submitCount];
    for (uint32_t i = 0; i < submitCount; i++) {
-      /* Fence for this submit.  NULL for all but the last one */
-      VkFence submit_fence = (i == submitCount - 1) ? fence : VK_NULL_HANDLE;
-
-      if (pSubmits[i].commandBufferCount == 0) {
-         /* If we don't have any command buffers, we need to submit a dummy
-          * batch to give GEM something to wait on.  We could, potentially,
-          * come up with something more efficient but this shouldn't be a
-          * common case.
-          */
-         result = v3dvk_cmd_buffer_execbuf(device, NULL,
-                                         pSubmits[i].pWaitSemaphores,
-                                         pSubmits[i].waitSemaphoreCount,
-                                         pSubmits[i].pSignalSemaphores,
-                                         pSubmits[i].signalSemaphoreCount,
-                                         submit_fence);
-         if (result != VK_SUCCESS)
-            goto out;
+      const VkSubmitInfo *info = &pSubmits[i];
+      struct v3dvk_queue_batch *batch = &submit->batches[i];
 
-         continue;
-      }
+      batch->wait_count = info->waitSemaphoreCount;
+      batch->waits = (struct v3dvk_semaphore **)ptrs;
+      for (uint32_t j = 0; j < info->waitSemaphoreCount; j++)
+         batch->waits[j] = v3dvk_semaphore_from_handle(info->pWaitSemaphores[j]);
+      ptrs += info->waitSemaphoreCount;
 
-      for (uint32_t j = 0; j < pSubmits[i].commandBufferCount; j++) {
-         V3DVK_FROM_HANDLE(v3dvk_cmd_buffer, cmd_buffer,
-                         pSubmits[i].pCommandBuffers[j]);
-         assert(cmd_buffer->level == VK_COMMAND_BUFFER_LEVEL_PRIMARY);
-
-         /* Fence for this execbuf.  NULL for all but the last one */
-         VkFence execbuf_fence =
-            (j == pSubmits[i].commandBufferCount - 1) ?
-            submit_fence : VK_NULL_HANDLE;
-
-         const VkSemaphore *in_semaphores = NULL, *out_semaphores = NULL;
-         uint32_t num_in_semaphores = 0, num_out_semaphores = 0;
-         if (j == 0) {
-            /* Only the first batch gets the in semaphores */
-            in_semaphores = pSubmits[i].pWaitSemaphores;
-            num_in_semaphores = pSubmits[i].waitSemaphoreCount;
-         }
-
-         if (j == pSubmits[i].commandBufferCount - 1) {
-            /* Only the last batch gets the out semaphores */
-            out_semaphores = pSubmits[i].pSignalSemaphores;
-            num_out_semaphores = pSubmits[i].signalSemaphoreCount;
-         }
-
-         result = v3dvk_cmd_buffer_execbuf(device, cmd_buffer,
-                                         in_semaphores, num_in_semaphores,
-                                         out_semaphores, num_out_semaphores,
-                                         execbuf_fence);
-         if (result != VK_SUCCESS)
-            goto out;
+      batch->cmd_buffer_count = info->commandBufferCount;
+      batch->cmd_buffers = (struct v3dvk_cmd_buffer **)ptrs;
+      for (uint32_t j = 0; j < info->commandBufferCount; j++) {
+         batch->cmd_buffers[j] =
+            v3dvk_cmd_buffer_from_handle(info->pCommandBuffers[j]);
+         assert(batch->cmd_buffers[j]->level ==
+                VK_COMMAND_BUFFER_LEVEL_PRIMARY);
       }
+      ptrs += info->commandBufferCount;
+
+      batch->signal_count = info->signalSemaphoreCount;
+      batch->signals = (struct v3dvk_semaphore **)ptrs;
+      for (uint32_t j = 0; j < info->signalSemaphoreCount; j++)
+         batch->signals[j] = v3dvk_semaphore_from_handle(info->pSignalSemaphores[j]);
+      ptrs += info->signalSemaphoreCount;
    }
-#if 0
-   pthread_cond_broadcast(&device->queue_submit);
-#endif
-out:
-   if (result != VK_SUCCESS) {
-      /* In the case that something has gone wrong we may end up with an
-       * inconsistent state from which it may not be trivial to recover.
-       * For example, we might have computed address relocations and
-       * any future attempt to re-submit this job will need to know about
-       * this and avoid computing relocation addresses again.
-       *
-       * To avoid this sort of issues, we assume that if something was
-       * wrong during submission we must already be in a really bad situation
-       * anyway (such us being out of memory) and return
-       * VK_ERROR_DEVICE_LOST to ensure that clients do not attempt to
-       * submit the same job again to this device.
-       */
-      result = v3dvk_device_set_lost(device, "vkQueueSubmit() failed");
-   }
-#if 0
-   pthread_mutex_unlock(&device->mutex);
-#endif
-   return result;
+
+   util_queue_add_job(&queue->submit_queue, submit, &submit->fence,
+                      v3dvk_queue_submit_execute, v3dvk_queue_submit_cleanup,
+                      0);
+
+   return VK_SUCCESS;
 }
 
 VkResult v3dvk_QueueWaitIdle(
     VkQueue                                     _queue)
 {
    V3DVK_FROM_HANDLE(v3dvk_queue, queue, _queue);
+   struct v3dvk_device *device = queue->device;
 
-   v3dvk_fence_wait_idle(&queue->submit_fence);
+   util_queue_finish(&queue->submit_queue);
+
+   if (v3dvk_device_is_lost(device))
+      return VK_ERROR_DEVICE_LOST;
+
+   uint32_t syncobjs[2] = { queue->last_job_syncobj, queue->wait_syncobj };
+   if (drmSyncobjWait(device->fd, syncobjs, queue->has_pending_wait ? 2 : 1,
+                      INT64_MAX, DRM_SYNCOBJ_WAIT_FLAGS_WAIT_ALL, NULL))
+      return v3dvk_device_set_lost(device, "queue wait failed: %m");
 
    return VK_SUCCESS;
 }
 
-void
+VkResult
 v3dvk_queue_init(struct v3dvk_device *device, struct v3dvk_queue *queue)
 {
    queue->_loader_data.loaderMagic = ICD_LOADER_MAGIC;
    queue->device = device;
    queue->flags = 0;
+   queue->has_pending_wait = false;
+
+   /* Created signaled, so that there is always a fence to export. */
+   if (drmSyncobjCreate(device->fd, DRM_SYNCOBJ_CREATE_SIGNALED,
+                        &queue->last_job_syncobj))
+      return vk_error(VK_ERROR_INITIALIZATION_FAILED);
+
+   if (drmSyncobjCreate(device->fd, 0, &queue->wait_syncobj))
+      goto fail_last_job;
+
+   if (!util_queue_init(&queue->submit_queue, "v3dvk_submit", 32, 1,
+                        UTIL_QUEUE_INIT_RESIZE_IF_FULL))
+      goto fail_wait;
 
-   v3dvk_fence_init(&queue->submit_fence, false);
+   return VK_SUCCESS;
+
+ fail_wait:
+   drmSyncobjDestroy(device->fd, queue->wait_syncobj);
+ fail_last_job:
+   drmSyncobjDestroy(device->fd, queue->last_job_syncobj);
+   return vk_error(VK_ERROR_INITIALIZATION_FAILED);
 }
 
 void
 v3dvk_queue_finish(struct v3dvk_queue *queue)
 {
-   v3dvk_fence_finish(&queue->submit_fence);
+   /* Queues are zeroed before init, so this is false for queues the device
+    * creation failed before getting to.
+    */
+   if (!util_queue_is_initialized(&queue->submit_queue))
+      return;
+
+   util_queue_finish(&queue->submit_queue);
+   util_queue_destroy(&queue->submit_queue);
+
+   drmSyncobjDestroy(queue->device->fd, queue->wait_syncobj);
+   drmSyncobjDestroy(queue->device->fd, queue->last_job_syncobj);
 }
@@ -25,6 +25,8 @@
 #define V3DVK_QUEUE_H
 
 #include <vulkan/vk_icd.h>
+#include <vulkan/vulkan.h>
+#include "util/u_queue.h"
 #include "v3dvk_fence.h"
 
 
@@ -41,10 +43,25 @@ struct v3dvk_queue {
     struct v3dvk_device *                       device;
 
     VkDeviceQueueCreateFlags                    flags;
-    struct v3dvk_fence                          submit_fence;
+
+    /* vkQueueSubmit() only copies the submission and hands it to this
+     * queue's thread, which does the semaphore work and the SUBMIT_CL
+     * ioctls.  Everything below is only touched from that thread, or after
+     * util_queue_finish().
+     */
+    struct util_queue                           submit_queue;
+
+    /* Syncobj signaled when the last job submitted to the kernel is done. */
+    uint32_t                                    last_job_syncobj;
+
+    /* Syncobj the next job waits on, holding the merged fences of
+     * semaphore waits not consumed by a job yet.
+     */
+    uint32_t                                    wait_syncobj;
+    bool                                        has_pending_wait;
 };
 
-void
+VkResult
 v3dvk_queue_init(struct v3dvk_device *device, struct v3dvk_queue *queue);
 
 void
@@ -1,4 +1,5 @@
 
+#include <xf86drm.h>
 #include <vulkan/vulkan.h>
 #include "common.h"
 #include "device.h"
@@ -21,6 +22,13 @@ v3dvk_CreateSemaphore(VkDevice _device,
    if (!sem)
       return v3dvk_error(device->instance, VK_ERROR_OUT_OF_HOST_MEMORY);
 
+   sem->permanent.type = V3DVK_SEMAPHORE_TYPE_DRM_SYNCOBJ;
+   if (drmSyncobjCreate(device->fd, 0, &sem->permanent.syncobj)) {
+      vk_free2(&device->alloc, pAllocator, sem);
+      return v3dvk_error(device->instance, VK_ERROR_OUT_OF_HOST_MEMORY);
+   }
+   sem->temporary.type = V3DVK_SEMAPHORE_TYPE_NONE;
+
    *pSemaphore = v3dvk_semaphore_to_handle(sem);
    return VK_SUCCESS;
 }
@@ -35,5 +43,8 @@ v3dvk_DestroySemaphore(VkDevice _device,
    if (!_semaphore)
       return;
 
+   if (sem->permanent.type == V3DVK_SEMAPHORE_TYPE_DRM_SYNCOBJ)
+      drmSyncobjDestroy(device->fd, sem->permanent.syncobj);
+
    vk_free2(&device->alloc, pAllocator, sem);
 }
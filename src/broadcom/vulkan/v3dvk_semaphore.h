@@ -31,9 +31,7 @@ enum v3dvk_semaphore_type {
    V3DVK_SEMAPHORE_TYPE_BO,
 #endif
    V3DVK_SEMAPHORE_TYPE_SYNC_FILE,
-#if 0
    V3DVK_SEMAPHORE_TYPE_DRM_SYNCOBJ,
-#endif
 };
 
 struct v3dvk_semaphore_impl {
@@ -53,13 +51,12 @@ struct v3dvk_semaphore_impl {
        * created or because it has been used for a wait, fd will be -1.
        */
       int fd;
-#if 0
-      /* Sync object handle when type == ANV_SEMAPHORE_TYPE_DRM_SYNCOBJ.
+
+      /* Sync object handle when type == V3DVK_SEMAPHORE_TYPE_DRM_SYNCOBJ.
        * Unlike GEM BOs, DRM sync objects aren't deduplicated by the kernel on
        * import so we don't need to bother with a userspace cache.
        */
       uint32_t syncobj;
-#endif
    };
 };
 
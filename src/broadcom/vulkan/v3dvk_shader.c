@@ -5,8 +5,10 @@
 #include "device.h"
 #include "instance.h"
 #include "v3dvk_error.h"
+#include "v3dvk_pipeline_cache.h"
 #include "v3dvk_shader.h"
 #include "util/mesa-sha1.h"
+#include "util/ralloc.h"
 
 static nir_shader *
 v3dvk_spirv_to_nir(const uint32_t *words,
@@ -206,9 +208,37 @@ v3dvk_shader_create(struct v3dvk_device *dev,
    shader->type = stage;
    shader->nir = nir;
 
+   struct mesa_sha1 ctx;
+   _mesa_sha1_init(&ctx);
+   _mesa_sha1_update(&ctx, module->sha1, sizeof(module->sha1));
+   _mesa_sha1_update(&ctx, &stage, sizeof(stage));
+   _mesa_sha1_update(&ctx, stage_info->pName, strlen(stage_info->pName));
+   const VkSpecializationInfo *spec_info = stage_info->pSpecializationInfo;
+   if (spec_info && spec_info->mapEntryCount) {
+      _mesa_sha1_update(&ctx, spec_info->pMapEntries,
+                        spec_info->mapEntryCount *
+                        sizeof(*spec_info->pMapEntries));
+      _mesa_sha1_update(&ctx, spec_info->pData, spec_info->dataSize);
+   }
+   _mesa_sha1_final(&ctx, shader->sha1);
+
    return shader;
 }
 
+void
+v3dvk_shader_destroy(struct v3dvk_device *dev,
+                     struct v3dvk_shader *shader,
+                     const VkAllocationCallbacks *alloc)
+{
+   if (shader->variant)
+      v3dvk_shader_variant_unref(shader->variant);
+   if (shader->binning_variant)
+      v3dvk_shader_variant_unref(shader->binning_variant);
+
+   ralloc_free(shader->nir);
+   vk_free2(&dev->alloc, alloc, shader);
+}
+
 static void
 v3dvk_shader_debug_output(const char *message, void *data)
 {
@@ -218,42 +248,53 @@ v3dvk_shader_debug_output(const char *message, void *data)
    fprintf(stderr, "SHADER_INFO %s:\n", message);
 }
 
-#if 0
-static uint32_t *
-v3dvk_compile_shader_variant(struct v3dvk_device* dev,
-                             struct v3d_key *key,
-                          struct ir3_shader_variant *nonbinning,
-                          struct ir3_shader_variant *variant)
+/* Texture return sizes and swizzles aren't known until draw time in Vulkan,
+ * so always return 32-bit RGBA and let the sampler state swizzle.
+ */
+void
+v3dvk_shader_key_init(union v3dvk_shader_key *key)
 {
-   variant->shader = shader;
-   variant->type = shader->type;
-   variant->key = *key;
-   variant->binning_pass = !!nonbinning;
-   variant->nonbinning = nonbinning;
-
-   nir_shader *s
+   memset(key, 0, sizeof(*key));
+
+   for (unsigned i = 0; i < ARRAY_SIZE(key->base.tex); i++) {
+      key->base.tex[i].return_size = 32;
+      key->base.tex[i].return_channels = 4;
+      key->base.tex[i].swizzle[0] = PIPE_SWIZZLE_X;
+      key->base.tex[i].swizzle[1] = PIPE_SWIZZLE_Y;
+      key->base.tex[i].swizzle[2] = PIPE_SWIZZLE_Z;
+      key->base.tex[i].swizzle[3] = PIPE_SWIZZLE_W;
+   }
+}
 
+static struct v3dvk_shader_variant *
+v3dvk_compile_shader_variant(struct v3dvk_device *dev,
+                             struct v3dvk_pipeline_cache *cache,
+                             struct v3dvk_shader *shader,
+                             struct v3d_key *key,
+                             const unsigned char sha1[20])
+{
+   struct v3d_prog_data *prog_data;
    uint64_t *qpu_insts;
    uint32_t shader_size;
 
-   qpu_insts = v3d_compile(dev->compiler,
-                      key,
-                      struct v3d_prog_data **prog_data,
-                      nir_shader *s,
-                      v3dvk_shader_debug_output,
-                      dev,
-                      int program_id, int variant_id,
-                      &shader_size);
+   qpu_insts = v3d_compile(dev->compiler, key, &prog_data, shader->nir,
+                           v3dvk_shader_debug_output, dev,
+                           0, 0, &shader_size);
+   if (!qpu_insts)
+      return NULL;
 
-   free(qpu_insts);
+   struct v3dvk_shader_variant *variant =
+      v3dvk_pipeline_cache_upload(cache, sha1, shader->type, prog_data,
+                                  qpu_insts, shader_size);
 
-   // TODO: Implement cache
+   free(qpu_insts);
 
+   return variant;
 }
-#endif
 
 VkResult
 v3dvk_shader_compile(struct v3dvk_device *dev,
+                     struct v3dvk_pipeline_cache *cache,
                      struct v3dvk_shader *shader,
                      const struct v3dvk_shader *next_stage,
                      const struct v3dvk_shader_compile_options *options,
@@ -271,41 +312,35 @@ v3dvk_shader_compile(struct v3dvk_device *dev,
       }
    }
 #endif
-#if 0
-   shader->binary = v3dvk_compile_shader_variant(
-      dev,
-      &shader->ir3_shader, &options->key, NULL, &shader->variants[0]);
-   if (!shader->binary)
-      return VK_ERROR_OUT_OF_HOST_MEMORY;
-
-   /* compile another variant for the binning pass */
-   if (options->include_binning_pass &&
-       shader->ir3_shader.type == MESA_SHADER_VERTEX) {
-      shader->binning_binary = tu_compile_shader_variant(
-         &shader->ir3_shader, &options->key, &shader->variants[0],
-         &shader->variants[1]);
-      if (!shader->binning_binary)
-         return VK_ERROR_OUT_OF_HOST_MEMORY;
-
-      shader->has_binning_pass = true;
-   }
-
-   if (unlikely(dev->instance->debug_flags & V3DVK_DEBUG_IR3)) {
-      fprintf(stderr, "disassembled ir3:\n");
-      fprintf(stderr, "shader: %s\n",
-              gl_shader_stage_name(shader->ir3_shader.type));
-      ir3_shader_disasm(&shader->variants[0], shader->binary, stderr);
-
-      if (shader->has_binning_pass) {
-         fprintf(stderr, "disassembled ir3:\n");
-         fprintf(stderr, "shader: %s (binning)\n",
-                 gl_shader_stage_name(shader->ir3_shader.type));
-         ir3_shader_disasm(&shader->variants[1], shader->binning_binary,
-                           stderr);
-      }
+   if (!cache)
+      cache = &dev->default_pipeline_cache;
+
+   /* The shader_state pointer is only meaningful to gallium. */
+   union v3dvk_shader_key key = options->key;
+   key.base.shader_state = NULL;
+
+   struct v3dvk_shader_variant **variant = &shader->variant;
+   if (shader->type == MESA_SHADER_VERTEX && key.vs.is_coord)
+      variant = &shader->binning_variant;
+
+   unsigned char sha1[20];
+   struct mesa_sha1 ctx;
+   _mesa_sha1_init(&ctx);
+   _mesa_sha1_update(&ctx, shader->sha1, sizeof(shader->sha1));
+   _mesa_sha1_update(&ctx, &key, sizeof(key));
+   _mesa_sha1_final(&ctx, sha1);
+
+   if (*variant)
+      v3dvk_shader_variant_unref(*variant);
+
+   *variant = v3dvk_pipeline_cache_search(cache, sha1);
+   if (!*variant) {
+      *variant =
+         v3dvk_compile_shader_variant(dev, cache, shader, &key.base, sha1);
+      if (!*variant)
+         return vk_error(VK_ERROR_OUT_OF_HOST_MEMORY);
    }
 
-#endif
    return VK_SUCCESS;
 }
 
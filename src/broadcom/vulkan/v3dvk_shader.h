@@ -2,20 +2,34 @@
 #ifndef V3DVK_SHADER_H
 #define V3DVK_SHADER_H
 
+#include <assert.h>
 #include <stdint.h>
+#include <strings.h>
+#include <vulkan/vulkan.h>
 #include "compiler/shader_enums.h"
 #include "compiler/v3d_compiler.h"
 #include "v3dvk_descriptor_set.h"
 
 struct v3dvk_device;
+struct v3dvk_pipeline_cache;
+struct v3dvk_shader_variant;
+
+/* The compiler key of each stage starts with a struct v3d_key.  Keys get
+ * hashed whole, so they must be set up with v3dvk_shader_key_init().
+ */
+union v3dvk_shader_key
+{
+   struct v3d_key base;
+   struct v3d_vs_key vs;
+   struct v3d_fs_key fs;
+};
 
 struct v3dvk_shader_compile_options
 {
-   struct v3d_key key;
+   union v3dvk_shader_key key;
 #if 0
    bool optimize;
 #endif
-   bool include_binning_pass;
 };
 
 struct v3dvk_shader_module
@@ -34,6 +48,17 @@ struct v3dvk_shader
    nir_shader *nir;
    gl_shader_stage type;
 
+   /* Hash of the SPIR-V module, entrypoint and specialization constants the
+    * NIR was built from.
+    */
+   unsigned char sha1[20];
+
+   /* Compiled code, set by v3dvk_shader_compile().  Vertex shaders compiled
+    * with key.vs.is_coord set get their binning variant set instead.
+    */
+   struct v3dvk_shader_variant *variant;
+   struct v3dvk_shader_variant *binning_variant;
+
    struct v3dvk_descriptor_map texture_map;
    struct v3dvk_descriptor_map sampler_map;
 #if 0
@@ -51,6 +76,13 @@ struct v3dvk_shader
 #endif
 };
 
+static inline gl_shader_stage
+vk_to_mesa_shader_stage(VkShaderStageFlagBits vk_stage)
+{
+   assert(__builtin_popcount(vk_stage) == 1);
+   return ffs(vk_stage) - 1;
+}
+
 struct v3dvk_shader *
 v3dvk_shader_create(struct v3dvk_device *dev,
                     gl_shader_stage stage,
@@ -58,8 +90,12 @@ v3dvk_shader_create(struct v3dvk_device *dev,
                     const VkAllocationCallbacks *alloc);
 
 
+void
+v3dvk_shader_key_init(union v3dvk_shader_key *key);
+
 VkResult
 v3dvk_shader_compile(struct v3dvk_device *dev,
+                     struct v3dvk_pipeline_cache *cache,
                      struct v3dvk_shader *shader,
                      const struct v3dvk_shader *next_stage,
                      const struct v3dvk_shader_compile_options *options,
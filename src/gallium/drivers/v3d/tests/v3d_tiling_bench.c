@@ -0,0 +1,270 @@
+/*
+ * Copyright © 2020 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Checks the whole-utile tiling paths, single and multithreaded, against the
+ * per-pixel reference for every layout and cpp, then reports the throughput
+ * of each for a large UIF texture.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/os_time.h"
+#include "util/u_math.h"
+#include "util/u_queue.h"
+#include "v3d_context.h"
+#include "v3d_tiling.h"
+
+static const char *tiling_names[] = {
+        [VC5_TILING_LINEARTILE] = "LT",
+        [VC5_TILING_UBLINEAR_1_COLUMN] = "UBLINEAR_1",
+        [VC5_TILING_UBLINEAR_2_COLUMN] = "UBLINEAR_2",
+        [VC5_TILING_UIF_NO_XOR] = "UIF_NO_XOR",
+        [VC5_TILING_UIF_XOR] = "UIF_XOR",
+};
+
+static const int cpps[] = { 1, 2, 4, 8, 16 };
+
+struct tiled_image {
+        enum v3d_tiling_mode tiling;
+        int cpp;
+        uint32_t width, height;
+        /* Padded size of the GPU copy. */
+        uint32_t padded_w, padded_h;
+        uint32_t gpu_size;
+};
+
+static void
+tiled_image_init(struct tiled_image *img, enum v3d_tiling_mode tiling,
+                 int cpp, uint32_t width, uint32_t height)
+{
+        uint32_t utile_w = v3d_utile_width(cpp);
+        uint32_t utile_h = v3d_utile_height(cpp);
+
+        img->tiling = tiling;
+        img->cpp = cpp;
+        img->width = width;
+        img->height = height;
+
+        /* Generous padding so that the XOR in UIF_XOR never addresses past
+         * the end of the buffer.
+         */
+        img->padded_w = align(width, 8 * utile_w);
+        img->padded_h = align(height, 64 * utile_h);
+        img->gpu_size = img->padded_w * img->padded_h * cpp;
+}
+
+static void
+fill_random(uint8_t *data, uint32_t size, uint32_t *seed)
+{
+        for (uint32_t i = 0; i < size; i++) {
+                *seed = *seed * 1103515245 + 12345;
+                data[i] = *seed >> 16;
+        }
+}
+
+/* Stores and loads a box that isn't utile aligned on any side through both
+ * paths and compares the results.
+ */
+static bool
+check_image(const struct tiled_image *img, struct util_queue *queue)
+{
+        struct pipe_box box = {
+                .x = 3,
+                .y = 1,
+                .width = img->width - 3,
+                .height = img->height - 1,
+        };
+        uint32_t cpu_stride = box.width * img->cpp;
+        uint32_t cpu_size = cpu_stride * box.height;
+        uint32_t gpu_stride = img->padded_w * img->cpp;
+        uint8_t *cpu = malloc(cpu_size);
+        uint8_t *cpu_ref = malloc(cpu_size);
+        uint8_t *gpu = malloc(img->gpu_size);
+        uint8_t *gpu_ref = malloc(img->gpu_size);
+        uint32_t seed = img->cpp * 31 + img->tiling;
+        bool pass = true;
+
+        fill_random(cpu, cpu_size, &seed);
+        memset(gpu, 0xd0, img->gpu_size);
+        memset(gpu_ref, 0xd0, img->gpu_size);
+
+        v3d_store_tiled_image_per_pixel(gpu_ref, gpu_stride, cpu, cpu_stride,
+                                        img->tiling, img->cpp,
+                                        img->padded_h, &box);
+        v3d_store_tiled_image(gpu, gpu_stride, cpu, cpu_stride,
+                              img->tiling, img->cpp, img->padded_h, &box,
+                              queue);
+        if (memcmp(gpu, gpu_ref, img->gpu_size) != 0) {
+                fprintf(stderr, "%s cpp %d %ux%u%s: store mismatch\n",
+                        tiling_names[img->tiling], img->cpp,
+                        img->width, img->height, queue ? " (MT)" : "");
+                pass = false;
+        }
+
+        fill_random(gpu, img->gpu_size, &seed);
+        memset(cpu, 0xd0, cpu_size);
+        memset(cpu_ref, 0xd0, cpu_size);
+
+        v3d_load_tiled_image_per_pixel(cpu_ref, cpu_stride, gpu, gpu_stride,
+                                       img->tiling, img->cpp,
+                                       img->padded_h, &box);
+        v3d_load_tiled_image(cpu, cpu_stride, gpu, gpu_stride,
+                             img->tiling, img->cpp, img->padded_h, &box,
+                             queue);
+        if (memcmp(cpu, cpu_ref, cpu_size) != 0) {
+                fprintf(stderr, "%s cpp %d %ux%u%s: load mismatch\n",
+                        tiling_names[img->tiling], img->cpp,
+                        img->width, img->height, queue ? " (MT)" : "");
+                pass = false;
+        }
+
+        free(cpu);
+        free(cpu_ref);
+        free(gpu);
+        free(gpu_ref);
+
+        return pass;
+}
+
+static bool
+check_all(struct util_queue *queue)
+{
+        bool pass = true;
+
+        for (int i = 0; i < ARRAY_SIZE(cpps); i++) {
+                int cpp = cpps[i];
+                uint32_t utile_w = v3d_utile_width(cpp);
+                uint32_t utile_h = v3d_utile_height(cpp);
+                struct tiled_image img;
+
+                /* LT is a single line of utiles, and UBLINEAR one or two
+                 * UIF blocks wide, so keep those images within that.
+                 */
+                tiled_image_init(&img, VC5_TILING_LINEARTILE, cpp,
+                                 16 * utile_w, utile_h);
+                pass &= check_image(&img, queue);
+
+                tiled_image_init(&img, VC5_TILING_UBLINEAR_1_COLUMN, cpp,
+                                 2 * utile_w, 300);
+                pass &= check_image(&img, queue);
+
+                tiled_image_init(&img, VC5_TILING_UBLINEAR_2_COLUMN, cpp,
+                                 4 * utile_w, 300);
+                pass &= check_image(&img, queue);
+
+                tiled_image_init(&img, VC5_TILING_UIF_NO_XOR, cpp, 1007, 703);
+                pass &= check_image(&img, queue);
+
+                tiled_image_init(&img, VC5_TILING_UIF_XOR, cpp, 1007, 703);
+                pass &= check_image(&img, queue);
+        }
+
+        return pass;
+}
+
+#define BENCH_SIZE 2048
+#define BENCH_ITERATIONS 10
+
+static void
+store_per_pixel(void *gpu, uint32_t gpu_stride, void *cpu, uint32_t cpu_stride,
+                const struct tiled_image *img, const struct pipe_box *box,
+                struct util_queue *queue)
+{
+        v3d_store_tiled_image_per_pixel(gpu, gpu_stride, cpu, cpu_stride,
+                                        img->tiling, img->cpp,
+                                        img->padded_h, box);
+}
+
+static void
+store_utiles(void *gpu, uint32_t gpu_stride, void *cpu, uint32_t cpu_stride,
+             const struct tiled_image *img, const struct pipe_box *box,
+             struct util_queue *queue)
+{
+        v3d_store_tiled_image(gpu, gpu_stride, cpu, cpu_stride,
+                              img->tiling, img->cpp, img->padded_h, box,
+                              queue);
+}
+
+static void
+bench(const char *name, struct util_queue *queue,
+      void (*store)(void *gpu, uint32_t gpu_stride,
+                    void *cpu, uint32_t cpu_stride,
+                    const struct tiled_image *img,
+                    const struct pipe_box *box,
+                    struct util_queue *queue))
+{
+        struct tiled_image img;
+        tiled_image_init(&img, VC5_TILING_UIF_XOR, 4, BENCH_SIZE, BENCH_SIZE);
+
+        struct pipe_box box = {
+                .width = BENCH_SIZE,
+                .height = BENCH_SIZE,
+        };
+        uint32_t cpu_stride = BENCH_SIZE * img.cpp;
+        uint8_t *cpu = calloc(1, cpu_stride * BENCH_SIZE);
+        uint8_t *gpu = calloc(1, img.gpu_size);
+
+        int64_t start = os_time_get_nano();
+        for (int i = 0; i < BENCH_ITERATIONS; i++) {
+                store(gpu, img.padded_w * img.cpp, cpu, cpu_stride,
+                      &img, &box, queue);
+        }
+        int64_t elapsed = os_time_get_nano() - start;
+
+        printf("%-24s %8.1f MB/s\n", name,
+               (double)cpu_stride * BENCH_SIZE * BENCH_ITERATIONS /
+               (elapsed / 1e9) / (1024 * 1024));
+
+        free(cpu);
+        free(gpu);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct util_queue queue;
+
+        if (!util_queue_init(&queue, "v3d_tiling", 16, 3,
+                             UTIL_QUEUE_INIT_RESIZE_IF_FULL)) {
+                fprintf(stderr, "failed to create the tiling queue\n");
+                return 1;
+        }
+
+        bool pass = check_all(NULL);
+        pass &= check_all(&queue);
+        if (!pass) {
+                util_queue_destroy(&queue);
+                return 1;
+        }
+
+        printf("UIF_XOR %dx%d RGBA8 store:\n", BENCH_SIZE, BENCH_SIZE);
+        bench("per pixel", NULL, store_per_pixel);
+        bench("utiles", NULL, store_utiles);
+        bench("utiles, 4 threads", &queue, store_utiles);
+
+        util_queue_destroy(&queue);
+
+        return 0;
+}
@@ -283,20 +283,20 @@ v3d_stencil_blit(struct pipe_context *ctx, const struct pipe_blit_info *info)
                 .format = dst_format,
         };
         struct pipe_surface *dst_surf =
-                ctx->create_surface(ctx, &dst->base, &dst_tmpl);
+                ctx->create_surface(ctx, &dst->base.b, &dst_tmpl);
 
         /* Initialize the sampler view. */
         struct pipe_sampler_view src_tmpl = {
-                .target = src->base.target,
+                .target = src->base.b.target,
                 .format = src_format,
                 .u.tex = {
                         .first_level = info->src.level,
                         .last_level = info->src.level,
                         .first_layer = 0,
                         .last_layer = (PIPE_TEXTURE_3D ?
-                                       u_minify(src->base.depth0,
+                                       u_minify(src->base.b.depth0,
                                                 info->src.level) - 1 :
-                                       src->base.array_size - 1),
+                                       src->base.b.array_size - 1),
                 },
                 .swizzle_r = PIPE_SWIZZLE_X,
                 .swizzle_g = PIPE_SWIZZLE_Y,
@@ -304,12 +304,12 @@ v3d_stencil_blit(struct pipe_context *ctx, const struct pipe_blit_info *info)
                 .swizzle_a = PIPE_SWIZZLE_W,
         };
         struct pipe_sampler_view *src_view =
-                ctx->create_sampler_view(ctx, &src->base, &src_tmpl);
+                ctx->create_sampler_view(ctx, &src->base.b, &src_tmpl);
 
         v3d_blitter_save(v3d);
         util_blitter_blit_generic(v3d->blitter, dst_surf, &info->dst.box,
                                   src_view, &info->src.box,
-                                  src->base.width0, src->base.height0,
+                                  src->base.b.width0, src->base.b.height0,
                                   PIPE_MASK_R,
                                   PIPE_TEX_FILTER_NEAREST,
                                   info->scissor_enable ? &info->scissor : NULL,
@@ -343,7 +343,7 @@ v3d_stencil_blit(struct pipe_context *ctx, const struct pipe_blit_info *info)
 #define V3D_TFU_ICFG_FORMAT_UIF_NO_XOR 14
 #define V3D_TFU_ICFG_FORMAT_UIF_XOR 15
 
-static bool
+bool
 v3d_tfu(struct pipe_context *pctx,
         struct pipe_resource *pdst,
         struct pipe_resource *psrc,
@@ -406,7 +406,7 @@ v3d_tfu(struct pipe_context *pctx,
         }
 
         uint32_t dst_offset = (dst->bo->offset +
-                               v3d_layer_offset(pdst, src_level, dst_layer));
+                               v3d_layer_offset(pdst, base_level, dst_layer));
         tfu.ioa |= dst_offset;
         if (last_level != base_level)
                 tfu.ioa |= V3D_TFU_IOA_DIMTW;
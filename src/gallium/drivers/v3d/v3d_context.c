@@ -30,6 +30,7 @@
 #include "util/u_inlines.h"
 #include "util/u_memory.h"
 #include "util/u_blitter.h"
+#include "util/u_threaded_context.h"
 #include "util/u_upload_mgr.h"
 #include "util/u_prim.h"
 #include "indices/u_primconvert.h"
@@ -104,6 +105,11 @@ v3d_invalidate_resource(struct pipe_context *pctx, struct pipe_resource *prsc)
         struct v3d_context *v3d = v3d_context(pctx);
         struct v3d_resource *rsc = v3d_resource(prsc);
 
+        if (prsc->target == PIPE_BUFFER) {
+                v3d_resource_invalidate_buffer(pctx, prsc);
+                return;
+        }
+
         rsc->initialized_buffers = 0;
 
         struct hash_entry *entry = _mesa_hash_table_search(v3d->write_jobs,
@@ -156,6 +162,20 @@ v3d_context_destroy(struct pipe_context *pctx)
 
         v3d_flush(pctx);
 
+        if (unlikely(V3D_DEBUG & V3D_DEBUG_PERF)) {
+                fprintf(stderr, "v3d tiled transfers: %d cpu, "
+                        "%d tfu uploads (%d fell back to cpu), "
+                        "%d blit readbacks\n",
+                        v3d->transfer_stats.cpu_maps,
+                        v3d->transfer_stats.tfu_uploads,
+                        v3d->transfer_stats.tfu_fallbacks,
+                        v3d->transfer_stats.blit_readbacks);
+                fprintf(stderr, "v3d buffer transfers: %d discard renames, "
+                        "%d dontblock fails\n",
+                        v3d->transfer_stats.discard_renames,
+                        v3d->transfer_stats.dontblock_fails);
+        }
+
         if (v3d->blitter)
                 util_blitter_destroy(v3d->blitter);
 
@@ -171,6 +191,7 @@ v3d_context_destroy(struct pipe_context *pctx)
                 pipe_resource_reference(&v3d->prim_counts, NULL);
 
         slab_destroy_child(&v3d->transfer_pool);
+        slab_destroy_child(&v3d->transfer_pool_unsync);
 
         pipe_surface_reference(&v3d->framebuffer.cbufs[0], NULL);
         pipe_surface_reference(&v3d->framebuffer.zsbuf, NULL);
@@ -250,6 +271,7 @@ v3d_context_create(struct pipe_screen *pscreen, void *priv, unsigned flags)
         v3d->fd = screen->fd;
 
         slab_create_child(&v3d->transfer_pool, &screen->transfer_pool);
+        slab_create_child(&v3d->transfer_pool_unsync, &screen->transfer_pool);
 
         v3d->uploader = u_upload_create_default(&v3d->base);
         v3d->base.stream_uploader = v3d->uploader;
@@ -274,7 +296,23 @@ v3d_context_create(struct pipe_screen *pscreen, void *priv, unsigned flags)
         v3d->sample_mask = (1 << V3D_MAX_SAMPLES) - 1;
         v3d->active_queries = true;
 
-        return &v3d->base;
+        /* Shader precompiles use the context's shader caches from the
+         * thread creating the shader, so they can't be done under
+         * u_threaded_context.
+         */
+        if (!(flags & PIPE_CONTEXT_PREFER_THREADED) ||
+            (V3D_DEBUG & V3D_DEBUG_PRECOMPILE)) {
+                return &v3d->base;
+        }
+
+        /* We don't give u_threaded_context a create_fence callback, so
+         * flushes that return a fence synchronize with the driver thread and
+         * fences are only ever created there.
+         */
+        return threaded_context_create(pctx, &screen->transfer_pool,
+                                       v3d_replace_buffer_storage,
+                                       NULL,
+                                       &v3d->tc);
 
 fail:
         pctx->destroy(pctx);
@@ -42,6 +42,7 @@
 
 struct v3d_job;
 struct v3d_bo;
+struct v3d_key;
 void v3d_job_add_bo(struct v3d_job *job, struct v3d_bo *bo);
 
 #include "v3d_bufmgr.h"
@@ -97,6 +98,11 @@ void v3d_job_add_bo(struct v3d_job *job, struct v3d_bo *bo);
 
 #define VC5_MAX_FS_INPUTS 64
 
+/* Maximum number of FBO jobs queued at once, so that each can have a bit in
+ * the masks of v3d->bo_jobs.
+ */
+#define V3D_MAX_JOBS 32
+
 enum v3d_sampler_state_variant {
         V3D_SAMPLER_STATE_BORDER_0,
         V3D_SAMPLER_STATE_F16,
@@ -171,7 +177,7 @@ struct v3d_sampler_state {
         /* V3D 3.x: Packed texture state. */
         uint8_t texture_shader_state[32];
         /* V3D 4.x: Sampler state struct. */
-        struct pipe_resource *sampler_state;
+        struct v3d_bo *sampler_state;
         uint32_t sampler_state_offset[V3D_SAMPLER_STATE_VARIANT_COUNT];
 
         bool border_color_variants;
@@ -202,6 +208,9 @@ struct v3d_uncompiled_shader {
         uint16_t tf_specs[16];
         uint16_t tf_specs_psiz[16];
         uint32_t num_tf_specs;
+
+        /** SHA-1 of the serialized NIR, for the disk cache. */
+        unsigned char sha1[20];
 };
 
 struct v3d_compiled_shader {
@@ -222,6 +231,14 @@ struct v3d_compiled_shader {
          * reemitted).
          */
         uint64_t uniform_dirty_bits;
+
+        /**
+         * Whether the uniform stream is made only of constants, in which
+         * case it was uploaded once right after the QPU code, at
+         * uniforms_offset in the resource, instead of into each job.
+         */
+        bool static_uniforms;
+        uint32_t uniforms_offset;
 };
 
 struct v3d_program_stateobj {
@@ -232,6 +249,18 @@ struct v3d_program_stateobj {
 
         struct v3d_bo *spill_bo;
         int spill_size_per_thread;
+
+        /**
+         * The uniform streams written for the last GL shader state emitted
+         * in the current job, reused by the following ones if nothing they
+         * contain has changed.
+         */
+        struct v3d_cl_reloc cs_uniforms, vs_uniforms, gs_bin_uniforms;
+        struct v3d_cl_reloc gs_uniforms, fs_uniforms;
+
+        /** Variants looked up in the disk cache, and how many were found. */
+        uint32_t disk_cache_lookups;
+        uint32_t disk_cache_hits;
 };
 
 struct v3d_constbuf_stateobj {
@@ -252,8 +281,7 @@ struct v3d_vertex_stateobj {
         unsigned num_elements;
 
         uint8_t attrs[16 * (V3D_MAX_VS_INPUTS / 4)];
-        struct pipe_resource *defaults;
-        uint32_t defaults_offset;
+        struct v3d_bo *defaults;
 };
 
 struct v3d_stream_output_target {
@@ -328,6 +356,12 @@ struct v3d_job {
         /** Sum of the sizes of the BOs referenced by the job. */
         uint32_t referenced_size;
 
+        /**
+         * Bit for the job's slot in v3d->job_slots, or 0 if it's not one of
+         * the FBO jobs in v3d->jobs (such as a compute job).
+         */
+        uint32_t slot_bit;
+
         struct set *write_prscs;
         struct set *tf_write_prscs;
 
@@ -450,9 +484,47 @@ struct v3d_context {
          */
         struct hash_table *write_jobs;
 
+        /**
+         * Map from v3d_bo to the bitmask of v3d->job_slots referencing it,
+         * so that flushing the users of a BO doesn't have to search every
+         * job's BO set.
+         */
+        struct hash_table *bo_jobs;
+
+        /** The jobs in v3d->jobs, indexed by their slot. */
+        struct v3d_job *job_slots[V3D_MAX_JOBS];
+        uint32_t job_slots_used;
+
         struct slab_child_pool transfer_pool;
+        /** Transfers for unsynchronized maps from u_threaded_context's
+         * application thread.
+         */
+        struct slab_child_pool transfer_pool_unsync;
+        /** The u_threaded_context wrapping us, if any. */
+        struct threaded_context *tc;
         struct blitter_context *blitter;
 
+        /**
+         * How maps of tiled textures got their data tiled and untiled,
+         * reported at context destruction with V3D_DEBUG=perf.
+         */
+        struct {
+                /** Tiled/untiled on the CPU. */
+                uint32_t cpu_maps;
+                /** Written through a linear staging BO and the TFU. */
+                uint32_t tfu_uploads;
+                /** Read through a render blit to a linear staging BO. */
+                uint32_t blit_readbacks;
+                /** TFU uploads that failed to submit and got stored on the
+                 * CPU from the staging BO instead.
+                 */
+                uint32_t tfu_fallbacks;
+                /** Busy buffers given a new BO on a partial discard. */
+                uint32_t discard_renames;
+                /** DONTBLOCK maps that returned NULL on a busy resource. */
+                uint32_t dontblock_fails;
+        } transfer_stats;
+
         /** bitfield of VC5_DIRTY_* */
         uint64_t dirty;
 
@@ -609,6 +681,19 @@ void v3d_program_init(struct pipe_context *pctx);
 void v3d_program_fini(struct pipe_context *pctx);
 void v3d_query_init(struct pipe_context *pctx);
 
+void v3d_disk_cache_init(struct v3d_screen *screen);
+uint64_t *v3d_disk_cache_retrieve(struct v3d_context *v3d,
+                                  const struct v3d_key *key,
+                                  uint32_t key_size,
+                                  struct v3d_compiled_shader *shader,
+                                  uint32_t *qpu_size);
+void v3d_disk_cache_store(struct v3d_context *v3d,
+                          const struct v3d_key *key,
+                          uint32_t key_size,
+                          const struct v3d_compiled_shader *shader,
+                          const uint64_t *qpu_insts,
+                          uint32_t qpu_size);
+
 void v3d_simulator_init(struct v3d_screen *screen);
 void v3d_simulator_destroy(struct v3d_screen *screen);
 uint32_t v3d_simulator_get_spill(uint32_t spill_size);
@@ -637,6 +722,12 @@ struct v3d_cl_reloc v3d_write_uniforms(struct v3d_context *v3d,
                                        struct v3d_job *job,
                                        struct v3d_compiled_shader *shader,
                                        enum pipe_shader_type stage);
+struct v3d_cl_reloc v3d_get_uniforms(struct v3d_context *v3d,
+                                     struct v3d_job *job,
+                                     struct v3d_compiled_shader *shader,
+                                     enum pipe_shader_type stage,
+                                     uint64_t compiled_dirty,
+                                     struct v3d_cl_reloc *last);
 
 void v3d_flush(struct pipe_context *pctx);
 void v3d_job_init(struct v3d_context *v3d);
@@ -650,6 +741,7 @@ void v3d_job_add_bo(struct v3d_job *job, struct v3d_bo *bo);
 void v3d_job_add_write_resource(struct v3d_job *job, struct pipe_resource *prsc);
 void v3d_job_add_tf_write_resource(struct v3d_job *job, struct pipe_resource *prsc);
 void v3d_job_submit(struct v3d_context *v3d, struct v3d_job *job);
+bool v3d_bo_used_by_jobs(struct v3d_context *v3d, struct v3d_bo *bo);
 void v3d_flush_jobs_using_bo(struct v3d_context *v3d, struct v3d_bo *bo);
 void v3d_flush_jobs_writing_resource(struct v3d_context *v3d,
                                      struct pipe_resource *prsc,
@@ -683,6 +775,14 @@ bool v3d_tfu_supports_tex_format(const struct v3d_device_info *devinfo,
 void v3d_init_query_functions(struct v3d_context *v3d);
 void v3d_blit(struct pipe_context *pctx, const struct pipe_blit_info *blit_info);
 void v3d_blitter_save(struct v3d_context *v3d);
+bool v3d_tfu(struct pipe_context *pctx,
+             struct pipe_resource *pdst,
+             struct pipe_resource *psrc,
+             unsigned int src_level,
+             unsigned int base_level,
+             unsigned int last_level,
+             unsigned int src_layer,
+             unsigned int dst_layer);
 bool v3d_generate_mipmap(struct pipe_context *pctx,
                          struct pipe_resource *prsc,
                          enum pipe_format format,
@@ -0,0 +1,252 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/** @file v3d_disk_cache.c
+ *
+ * Keeps the compiled shader variants in the on-disk shader cache, so that
+ * they don't have to be compiled again from NIR on the next run.
+ *
+ * The entries are keyed on the SHA-1 of the serialized NIR together with the
+ * variant's v3d_key, in a cache that disk_cache tags with the driver's build
+ * ID and the devinfo version.
+ */
+
+#include "util/blob.h"
+#include "util/build_id.h"
+#include "util/disk_cache.h"
+#include "util/mesa-sha1.h"
+#include "util/ralloc.h"
+#include "broadcom/compiler/v3d_compiler.h"
+
+#include "v3d_context.h"
+#include "v3d_screen.h"
+
+/* Shader dumps are only produced when compiling, so don't skip them by
+ * hitting in the cache when they were asked for.
+ */
+static bool
+v3d_disk_cache_enabled(struct v3d_screen *screen, gl_shader_stage stage)
+{
+        return (screen->disk_cache &&
+                !(V3D_DEBUG & (V3D_DEBUG_NIR |
+                               V3D_DEBUG_VIR |
+                               V3D_DEBUG_QPU |
+                               V3D_DEBUG_SHADERDB |
+                               v3d_debug_flag_for_shader_stage(stage))));
+}
+
+static void
+v3d_disk_cache_compute_key(struct disk_cache *cache,
+                           const struct v3d_key *key,
+                           uint32_t key_size,
+                           cache_key cache_key)
+{
+        struct v3d_uncompiled_shader *uncompiled = key->shader_state;
+        union {
+                struct v3d_key base;
+                struct v3d_vs_key vs;
+                struct v3d_gs_key gs;
+                struct v3d_fs_key fs;
+        } key_copy;
+
+        /* The shader_state pointer differs between runs, and the NIR hash
+         * stands for it.
+         */
+        assert(key_size <= sizeof(key_copy));
+        memcpy(&key_copy, key, key_size);
+        key_copy.base.shader_state = NULL;
+
+        uint8_t data[sizeof(uncompiled->sha1) + sizeof(key_copy)];
+        memcpy(data, uncompiled->sha1, sizeof(uncompiled->sha1));
+        memcpy(data + sizeof(uncompiled->sha1), &key_copy, key_size);
+
+        disk_cache_compute_key(cache, data,
+                               sizeof(uncompiled->sha1) + key_size,
+                               cache_key);
+}
+
+/**
+ * Looks up a variant in the disk cache.
+ *
+ * On a hit, returns the QPU code in a malloced buffer and sets up the
+ * shader's prog_data, as v3d_compile() would have.
+ */
+uint64_t *
+v3d_disk_cache_retrieve(struct v3d_context *v3d,
+                        const struct v3d_key *key,
+                        uint32_t key_size,
+                        struct v3d_compiled_shader *shader,
+                        uint32_t *qpu_size)
+{
+        struct v3d_screen *screen = v3d->screen;
+        struct v3d_uncompiled_shader *uncompiled = key->shader_state;
+        nir_shader *s = uncompiled->base.ir.nir;
+        gl_shader_stage stage = s->info.stage;
+
+        if (!v3d_disk_cache_enabled(screen, stage))
+                return NULL;
+
+        cache_key cache_key;
+        v3d_disk_cache_compute_key(screen->disk_cache, key, key_size,
+                                   cache_key);
+
+        size_t size;
+        void *buffer = disk_cache_get(screen->disk_cache, cache_key, &size);
+
+        v3d->prog.disk_cache_lookups++;
+        if (buffer)
+                v3d->prog.disk_cache_hits++;
+
+        if (unlikely(V3D_DEBUG & V3D_DEBUG_CACHE)) {
+                char sha1[41];
+                _mesa_sha1_format(sha1, cache_key);
+                fprintf(stderr, "[v3d disk cache] retrieving %s: %s\n",
+                        sha1, buffer ? "found" : "missing");
+        }
+
+        pipe_debug_message(&v3d->debug, SHADER_INFO,
+                           "%s prog %d disk cache %s, "
+                           "%u of %u lookups hit",
+                           gl_shader_stage_name(stage),
+                           uncompiled->program_id,
+                           buffer ? "hit" : "miss",
+                           v3d->prog.disk_cache_hits,
+                           v3d->prog.disk_cache_lookups);
+
+        if (!buffer)
+                return NULL;
+
+        /* The blob is laid out as v3d_disk_cache_store() wrote it:
+         *
+         * 1. The stage's prog_data
+         * 2. The uniform stream contents and data
+         * 3. The size of the QPU code and the code itself
+         */
+        struct blob_reader blob;
+        blob_reader_init(&blob, buffer, size);
+
+        uint32_t prog_data_size = v3d_prog_data_size(stage);
+        struct v3d_prog_data *prog_data = rzalloc_size(shader, prog_data_size);
+        blob_copy_bytes(&blob, prog_data, prog_data_size);
+
+        struct v3d_uniform_list *ulist = &prog_data->uniforms;
+        ulist->contents = ralloc_array(prog_data, enum quniform_contents,
+                                       ulist->count);
+        blob_copy_bytes(&blob, ulist->contents,
+                        ulist->count * sizeof(*ulist->contents));
+        ulist->data = ralloc_array(prog_data, uint32_t, ulist->count);
+        blob_copy_bytes(&blob, ulist->data,
+                        ulist->count * sizeof(*ulist->data));
+
+        *qpu_size = blob_read_uint32(&blob);
+        uint64_t *qpu_insts = malloc(*qpu_size);
+        if (qpu_insts)
+                blob_copy_bytes(&blob, qpu_insts, *qpu_size);
+
+        free(buffer);
+
+        if (blob.overrun || !qpu_insts) {
+                ralloc_free(prog_data);
+                free(qpu_insts);
+                return NULL;
+        }
+
+        shader->prog_data.base = prog_data;
+
+        return qpu_insts;
+}
+
+/**
+ * Stores a newly compiled variant in the disk cache.
+ */
+void
+v3d_disk_cache_store(struct v3d_context *v3d,
+                     const struct v3d_key *key,
+                     uint32_t key_size,
+                     const struct v3d_compiled_shader *shader,
+                     const uint64_t *qpu_insts,
+                     uint32_t qpu_size)
+{
+        struct v3d_screen *screen = v3d->screen;
+        struct v3d_uncompiled_shader *uncompiled = key->shader_state;
+        nir_shader *s = uncompiled->base.ir.nir;
+        gl_shader_stage stage = s->info.stage;
+
+        if (!v3d_disk_cache_enabled(screen, stage))
+                return;
+
+        cache_key cache_key;
+        v3d_disk_cache_compute_key(screen->disk_cache, key, key_size,
+                                   cache_key);
+
+        if (unlikely(V3D_DEBUG & V3D_DEBUG_CACHE)) {
+                char sha1[41];
+                _mesa_sha1_format(sha1, cache_key);
+                fprintf(stderr, "[v3d disk cache] storing %s\n", sha1);
+        }
+
+        const struct v3d_prog_data *prog_data = shader->prog_data.base;
+        const struct v3d_uniform_list *ulist = &prog_data->uniforms;
+
+        struct blob blob;
+        blob_init(&blob);
+
+        blob_write_bytes(&blob, prog_data, v3d_prog_data_size(stage));
+        blob_write_bytes(&blob, ulist->contents,
+                         ulist->count * sizeof(*ulist->contents));
+        blob_write_bytes(&blob, ulist->data,
+                         ulist->count * sizeof(*ulist->data));
+        blob_write_uint32(&blob, qpu_size);
+        blob_write_bytes(&blob, qpu_insts, qpu_size);
+
+        if (!blob.out_of_memory)
+                disk_cache_put(screen->disk_cache, cache_key,
+                               blob.data, blob.size, NULL);
+
+        blob_finish(&blob);
+}
+
+void
+v3d_disk_cache_init(struct v3d_screen *screen)
+{
+#ifdef ENABLE_SHADER_CACHE
+        char renderer[16];
+        snprintf(renderer, sizeof(renderer), "v3d_%d", screen->devinfo.ver);
+
+        const struct build_id_note *note =
+                build_id_find_nhdr_for_addr(v3d_disk_cache_init);
+        assert(note && build_id_length(note) == 20); /* sha1 */
+
+        const uint8_t *id_sha1 = build_id_data(note);
+        assert(id_sha1);
+
+        char timestamp[41];
+        _mesa_sha1_format(timestamp, id_sha1);
+
+        /* The only debug flag changing the generated code. */
+        const uint64_t driver_flags = V3D_DEBUG & V3D_DEBUG_NO_VIR_SCHED;
+
+        screen->disk_cache = disk_cache_create(renderer, timestamp,
+                                               driver_flags);
+#endif
+}
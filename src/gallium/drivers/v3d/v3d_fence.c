@@ -82,6 +82,7 @@ v3d_fence_finish(struct pipe_screen *pscreen,
         ret = drmSyncobjImportSyncFile(screen->fd, syncobj, f->fd);
         if (ret) {
                 fprintf(stderr, "Failed to import fence to syncobj: %d\n", ret);
+                drmSyncobjDestroy(screen->fd, syncobj);
                 return false;
         }
 
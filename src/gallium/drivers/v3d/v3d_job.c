@@ -37,14 +37,40 @@
 #include "util/set.h"
 #include "broadcom/clif/clif_dump.h"
 
+/* Returns the mask of v3d->job_slots whose jobs reference the BO. */
+static uint32_t
+v3d_bo_job_mask(struct v3d_context *v3d, struct v3d_bo *bo)
+{
+        struct hash_entry *entry = _mesa_hash_table_search(v3d->bo_jobs, bo);
+
+        return entry ? (uintptr_t)entry->data : 0;
+}
+
 void
 v3d_job_free(struct v3d_context *v3d, struct v3d_job *job)
 {
         set_foreach(job->bos, entry) {
                 struct v3d_bo *bo = (struct v3d_bo *)entry->key;
+
+                if (job->slot_bit) {
+                        struct hash_entry *bo_entry =
+                                _mesa_hash_table_search(v3d->bo_jobs, bo);
+                        uintptr_t mask = ((uintptr_t)bo_entry->data &
+                                          ~job->slot_bit);
+                        if (mask)
+                                bo_entry->data = (void *)mask;
+                        else
+                                _mesa_hash_table_remove(v3d->bo_jobs, bo_entry);
+                }
+
                 v3d_bo_unreference(&bo);
         }
 
+        if (job->slot_bit) {
+                v3d->job_slots[ffs(job->slot_bit) - 1] = NULL;
+                v3d->job_slots_used &= ~job->slot_bit;
+        }
+
         _mesa_hash_table_remove_key(v3d->jobs, &job->key);
 
         if (job->write_prscs) {
@@ -66,7 +92,7 @@ v3d_job_free(struct v3d_context *v3d, struct v3d_job *job)
                 struct v3d_resource *rsc = v3d_resource(job->zsbuf->texture);
                 if (rsc->separate_stencil)
                         _mesa_hash_table_remove_key(v3d->write_jobs,
-                                                    &rsc->separate_stencil->base);
+                                                    &rsc->separate_stencil->base.b);
 
                 _mesa_hash_table_remove_key(v3d->write_jobs,
                                             job->zsbuf->texture);
@@ -120,6 +146,19 @@ v3d_job_add_bo(struct v3d_job *job, struct v3d_bo *bo)
         _mesa_set_add(job->bos, bo);
         job->referenced_size += bo->size;
 
+        if (job->slot_bit) {
+                struct v3d_context *v3d = job->v3d;
+                struct hash_entry *entry =
+                        _mesa_hash_table_search(v3d->bo_jobs, bo);
+                if (entry) {
+                        entry->data = (void *)((uintptr_t)entry->data |
+                                               job->slot_bit);
+                } else {
+                        _mesa_hash_table_insert(v3d->bo_jobs, bo,
+                                                (void *)(uintptr_t)job->slot_bit);
+                }
+        }
+
         uint32_t *bo_handles = (void *)(uintptr_t)job->submit.bo_handles;
 
         if (job->submit.bo_handle_count >= job->bo_handles_size) {
@@ -144,17 +183,20 @@ v3d_job_add_write_resource(struct v3d_job *job, struct pipe_resource *prsc)
 
         _mesa_set_add(job->write_prscs, prsc);
         _mesa_hash_table_insert(v3d->write_jobs, prsc, job);
+        v3d_resource(prsc)->gpu_written = true;
+}
+
+bool
+v3d_bo_used_by_jobs(struct v3d_context *v3d, struct v3d_bo *bo)
+{
+        return v3d_bo_job_mask(v3d, bo) != 0;
 }
 
 void
 v3d_flush_jobs_using_bo(struct v3d_context *v3d, struct v3d_bo *bo)
 {
-        hash_table_foreach(v3d->jobs, entry) {
-                struct v3d_job *job = entry->data;
-
-                if (_mesa_set_search(job->bos, bo))
-                        v3d_job_submit(v3d, job);
-        }
+        foreach_bit(slot, v3d_bo_job_mask(v3d, bo))
+                v3d_job_submit(v3d, v3d->job_slots[slot]);
 }
 
 void
@@ -232,11 +274,8 @@ v3d_flush_jobs_reading_resource(struct v3d_context *v3d,
          */
         v3d_flush_jobs_writing_resource(v3d, prsc, flush_cond);
 
-        hash_table_foreach(v3d->jobs, entry) {
-                struct v3d_job *job = entry->data;
-
-                if (!_mesa_set_search(job->bos, rsc->bo))
-                        continue;
+        foreach_bit(slot, v3d_bo_job_mask(v3d, rsc->bo)) {
+                struct v3d_job *job = v3d->job_slots[slot];
 
                 bool needs_flush;
                 switch (flush_cond) {
@@ -251,11 +290,6 @@ v3d_flush_jobs_reading_resource(struct v3d_context *v3d,
 
                 if (needs_flush)
                         v3d_job_submit(v3d, job);
-
-                /* Reminder: v3d->jobs is safe to keep iterating even
-                 * after deletion of an entry.
-                 */
-                continue;
         }
 }
 
@@ -321,11 +355,22 @@ v3d_get_job(struct v3d_context *v3d,
         if (entry)
                 return entry->data;
 
+        if (v3d->job_slots_used == ~0u) {
+                perf_debug("Flushing all jobs to get past %d queued FBOs\n",
+                           V3D_MAX_JOBS);
+                v3d_flush(&v3d->base);
+        }
+
         /* Creating a new job.  Make sure that any previous jobs reading or
          * writing these buffers are flushed.
          */
         struct v3d_job *job = v3d_job_create(v3d);
 
+        int slot = ffs(~v3d->job_slots_used) - 1;
+        job->slot_bit = 1u << slot;
+        v3d->job_slots[slot] = job;
+        v3d->job_slots_used |= job->slot_bit;
+
         for (int i = 0; i < V3D_MAX_DRAW_BUFFERS; i++) {
                 if (cbufs[i]) {
                         v3d_flush_jobs_reading_resource(v3d, cbufs[i]->texture,
@@ -355,10 +400,10 @@ v3d_get_job(struct v3d_context *v3d,
                 struct v3d_resource *rsc = v3d_resource(zsbuf->texture);
                 if (rsc->separate_stencil) {
                         v3d_flush_jobs_reading_resource(v3d,
-                                                        &rsc->separate_stencil->base,
+                                                        &rsc->separate_stencil->base.b,
                                                         V3D_FLUSH_DEFAULT);
                         _mesa_hash_table_insert(v3d->write_jobs,
-                                                &rsc->separate_stencil->base,
+                                                &rsc->separate_stencil->base.b,
                                                 job);
                 }
         }
@@ -573,5 +618,6 @@ v3d_job_init(struct v3d_context *v3d)
         v3d->write_jobs = _mesa_hash_table_create(v3d,
                                                   _mesa_hash_pointer,
                                                   _mesa_key_pointer_equal);
+        v3d->bo_jobs = _mesa_pointer_hash_table_create(v3d);
 }
 
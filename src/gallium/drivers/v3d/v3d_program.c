@@ -23,15 +23,19 @@
 
 #include <inttypes.h>
 #include "util/format/u_format.h"
+#include "util/blob.h"
+#include "util/u_atomic.h"
 #include "util/u_math.h"
 #include "util/u_memory.h"
 #include "util/ralloc.h"
 #include "util/hash_table.h"
+#include "util/mesa-sha1.h"
 #include "util/u_upload_mgr.h"
 #include "tgsi/tgsi_dump.h"
 #include "tgsi/tgsi_parse.h"
 #include "compiler/nir/nir.h"
 #include "compiler/nir/nir_builder.h"
+#include "compiler/nir/nir_serialize.h"
 #include "nir/tgsi_to_nir.h"
 #include "compiler/v3d_compiler.h"
 #include "v3d_context.h"
@@ -285,7 +289,11 @@ v3d_uncompiled_shader_create(struct pipe_context *pctx,
         if (!so)
                 return NULL;
 
-        so->program_id = v3d->next_uncompiled_program_id++;
+        /* Shader CSOs may be created from another thread than the one
+         * drawing with the context when it's wrapped by u_threaded_context.
+         */
+        so->program_id =
+                p_atomic_inc_return(&v3d->next_uncompiled_program_id) - 1;
 
         nir_shader *s;
 
@@ -330,6 +338,17 @@ v3d_uncompiled_shader_create(struct pipe_context *pctx,
         so->base.type = PIPE_SHADER_IR_NIR;
         so->base.ir.nir = s;
 
+        if (v3d->screen->disk_cache) {
+                /* Hash the NIR without the names and other info that don't
+                 * change the generated code, for more disk cache hits.
+                 */
+                struct blob blob;
+                blob_init(&blob);
+                nir_serialize(&blob, s, true);
+                _mesa_sha1_compute(blob.data, blob.size, so->sha1);
+                blob_finish(&blob);
+        }
+
         if (V3D_DEBUG & (V3D_DEBUG_NIR |
                          v3d_debug_flag_for_shader_stage(s->info.stage))) {
                 fprintf(stderr, "%s prog %d NIR:\n",
@@ -385,22 +404,52 @@ v3d_get_compiled_shader(struct v3d_context *v3d,
         struct v3d_compiled_shader *shader =
                 rzalloc(NULL, struct v3d_compiled_shader);
 
-        int program_id = shader_state->program_id;
-        int variant_id =
-                p_atomic_inc_return(&shader_state->compiled_variant_count);
-        uint64_t *qpu_insts;
         uint32_t shader_size;
-
-        qpu_insts = v3d_compile(v3d->screen->compiler, key,
-                                &shader->prog_data.base, s,
-                                v3d_shader_debug_output,
-                                v3d,
-                                program_id, variant_id, &shader_size);
-        ralloc_steal(shader, shader->prog_data.base);
+        uint64_t *qpu_insts = v3d_disk_cache_retrieve(v3d, key, key_size,
+                                                      shader, &shader_size);
+        if (!qpu_insts) {
+                int program_id = shader_state->program_id;
+                int variant_id = p_atomic_inc_return(
+                        &shader_state->compiled_variant_count);
+
+                qpu_insts = v3d_compile(v3d->screen->compiler, key,
+                                        &shader->prog_data.base, s,
+                                        v3d_shader_debug_output,
+                                        v3d,
+                                        program_id, variant_id, &shader_size);
+                ralloc_steal(shader, shader->prog_data.base);
+
+                if (shader_size) {
+                        v3d_disk_cache_store(v3d, key, key_size, shader,
+                                             qpu_insts, shader_size);
+                }
+        }
 
         v3d_set_shader_uniform_dirty_flags(shader);
 
-        if (shader_size) {
+        if (!shader_size)
+                shader->static_uniforms = false;
+
+        if (shader->static_uniforms) {
+                /* Upload the constant uniforms with the code, so that all
+                 * the draws using the shader share them.  Leave an extra
+                 * zero slot for the uniform the hardware prefetches past
+                 * the end of the stream.
+                 */
+                struct v3d_uniform_list *uinfo =
+                        &shader->prog_data.base->uniforms;
+                uint32_t size = shader_size + (uinfo->count + 1) * 4;
+                uint8_t *data = calloc(1, size);
+
+                memcpy(data, qpu_insts, shader_size);
+                memcpy(data + shader_size, uinfo->data, uinfo->count * 4);
+
+                u_upload_data(v3d->state_uploader, 0, size, 8,
+                              data, &shader->offset, &shader->resource);
+                shader->uniforms_offset = shader->offset + shader_size;
+
+                free(data);
+        } else if (shader_size) {
                 u_upload_data(v3d->state_uploader, 0, shader_size, 8,
                               qpu_insts, &shader->offset, &shader->resource);
         }
@@ -1005,4 +1054,10 @@ v3d_program_fini(struct pipe_context *pctx)
         }
 
         v3d_bo_unreference(&v3d->prog.spill_bo);
+
+        v3d_bo_unreference(&v3d->prog.cs_uniforms.bo);
+        v3d_bo_unreference(&v3d->prog.vs_uniforms.bo);
+        v3d_bo_unreference(&v3d->prog.gs_bin_uniforms.bo);
+        v3d_bo_unreference(&v3d->prog.gs_uniforms.bo);
+        v3d_bo_unreference(&v3d->prog.fs_uniforms.bo);
 }
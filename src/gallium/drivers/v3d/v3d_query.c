@@ -38,6 +38,7 @@
 
 struct v3d_query
 {
+        struct threaded_query base;
         enum pipe_query_type type;
         struct v3d_bo *bo;
 
@@ -153,7 +154,12 @@ v3d_get_query_result(struct pipe_context *pctx, struct pipe_query *query,
         uint32_t result = 0;
 
         if (q->bo) {
-                v3d_flush_jobs_using_bo(v3d, q->bo);
+                /* Once u_threaded_context has flushed the query, its jobs
+                 * have been submitted and we may be called from the app
+                 * thread, which mustn't look at the context's jobs.
+                 */
+                if (!q->base.flushed)
+                        v3d_flush_jobs_using_bo(v3d, q->bo);
 
                 if (wait) {
                         if (!v3d_bo_wait(q->bo, ~0ull, "query"))
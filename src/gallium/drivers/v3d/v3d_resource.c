@@ -24,6 +24,8 @@
 
 #include "pipe/p_defines.h"
 #include "util/u_blit.h"
+#include "util/u_blitter.h"
+#include "util/hash_table.h"
 #include "util/u_memory.h"
 #include "util/format/u_format.h"
 #include "util/u_inlines.h"
@@ -46,7 +48,7 @@ v3d_debug_resource_layout(struct v3d_resource *rsc, const char *caller)
         if (!(V3D_DEBUG & V3D_DEBUG_SURFACE))
                 return;
 
-        struct pipe_resource *prsc = &rsc->base;
+        struct pipe_resource *prsc = &rsc->base.b;
 
         if (prsc->target == PIPE_BUFFER) {
                 fprintf(stderr,
@@ -97,7 +99,7 @@ v3d_debug_resource_layout(struct v3d_resource *rsc, const char *caller)
 static bool
 v3d_resource_bo_alloc(struct v3d_resource *rsc)
 {
-        struct pipe_resource *prsc = &rsc->base;
+        struct pipe_resource *prsc = &rsc->base.b;
         struct pipe_screen *pscreen = prsc->screen;
         struct v3d_bo *bo;
 
@@ -105,6 +107,7 @@ v3d_resource_bo_alloc(struct v3d_resource *rsc)
         if (bo) {
                 v3d_bo_unreference(&rsc->bo);
                 rsc->bo = bo;
+                rsc->gpu_written = false;
                 v3d_debug_resource_layout(rsc, "alloc");
                 return true;
         } else {
@@ -112,39 +115,124 @@ v3d_resource_bo_alloc(struct v3d_resource *rsc)
         }
 }
 
+/* Flags the state that may point at a resource's BO after reallocating it. */
 static void
-v3d_resource_transfer_unmap(struct pipe_context *pctx,
-                            struct pipe_transfer *ptrans)
+v3d_resource_bo_changed(struct v3d_context *v3d, struct pipe_resource *prsc)
+{
+        /* If it might be bound as one of our vertex buffers or UBOs, make
+         * sure we re-emit vertex buffer state or uniforms.
+         */
+        if (prsc->bind & PIPE_BIND_VERTEX_BUFFER)
+                v3d->dirty |= VC5_DIRTY_VTXBUF;
+        if (prsc->bind & PIPE_BIND_CONSTANT_BUFFER)
+                v3d->dirty |= VC5_DIRTY_CONSTBUF;
+}
+
+/* Returns whether the resource's BO is used by queued or running jobs. */
+static bool
+v3d_resource_is_busy(struct v3d_context *v3d, struct v3d_resource *rsc)
+{
+        return (v3d_bo_used_by_jobs(v3d, rsc->bo) ||
+                !v3d_bo_wait(rsc->bo, 0, NULL));
+}
+
+/* Largest amount of a buffer's contents that we copy to a new BO on a
+ * partial discard, instead of waiting for the GPU to be done with it.  The
+ * old contents are read through a write-combined mapping, which is slow.
+ */
+#define V3D_DISCARD_RANGE_MAX_COPY (64 * 1024)
+
+/**
+ * Gives a busy buffer a new BO for a map that discards the mapped range, so
+ * that the map neither flushes the jobs using the buffer nor waits for them.
+ *
+ * The new BO comes idle from the BO cache, and the contents outside of the
+ * range are copied over from the old BO, which is safe as long as the GPU is
+ * only reading it.  The jobs already using the old BO keep a reference to it.
+ */
+static bool
+v3d_resource_rename_for_discard(struct v3d_context *v3d,
+                                struct v3d_resource *rsc,
+                                const struct pipe_box *box)
+{
+        struct pipe_resource *prsc = &rsc->base.b;
+
+        if (prsc->target != PIPE_BUFFER ||
+            (prsc->flags & PIPE_RESOURCE_FLAG_MAP_PERSISTENT) ||
+            !rsc->bo->private ||
+            rsc->gpu_written ||
+            prsc->width0 - box->width > V3D_DISCARD_RANGE_MAX_COPY ||
+            _mesa_hash_table_search(v3d->write_jobs, prsc)) {
+                return false;
+        }
+
+        if (!v3d_resource_is_busy(v3d, rsc))
+                return false;
+
+        struct v3d_bo *old_bo = v3d_bo_reference(rsc->bo);
+        if (!v3d_resource_bo_alloc(rsc)) {
+                v3d_bo_unreference(&old_bo);
+                return false;
+        }
+
+        uint8_t *src = v3d_bo_map_unsynchronized(old_bo);
+        uint8_t *dst = v3d_bo_map_unsynchronized(rsc->bo);
+        uint32_t end = box->x + box->width;
+        memcpy(dst, src, box->x);
+        memcpy(dst + end, src + end, prsc->width0 - end);
+
+        v3d_bo_unreference(&old_bo);
+
+        v3d_resource_bo_changed(v3d, prsc);
+        v3d->transfer_stats.discard_renames++;
+
+        return true;
+}
+
+/**
+ * Gives a busy buffer a new BO when its contents are invalidated, so that
+ * the writes that follow don't have to wait for the jobs using the old ones.
+ */
+void
+v3d_resource_invalidate_buffer(struct pipe_context *pctx,
+                               struct pipe_resource *prsc)
 {
         struct v3d_context *v3d = v3d_context(pctx);
-        struct v3d_transfer *trans = v3d_transfer(ptrans);
+        struct v3d_resource *rsc = v3d_resource(prsc);
 
-        if (trans->map) {
-                struct v3d_resource *rsc = v3d_resource(ptrans->resource);
-                struct v3d_resource_slice *slice = &rsc->slices[ptrans->level];
+        assert(prsc->target == PIPE_BUFFER);
 
-                if (ptrans->usage & PIPE_TRANSFER_WRITE) {
-                        for (int z = 0; z < ptrans->box.depth; z++) {
-                                void *dst = rsc->bo->map +
-                                        v3d_layer_offset(&rsc->base,
-                                                         ptrans->level,
-                                                         ptrans->box.z + z);
-                                v3d_store_tiled_image(dst,
-                                                      slice->stride,
-                                                      (trans->map +
-                                                       ptrans->stride *
-                                                       ptrans->box.height * z),
-                                                      ptrans->stride,
-                                                      slice->tiling, rsc->cpp,
-                                                      slice->padded_height,
-                                                      &ptrans->box);
-                        }
-                }
-                free(trans->map);
+        if ((prsc->flags & PIPE_RESOURCE_FLAG_MAP_PERSISTENT) ||
+            !rsc->bo->private ||
+            !v3d_resource_is_busy(v3d, rsc)) {
+                return;
         }
 
-        pipe_resource_reference(&ptrans->resource, NULL);
-        slab_free(&v3d->transfer_pool, ptrans);
+        if (v3d_resource_bo_alloc(rsc))
+                v3d_resource_bo_changed(v3d, prsc);
+}
+
+/**
+ * Moves the storage of a buffer reallocated by u_threaded_context into the
+ * original resource, once the driver thread reaches the invalidation.
+ */
+void
+v3d_replace_buffer_storage(struct pipe_context *pctx,
+                           struct pipe_resource *dst,
+                           struct pipe_resource *src)
+{
+        struct v3d_context *v3d = v3d_context(pctx);
+        struct v3d_resource *dst_rsc = v3d_resource(dst);
+        struct v3d_resource *src_rsc = v3d_resource(src);
+
+        assert(dst->target == PIPE_BUFFER && src->target == PIPE_BUFFER);
+        assert(dst->width0 == src->width0);
+
+        v3d_bo_unreference(&dst_rsc->bo);
+        dst_rsc->bo = v3d_bo_reference(src_rsc->bo);
+        dst_rsc->gpu_written = src_rsc->gpu_written;
+
+        v3d_resource_bo_changed(v3d, dst);
 }
 
 static void
@@ -157,14 +245,7 @@ v3d_map_usage_prep(struct pipe_context *pctx,
 
         if (usage & PIPE_TRANSFER_DISCARD_WHOLE_RESOURCE) {
                 if (v3d_resource_bo_alloc(rsc)) {
-                        /* If it might be bound as one of our vertex buffers
-                         * or UBOs, make sure we re-emit vertex buffer state
-                         * or uniforms.
-                         */
-                        if (prsc->bind & PIPE_BIND_VERTEX_BUFFER)
-                                v3d->dirty |= VC5_DIRTY_VTXBUF;
-                        if (prsc->bind & PIPE_BIND_CONSTANT_BUFFER)
-                                v3d->dirty |= VC5_DIRTY_CONSTBUF;
+                        v3d_resource_bo_changed(v3d, prsc);
                 } else {
                         /* If we failed to reallocate, flush users so that we
                          * don't violate any syncing requirements.
@@ -191,6 +272,241 @@ v3d_map_usage_prep(struct pipe_context *pctx,
         }
 }
 
+/* Tiled maps of fewer pixels than this are tiled or untiled on the CPU,
+ * where it's cheaper than getting a staging BO and submitting a GPU job.
+ */
+#define V3D_GPU_TILING_MIN_PIXELS (128 * 128)
+
+enum v3d_tiling_path {
+        V3D_TILING_CPU,
+        V3D_TILING_TFU_UPLOAD,
+        V3D_TILING_BLIT_READBACK,
+};
+
+/**
+ * Chooses whether a map of a tiled texture gets its data tiled or untiled by
+ * the CPU, or by the GPU through a linear staging resource.
+ *
+ * The GPU paths let writes avoid waiting for the texture to go idle and
+ * spare the CPU the swizzling, but they have a fixed cost and only handle
+ * single 2D images: the TFU can only write whole levels, and readbacks need
+ * the format to be renderable.
+ */
+static enum v3d_tiling_path
+v3d_choose_tiling_path(struct v3d_context *v3d, struct v3d_resource *rsc,
+                       unsigned level, unsigned usage,
+                       const struct pipe_box *box)
+{
+        struct v3d_screen *screen = v3d->screen;
+        struct pipe_resource *prsc = &rsc->base.b;
+
+        if (usage & (PIPE_TRANSFER_UNSYNCHRONIZED |
+                     PIPE_TRANSFER_MAP_DIRECTLY |
+                     PIPE_TRANSFER_PERSISTENT |
+                     PIPE_TRANSFER_COHERENT)) {
+                return V3D_TILING_CPU;
+        }
+
+        if (prsc->target != PIPE_TEXTURE_2D ||
+            prsc->nr_samples > 1 ||
+            box->depth != 1 ||
+            util_format_is_compressed(prsc->format) ||
+            box->width * box->height < V3D_GPU_TILING_MIN_PIXELS) {
+                return V3D_TILING_CPU;
+        }
+
+        switch (usage & PIPE_TRANSFER_READ_WRITE) {
+        case PIPE_TRANSFER_WRITE: {
+                if (!screen->has_tfu ||
+                    box->x != 0 || box->y != 0 ||
+                    box->width != u_minify(prsc->width0, level) ||
+                    box->height != u_minify(prsc->height0, level)) {
+                        return V3D_TILING_CPU;
+                }
+
+                uint32_t tex_format = v3d_get_tex_format(&screen->devinfo,
+                                                         prsc->format);
+                if (!v3d_tfu_supports_tex_format(&screen->devinfo,
+                                                 tex_format)) {
+                        return V3D_TILING_CPU;
+                }
+
+                return V3D_TILING_TFU_UPLOAD;
+        }
+
+        case PIPE_TRANSFER_READ:
+                if (util_format_is_depth_or_stencil(prsc->format) ||
+                    !screen->base.is_format_supported(&screen->base,
+                                                      prsc->format,
+                                                      PIPE_TEXTURE_2D, 0, 0,
+                                                      PIPE_BIND_RENDER_TARGET)) {
+                        return V3D_TILING_CPU;
+                }
+
+                return V3D_TILING_BLIT_READBACK;
+
+        default:
+                return V3D_TILING_CPU;
+        }
+}
+
+static struct pipe_resource *
+v3d_staging_create(struct pipe_context *pctx, struct pipe_resource *prsc,
+                   const struct pipe_box *box, unsigned bind)
+{
+        struct pipe_resource tmpl = {
+                .target = PIPE_TEXTURE_2D,
+                .format = prsc->format,
+                .width0 = box->width,
+                .height0 = box->height,
+                .depth0 = 1,
+                .array_size = 1,
+                .usage = PIPE_USAGE_STAGING,
+                .bind = PIPE_BIND_LINEAR | bind,
+        };
+
+        return v3d_resource_create(pctx->screen, &tmpl);
+}
+
+/* Stores a TFU upload's staging data on the CPU, if the TFU job couldn't be
+ * submitted.
+ */
+static void
+v3d_store_staging(struct pipe_context *pctx, struct pipe_transfer *ptrans)
+{
+        struct v3d_context *v3d = v3d_context(pctx);
+        struct v3d_resource *rsc = v3d_resource(ptrans->resource);
+        struct v3d_resource *staging =
+                v3d_resource(v3d_transfer(ptrans)->staging);
+        struct v3d_resource_slice *slice = &rsc->slices[ptrans->level];
+
+        v3d_map_usage_prep(pctx, ptrans->resource, PIPE_TRANSFER_WRITE);
+
+        void *dst = v3d_bo_map(rsc->bo) +
+                v3d_layer_offset(&rsc->base.b, ptrans->level, ptrans->box.z);
+        v3d_store_tiled_image(dst, slice->stride,
+                              v3d_bo_map(staging->bo), ptrans->stride,
+                              slice->tiling, rsc->cpp, slice->padded_height,
+                              &ptrans->box, &v3d->screen->tiling_queue);
+}
+
+/* Maps a linear staging resource for a tiled texture map that the GPU will
+ * tile or untile, or returns NULL to fall back to the CPU.
+ */
+static void *
+v3d_staging_map(struct pipe_context *pctx, struct pipe_transfer *ptrans,
+                enum v3d_tiling_path path)
+{
+        struct v3d_context *v3d = v3d_context(pctx);
+        struct v3d_transfer *trans = v3d_transfer(ptrans);
+        struct pipe_resource *prsc = ptrans->resource;
+        struct v3d_resource *rsc = v3d_resource(prsc);
+
+        if (path == V3D_TILING_TFU_UPLOAD) {
+                trans->staging = v3d_staging_create(pctx, prsc, &ptrans->box,
+                                                    0);
+                if (!trans->staging)
+                        return NULL;
+
+                /* The TFU job will be ordered after the jobs using the
+                 * texture, so there's nothing to wait for here.
+                 */
+                rsc->initialized_buffers = ~0;
+                v3d->transfer_stats.tfu_uploads++;
+        } else {
+                trans->staging = v3d_staging_create(pctx, prsc, &ptrans->box,
+                                                    PIPE_BIND_RENDER_TARGET);
+                if (!trans->staging)
+                        return NULL;
+
+                struct pipe_blit_info info = {
+                        .dst = {
+                                .resource = trans->staging,
+                                .format = prsc->format,
+                                .box = {
+                                        .width = ptrans->box.width,
+                                        .height = ptrans->box.height,
+                                        .depth = 1,
+                                },
+                        },
+                        .src = {
+                                .resource = prsc,
+                                .level = ptrans->level,
+                                .format = prsc->format,
+                                .box = ptrans->box,
+                        },
+                        .mask = util_format_get_mask(prsc->format),
+                        .filter = PIPE_TEX_FILTER_NEAREST,
+                };
+
+                if (!util_blitter_is_blit_supported(v3d->blitter, &info)) {
+                        pipe_resource_reference(&trans->staging, NULL);
+                        return NULL;
+                }
+
+                /* v3d_blit() submits the job, and mapping the staging BO
+                 * below waits for it.
+                 */
+                pctx->blit(pctx, &info);
+                v3d->transfer_stats.blit_readbacks++;
+        }
+
+        struct v3d_resource *staging = v3d_resource(trans->staging);
+        ptrans->stride = staging->slices[0].stride;
+        ptrans->layer_stride = ptrans->stride * ptrans->box.height;
+
+        return v3d_bo_map(staging->bo);
+}
+
+static void
+v3d_resource_transfer_unmap(struct pipe_context *pctx,
+                            struct pipe_transfer *ptrans)
+{
+        struct v3d_context *v3d = v3d_context(pctx);
+        struct v3d_screen *screen = v3d->screen;
+        struct v3d_transfer *trans = v3d_transfer(ptrans);
+
+        if (trans->staging) {
+                if ((ptrans->usage & PIPE_TRANSFER_WRITE) &&
+                    !v3d_tfu(pctx, ptrans->resource, trans->staging,
+                             0, ptrans->level, ptrans->level,
+                             0, ptrans->box.z)) {
+                        v3d_store_staging(pctx, ptrans);
+                        v3d->transfer_stats.tfu_fallbacks++;
+                }
+                pipe_resource_reference(&trans->staging, NULL);
+        } else if (trans->map) {
+                struct v3d_resource *rsc = v3d_resource(ptrans->resource);
+                struct v3d_resource_slice *slice = &rsc->slices[ptrans->level];
+
+                if (ptrans->usage & PIPE_TRANSFER_WRITE) {
+                        for (int z = 0; z < ptrans->box.depth; z++) {
+                                void *dst = rsc->bo->map +
+                                        v3d_layer_offset(&rsc->base.b,
+                                                         ptrans->level,
+                                                         ptrans->box.z + z);
+                                v3d_store_tiled_image(dst,
+                                                      slice->stride,
+                                                      (trans->map +
+                                                       ptrans->stride *
+                                                       ptrans->box.height * z),
+                                                      ptrans->stride,
+                                                      slice->tiling, rsc->cpp,
+                                                      slice->padded_height,
+                                                      &ptrans->box,
+                                                      &screen->tiling_queue);
+                        }
+                }
+                free(trans->map);
+        }
+
+        pipe_resource_reference(&ptrans->resource, NULL);
+        /* Unmaps always happen in the driver thread, even for transfers
+         * allocated from transfer_pool_unsync.
+         */
+        slab_free(&v3d->transfer_pool, ptrans);
+}
+
 static void *
 v3d_resource_transfer_map(struct pipe_context *pctx,
                           struct pipe_resource *prsc,
@@ -199,6 +515,7 @@ v3d_resource_transfer_map(struct pipe_context *pctx,
                           struct pipe_transfer **pptrans)
 {
         struct v3d_context *v3d = v3d_context(pctx);
+        struct v3d_screen *screen = v3d->screen;
         struct v3d_resource *rsc = v3d_resource(prsc);
         struct v3d_transfer *trans;
         struct pipe_transfer *ptrans;
@@ -208,11 +525,19 @@ v3d_resource_transfer_map(struct pipe_context *pctx,
         /* MSAA maps should have been handled by u_transfer_helper. */
         assert(prsc->nr_samples <= 1);
 
+        /* u_threaded_context does its own buffer invalidations, and unsynced
+         * maps may be made from the app thread using the latest storage, so
+         * we mustn't give the resource a new BO behind its back.
+         */
+        if (usage & TC_TRANSFER_MAP_NO_INVALIDATE)
+                usage &= ~PIPE_TRANSFER_DISCARD_WHOLE_RESOURCE;
+
         /* Upgrade DISCARD_RANGE to WHOLE_RESOURCE if the whole resource is
          * being mapped.
          */
         if ((usage & PIPE_TRANSFER_DISCARD_RANGE) &&
-            !(usage & PIPE_TRANSFER_UNSYNCHRONIZED) &&
+            !(usage & (PIPE_TRANSFER_UNSYNCHRONIZED |
+                       TC_TRANSFER_MAP_NO_INVALIDATE)) &&
             !(prsc->flags & PIPE_RESOURCE_FLAG_MAP_PERSISTENT) &&
             prsc->last_level == 0 &&
             prsc->width0 == box->width &&
@@ -223,23 +548,73 @@ v3d_resource_transfer_map(struct pipe_context *pctx,
                 usage |= PIPE_TRANSFER_DISCARD_WHOLE_RESOURCE;
         }
 
-        v3d_map_usage_prep(pctx, prsc, usage);
+        /* Partial discards of busy buffers get a new BO to write to, so
+         * there's nothing left to synchronize with.
+         */
+        if ((usage & PIPE_TRANSFER_DISCARD_RANGE) &&
+            !(usage & (PIPE_TRANSFER_UNSYNCHRONIZED |
+                       PIPE_TRANSFER_DISCARD_WHOLE_RESOURCE |
+                       TC_TRANSFER_MAP_NO_INVALIDATE)) &&
+            v3d_resource_rename_for_discard(v3d, rsc, box)) {
+                usage |= PIPE_TRANSFER_UNSYNCHRONIZED;
+        }
+
+        /* Anything else but reallocating would flush or wait for the jobs
+         * using the resource.
+         */
+        if ((usage & PIPE_TRANSFER_DONTBLOCK) &&
+            !(usage & (PIPE_TRANSFER_UNSYNCHRONIZED |
+                       PIPE_TRANSFER_DISCARD_WHOLE_RESOURCE)) &&
+            v3d_resource_is_busy(v3d, rsc)) {
+                v3d->transfer_stats.dontblock_fails++;
+                return NULL;
+        }
+
+        enum v3d_tiling_path path = V3D_TILING_CPU;
+        if (rsc->tiled)
+                path = v3d_choose_tiling_path(v3d, rsc, level, usage, box);
 
-        trans = slab_alloc(&v3d->transfer_pool);
+        if (path == V3D_TILING_CPU)
+                v3d_map_usage_prep(pctx, prsc, usage);
+
+        /* Unsynchronized maps under u_threaded_context come from the app
+         * thread, which can't use the driver thread's slab pool.  They're
+         * also only for buffers, so nothing above touched the context.
+         */
+        if (usage & TC_TRANSFER_MAP_THREADED_UNSYNC) {
+                assert(prsc->target == PIPE_BUFFER);
+                trans = slab_alloc(&v3d->transfer_pool_unsync);
+        } else {
+                trans = slab_alloc(&v3d->transfer_pool);
+        }
         if (!trans)
                 return NULL;
 
-        /* XXX: Handle DONTBLOCK, DISCARD_RANGE, PERSISTENT, COHERENT. */
+        /* PERSISTENT and COHERENT maps need nothing special: the GPU sees
+         * the CPU's writes to our write-combined mappings without any
+         * flushing, and the discard paths above don't reallocate resources
+         * created for persistent mapping.
+         */
 
         /* slab_alloc_st() doesn't zero: */
         memset(trans, 0, sizeof(*trans));
-        ptrans = &trans->base;
+        ptrans = &trans->base.b;
 
         pipe_resource_reference(&ptrans->resource, prsc);
         ptrans->level = level;
         ptrans->usage = usage;
         ptrans->box = *box;
 
+        if (path != V3D_TILING_CPU) {
+                void *map = v3d_staging_map(pctx, ptrans, path);
+                if (map) {
+                        *pptrans = ptrans;
+                        return map;
+                }
+
+                v3d_map_usage_prep(pctx, prsc, usage);
+        }
+
         /* Note that the current kernel implementation is synchronous, so no
          * need to do syncing stuff here yet.
          */
@@ -275,11 +650,12 @@ v3d_resource_transfer_map(struct pipe_context *pctx,
                 ptrans->layer_stride = ptrans->stride * ptrans->box.height;
 
                 trans->map = malloc(ptrans->layer_stride * ptrans->box.depth);
+                v3d->transfer_stats.cpu_maps++;
 
                 if (usage & PIPE_TRANSFER_READ) {
                         for (int z = 0; z < ptrans->box.depth; z++) {
                                 void *src = rsc->bo->map +
-                                        v3d_layer_offset(&rsc->base,
+                                        v3d_layer_offset(&rsc->base.b,
                                                          ptrans->level,
                                                          ptrans->box.z + z);
                                 v3d_load_tiled_image((trans->map +
@@ -290,7 +666,8 @@ v3d_resource_transfer_map(struct pipe_context *pctx,
                                                      slice->stride,
                                                      slice->tiling, rsc->cpp,
                                                      slice->padded_height,
-                                             &ptrans->box);
+                                                     &ptrans->box,
+                                                     &screen->tiling_queue);
                         }
                 }
                 return trans->map;
@@ -320,6 +697,7 @@ v3d_texture_subdata(struct pipe_context *pctx,
                     unsigned stride,
                     unsigned layer_stride)
 {
+        struct v3d_screen *screen = v3d_context(pctx)->screen;
         struct v3d_resource *rsc = v3d_resource(prsc);
         struct v3d_resource_slice *slice = &rsc->slices[level];
 
@@ -344,14 +722,14 @@ v3d_texture_subdata(struct pipe_context *pctx,
 
         for (int i = 0; i < box->depth; i++) {
                 v3d_store_tiled_image(buf +
-                                      v3d_layer_offset(&rsc->base,
+                                      v3d_layer_offset(&rsc->base.b,
                                                        level,
                                                        box->z + i),
                                       slice->stride,
                                       (void *)data + layer_stride * i,
                                       stride,
                                       slice->tiling, rsc->cpp, slice->padded_height,
-                                      box);
+                                      box, &screen->tiling_queue);
         }
 }
 
@@ -365,6 +743,7 @@ v3d_resource_destroy(struct pipe_screen *pscreen,
         if (rsc->scanout)
                 renderonly_scanout_destroy(rsc->scanout, screen->ro);
 
+        threaded_resource_deinit(prsc);
         v3d_bo_unreference(&rsc->bo);
         free(rsc);
 }
@@ -388,6 +767,7 @@ v3d_resource_get_handle(struct pipe_screen *pscreen,
          * the ones seeing it (like BO caching).
          */
         bo->private = false;
+        rsc->base.is_shared = true;
 
         if (rsc->tiled) {
                 /* A shared tiled buffer should always be allocated as UIF,
@@ -470,7 +850,7 @@ static void
 v3d_setup_slices(struct v3d_resource *rsc, uint32_t winsys_stride,
                  bool uif_top)
 {
-        struct pipe_resource *prsc = &rsc->base;
+        struct pipe_resource *prsc = &rsc->base.b;
         uint32_t width = prsc->width0;
         uint32_t height = prsc->height0;
         uint32_t depth = prsc->depth0;
@@ -652,12 +1032,13 @@ v3d_resource_setup(struct pipe_screen *pscreen,
         struct v3d_resource *rsc = CALLOC_STRUCT(v3d_resource);
         if (!rsc)
                 return NULL;
-        struct pipe_resource *prsc = &rsc->base;
+        struct pipe_resource *prsc = &rsc->base.b;
 
         *prsc = *tmpl;
 
         pipe_reference_init(&prsc->reference, 1);
         prsc->screen = pscreen;
+        threaded_resource_init(prsc);
 
         if (prsc->nr_samples <= 1 ||
             screen->devinfo.ver >= 40 ||
@@ -703,7 +1084,7 @@ v3d_resource_create_with_modifiers(struct pipe_screen *pscreen,
 
         bool linear_ok = drm_find_modifier(DRM_FORMAT_MOD_LINEAR, modifiers, count);
         struct v3d_resource *rsc = v3d_resource_setup(pscreen, tmpl);
-        struct pipe_resource *prsc = &rsc->base;
+        struct pipe_resource *prsc = &rsc->base.b;
         /* Use a tiled layout if we can, for better 3D performance. */
         bool should_tile = true;
 
@@ -819,7 +1200,7 @@ v3d_resource_from_handle(struct pipe_screen *pscreen,
 {
         struct v3d_screen *screen = v3d_screen(pscreen);
         struct v3d_resource *rsc = v3d_resource_setup(pscreen, tmpl);
-        struct pipe_resource *prsc = &rsc->base;
+        struct pipe_resource *prsc = &rsc->base.b;
         struct v3d_resource_slice *slice = &rsc->slices[0];
 
         if (!rsc)
@@ -859,6 +1240,7 @@ v3d_resource_from_handle(struct pipe_screen *pscreen,
         if (!rsc->bo)
                 goto fail;
 
+        rsc->base.is_shared = true;
         rsc->internal_format = prsc->format;
 
         v3d_setup_slices(rsc, whandle->stride, true);
@@ -938,15 +1320,15 @@ v3d_update_shadow_texture(struct pipe_context *pctx,
                 return;
 
         perf_debug("Updating %dx%d@%d shadow for linear texture\n",
-                   orig->base.width0, orig->base.height0,
+                   orig->base.b.width0, orig->base.b.height0,
                    pview->u.tex.first_level);
 
-        for (int i = 0; i <= shadow->base.last_level; i++) {
-                unsigned width = u_minify(shadow->base.width0, i);
-                unsigned height = u_minify(shadow->base.height0, i);
+        for (int i = 0; i <= shadow->base.b.last_level; i++) {
+                unsigned width = u_minify(shadow->base.b.width0, i);
+                unsigned height = u_minify(shadow->base.b.height0, i);
                 struct pipe_blit_info info = {
                         .dst = {
-                                .resource = &shadow->base,
+                                .resource = &shadow->base.b,
                                 .level = i,
                                 .box = {
                                         .x = 0,
@@ -956,10 +1338,10 @@ v3d_update_shadow_texture(struct pipe_context *pctx,
                                         .height = height,
                                         .depth = 1,
                                 },
-                                .format = shadow->base.format,
+                                .format = shadow->base.b.format,
                         },
                         .src = {
-                                .resource = &orig->base,
+                                .resource = &orig->base.b,
                                 .level = pview->u.tex.first_level + i,
                                 .box = {
                                         .x = 0,
@@ -969,9 +1351,9 @@ v3d_update_shadow_texture(struct pipe_context *pctx,
                                         .height = height,
                                         .depth = 1,
                                 },
-                                .format = orig->base.format,
+                                .format = orig->base.b.format,
                         },
-                        .mask = util_format_get_mask(orig->base.format),
+                        .mask = util_format_get_mask(orig->base.b.format),
                 };
                 pctx->blit(pctx, &info);
         }
@@ -1049,7 +1431,7 @@ v3d_create_surface(struct pipe_context *pctx,
 
         if (rsc->separate_stencil) {
                 surface->separate_stencil =
-                        v3d_create_surface(pctx, &rsc->separate_stencil->base,
+                        v3d_create_surface(pctx, &rsc->separate_stencil->base.b,
                                            surf_tmpl);
         }
 
@@ -1094,7 +1476,7 @@ v3d_resource_get_stencil(struct pipe_resource *prsc)
 {
         struct v3d_resource *rsc = v3d_resource(prsc);
 
-        return &rsc->separate_stencil->base;
+        return &rsc->separate_stencil->base.b;
 }
 
 static const struct u_transfer_vtbl transfer_vtbl = {
@@ -26,6 +26,7 @@
 #define VC5_RESOURCE_H
 
 #include "v3d_screen.h"
+#include "util/u_threaded_context.h"
 #include "util/u_transfer.h"
 
 /* A UIFblock is a 256-byte region of memory that's 256-byte aligned.  These
@@ -66,8 +67,12 @@ enum v3d_tiling_mode {
 };
 
 struct v3d_transfer {
-        struct pipe_transfer base;
+        struct threaded_transfer base;
         void *map;
+        /** Linear resource the map points into, if the tiling is being done
+         * by the GPU.
+         */
+        struct pipe_resource *staging;
 };
 
 struct v3d_resource_slice {
@@ -120,7 +125,7 @@ struct v3d_surface {
 };
 
 struct v3d_resource {
-        struct pipe_resource base;
+        struct threaded_resource base;
         struct v3d_bo *bo;
         struct renderonly_scanout *scanout;
         struct v3d_resource_slice slices[V3D_MAX_MIP_LEVELS];
@@ -148,6 +153,12 @@ struct v3d_resource {
          */
         uint32_t initialized_buffers;
 
+        /**
+         * Whether jobs writing the current BO may have been submitted.  If
+         * not, its contents can be copied while the GPU is still using it.
+         */
+        bool gpu_written;
+
         enum pipe_format internal_format;
 
         /* Resource storing the S8 part of a Z32F_S8 resource, or NULL. */
@@ -180,6 +191,11 @@ void v3d_update_shadow_texture(struct pipe_context *pctx,
                                struct pipe_sampler_view *view);
 uint32_t v3d_layer_offset(struct pipe_resource *prsc, uint32_t level,
                           uint32_t layer);
+void v3d_resource_invalidate_buffer(struct pipe_context *pctx,
+                                    struct pipe_resource *prsc);
+void v3d_replace_buffer_storage(struct pipe_context *pctx,
+                                struct pipe_resource *dst,
+                                struct pipe_resource *src);
 
 
 #endif /* VC5_RESOURCE_H */
@@ -31,6 +31,8 @@
 #include "pipe/p_screen.h"
 #include "pipe/p_state.h"
 
+#include "util/disk_cache.h"
+#include "util/u_cpu_detect.h"
 #include "util/u_debug.h"
 #include "util/u_memory.h"
 #include "util/format/u_format.h"
@@ -76,12 +78,15 @@ v3d_screen_destroy(struct pipe_screen *pscreen)
         util_hash_table_destroy(screen->bo_handles);
         v3d_bufmgr_destroy(pscreen);
         slab_destroy_parent(&screen->transfer_pool);
+        if (util_queue_is_initialized(&screen->tiling_queue))
+                util_queue_destroy(&screen->tiling_queue);
         free(screen->ro);
 
         if (using_v3d_simulator)
                 v3d_simulator_destroy(screen);
 
         v3d_compiler_free(screen->compiler);
+        disk_cache_destroy(screen->disk_cache);
         u_transfer_helper_destroy(pscreen->transfer_helper);
 
         close(screen->fd);
@@ -158,7 +163,7 @@ v3d_screen_get_param(struct pipe_screen *pscreen, enum pipe_cap param)
                 return screen->has_csd && screen->devinfo.ver >= 41;
 
         case PIPE_CAP_GENERATE_MIPMAP:
-                return v3d_has_feature(screen, DRM_V3D_PARAM_SUPPORTS_TFU);
+                return screen->has_tfu;
 
         case PIPE_CAP_INDEP_BLEND_ENABLE:
                 return screen->devinfo.ver >= 40;
@@ -625,6 +630,14 @@ v3d_screen_get_compiler_options(struct pipe_screen *pscreen,
         return &v3d_nir_options;
 }
 
+static struct disk_cache *
+v3d_screen_get_disk_shader_cache(struct pipe_screen *pscreen)
+{
+        struct v3d_screen *screen = v3d_screen(pscreen);
+
+        return screen->disk_cache;
+}
+
 static void
 v3d_screen_query_dmabuf_modifiers(struct pipe_screen *pscreen,
                                   enum pipe_format format, int max,
@@ -699,9 +712,23 @@ v3d_screen_create(int fd, const struct pipe_screen_config *config,
 
         slab_create_parent(&screen->transfer_pool, sizeof(struct v3d_transfer), 16);
 
+        /* The thread doing the load/store takes part in it too, so the queue
+         * gets one thread less than the number we split the work into.
+         */
+        util_cpu_detect();
+        int tiling_threads =
+                debug_get_num_option("V3D_TILING_THREADS",
+                                     MIN2(util_cpu_caps.nr_cpus, 4));
+        if (tiling_threads > 1) {
+                util_queue_init(&screen->tiling_queue, "v3d_tiling", 16,
+                                tiling_threads - 1,
+                                UTIL_QUEUE_INIT_RESIZE_IF_FULL);
+        }
+
         screen->has_csd = v3d_has_feature(screen, DRM_V3D_PARAM_SUPPORTS_CSD);
         screen->has_cache_flush =
                 v3d_has_feature(screen, DRM_V3D_PARAM_SUPPORTS_CACHE_FLUSH);
+        screen->has_tfu = v3d_has_feature(screen, DRM_V3D_PARAM_SUPPORTS_TFU);
 
         v3d_fence_init(screen);
 
@@ -709,12 +736,24 @@ v3d_screen_create(int fd, const struct pipe_screen_config *config,
 
         v3d_resource_screen_init(pscreen);
 
-        screen->compiler = v3d_compiler_init(&screen->devinfo);
+        /* Compile shaders at the lower thread counts on other cores while
+         * we try 4 threads, instead of only after that failed.
+         */
+        int compile_threads =
+                debug_get_num_option("V3D_COMPILE_THREADS",
+                                     MIN2(util_cpu_caps.nr_cpus - 1,
+                                          screen->devinfo.ver >= 41 ? 1 : 2));
+        screen->compiler =
+                v3d_compiler_init_speculative(&screen->devinfo,
+                                              MAX2(compile_threads, 0));
+
+        v3d_disk_cache_init(screen);
 
         pscreen->get_name = v3d_screen_get_name;
         pscreen->get_vendor = v3d_screen_get_vendor;
         pscreen->get_device_vendor = v3d_screen_get_vendor;
         pscreen->get_compiler_options = v3d_screen_get_compiler_options;
+        pscreen->get_disk_shader_cache = v3d_screen_get_disk_shader_cache;
         pscreen->query_dmabuf_modifiers = v3d_screen_query_dmabuf_modifiers;
 
         return pscreen;
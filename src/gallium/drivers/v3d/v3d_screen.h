@@ -30,6 +30,7 @@
 #include "state_tracker/drm_driver.h"
 #include "util/list.h"
 #include "util/slab.h"
+#include "util/u_queue.h"
 #include "broadcom/common/v3d_debug.h"
 #include "broadcom/common/v3d_device_info.h"
 
@@ -46,6 +47,7 @@ struct v3d_bo;
 #define VC5_UIFBLOCK_SIZE (4 * VC5_UBLOCK_SIZE)
 #define VC5_UIFBLOCK_ROW_SIZE (4 * VC5_UIFBLOCK_SIZE)
 
+struct disk_cache;
 struct v3d_simulator_file;
 
 struct v3d_screen {
@@ -59,6 +61,9 @@ struct v3d_screen {
 
         struct slab_parent_pool transfer_pool;
 
+        /** Threads that large tiled texture loads/stores get split across. */
+        struct util_queue tiling_queue;
+
         struct v3d_bo_cache {
                 /** List of struct v3d_bo freed, by age. */
                 struct list_head time_list;
@@ -71,6 +76,9 @@ struct v3d_screen {
 
         const struct v3d_compiler *compiler;
 
+        /** On-disk cache of compiled shader variants, if enabled. */
+        struct disk_cache *disk_cache;
+
         struct util_hash_table *bo_handles;
         mtx_t bo_handles_mutex;
 
@@ -79,6 +87,7 @@ struct v3d_screen {
 
         bool has_csd;
         bool has_cache_flush;
+        bool has_tfu;
         bool nonmsaa_texture_size_limit;
 
         struct v3d_simulator_file *sim_file;
@@ -31,6 +31,7 @@
 #include "v3d_screen.h"
 #include "v3d_context.h"
 #include "v3d_tiling.h"
+#include "util/u_queue.h"
 #include "broadcom/common/v3d_cpu_tiling.h"
 
 /** Return the width in pixels of a 64-byte microtile. */
@@ -252,6 +253,219 @@ v3d_move_pixels_unaligned(void *gpu, uint32_t gpu_stride,
         }
 }
 
+typedef uint32_t (*v3d_pixel_offset_func)(uint32_t cpp, uint32_t image_h,
+                                         uint32_t x, uint32_t y);
+
+/* Number of utiles in an aligned region above which it gets split across the
+ * tiling queue.  Below this, handing the work off to other threads costs more
+ * than it saves.
+ */
+#define V3D_TILING_MT_MIN_UTILES 4096
+
+#define V3D_TILING_MAX_BANDS 8
+
+/**
+ * A rectangle of whole utiles to be moved.
+ *
+ * All of the tiling layouts are separable: the offset of a utile is the
+ * offset of its column in the first utile row plus the offset of its row in
+ * the first utile column, so we only need to call the pixel offset functions
+ * once per row and column instead of once per utile.  The exception is
+ * UIF_XOR, where every other group of 4 UIF block columns gets bit 4 of the
+ * UIF block row flipped.  Those columns have bit 0 of their column offset set
+ * (utile offsets are 64-byte aligned) and use the second row table.
+ */
+struct v3d_utile_region {
+        void *gpu;
+        void *cpu;
+        uint32_t cpu_stride;
+        int cpp;
+        uint32_t cols, rows;
+        const uint32_t *col_offsets;
+        const uint32_t *row_offsets[2];
+};
+
+struct v3d_tiling_job {
+        const struct v3d_utile_region *region;
+        uint32_t row_start, row_end;
+        bool is_load;
+        struct util_queue_fence fence;
+};
+
+static inline void
+v3d_move_utiles_percpp(const struct v3d_utile_region *region,
+                       uint32_t row_start, uint32_t row_end,
+                       int cpp, bool is_load)
+{
+        uint32_t utile_gpu_stride = v3d_utile_width(cpp) * cpp;
+        uint32_t utile_cpu_size = v3d_utile_height(cpp) * region->cpu_stride;
+
+        for (uint32_t row = row_start; row < row_end; row++) {
+                void *utile_cpu = region->cpu + row * utile_cpu_size;
+
+                for (uint32_t col = 0; col < region->cols; col++) {
+                        uint32_t col_offset = region->col_offsets[col];
+                        void *utile_gpu = (region->gpu +
+                                           ((col_offset & ~1) +
+                                            region->row_offsets[col_offset & 1][row]));
+
+                        if (is_load) {
+                                v3d_load_utile(utile_cpu, region->cpu_stride,
+                                               utile_gpu, utile_gpu_stride);
+                        } else {
+                                v3d_store_utile(utile_gpu, utile_gpu_stride,
+                                                utile_cpu, region->cpu_stride);
+                        }
+
+                        utile_cpu += utile_gpu_stride;
+                }
+        }
+}
+
+static void
+v3d_move_utiles(const struct v3d_utile_region *region,
+                uint32_t row_start, uint32_t row_end, bool is_load)
+{
+        switch (region->cpp) {
+        case 1:
+                v3d_move_utiles_percpp(region, row_start, row_end, 1, is_load);
+                break;
+        case 2:
+                v3d_move_utiles_percpp(region, row_start, row_end, 2, is_load);
+                break;
+        case 4:
+                v3d_move_utiles_percpp(region, row_start, row_end, 4, is_load);
+                break;
+        case 8:
+                v3d_move_utiles_percpp(region, row_start, row_end, 8, is_load);
+                break;
+        case 16:
+                v3d_move_utiles_percpp(region, row_start, row_end, 16, is_load);
+                break;
+        }
+}
+
+static void
+v3d_tiling_job_execute(void *data, int thread_index)
+{
+        struct v3d_tiling_job *job = data;
+
+        v3d_move_utiles(job->region, job->row_start, job->row_end,
+                        job->is_load);
+}
+
+/* Moves the region, splitting large ones into bands of utile rows that get
+ * moved by the tiling queue's threads and the calling thread in parallel.
+ */
+static void
+v3d_move_utile_region(const struct v3d_utile_region *region,
+                      struct util_queue *queue, bool is_load)
+{
+        struct v3d_tiling_job jobs[V3D_TILING_MAX_BANDS];
+        uint32_t bands = 1;
+
+        if (queue && util_queue_is_initialized(queue) &&
+            region->rows * region->cols >= V3D_TILING_MT_MIN_UTILES) {
+                bands = MIN3(queue->num_threads + 1, V3D_TILING_MAX_BANDS,
+                             region->rows);
+        }
+
+        uint32_t band_rows = DIV_ROUND_UP(region->rows, bands);
+
+        for (uint32_t i = 1; i < bands; i++) {
+                jobs[i].region = region;
+                jobs[i].row_start = MIN2(i * band_rows, region->rows);
+                jobs[i].row_end = MIN2((i + 1) * band_rows, region->rows);
+                jobs[i].is_load = is_load;
+                util_queue_fence_init(&jobs[i].fence);
+                util_queue_add_job(queue, &jobs[i], &jobs[i].fence,
+                                   v3d_tiling_job_execute, NULL, 0);
+        }
+
+        v3d_move_utiles(region, 0, MIN2(band_rows, region->rows), is_load);
+
+        for (uint32_t i = 1; i < bands; i++) {
+                util_queue_fence_wait(&jobs[i].fence);
+                util_queue_fence_destroy(&jobs[i].fence);
+        }
+}
+
+/* Moves the cols x rows utiles starting at utile-aligned pixel (x, y), with
+ * @cpu pointing at the CPU copy of that pixel.
+ */
+static void
+v3d_move_aligned_utiles(void *gpu, void *cpu, uint32_t cpu_stride,
+                        int cpp, uint32_t image_h,
+                        uint32_t x, uint32_t y, uint32_t cols, uint32_t rows,
+                        v3d_pixel_offset_func get_pixel_offset,
+                        bool do_xor, struct util_queue *queue, bool is_load)
+{
+        uint32_t utile_w = v3d_utile_width(cpp);
+        uint32_t utile_h = v3d_utile_height(cpp);
+        uint32_t stack_offsets[256];
+        uint32_t *offsets = stack_offsets;
+        uint32_t table_size = cols + (do_xor ? 2 : 1) * rows;
+
+        if (table_size > ARRAY_SIZE(stack_offsets)) {
+                offsets = malloc(table_size * sizeof(*offsets));
+                if (!offsets) {
+                        struct pipe_box box = {
+                                .x = x,
+                                .y = y,
+                                .width = cols * utile_w,
+                                .height = rows * utile_h,
+                        };
+                        v3d_move_pixels_unaligned(gpu, 0, cpu, cpu_stride,
+                                                  cpp, image_h, &box,
+                                                  get_pixel_offset, is_load);
+                        return;
+                }
+        }
+
+        uint32_t *col_offsets = offsets;
+        uint32_t *row_offsets = offsets + cols;
+        uint32_t *xor_row_offsets = do_xor ? row_offsets + rows : row_offsets;
+
+        /* First pixel of the first group of UIF block columns that gets the
+         * XOR applied.
+         */
+        uint32_t xor_x = 4 * 2 * utile_w;
+
+        for (uint32_t i = 0; i < cols; i++) {
+                uint32_t px = x + i * utile_w;
+
+                col_offsets[i] = get_pixel_offset(cpp, image_h, px, 0);
+                if (do_xor && (px / xor_x) & 1)
+                        col_offsets[i] |= 1;
+        }
+
+        for (uint32_t j = 0; j < rows; j++) {
+                uint32_t py = y + j * utile_h;
+
+                row_offsets[j] = get_pixel_offset(cpp, image_h, 0, py);
+                if (do_xor) {
+                        xor_row_offsets[j] =
+                                (get_pixel_offset(cpp, image_h, xor_x, py) -
+                                 get_pixel_offset(cpp, image_h, xor_x, 0));
+                }
+        }
+
+        struct v3d_utile_region region = {
+                .gpu = gpu,
+                .cpu = cpu,
+                .cpu_stride = cpu_stride,
+                .cpp = cpp,
+                .cols = cols,
+                .rows = rows,
+                .col_offsets = col_offsets,
+                .row_offsets = { row_offsets, xor_row_offsets },
+        };
+        v3d_move_utile_region(&region, queue, is_load);
+
+        if (offsets != stack_offsets)
+                free(offsets);
+}
+
 /* Breaks the image down into utiles and calls either the fast whole-utile
  * load/store functions, or the unaligned fallback case.
  */
@@ -263,11 +477,11 @@ v3d_move_pixels_general_percpp(void *gpu, uint32_t gpu_stride,
                                uint32_t (*get_pixel_offset)(uint32_t cpp,
                                                             uint32_t image_h,
                                                             uint32_t x, uint32_t y),
+                               bool do_xor, struct util_queue *queue,
                                bool is_load)
 {
         uint32_t utile_w = v3d_utile_width(cpp);
         uint32_t utile_h = v3d_utile_height(cpp);
-        uint32_t utile_gpu_stride = utile_w * cpp;
         uint32_t x1 = box->x;
         uint32_t y1 = box->y;
         uint32_t x2 = box->x + box->width;
@@ -277,26 +491,7 @@ v3d_move_pixels_general_percpp(void *gpu, uint32_t gpu_stride,
         uint32_t align_x2 = x2 & ~(utile_w - 1);
         uint32_t align_y2 = y2 & ~(utile_h - 1);
 
-        /* Load/store all the whole utiles first. */
-        for (uint32_t y = align_y1; y < align_y2; y += utile_h) {
-                void *cpu_row = cpu + (y - box->y) * cpu_stride;
-
-                for (uint32_t x = align_x1; x < align_x2; x += utile_w) {
-                        void *utile_gpu = (gpu +
-                                           get_pixel_offset(cpp, image_h, x, y));
-                        void *utile_cpu = cpu_row + (x - box->x) * cpp;
-
-                        if (is_load) {
-                                v3d_load_utile(utile_cpu, cpu_stride,
-                                               utile_gpu, utile_gpu_stride);
-                        } else {
-                                v3d_store_utile(utile_gpu, utile_gpu_stride,
-                                                utile_cpu, cpu_stride);
-                        }
-                }
-        }
-
-        /* If there were no aligned utiles in the middle, load/store the whole
+        /* If there are no aligned utiles in the middle, load/store the whole
          * thing unaligned.
          */
         if (align_y2 <= align_y1 ||
@@ -309,6 +504,17 @@ v3d_move_pixels_general_percpp(void *gpu, uint32_t gpu_stride,
                 return;
         }
 
+        /* Load/store all the whole utiles first. */
+        v3d_move_aligned_utiles(gpu,
+                                (cpu +
+                                 (align_y1 - y1) * cpu_stride +
+                                 (align_x1 - x1) * cpp),
+                                cpu_stride, cpp, image_h,
+                                align_x1, align_y1,
+                                (align_x2 - align_x1) / utile_w,
+                                (align_y2 - align_y1) / utile_h,
+                                get_pixel_offset, do_xor, queue, is_load);
+
         /* Load/store the partial utiles. */
         struct pipe_box partial_boxes[4] = {
                 /* Top */
@@ -355,13 +561,14 @@ v3d_move_pixels_general_percpp(void *gpu, uint32_t gpu_stride,
 
 static inline void
 v3d_move_pixels_general(void *gpu, uint32_t gpu_stride,
-                               void *cpu, uint32_t cpu_stride,
-                               int cpp, uint32_t image_h,
-                               const struct pipe_box *box,
-                               uint32_t (*get_pixel_offset)(uint32_t cpp,
-                                                            uint32_t image_h,
-                                                            uint32_t x, uint32_t y),
-                               bool is_load)
+                        void *cpu, uint32_t cpu_stride,
+                        int cpp, uint32_t image_h,
+                        const struct pipe_box *box,
+                        uint32_t (*get_pixel_offset)(uint32_t cpp,
+                                                     uint32_t image_h,
+                                                     uint32_t x, uint32_t y),
+                        bool do_xor, struct util_queue *queue,
+                        bool is_load)
 {
         switch (cpp) {
         case 1:
@@ -369,100 +576,90 @@ v3d_move_pixels_general(void *gpu, uint32_t gpu_stride,
                                                cpu, cpu_stride,
                                                1, image_h, box,
                                                get_pixel_offset,
-                                               is_load);
+                                               do_xor, queue, is_load);
                 break;
         case 2:
                 v3d_move_pixels_general_percpp(gpu, gpu_stride,
                                                cpu, cpu_stride,
                                                2, image_h, box,
                                                get_pixel_offset,
-                                               is_load);
+                                               do_xor, queue, is_load);
                 break;
         case 4:
                 v3d_move_pixels_general_percpp(gpu, gpu_stride,
                                                cpu, cpu_stride,
                                                4, image_h, box,
                                                get_pixel_offset,
-                                               is_load);
+                                               do_xor, queue, is_load);
                 break;
         case 8:
                 v3d_move_pixels_general_percpp(gpu, gpu_stride,
                                                cpu, cpu_stride,
                                                8, image_h, box,
                                                get_pixel_offset,
-                                               is_load);
+                                               do_xor, queue, is_load);
                 break;
         case 16:
                 v3d_move_pixels_general_percpp(gpu, gpu_stride,
                                                cpu, cpu_stride,
                                                16, image_h, box,
                                                get_pixel_offset,
-                                               is_load);
+                                               do_xor, queue, is_load);
                 break;
         }
 }
 
-static inline void
-v3d_move_tiled_image(void *gpu, uint32_t gpu_stride,
-                     void *cpu, uint32_t cpu_stride,
-                     enum v3d_tiling_mode tiling_format,
-                     int cpp,
-                     uint32_t image_h,
-                     const struct pipe_box *box,
-                     bool is_load)
+static v3d_pixel_offset_func
+v3d_get_pixel_offset_func(enum v3d_tiling_mode tiling_format)
 {
         switch (tiling_format) {
         case VC5_TILING_UIF_XOR:
-                v3d_move_pixels_general(gpu, gpu_stride,
-                                        cpu, cpu_stride,
-                                        cpp, image_h, box,
-                                        v3d_get_uif_xor_pixel_offset,
-                                        is_load);
-                break;
+                return v3d_get_uif_xor_pixel_offset;
         case VC5_TILING_UIF_NO_XOR:
-                v3d_move_pixels_general(gpu, gpu_stride,
-                                        cpu, cpu_stride,
-                                        cpp, image_h, box,
-                                        v3d_get_uif_no_xor_pixel_offset,
-                                        is_load);
-                break;
+                return v3d_get_uif_no_xor_pixel_offset;
         case VC5_TILING_UBLINEAR_2_COLUMN:
-                v3d_move_pixels_general(gpu, gpu_stride,
-                                        cpu, cpu_stride,
-                                        cpp, image_h, box,
-                                        v3d_get_ublinear_2_column_pixel_offset,
-                                        is_load);
-                break;
+                return v3d_get_ublinear_2_column_pixel_offset;
         case VC5_TILING_UBLINEAR_1_COLUMN:
-                v3d_move_pixels_general(gpu, gpu_stride,
-                                        cpu, cpu_stride,
-                                        cpp, image_h, box,
-                                        v3d_get_ublinear_1_column_pixel_offset,
-                                        is_load);
-                break;
+                return v3d_get_ublinear_1_column_pixel_offset;
         case VC5_TILING_LINEARTILE:
-                v3d_move_pixels_general(gpu, gpu_stride,
-                                        cpu, cpu_stride,
-                                        cpp, image_h, box,
-                                        v3d_get_lt_pixel_offset,
-                                        is_load);
-                break;
+                return v3d_get_lt_pixel_offset;
         default:
                 unreachable("Unsupported tiling format");
-                break;
+                return NULL;
         }
 }
 
+static inline void
+v3d_move_tiled_image(void *gpu, uint32_t gpu_stride,
+                     void *cpu, uint32_t cpu_stride,
+                     enum v3d_tiling_mode tiling_format,
+                     int cpp,
+                     uint32_t image_h,
+                     const struct pipe_box *box,
+                     struct util_queue *queue,
+                     bool is_load)
+{
+        v3d_move_pixels_general(gpu, gpu_stride,
+                                cpu, cpu_stride,
+                                cpp, image_h, box,
+                                v3d_get_pixel_offset_func(tiling_format),
+                                tiling_format == VC5_TILING_UIF_XOR,
+                                queue, is_load);
+}
+
 /**
  * Loads pixel data from the start (microtile-aligned) box in \p src to the
  * start of \p dst according to the given tiling format.
+ *
+ * If \p queue is initialized, large boxes get split across its threads.
  */
 void
 v3d_load_tiled_image(void *dst, uint32_t dst_stride,
                      void *src, uint32_t src_stride,
                      enum v3d_tiling_mode tiling_format, int cpp,
                      uint32_t image_h,
-                     const struct pipe_box *box)
+                     const struct pipe_box *box,
+                     struct util_queue *queue)
 {
         v3d_move_tiled_image(src, src_stride,
                              dst, dst_stride,
@@ -470,19 +667,23 @@ v3d_load_tiled_image(void *dst, uint32_t dst_stride,
                              cpp,
                              image_h,
                              box,
+                             queue,
                              true);
 }
 
 /**
  * Stores pixel data from the start of \p src into a (microtile-aligned) box in
  * \p dst according to the given tiling format.
+ *
+ * If \p queue is initialized, large boxes get split across its threads.
  */
 void
 v3d_store_tiled_image(void *dst, uint32_t dst_stride,
                       void *src, uint32_t src_stride,
                       enum v3d_tiling_mode tiling_format, int cpp,
                       uint32_t image_h,
-                      const struct pipe_box *box)
+                      const struct pipe_box *box,
+                      struct util_queue *queue)
 {
         v3d_move_tiled_image(dst, dst_stride,
                              src, src_stride,
@@ -490,5 +691,42 @@ v3d_store_tiled_image(void *dst, uint32_t dst_stride,
                              cpp,
                              image_h,
                              box,
+                             queue,
                              false);
 }
+
+/**
+ * Same as v3d_load_tiled_image(), but computing the address of every pixel.
+ * Only used as the reference for testing the whole-utile paths.
+ */
+void
+v3d_load_tiled_image_per_pixel(void *dst, uint32_t dst_stride,
+                               void *src, uint32_t src_stride,
+                               enum v3d_tiling_mode tiling_format, int cpp,
+                               uint32_t image_h,
+                               const struct pipe_box *box)
+{
+        v3d_move_pixels_unaligned(src, src_stride,
+                                  dst, dst_stride,
+                                  cpp, image_h, box,
+                                  v3d_get_pixel_offset_func(tiling_format),
+                                  true);
+}
+
+/**
+ * Same as v3d_store_tiled_image(), but computing the address of every pixel.
+ * Only used as the reference for testing the whole-utile paths.
+ */
+void
+v3d_store_tiled_image_per_pixel(void *dst, uint32_t dst_stride,
+                                void *src, uint32_t src_stride,
+                                enum v3d_tiling_mode tiling_format, int cpp,
+                                uint32_t image_h,
+                                const struct pipe_box *box)
+{
+        v3d_move_pixels_unaligned(dst, dst_stride,
+                                  src, src_stride,
+                                  cpp, image_h, box,
+                                  v3d_get_pixel_offset_func(tiling_format),
+                                  false);
+}
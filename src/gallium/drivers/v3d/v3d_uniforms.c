@@ -200,7 +200,7 @@ write_tmu_p1(struct v3d_job *job,
                 variant = sview->sampler_variant;
 
         cl_aligned_reloc(&job->indirect, uniforms,
-                         v3d_resource(sampler->sampler_state)->bo,
+                         sampler->sampler_state,
                          sampler->sampler_state_offset[variant] |
                          v3d_unit_data_get_offset(data));
 }
@@ -215,6 +215,15 @@ v3d_write_uniforms(struct v3d_context *v3d, struct v3d_job *job,
         struct v3d_uniform_list *uinfo = &shader->prog_data.base->uniforms;
         const uint32_t *gallium_uniforms = cb->cb[0].user_buffer;
 
+        if (shader->static_uniforms) {
+                struct v3d_cl_reloc uniform_stream = {
+                        .bo = v3d_resource(shader->resource)->bo,
+                        .offset = shader->uniforms_offset,
+                };
+                v3d_bo_reference(uniform_stream.bo);
+                return uniform_stream;
+        }
+
         /* The hardware always pre-fetches the next uniform (also when there
          * aren't any), so we always allocate space for an extra slot. This
          * fixes MMU exceptions reported since Linux kernel 5.4 when the
@@ -402,12 +411,52 @@ v3d_write_uniforms(struct v3d_context *v3d, struct v3d_job *job,
         return uniform_stream;
 }
 
+/**
+ * Returns the uniform stream for a GL shader stage, reusing the one written
+ * for the last shader state emitted in this job if the stage's shader and
+ * the state its uniforms depend on haven't changed since.
+ *
+ * The QPU reads each shader's uniforms as one linear stream, so it can't be
+ * patched in pieces, but when a draw only changes the state of some stages,
+ * the streams of the others can still be shared between the shader records.
+ * v3d->dirty is reset to ~0 when switching jobs, so @last never points into
+ * another job's indirect CL when it's reused.
+ */
+struct v3d_cl_reloc
+v3d_get_uniforms(struct v3d_context *v3d, struct v3d_job *job,
+                 struct v3d_compiled_shader *shader,
+                 enum pipe_shader_type stage,
+                 uint64_t compiled_dirty,
+                 struct v3d_cl_reloc *last)
+{
+        if (last->bo &&
+            !(v3d->dirty & (compiled_dirty | shader->uniform_dirty_bits))) {
+                v3d_bo_reference(last->bo);
+                return *last;
+        }
+
+        struct v3d_cl_reloc uniforms = v3d_write_uniforms(v3d, job, shader,
+                                                          stage);
+
+        v3d_bo_unreference(&last->bo);
+        *last = uniforms;
+        v3d_bo_reference(last->bo);
+
+        return uniforms;
+}
+
 void
 v3d_set_shader_uniform_dirty_flags(struct v3d_compiled_shader *shader)
 {
         uint32_t dirty = 0;
+        bool all_constant = true;
 
         for (int i = 0; i < shader->prog_data.base->uniforms.count; i++) {
+                if (shader->prog_data.base->uniforms.contents[i] !=
+                    QUNIFORM_CONSTANT) {
+                        all_constant = false;
+                }
+
                 switch (shader->prog_data.base->uniforms.contents[i]) {
                 case QUNIFORM_CONSTANT:
                         break;
@@ -482,4 +531,5 @@ v3d_set_shader_uniform_dirty_flags(struct v3d_compiled_shader *shader)
         }
 
         shader->uniform_dirty_bits = dirty;
+        shader->static_uniforms = all_constant;
 }
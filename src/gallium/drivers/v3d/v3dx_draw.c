@@ -628,26 +628,36 @@ v3d_emit_gl_shader_state(struct v3d_context *v3d,
 
         /* Upload the uniforms to the indirect CL first */
         struct v3d_cl_reloc fs_uniforms =
-                v3d_write_uniforms(v3d, job, v3d->prog.fs,
-                                   PIPE_SHADER_FRAGMENT);
+                v3d_get_uniforms(v3d, job, v3d->prog.fs,
+                                 PIPE_SHADER_FRAGMENT,
+                                 VC5_DIRTY_COMPILED_FS,
+                                 &v3d->prog.fs_uniforms);
 
         struct v3d_cl_reloc gs_uniforms = { NULL, 0 };
         struct v3d_cl_reloc gs_bin_uniforms = { NULL, 0 };
         if (v3d->prog.gs) {
-                gs_uniforms = v3d_write_uniforms(v3d, job, v3d->prog.gs,
-                                                 PIPE_SHADER_GEOMETRY);
+                gs_uniforms = v3d_get_uniforms(v3d, job, v3d->prog.gs,
+                                               PIPE_SHADER_GEOMETRY,
+                                               VC5_DIRTY_COMPILED_GS,
+                                               &v3d->prog.gs_uniforms);
         }
         if (v3d->prog.gs_bin) {
-                gs_bin_uniforms = v3d_write_uniforms(v3d, job, v3d->prog.gs_bin,
-                                                     PIPE_SHADER_GEOMETRY);
+                gs_bin_uniforms = v3d_get_uniforms(v3d, job, v3d->prog.gs_bin,
+                                                   PIPE_SHADER_GEOMETRY,
+                                                   VC5_DIRTY_COMPILED_GS_BIN,
+                                                   &v3d->prog.gs_bin_uniforms);
         }
 
         struct v3d_cl_reloc vs_uniforms =
-                v3d_write_uniforms(v3d, job, v3d->prog.vs,
-                                   PIPE_SHADER_VERTEX);
+                v3d_get_uniforms(v3d, job, v3d->prog.vs,
+                                 PIPE_SHADER_VERTEX,
+                                 VC5_DIRTY_COMPILED_VS,
+                                 &v3d->prog.vs_uniforms);
         struct v3d_cl_reloc cs_uniforms =
-                v3d_write_uniforms(v3d, job, v3d->prog.cs,
-                                   PIPE_SHADER_VERTEX);
+                v3d_get_uniforms(v3d, job, v3d->prog.cs,
+                                 PIPE_SHADER_VERTEX,
+                                 VC5_DIRTY_COMPILED_CS,
+                                 &v3d->prog.cs_uniforms);
 
         /* Update the cache dirty flag based on the shader progs data */
         job->tmu_dirty_rcl |= v3d->prog.cs->prog_data.vs->base.tmu_dirty_rcl;
@@ -861,8 +871,7 @@ v3d_emit_gl_shader_state(struct v3d_context *v3d,
                         v3d->prog.vs->prog_data.vs->uses_iid;
 
                 shader.address_of_default_attribute_values =
-                        cl_address(v3d_resource(vtx->defaults)->bo,
-                                   vtx->defaults_offset);
+                        cl_address(vtx->defaults, 0);
         }
 
         bool cs_loaded_any = false;
@@ -1576,12 +1585,14 @@ v3d_launch_grid(struct pipe_context *pctx, const struct pipe_grid_info *info)
                 struct v3d_resource *rsc = v3d_resource(
                         v3d->ssbo[PIPE_SHADER_COMPUTE].sb[i].buffer);
                 rsc->writes++; /* XXX */
+                rsc->gpu_written = true;
         }
 
         foreach_bit(i, v3d->shaderimg[PIPE_SHADER_COMPUTE].enabled_mask) {
                 struct v3d_resource *rsc = v3d_resource(
                         v3d->shaderimg[PIPE_SHADER_COMPUTE].si[i].base.resource);
                 rsc->writes++;
+                rsc->gpu_written = true;
         }
 
         v3d_bo_unreference(&uniforms.bo);
@@ -65,7 +65,7 @@ load_general(struct v3d_cl *cl, struct pipe_surface *psurf, int buffer,
         struct v3d_resource *rsc = v3d_resource(psurf->texture);
 
         uint32_t layer_offset =
-                v3d_layer_offset(&rsc->base, psurf->u.tex.level,
+                v3d_layer_offset(&rsc->base.b, psurf->u.tex.level,
                                  psurf->u.tex.first_layer + layer);
         cl_emit(cl, LOAD_TILE_BUFFER_GENERAL, load) {
                 load.buffer_to_load = buffer;
@@ -131,7 +131,7 @@ store_general(struct v3d_job *job,
         rsc->writes++;
 
         uint32_t layer_offset =
-                v3d_layer_offset(&rsc->base, psurf->u.tex.level,
+                v3d_layer_offset(&rsc->base.b, psurf->u.tex.level,
                                  psurf->u.tex.first_layer + layer);
         cl_emit(cl, STORE_TILE_BUFFER_GENERAL, store) {
                 store.buffer_to_store = buffer;
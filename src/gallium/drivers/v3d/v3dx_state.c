@@ -404,12 +404,14 @@ v3d_vertex_state_create(struct pipe_context *pctx, unsigned num_elements,
         }
 
         /* Set up the default attribute values in case any of the vertex
-         * elements use them.
+         * elements use them.  This gets its own BO rather than going
+         * through the state uploader, since CSOs may be created from
+         * another thread than the one using the context.
          */
-        uint32_t *attrs;
-        u_upload_alloc(v3d->state_uploader, 0,
-                       V3D_MAX_VS_INPUTS * sizeof(float), 16,
-                       &so->defaults_offset, &so->defaults, (void **)&attrs);
+        so->defaults = v3d_bo_alloc(v3d->screen,
+                                    V3D_MAX_VS_INPUTS * sizeof(float),
+                                    "vertex defaults");
+        uint32_t *attrs = v3d_bo_map(so->defaults);
 
         for (int i = 0; i < V3D_MAX_VS_INPUTS / 4; i++) {
                 attrs[i * 4 + 0] = 0;
@@ -423,7 +425,6 @@ v3d_vertex_state_create(struct pipe_context *pctx, unsigned num_elements,
                 }
         }
 
-        u_upload_unmap(v3d->state_uploader);
         return so;
 }
 
@@ -432,7 +433,7 @@ v3d_vertex_state_delete(struct pipe_context *pctx, void *hwcso)
 {
         struct v3d_vertex_stateobj *so = hwcso;
 
-        pipe_resource_reference(&so->defaults, NULL);
+        v3d_bo_unreference(&so->defaults);
         free(so);
 }
 
@@ -737,20 +738,19 @@ v3d_create_sampler_state(struct pipe_context *pctx,
                                       cso->border_color.ui[3] != 0));
 
 #if V3D_VERSION >= 40
-        void *map;
         int sampler_align = so->border_color_variants ? 32 : 8;
         int sampler_size = align(cl_packet_length(SAMPLER_STATE), sampler_align);
         int num_variants = (so->border_color_variants ? ARRAY_SIZE(so->sampler_state_offset) : 1);
-        u_upload_alloc(v3d->state_uploader, 0,
-                       sampler_size * num_variants,
-                       sampler_align,
-                       &so->sampler_state_offset[0],
-                       &so->sampler_state,
-                       &map);
+        /* Like the sampler views, this gets its own BO so that it can be
+         * created from another thread than the one using the context.
+         */
+        so->sampler_state = v3d_bo_alloc(v3d->screen,
+                                         sampler_size * num_variants,
+                                         "sampler");
+        void *map = v3d_bo_map(so->sampler_state);
 
         for (int i = 0; i < num_variants; i++) {
-                so->sampler_state_offset[i] =
-                        so->sampler_state_offset[0] + i * sampler_size;
+                so->sampler_state_offset[i] = i * sampler_size;
                 v3d_upload_sampler_state_variant(map + i * sampler_size,
                                                  cso, i, either_nearest);
         }
@@ -826,7 +826,7 @@ v3d_sampler_state_delete(struct pipe_context *pctx,
         struct pipe_sampler_state *psampler = hwcso;
         struct v3d_sampler_state *sampler = v3d_sampler_state(psampler);
 
-        pipe_resource_reference(&sampler->sampler_state, NULL);
+        v3d_bo_unreference(&sampler->sampler_state);
         free(psampler);
 }
 
@@ -953,7 +953,7 @@ v3d_create_sampler_view(struct pipe_context *pctx, struct pipe_resource *prsc,
         if (rsc->separate_stencil &&
             cso->format == PIPE_FORMAT_X32_S8X24_UINT) {
                 rsc = rsc->separate_stencil;
-                prsc = &rsc->base;
+                prsc = &rsc->base.b;
         }
 
         /* If we're sampling depth from depth/stencil, demote the format to
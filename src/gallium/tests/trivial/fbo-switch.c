@@ -0,0 +1,279 @@
+/*
+ * Copyright © 2019 Broadcom
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* Measures the CPU time of a frame that keeps switching between many render
+ * targets, each drawn with a different set of vertex buffers, and that
+ * updates a buffer between the switches.  This keeps many jobs queued, each
+ * referencing many BOs, which is what makes the driver's checks for jobs
+ * reading a resource expensive.
+ *
+ * Usage: fbo-switch [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pipe/p_state.h"
+#include "pipe/p_context.h"
+#include "pipe/p_screen.h"
+#include "pipe/p_defines.h"
+#include "pipe/p_shader_tokens.h"
+#include "util/u_inlines.h"
+#include "util/u_draw_quad.h"
+#include "util/u_memory.h"
+#include "util/u_simple_shaders.h"
+#include "util/os_time.h"
+#include "cso_cache/cso_context.h"
+#include "pipe-loader/pipe_loader.h"
+
+#define WIDTH 64
+#define HEIGHT 64
+#define NUM_TARGETS 24
+#define NUM_VBUFS 96
+#define DRAWS_PER_TARGET 8
+
+struct program
+{
+	struct pipe_loader_device *dev;
+	struct pipe_screen *screen;
+	struct pipe_context *pipe;
+	struct cso_context *cso;
+
+	struct pipe_blend_state blend;
+	struct pipe_depth_stencil_alpha_state depthstencil;
+	struct pipe_rasterizer_state rasterizer;
+	struct pipe_viewport_state viewport;
+	struct pipe_vertex_element velem[2];
+
+	void *vs;
+	void *fs;
+
+	struct pipe_resource *vbufs[NUM_VBUFS];
+	struct pipe_resource *targets[NUM_TARGETS];
+	struct pipe_surface *surfaces[NUM_TARGETS];
+	struct pipe_resource *scratch;
+};
+
+static void init_prog(struct program *p)
+{
+	int ret;
+
+	ret = pipe_loader_probe(&p->dev, 1);
+	assert(ret);
+
+	p->screen = pipe_loader_create_screen(p->dev);
+	assert(p->screen);
+
+	p->pipe = p->screen->context_create(p->screen, NULL, 0);
+	p->cso = cso_create_context(p->pipe, 0);
+
+	/* one small triangle per vertex buffer, so each is its own BO */
+	for (int i = 0; i < NUM_VBUFS; i++) {
+		float x = (float)(i % 8) / 4.0f - 1.0f;
+		float y = (float)(i / 8 % 8) / 4.0f - 1.0f;
+		float vertices[3][2][4] = {
+			{ { x, y, 0.0f, 1.0f }, { 1.0f, 0.0f, 0.0f, 1.0f } },
+			{ { x + 0.25f, y, 0.0f, 1.0f }, { 0.0f, 1.0f, 0.0f, 1.0f } },
+			{ { x, y + 0.25f, 0.0f, 1.0f }, { 0.0f, 0.0f, 1.0f, 1.0f } },
+		};
+
+		p->vbufs[i] = pipe_buffer_create(p->screen,
+						 PIPE_BIND_VERTEX_BUFFER,
+						 PIPE_USAGE_DEFAULT,
+						 sizeof(vertices));
+		pipe_buffer_write(p->pipe, p->vbufs[i], 0, sizeof(vertices),
+				  vertices);
+	}
+
+	p->scratch = pipe_buffer_create(p->screen, PIPE_BIND_CONSTANT_BUFFER,
+					PIPE_USAGE_DEFAULT, 4096);
+
+	for (int i = 0; i < NUM_TARGETS; i++) {
+		struct pipe_resource tmplt;
+		struct pipe_surface surf_tmpl;
+
+		memset(&tmplt, 0, sizeof(tmplt));
+		tmplt.target = PIPE_TEXTURE_2D;
+		tmplt.format = PIPE_FORMAT_B8G8R8A8_UNORM;
+		tmplt.width0 = WIDTH;
+		tmplt.height0 = HEIGHT;
+		tmplt.depth0 = 1;
+		tmplt.array_size = 1;
+		tmplt.bind = PIPE_BIND_RENDER_TARGET;
+		p->targets[i] = p->screen->resource_create(p->screen, &tmplt);
+
+		memset(&surf_tmpl, 0, sizeof(surf_tmpl));
+		surf_tmpl.format = PIPE_FORMAT_B8G8R8A8_UNORM;
+		p->surfaces[i] = p->pipe->create_surface(p->pipe, p->targets[i],
+							 &surf_tmpl);
+	}
+
+	memset(&p->blend, 0, sizeof(p->blend));
+	p->blend.rt[0].colormask = PIPE_MASK_RGBA;
+
+	memset(&p->depthstencil, 0, sizeof(p->depthstencil));
+
+	memset(&p->rasterizer, 0, sizeof(p->rasterizer));
+	p->rasterizer.cull_face = PIPE_FACE_NONE;
+	p->rasterizer.half_pixel_center = 1;
+	p->rasterizer.bottom_edge_rule = 1;
+	p->rasterizer.depth_clip_near = 1;
+	p->rasterizer.depth_clip_far = 1;
+
+	p->viewport.scale[0] = WIDTH / 2.0f;
+	p->viewport.scale[1] = HEIGHT / 2.0f;
+	p->viewport.scale[2] = 0.5f;
+	p->viewport.translate[0] = WIDTH / 2.0f;
+	p->viewport.translate[1] = HEIGHT / 2.0f;
+	p->viewport.translate[2] = 0.5f;
+
+	memset(p->velem, 0, sizeof(p->velem));
+	p->velem[0].src_offset = 0;
+	p->velem[0].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+	p->velem[1].src_offset = 4 * sizeof(float);
+	p->velem[1].src_format = PIPE_FORMAT_R32G32B32A32_FLOAT;
+
+	{
+		const enum tgsi_semantic semantic_names[] =
+			{ TGSI_SEMANTIC_POSITION, TGSI_SEMANTIC_COLOR };
+		const uint semantic_indexes[] = { 0, 0 };
+		p->vs = util_make_vertex_passthrough_shader(p->pipe, 2, semantic_names, semantic_indexes, FALSE);
+	}
+
+	p->fs = util_make_fragment_passthrough_shader(p->pipe,
+		    TGSI_SEMANTIC_COLOR, TGSI_INTERPOLATE_PERSPECTIVE, TRUE);
+}
+
+static void close_prog(struct program *p)
+{
+	cso_destroy_context(p->cso);
+
+	p->pipe->delete_vs_state(p->pipe, p->vs);
+	p->pipe->delete_fs_state(p->pipe, p->fs);
+
+	for (int i = 0; i < NUM_TARGETS; i++) {
+		pipe_surface_reference(&p->surfaces[i], NULL);
+		pipe_resource_reference(&p->targets[i], NULL);
+	}
+	for (int i = 0; i < NUM_VBUFS; i++)
+		pipe_resource_reference(&p->vbufs[i], NULL);
+	pipe_resource_reference(&p->scratch, NULL);
+
+	p->pipe->destroy(p->pipe);
+	p->screen->destroy(p->screen);
+	pipe_loader_release(&p->dev, 1);
+
+	FREE(p);
+}
+
+static void draw_frame(struct program *p, int frame)
+{
+	struct pipe_framebuffer_state fb;
+	union pipe_color_union clear_color = { .f = { 0.2, 0.2, 0.2, 1.0 } };
+
+	memset(&fb, 0, sizeof(fb));
+	fb.width = WIDTH;
+	fb.height = HEIGHT;
+	fb.nr_cbufs = 1;
+
+	/* Go through the targets twice, so the second pass finds their jobs
+	 * still queued.
+	 */
+	for (int pass = 0; pass < 2; pass++) {
+		for (int t = 0; t < NUM_TARGETS; t++) {
+			fb.cbufs[0] = p->surfaces[t];
+			cso_set_framebuffer(p->cso, &fb);
+
+			if (pass == 0) {
+				p->pipe->clear(p->pipe, PIPE_CLEAR_COLOR,
+					       &clear_color, 0, 0);
+			}
+
+			for (int d = 0; d < DRAWS_PER_TARGET; d++) {
+				int v = (t * DRAWS_PER_TARGET + d +
+					 pass * 3) % NUM_VBUFS;
+
+				util_draw_vertex_buffer(p->pipe, p->cso,
+							p->vbufs[v], 0, 0,
+							PIPE_PRIM_TRIANGLES,
+							2,  /* attribs/vert */
+							3); /* verts */
+			}
+
+			/* A synchronized write to a buffer no job uses,
+			 * which still has to look for jobs reading it.
+			 */
+			uint32_t value = frame * NUM_TARGETS + t;
+			pipe_buffer_write(p->pipe, p->scratch,
+					  (t % 64) * sizeof(value),
+					  sizeof(value), &value);
+		}
+	}
+}
+
+static void run(struct program *p, int frames)
+{
+	struct pipe_fence_handle *fence = NULL;
+	int64_t cpu_time = 0;
+
+	cso_set_blend(p->cso, &p->blend);
+	cso_set_depth_stencil_alpha(p->cso, &p->depthstencil);
+	cso_set_rasterizer(p->cso, &p->rasterizer);
+	cso_set_viewport(p->cso, &p->viewport);
+	cso_set_fragment_shader_handle(p->cso, p->fs);
+	cso_set_vertex_shader_handle(p->cso, p->vs);
+	cso_set_vertex_elements(p->cso, 2, p->velem);
+
+	for (int frame = 0; frame < frames; frame++) {
+		int64_t start = os_time_get_nano();
+		draw_frame(p, frame);
+		p->pipe->flush(p->pipe, &fence, 0);
+		cpu_time += os_time_get_nano() - start;
+
+		/* Don't let the GPU fall behind, which isn't what we're
+		 * measuring.
+		 */
+		p->screen->fence_finish(p->screen, NULL, fence,
+					PIPE_TIMEOUT_INFINITE);
+		p->screen->fence_reference(p->screen, &fence, NULL);
+	}
+
+	printf("{\"bench\": \"fbo_switch\", \"frames\": %d, "
+	       "\"targets\": %d, \"vbufs\": %d, \"draws_per_frame\": %d, "
+	       "\"cpu_us_per_frame\": %.1f}\n",
+	       frames, NUM_TARGETS, NUM_VBUFS,
+	       2 * NUM_TARGETS * DRAWS_PER_TARGET,
+	       (double)cpu_time / frames / 1000.0);
+}
+
+int main(int argc, char** argv)
+{
+	struct program *p = CALLOC_STRUCT(program);
+	int frames = argc > 1 ? atoi(argv[1]) : 200;
+
+	init_prog(p);
+	run(p, frames);
+	close_prog(p);
+
+	return 0;
+}